@@ -39,7 +39,7 @@ public:
     assert(level1.lookUp(k, out) ^ level2.lookUp(k, out));
     if (level1.lookUp(k, out)) return true;
     
-    Counter::count("DataPlaneCuckooFiltable fallback to lv2");
+    COUNT_ID("DataPlaneCuckooFiltable fallback to lv2", 1);
     return level2.lookUp(k, out);
   }
   
@@ -146,7 +146,7 @@ public:
       }
       rebuild(k, value);
     } else if (result != &k) { // collision
-      Counter::count("ControlPlaneCuckooFiltable digest collision");
+      COUNT_ID("ControlPlaneCuckooFiltable digest collision", 1);
       
       vector<const K *> collisions = level1->FindAllCollisions(k);
       for (int i = 0; i < 2; ++i) {
@@ -167,7 +167,7 @@ public:
         rebuildL2(k, value);
       }
     } else {
-      Counter::count("ControlPlaneCuckooFiltable lv1 add");
+      COUNT_ID("ControlPlaneCuckooFiltable lv1 add", 1);
     }
   }
   
@@ -188,7 +188,7 @@ public:
 
 private:
   void rebuild(const K &k, V value) {
-    Counter::count("ControlPlaneCuckooFiltable level1 rebuild");
+    COUNT_ID("ControlPlaneCuckooFiltable level1 rebuild", 1);
     Clocker rebuild("Cuckoo level1 rebuild");
     
     unordered_map<K, V, Hasher32<K>> map = level1->toMap();
@@ -203,7 +203,7 @@ private:
     level2 = nullptr;
     
     while (!level1) {
-      Counter::count("ControlPlaneCuckooFiltable level1 re-rebuild");
+      COUNT_ID("ControlPlaneCuckooFiltable level1 re-rebuild", 1);
       
       level1 = new ControlPlaneCuckooMap<K, V, Match, true, DL, 2, 4>(capacity);
       level2 = new ControlPlaneCuckooMap<K, V, Match, false, DL, 2, 4>(capacity / 10);
@@ -223,7 +223,7 @@ private:
   }
   
   void rebuildL2(const K &k, V value) {
-    Counter::count("ControlPlaneCuckooFiltable level2 full, only rebuild lv2");
+    COUNT_ID("ControlPlaneCuckooFiltable level2 full, only rebuild lv2", 1);
     unordered_map<K, V, Hasher32<K>> map = level2->toMap();
     map.insert(make_pair(k, value));
     
@@ -34,7 +34,7 @@ public:
     assert(level1.lookUp(k, out) ^ level2.lookUp(k, out));
     if (level1.lookUp(k, out)) return true;
     
-    Counter::count("Cuckoo fallback to lv2");
+    COUNT_ID("Cuckoo fallback to lv2", 1);
     return level2.lookUp(k, out);
   }
   
@@ -80,6 +80,7 @@ public:
   uint64_t getMemoryCost() const {
     return level1.getMemoryCost() + level2.getMemoryCost();
   }
+
 };
 
 template<class K, class Match, char DL>
@@ -129,6 +130,10 @@ public:
   ControlPlaneCuckooMap<K, uint16_t, Match, true, DL, 2, 4> *level1;
   ControlPlaneCuckooMap<K, uint16_t, Match, false, DL, 2, 4> *level2;
   
+  /// construct keeps the data plane of every node, as simulateRoutingBatch needs, instead of building a few to
+  /// measure the construction and keeping only the first
+  bool keepAllDataPlanes = false;
+  
   explicit TwoLevelCuckooControlPlane(uint32_t capacity)
     : ControlPlane<K, l2>(capacity),
       level1(new ControlPlaneCuckooMap<K, uint16_t, Match, true, DL, 2, 4>(capacity)),
@@ -274,9 +279,7 @@ public:
       
       for (int i = 0; i < hostIds.size(); ++i) {
         int host = hostIds[i];
-        vector<Graph<>::ShortestPathCell> path = graph->shortestPathTo[host];
-        assert(!path.empty());  // asserting the host is a real host
-        uint16_t nextHop = path[gatewayId].nextHop;
+        uint16_t nextHop = graph->nextHopTo(uint16_t(host), uint16_t(gatewayId));
         
         P portNum = (P) (std::find(graph->adjacencyList[gatewayId].begin(),
                                    graph->adjacencyList[gatewayId].end(),
@@ -343,12 +346,12 @@ public:
         P port = uint8_t(-1);
         assert(gateway.lookUp(key, port));
         int gatewayNextHop = graph->adjacencyList[gatewayId][port].to;
-        uint16_t nextHop = graph->shortestPathTo[host][gatewayId].nextHop;
+        uint16_t nextHop = graph->nextHopTo(uint16_t(host), uint16_t(gatewayId));
         assert(gatewayNextHop == nextHop);
       }
       #endif
       
-      if (gateways.empty()) {
+      if (gateways.empty() || keepAllDataPlanes) {
         gateways.push_back(gateway);  // just store 1 gateway
       } else {
         asm volatile (""::"g" (gateway): "memory");
@@ -370,7 +373,7 @@ public:
     auto hostIds = ControlPlane<K, isL2>::getHostIds();
     auto routerIds = ControlPlane<K, l2>::getRouterIds();
     
-    routerIds.resize(10);
+    if (!keepAllDataPlanes) routerIds.resize(10);
     ostringstream oss;
     oss << "Router construction (" << routerIds.size() << " routers)";
     Clocker clocker(oss.str());
@@ -424,9 +427,7 @@ public:
       
       for (int i = 0; i < hostIds.size(); ++i) {
         int host = hostIds[i];
-        vector<Graph<>::ShortestPathCell> path = graph->shortestPathTo[host];
-        assert(!path.empty());  // asserting the host is a real host
-        uint16_t nextHop = path[routerId].nextHop;
+        uint16_t nextHop = graph->nextHopTo(uint16_t(host), uint16_t(routerId));
         
         P portNum = P(std::find(graph->adjacencyList[routerId].begin(),
                                 graph->adjacencyList[routerId].end(),
@@ -493,13 +494,13 @@ public:
         assert(port != (P) (-1));
         
         int gatewayNextHop = graph->adjacencyList[routerId][port].to;
-        uint16_t nextHop = graph->shortestPathTo[host][routerId].nextHop;
+        uint16_t nextHop = graph->nextHopTo(uint16_t(host), uint16_t(routerId));
         
         assert (gatewayNextHop == nextHop);
       }
       #endif
       
-      if (routers.empty()) {
+      if (routers.empty() || keepAllDataPlanes) {
         routers.push_back(router);  // just store 1 router
       } else {
         asm volatile (""::"g" (router): "memory");
@@ -511,7 +512,7 @@ public:
   typename std::enable_if<!isL2, void>::type constructRouter() {
     auto routerIds = ControlPlane<K, l2>::getRouterIds();
     
-    routerIds.resize(1);
+    if (!keepAllDataPlanes) routerIds.resize(1);
     ostringstream oss;
     oss << "Router construction (" << routerIds.size() << " routers)";
     Clocker clocker(oss.str());
@@ -519,7 +520,7 @@ public:
     for (int routerId: routerIds) {
       TwoLevelCuckooRouter<K, Match, l2, DL> router(*level1, *level2);
       
-      if (routers.empty()) {
+      if (routers.empty() || keepAllDataPlanes) {
         routers.push_back(router);  // just store 1 router
       } else {
         asm volatile (""::"g" (router): "memory");
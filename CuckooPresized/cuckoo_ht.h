@@ -68,6 +68,9 @@ public:
   // The key type is fixed as a pre-hashed key for this specialized use.
   explicit CuckooHashTable(const CuckooHashTable<Key, Value> &another) :
     entryCount(another.entryCount), num_buckets_(another.num_buckets_), buckets_(another.buckets_) {
+    for (int i = 0; i < kCandidateBuckets + 1; ++i) {
+      h[i] = another.h[i];
+    }
     cpq_.reset();
   }
   
@@ -169,14 +172,14 @@ public:
     }
     
     if (target_slot != -1) {
-      Counter::count("Cuckoo direct insert");
+      COUNT_ID("Cuckoo direct insert", 1);
       InsertInternal(k, v, target_bucket, target_slot);
       return &k;
     }
     
     // No space, perform cuckooInsert
     if (CuckooInsert(k, v)) {
-      Counter::count("Cuckoo cuckoo insert");
+      COUNT_ID("Cuckoo cuckoo insert", 1);
       return &k;
     } else {
       entryCount--;
@@ -236,6 +239,27 @@ public:
     
     return map;
   }
+  
+  void writeSnapshot(SnapshotWriter &w) const {
+    w.putSignature(SnapshotSignature("CuckooHashTable", {sizeof(Key), sizeof(Value), kCandidateBuckets, kSlotsPerBucket}));
+    for (auto &hash : h) {
+      w.put(hash.s);
+    }
+    w.put(entryCount);
+    w.put(num_buckets_);
+    w.putArray(buckets_);
+  }
+  
+  void readSnapshot(SnapshotReader &r) {
+    r.expectSignature(SnapshotSignature("CuckooHashTable", {sizeof(Key), sizeof(Value), kCandidateBuckets, kSlotsPerBucket}));
+    for (auto &hash : h) {
+      r.get(hash.s);
+    }
+    r.get(entryCount);
+    r.get(num_buckets_);
+    r.getArray(buckets_);
+    cpq_.reset();
+  }
 
 //private:
   Hasher32<Key> h[
@@ -395,7 +419,7 @@ public:
   }
   
   inline void CopyItem(uint32_t src_bucket, int src_slot, uint32_t dst_bucket, int dst_slot) {
-    Counter::count("Cuckoo copy item");
+    COUNT_ID("Cuckoo copy item", 1);
     Bucket &src_ref = buckets_[src_bucket];
     Bucket &dst_ref = buckets_[dst_bucket];
     dst_ref.keys[dst_slot] = src_ref.keys[src_slot];
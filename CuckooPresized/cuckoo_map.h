@@ -153,7 +153,7 @@ public:
         vector<Key> &set = collisionSets[bucket];
         for (const Key &key : set) {
           if ((getDigest(key) & MASK) == (getDigest(k) & MASK)) {
-            Counter::count("Cuckoo collision");
+            COUNT_ID("Cuckoo collision", 1);
             return &key;         // Collisions are not allowed.
           }
         }
@@ -183,20 +183,22 @@ public:
     }
     
     if (target_slot != -1) {
-      Counter::count("Cuckoo direct insert");
+      COUNT_ID("Cuckoo direct insert", 1);
       InsertInternal(k, v, target_bucket, target_slot);
+      pathStats.record(1);
       if (rememberPath && path)
         path->push_back({target_bucket, target_bucket, uint8_t(target_slot), uint8_t(target_slot)});
       return &k;
     }
     
     // No space, perform cuckooInsert
-    Counter::count("Cuckoo cuckoo insert");
+    COUNT_ID("Cuckoo cuckoo insert", 1);
     
     if (CuckooInsert<rememberPath>(k, v, path)) {
       return &k;
     } else {
-      Counter::count("Cuckoo insert fail");
+      COUNT_ID("Cuckoo insert fail", 1);
+      pathStats.failures++;
       entryCount--;
       return nullptr;
     }
@@ -352,6 +354,21 @@ public:
     return num_buckets_ * sizeof(buckets_[0]);
   }
   
+  CuckooPathStats pathStats;
+  
+  /// the occupancy of the table and the paths of its inserts, cheap enough to sample while it serves
+  json stats() const {
+    uint64_t collisionKeys = 0;
+    for (const vector<Key> &set: collisionSets) collisionKeys += set.size();
+    
+    return {{"entries", entryCount},
+            {"buckets", num_buckets_},
+            {"load factor", double(entryCount) / ((uint64_t) num_buckets_ * kSlotsPerBucket)},
+            {"collision set keys", collisionKeys},
+            {"inserts", pathStats.toJson()},
+            {"memory", getMemoryCost()}};
+  }
+  
   Hasher32<Key> h[kCandidateBuckets + 1];   // the last h is the digest function used in associated data plane
   
   // The load factor is chosen slightly conservatively for speed and
@@ -584,7 +601,7 @@ public:
   }
   
   inline void CopyItem(uint32_t src_bucket, int src_slot, uint32_t dst_bucket, int dst_slot) {
-    Counter::count("Cuckoo copy item");
+    COUNT_ID("Cuckoo copy item", 1);
     Bucket &src_ref = buckets_[src_bucket];
     Bucket &dst_ref = buckets_[dst_bucket];
     dst_ref.keys[dst_slot] = src_ref.keys[src_slot];
@@ -610,6 +627,8 @@ public:
       CuckooPathEntry entry = cpq_.pop_front();
       int free_slot = FindFreeSlot(entry.bucket);
       if (free_slot != -1) {
+        pathStats.record(entry.depth);
+
         // found a free slot in this path. just insert and follow this path
         buckets_[entry.bucket].occupiedMask |= 1U << free_slot;
         while (entry.depth > 1) {
@@ -682,16 +701,16 @@ public:
       h[i] = controlPlane.h[i];
     }
     
-    for (auto &b : controlPlane.buckets_) {
-      Bucket bucket;
+    buckets_.resize(controlPlane.buckets_.size());
+    for (uint32_t j = 0; j < buckets_.size(); ++j) {
+      const auto &b = controlPlane.buckets_[j];
+      Bucket &bucket = buckets_[j];
       bucket.occupiedMask = b.occupiedMask;
       
       for (int i = 0; i < kSlotsPerBucket; ++i) {
         bucket.keyDigests[i] = b.digests[i];
         bucket.values[i] = b.values[i];
       }
-      
-      buckets_.push_back(bucket);
     }
   }
   
@@ -702,19 +721,21 @@ public:
       h[i] = controlPlane.h[i];
     }
     
-    for (auto &b : controlPlane.buckets_) {
-      Bucket bucket;
+    buckets_.resize(controlPlane.buckets_.size());
+    for (uint32_t j = 0; j < buckets_.size(); ++j) {
+      const auto &b = controlPlane.buckets_[j];
+      Bucket &bucket = buckets_[j];
       bucket.occupiedMask = b.occupiedMask;
       
       for (int i = 0; i < kSlotsPerBucket; ++i) {
         bucket.keyDigests[i] = h[kCandidateBuckets](b.keys[i]);
         bucket.values[i] = b.values[i];
       }
-      
-      buckets_.push_back(bucket);
     }
   }
   
+  DataPlaneCuckooMap() = default;   // only for loadSnapshot
+  
   void Clear(int num_entries) {
     Bucket empty_bucket;
     buckets_.clear();
@@ -782,6 +803,47 @@ public:
     return num_buckets_ * sizeof(buckets_[0]);
   }
   
+  // move the buckets to memory allocated following the policy, e.g., huge pages of another NUMA node
+  void setMemoryPolicy(const MemoryPolicy &policy) {
+    buckets_.setMemoryPolicy(policy);
+  }
+  
+  void writeSnapshot(SnapshotWriter &w) const {
+    w.putSignature(signature());
+    w.put(num_buckets_);
+    for (auto &hash : h) {
+      w.put(hash.s);
+    }
+    w.putArray(buckets_);
+  }
+  
+  void readSnapshot(SnapshotReader &r) {
+    r.expectSignature(signature());
+    r.get(num_buckets_);
+    for (auto &hash : h) {
+      r.get(hash.s);
+    }
+    r.getArray(buckets_);
+  }
+  
+  void saveSnapshot(const string &path) const {
+    SnapshotWriter w(path);
+    writeSnapshot(w);
+    w.close();
+  }
+  
+  static DataPlaneCuckooMap loadSnapshot(const string &path) {
+    SnapshotReader r(path);
+    DataPlaneCuckooMap dp;
+    dp.readSnapshot(r);
+    return dp;
+  }
+  
+  static SnapshotSignature signature() {
+    return SnapshotSignature("DataPlaneCuckooMap", {sizeof(Key), sizeof(Value), sizeof(Match), uint32_t(DL),
+                                                    kCandidateBuckets, kSlotsPerBucket});
+  }
+  
   // Utility function to compute (x * y) >> 64, or "multiply high".
   // On x86-64, this is a single instruction, but not all platforms
   // support the __uint128_t type, so we provide a generic
@@ -813,6 +875,6 @@ public:
   
   // Set upon initialization: num_entries / kLoadFactor / kSlotsPerBucket.
   uint32_t num_buckets_;
-  std::vector<Bucket> buckets_;
+  TableArray<Bucket> buckets_;   // views the mapping of a loaded snapshot, see readSnapshot
 };
 
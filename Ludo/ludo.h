@@ -17,8 +17,13 @@
 
 #include "../CuckooPresized/cuckoo_ht.h"
 #include "../hash.h"
+#include "../hash_simd.h"
+#include "../version_lock.h"
+#include "../stash.h"
+#include "../bit_packed_array.h"
 #include "../common.h"
 #include "../Othello/data_plane_othello.h"
+#include "overflow_seeds.h"
 
 // Class for efficiently storing key->value mappings when the size is
 // known in advance and the keys are pre-hashed into uint64s.
@@ -29,9 +34,8 @@
 // ensure that their keys fall in the range 0 .. (uint64max-1);
 // the table uses 2^64-1 as the "not occupied" flag.
 //
-// Inserted k must be unique, and there are no update
-// or delete functions (until some subsequent use of this table
-// requires them).
+// Inserted k must be unique. Updates and deletions made in the
+// control plane are applied with applyUpdate and applyRemove.
 //
 // Threads must synchronize their access to a PresizedHeadlessCuckoo.
 //
@@ -43,7 +47,34 @@
 static const uint8_t LocatorSeedLength = 5;
 static const uint8_t MaxArrangementSeed = (1 << LocatorSeedLength) - 1;
 
-template<class Key, class Value, uint8_t VL, uint8_t DL>
+// bulkLoad, prepareToExport and the exports give every thread at least this many buckets, smaller tables use fewer
+// threads
+static const uint32_t kMinBucketsPerThread = 4096;
+
+/// odd multipliers of the arrangement seeds 0..254 that findSeed tries, see arrangedSlot
+struct ArrangementMultipliers {
+  uint64_t m[256];
+
+  constexpr ArrangementMultipliers() : m() {
+    for (int seed = 0; seed < 256; ++seed) {
+      uint64_t x = (seed + 1) * 0x9e3779b97f4a7c15ULL;
+      x = (x ^ (x >> 30)) * 0xbf58476d1ce4e5b9ULL;
+      x = (x ^ (x >> 27)) * 0x94d049bb133111ebULL;
+      m[seed] = (x ^ (x >> 31)) | 1;
+    }
+  }
+};
+
+static constexpr ArrangementMultipliers kArrangementMultipliers;
+
+/// The slot of a key in its bucket under an arrangement seed, by the hash that picks the two buckets of the key:
+/// the top 2 bits of the hash times the multiplier of the seed. So a lookup hashes the key once, and trying a seed
+/// on a bucket is a multiplication per key instead of a hash.
+inline uint8_t arrangedSlot(uint64_t hash, uint8_t seed) {
+  return uint8_t((hash * kArrangementMultipliers.m[seed]) >> 62);
+}
+
+template<class Key, class Value, uint8_t VL, uint8_t DL, class Layout>
 class DataPlaneLudo;
 
 struct MPC_PathEntry {
@@ -110,7 +141,7 @@ class ControlPlaneLudo {
   static constexpr int kMaxQueueSize = calMaxQueueSize();
   static constexpr int kVisitedListSize = calVisitedListSize();
 
-  unordered_map<Key, Value> fallback;
+  FlatStash<Key, Value> fallback;
 
 public:
   // Buckets are organized with key_types clustered for access speed
@@ -198,30 +229,55 @@ public:
     Clear(num_entries);
   }
 
-  // The key type is fixed as a pre-hashed key for this specialized use.
+  /// the control plane of another with every value v mapped to m(v), the buckets converted on threads threads
   template<class V, uint8_t vl, uint8_t dl>
-  ControlPlaneLudo(ControlPlaneLudo<Key, V, vl, dl> another, unordered_map<V, Value> m)
-    : locator(another.locator), entryCount(another.entryCount),
-      h(another.h), digestH(another.digestH) {
-    Bucket empty_bucket;
-    buckets_.clear();
-    unsigned long bucketCnt = another.buckets_.size();
-    buckets_.resize(bucketCnt, empty_bucket);
-
-    for (uint i = 0; i < bucketCnt; ++i) {
-      typename ControlPlaneLudo<Key, V, vl, dl>::Bucket &ob = another.buckets_[i];
-      Bucket &b = buckets_[i];
+  ControlPlaneLudo(const ControlPlaneLudo<Key, V, vl, dl> &another, const FlatStash<V, Value> &m,
+                   uint32_t threads = thread::hardware_concurrency())
+    : h(another.h), entryCount(another.entryCount), locator(another.locator), digestH(another.digestH) {
+    convertFrom(another, m, threads);
+  }
 
-      b.keys = ob.keys;
-      b.seed = ob.seed;
-      b.occupiedMask = ob.occupiedMask;
+  /// as above, but takes the locator over and frees the buckets of another, so the two tables of buckets are the
+  /// only copies alive during the conversion
+  template<class V, uint8_t vl, uint8_t dl>
+  ControlPlaneLudo(ControlPlaneLudo<Key, V, vl, dl> &&another, const FlatStash<V, Value> &m,
+                   uint32_t threads = thread::hardware_concurrency())
+    : h(another.h), entryCount(another.entryCount), locator(std::move(another.locator)), digestH(another.digestH) {
+    convertFrom(another, m, threads);
+    decltype(another.buckets_)().swap(another.buckets_);
+  }
 
-      for (char slot = 0; slot < kSlotsPerBucket; slot++) {
-        if (b.occupiedMask & (1 << slot)) {
-          b.values[slot] = m[b.values[slot]];
+  template<class V, uint8_t vl, uint8_t dl>
+  void convertFrom(const ControlPlaneLudo<Key, V, vl, dl> &another, const FlatStash<V, Value> &m, uint32_t threads) {
+    const uint32_t nb = another.buckets_.size();
+    const V otherValueMask = V((1ULL << vl) - 1);
+    buckets_.resize(nb);
+
+    threads = max(1U, min(threads, nb / kMinBucketsPerThread));
+    parallelFor(threads, [&](uint32_t t) {
+      for (uint32_t i = nb * uint64_t(t) / threads; i < nb * uint64_t(t + 1) / threads; ++i) {
+        const auto &ob = another.buckets_[i];
+        Bucket &b = buckets_[i];
+        b.seed = ob.seed;
+        b.occupiedMask = ob.occupiedMask;
+
+        for (char slot = 0; slot < kSlotsPerBucket; slot++) {
+          b.keys[slot] = ob.keys[slot];
+          b.values[slot] = 0;
+          if (!(b.occupiedMask & (1 << slot))) continue;
+
+          Value mapped = 0;
+          m.lookUp(V(ob.values[slot] & otherValueMask), mapped);
+          b.values[slot] = (mapped & ValueMask) + ((digestH(b.keys[slot]) << VL) & DigestMask);
         }
       }
-    }
+    });
+
+    another.fallbackEntries().forEach([&](const Key &k, const V &v) {
+      Value mapped = 0;
+      m.lookUp(v, mapped);
+      fallback.insert(k, mapped & ValueMask);
+    });
   }
 
   void Clear(uint32_t num_entries) {
@@ -244,7 +300,7 @@ public:
     buckets_.resize(num_buckets, empty_bucket);
 
     locator.clear();
-    locator.resizeKey(num_entries, true);
+    locator.resizeKey(num_buckets * kSlotsPerBucket, true);   // every slot may hold a key
   }
 
   pair<uint32_t, uint32_t> locate(const Key &k) const {
@@ -268,6 +324,15 @@ public:
   const Key *insert(const Key &k, Value v, vector<MPC_PathEntry> *const path = 0) {
     v = v & ValueMask;
 
+    // with a data plane, a key that would force a locator rebuild cannot be streamed and goes to the fallback table
+    if (path && !locator.canInsertWithoutRebuild(k)) {
+      COUNT_ID("Cuckoo insert closes a locator cycle, inserted to fallback", 1);
+      entryCount++;
+      fallback.insert(k, v);
+      COUNT_MAX_ID("Ludo fallback stash size", fallback.size());
+      return nullptr;
+    }
+
     // Merged find and duplicate checking.
     uint32_t target_bucket;
     char target_slot = -1;
@@ -300,33 +365,132 @@ public:
     }
 
     if (target_slot != -1) {
-      Counter::count("Cuckoo direct insert");
+      COUNT_ID("Cuckoo direct insert", 1);
       putItem(k, v, target_bucket, target_slot, path);
+      pathStats.record(1);
       return &k;
     }
 
     // No space, perform cuckooInsert
-    Counter::count("Cuckoo cuckoo insert");
+    COUNT_ID("Cuckoo cuckoo insert", 1);
 
     if (CuckooInsert(k, v, path)) {
       return &k;
     } else {
-      Counter::count_("Cuckoo insert fail, inserted to fallback");
-      fallback.insert(make_pair(k, v));
+      COUNT_ID("Cuckoo insert fail, inserted to fallback", 1);
+      pathStats.failures++;
+      fallback.insert(k, v);
+      COUNT_MAX_ID("Ludo fallback stash size", fallback.size());
 
       return nullptr;
     }
   }
 
-  inline bool remove(const Key &k) {
+  /// Insert many keys without remembering paths, i.e., before the data plane is exported. Every thread owns a range
+  /// of buckets and directly puts the keys of its range that find a free slot in either of their buckets there.
+  /// The rest, whose buckets are full or owned by another thread, go through the sequential cuckoo insert.
+  /// Like insert, duplicate keys are not checked.
+  void bulkLoad(const Key *keys, const Value *values, uint32_t n, uint32_t threads = thread::hardware_concurrency()) {
+    const uint32_t nb = buckets_.size();
+    threads = max(1U, min(threads, nb / kMinBucketsPerThread));
+
+    auto owner = [&](uint32_t b) { return uint32_t(uint64_t(b) * threads / nb); };
+    auto chunkBegin = [&](uint32_t t) { return uint32_t(uint64_t(n) * t / threads); };
+
+    // hash the keys, and count the keys of every chunk by the owner of their first bucket
+    vector<uint32_t> twoBuckets(2ULL * n);
+    vector<uint32_t> counts(threads * threads, 0);   // [chunk][owner]
+    parallelFor(threads, [&](uint32_t t) {
+      static const uint32_t kBlock = 64;
+      uint64_t hashes[kBlock];
+
+      for (uint32_t i = chunkBegin(t); i < chunkBegin(t + 1); i += kBlock) {
+        uint32_t len = min(kBlock, chunkBegin(t + 1) - i);
+        simd_hash::fastHash64(h, &keys[i], hashes, len);
+
+        for (uint32_t j = 0; j < len; ++j) {
+          fast_map_to_buckets(hashes[j], &twoBuckets[2ULL * (i + j)]);
+          counts[t * threads + owner(twoBuckets[2ULL * (i + j)])]++;
+        }
+      }
+    });
+
+    // group the key indices by the owner, each chunk scattering to its own offsets
+    vector<uint32_t> scatter(threads * threads);     // [chunk][owner]
+    vector<uint32_t> groupBegin(threads + 1, 0);
+    for (uint32_t o = 0, sum = 0; o < threads; ++o) {
+      groupBegin[o] = sum;
+      for (uint32_t t = 0; t < threads; ++t) {
+        scatter[t * threads + o] = sum;
+        sum += counts[t * threads + o];
+      }
+    }
+    groupBegin[threads] = n;
+
+    vector<uint32_t> order(n);
+    parallelFor(threads, [&](uint32_t t) {
+      for (uint32_t i = chunkBegin(t); i < chunkBegin(t + 1); ++i) {
+        order[scatter[t * threads + owner(twoBuckets[2ULL * i])]++] = i;
+      }
+    });
+
+    vector<vector<uint32_t>> residues(threads);
+    parallelFor(threads, [&](uint32_t o) {
+      for (uint32_t j = groupBegin[o]; j < groupBegin[o + 1]; ++j) {
+        uint32_t i = order[j];
+        const uint32_t *buckets = &twoBuckets[2ULL * i];
+
+        uint32_t target = buckets[0];
+        char slot = FindFreeSlot(target);
+        if (slot == -1 && owner(buckets[1]) == o) {
+          target = buckets[1];
+          slot = FindFreeSlot(target);
+        }
+
+        if (slot == -1) residues[o].push_back(i);
+        else putItem(keys[i], values[i] & ValueMask, target, slot);
+      }
+    });
+
+    uint32_t residueCnt = 0;
+    for (auto &r: residues) residueCnt += r.size();
+    entryCount += n - residueCnt;
+    COUNT_ID("Cuckoo direct insert", n - residueCnt);
+
+    for (auto &r: residues) {
+      for (uint32_t i: r) insert(keys[i], values[i]);
+    }
+  }
+
+  void bulkLoad(const vector<Key> &keys, const vector<Value> &values,
+                uint32_t threads = thread::hardware_concurrency()) {
+    if (keys.size() != values.size()) throw runtime_error("bulkLoad needs one value for every key");
+    if (keys.size() >= (1ULL << 32)) throw runtime_error("too many keys for one bulkLoad");
+
+    bulkLoad(keys.data(), values.data(), keys.size(), threads);
+  }
+
+  /// The freed slot is taken by the next insert to either of its buckets, and the bucket keeps its seed, so the
+  /// data plane only clears the slot, see DataPlaneLudo::applyRemove.
+  /// \param dpSlot if not null, set to the data plane slot of k, (bucket << 2) + slot like updateMapping returns,
+  ///        or -1 if k was in the fallback table
+  inline bool remove(const Key &k, uint32_t *dpSlot = nullptr) {
+    if (!fallback.empty() && fallback.remove(k)) {
+      entryCount--;
+      if (dpSlot) *dpSlot = uint32_t(-1);
+      return true;
+    }
+
     uint32_t buckets[2];
-    fast_map_to_buckets(h(k), buckets);
+    const uint64_t hash = h(k);
+    fast_map_to_buckets(hash, buckets);
 
     for (uint32_t &b : buckets) {
       Bucket &bucket = buckets_[b];
 
       if (RemoveInBucket(k, bucket)) {
         entryCount--;
+        if (dpSlot) *dpSlot = (b << 2) + arrangedSlot(hash, getSeed(b));
         return true;
       }
     }
@@ -337,7 +501,8 @@ public:
   // slot :2    bucket:30
   inline uint32_t updateMapping(const Key &k, Value val) {
     uint32_t buckets[2];
-    fast_map_to_buckets(h(k), buckets);
+    const uint64_t hash = h(k);
+    fast_map_to_buckets(hash, buckets);
 
     for (uint32_t &b : buckets) {
       Bucket &bucket = buckets_[b];
@@ -346,8 +511,8 @@ public:
         if (!(bucket.occupiedMask & (1 << slot))) continue;
 
         if (k == bucket.keys[slot]) {
-          bucket.values[slot] = val;
-          return (b << 2) + (FastHasher64<Key>(getSeed(b))(k) >> 62);
+          bucket.values[slot] = (val & ValueMask) | (bucket.values[slot] & DigestMask);   // keep the digest
+          return (b << 2) + arrangedSlot(hash, getSeed(b));
         }
       }
     }
@@ -357,11 +522,8 @@ public:
 
   // Returns true if found.  Sets *out = value.
   inline bool lookUp(const Key &k, Value &out) const {
-    if (!fallback.empty()) {
-      auto it = fallback.find(k);
-      if (it != fallback.end())
-        return it->second;
-    }
+    if (!fallback.empty() && fallback.lookUp(k, out)) return true;
+
     uint32_t buckets[2];
     fast_map_to_buckets(h(k), buckets);
 
@@ -373,6 +535,18 @@ public:
     return false;
   }
 
+  /// the keys insert could not place in the cuckoo table
+  inline const FlatStash<Key, Value> &fallbackEntries() const {
+    return fallback;
+  }
+
+  /// replace the value of k if it is in the fallback table, which updateMapping does not look into
+  inline bool updateFallback(const Key &k, Value val) {
+    if (fallback.empty() || !fallback.contains(k)) return false;
+    fallback.insert(k, val & ValueMask);
+    return true;
+  }
+
 //  /// compose two maps in place
 //  void Compose(unordered_map<Value, Value> &migrate) {
 //    for (auto &bucket : buckets_) {
@@ -463,6 +637,29 @@ public:
     return buckets_.size() * sizeof(buckets_[0]);
   }
 
+  CuckooPathStats pathStats;
+
+  /// The occupancy of the table, to sample while it serves, e.g., once a second: one pass over the seeds of the
+  /// buckets. The seeds from MaxArrangementSeed on overflow in the data plane, and a growing share of them, or of
+  /// long paths and failures, means the table is due for a resize or a rebuild.
+  json stats() const {
+    uint64_t seeds[256] = {0};
+    for (const Bucket &bucket: buckets_) ++seeds[bucket.seed];
+
+    uint64_t overflowed = 0;
+    for (uint32_t seed = MaxArrangementSeed; seed < 256; ++seed) overflowed += seeds[seed];
+
+    return {{"entries", entryCount},
+            {"buckets", buckets_.size()},
+            {"load factor", double(entryCount - fallback.size()) / (buckets_.size() * kSlotsPerBucket)},
+            {"seeds", histogramJson(seeds, 256)},
+            {"overflowed buckets", overflowed},
+            {"fallback", fallback.size()},
+            {"inserts", pathStats.toJson()},
+            {"locator", locator.stats()},
+            {"memory", getMemoryCost()}};
+  }
+
 //  void checkIntegrity() {
 //    for (auto &bucket: buckets_) {  // all buckets
 //      for (char slot = 0; slot < 4; ++slot) {
@@ -555,7 +752,7 @@ public:
       uint8_t seed = updateSeed(b, toSlot, slot);
       int64_t result = registerKey(k, b, path != nullptr);
 
-      path->push_back({b, uint8_t(FastHasher64<Key>(seed)(k) >> 62), seed,
+      path->push_back({b, arrangedSlot(h(k), seed), seed,
                        toSlot[0], toSlot[1], toSlot[2], toSlot[3],
                        result ? locator.getHalfTree(k, result > 0, false) : vector<uint32_t>()});
     }
@@ -564,7 +761,7 @@ public:
 
   inline void
   moveItem(uint32_t sBkt, uint8_t sSlot, uint32_t dBkt, uint8_t dSlot, vector<MPC_PathEntry> *const path) {
-    Counter::count("Cuckoo copy item");
+    COUNT_ID("Cuckoo copy item", 1);
     Bucket &dst_bucket = buckets_[dBkt];
     Bucket &src_bucket = buckets_[sBkt];
 
@@ -580,109 +777,251 @@ public:
       int64_t result = toggleKey(k);
       assert(result != 0);
 
-      path->push_back({dBkt, uint8_t(FastHasher64<Key>(seed)(k) >> 62), seed,
+      path->push_back({dBkt, arrangedSlot(h(k), seed), seed,
                        toSlot[0], toSlot[1], toSlot[2], toSlot[3],
                        locator.getHalfTree(k, result > 0, false)});
     }
 //    checkIntegrity();
   }
 
+  /// the hashes of the keys of the bucket, which every seed tried on it rearranges, see arrangedSlot
+  inline void keyHashes(const Bucket &bucket, uint64_t *hashes) const {
+    for (char slot = 0; slot < kSlotsPerBucket; ++slot) {
+      if (bucket.occupiedMask & (1 << slot)) hashes[slot] = h(bucket.keys[slot]);
+    }
+  }
+
+  /// whether the keys of the occupied slots, of the hashes, take distinct slots under the seed
+  static bool seedFits(const uint64_t *hashes, uint8_t occupiedMask, uint8_t seed) {
+    uint8_t taken = 0;
+
+    for (char slot = 0; slot < kSlotsPerBucket; ++slot) {
+      if (occupiedMask & (1 << slot)) {
+        uint8_t bit = uint8_t(1 << arrangedSlot(hashes[slot], seed));
+        if (taken & bit) return false;
+        taken |= bit;
+      }
+    }
+
+    return true;
+  }
+
+  /// the first seed under which the keys of the occupied slots take distinct slots
+  static uint8_t findSeed(const uint64_t *hashes, uint8_t occupiedMask) {
+    for (uint8_t seed = 0; seed < 255; ++seed) {
+      if (seedFits(hashes, occupiedMask, seed)) return seed;
+    }
+
+    throw runtime_error("Cannot generate a proper hash seed within 255 tries, which is rare");
+  }
+
+  /// the first seed under which the keys of the bucket take distinct slots. Touches nothing but the bucket, so
+  /// different buckets can be searched in parallel
+  uint8_t findSeed(const Bucket &bucket) const {
+    uint64_t hashes[kSlotsPerBucket];
+    keyHashes(bucket, hashes);
+    return findSeed(hashes, bucket.occupiedMask);
+  }
+
   uint8_t updateSeed(uint32_t bktIdx, uint8_t *dpSlotMove = 0, char slotWithNewKey = -1) {
     Bucket &bucket = buckets_[bktIdx];
-    FastHasher64<Key> h;
+    uint64_t hashes[kSlotsPerBucket];
+    keyHashes(bucket, hashes);
+
+    // with a data plane, keeping the seed spares moving the other slots, e.g., when a key takes a freed slot
+    const uint8_t oldSeed = getSeed(bktIdx);
+    uint8_t seed = dpSlotMove && seedFits(hashes, bucket.occupiedMask, oldSeed) ? oldSeed
+                                                                                 : findSeed(hashes, bucket.occupiedMask);
     bool occupied[4];
 
-    for (uint8_t seed = 0; seed < 255; ++seed) {
+    bool withDp = dpSlotMove != nullptr;
+
+    if (withDp) {
+      memset(dpSlotMove, -1, 4);
+      for (char slot = 0; slot < kSlotsPerBucket; ++slot) {
+        if ((bucket.occupiedMask & (1 << slot)) && slot != slotWithNewKey) {
+          uint8_t oldSlot = arrangedSlot(hashes[slot], oldSeed);
+          uint8_t toSlot = arrangedSlot(hashes[slot], seed);
+
+          dpSlotMove[oldSlot] = toSlot;
+        }
+      }
+
       *(uint32_t *) occupied = 0U;
-      h.setSeed(seed);
+      for (char slot = 0; slot < kSlotsPerBucket; ++slot) {
+        if (dpSlotMove[slot] != uint8_t(-1)) {
+          occupied[dpSlotMove[slot]] = true;
+        }
+      }
 
-      bool success = true;
+      char firstUnusedNewSlot = -1;
+      for (char slot = 0; slot < kSlotsPerBucket; ++slot) {
+        if (!occupied[slot]) {
+          firstUnusedNewSlot = slot;
+          break;
+        }
+      }
 
       for (char slot = 0; slot < kSlotsPerBucket; ++slot) {
-        if (bucket.occupiedMask & (1 << slot)) {
-          uint8_t i = uint8_t(h(bucket.keys[slot]) >> 62);
-          if (occupied[i]) {
-            success = false;
-            break;
-          } else { occupied[i] = true; }
+        if (dpSlotMove[slot] == uint8_t(-1)) {
+          assert(firstUnusedNewSlot >= 0);
+          dpSlotMove[slot] = uint8_t(firstUnusedNewSlot);
         }
       }
+    }
 
-      if (success) {
-        bool withDp = dpSlotMove != nullptr;
+    COUNT_MAX_ID("MPC max seed", seed);
+    bucket.seed = seed;
 
-        if (withDp) {
-          FastHasher64<Key> oldH(getSeed(bktIdx));
+    return seed;
+  }
 
-          memset(dpSlotMove, -1, 4);
-          for (char slot = 0; slot < kSlotsPerBucket; ++slot) {
-            if ((bucket.occupiedMask & (1 << slot)) && slot != slotWithNewKey) {
-              uint8_t oldSlot = uint8_t(oldH(bucket.keys[slot]) >> 62);
-              uint8_t toSlot = uint8_t(h(bucket.keys[slot]) >> 62);
+  /// the buckets whose seeds do not fit in the data plane, which keeps them in its OverflowSeeds
+  vector<uint32_t> overflowedBuckets() const {
+    vector<uint32_t> result;
+    for (uint32_t bktIdx = 0; bktIdx < buckets_.size(); ++bktIdx) {
+      if (buckets_[bktIdx].seed >= MaxArrangementSeed) result.push_back(bktIdx);
+    }
+    return result;
+  }
 
-              dpSlotMove[oldSlot] = toSlot;
-            }
-          }
+  /// Relieve a bucket whose seed does not fit in the data plane by moving one of its keys to the other bucket of the
+  /// key, so that both buckets take seeds below MaxArrangementSeed and their lookups skip the overflow seeds, e.g.,
+  /// for the hot buckets of DataPlaneLudoSketch::hotOverflowedBuckets. Applied by DataPlaneLudo::applyInsert(path, 0):
+  /// the last entry rearranges the bucket by the new seed, putting 0 in the slot left free.
+  /// \return false if no key can be moved without saturating the other bucket
+  bool reseedOverflowed(uint32_t bid, vector<MPC_PathEntry> &path) {
+    Bucket &bucket = buckets_[bid];
+    const uint8_t oldSeed = getSeed(bid);
+    if (oldSeed < MaxArrangementSeed) return false;
+
+    uint64_t hashes[kSlotsPerBucket];
+    keyHashes(bucket, hashes);
+
+    for (uint8_t slot = 0; slot < kSlotsPerBucket; ++slot) {
+      if (!(bucket.occupiedMask & (1 << slot))) continue;
+
+      const uint8_t rest = uint8_t(bucket.occupiedMask & ~(1 << slot));
+      uint32_t twoBuckets[2];
+      fast_map_to_buckets(hashes[slot], twoBuckets);
+      const uint32_t other = twoBuckets[0] == bid ? twoBuckets[1] : twoBuckets[0];
+      Bucket &dst = buckets_[other];
+      if (other == bid || dst.occupiedMask == 0xF || findSeed(hashes, rest) >= MaxArrangementSeed) continue;
+
+      // the other bucket keeps its seed if the key fits in, as moveItem does
+      uint64_t dstHashes[kSlotsPerBucket];
+      keyHashes(dst, dstHashes);
+      const uint8_t dstSlot = uint8_t(__builtin_ctz(~dst.occupiedMask & 0xF));
+      dstHashes[dstSlot] = hashes[slot];
+      const uint8_t withKey = uint8_t(dst.occupiedMask | (1 << dstSlot));
+      if (!seedFits(dstHashes, withKey, getSeed(other)) && findSeed(dstHashes, withKey) >= MaxArrangementSeed) {
+        continue;
+      }
 
-          *(uint32_t *) occupied = 0U;
-          for (char slot = 0; slot < kSlotsPerBucket; ++slot) {
-            if (dpSlotMove[slot] != uint8_t(-1)) {
-              occupied[dpSlotMove[slot]] = true;
-            }
-          }
+      dst.occupiedMask = withKey;
+      moveItem(bid, slot, other, dstSlot, &path);
+      bucket.occupiedMask = rest;
+
+      // the data plane slots of the keys left, from the old arrangement to the new one, and the slot of the moved
+      // key to the first free one, where the other entry reads it from
+      const uint8_t seed = findSeed(hashes, rest);
+      uint8_t toSlot[kSlotsPerBucket], taken = 0;
+      memset(toSlot, -1, kSlotsPerBucket);
+      for (uint8_t s = 0; s < kSlotsPerBucket; ++s) {
+        if (!(rest & (1 << s))) continue;
+        toSlot[arrangedSlot(hashes[s], oldSeed)] = arrangedSlot(hashes[s], seed);
+        taken |= 1 << arrangedSlot(hashes[s], seed);
+      }
+      const uint8_t freed = uint8_t(__builtin_ctz(~taken & 0xF));
+      toSlot[arrangedSlot(hashes[slot], oldSeed)] = freed;
+      taken |= 1 << freed;
+      for (uint8_t s = 0; s < kSlotsPerBucket; ++s) {
+        if (toSlot[s] != uint8_t(-1)) continue;
+        toSlot[s] = uint8_t(__builtin_ctz(~taken & 0xF));
+        taken |= 1 << toSlot[s];
+      }
 
-          char firstUnusedNewSlot = -1;
-          for (char slot = 0; slot < kSlotsPerBucket; ++slot) {
-            if (!occupied[slot]) {
-              firstUnusedNewSlot = slot;
-              break;
-            }
-          }
+      bucket.seed = seed;
+      path.push_back({bid, freed, seed, toSlot[0], toSlot[1], toSlot[2], toSlot[3], vector<uint32_t>()});
+      COUNT_ID("MPC reseed overflowed bucket", 1);
+      return true;
+    }
 
-          for (char slot = 0; slot < kSlotsPerBucket; ++slot) {
-            if (dpSlotMove[slot] == uint8_t(-1)) {
-              assert(firstUnusedNewSlot >= 0);
-              dpSlotMove[slot] = uint8_t(firstUnusedNewSlot);
-            }
-          }
-        }
+    return false;
+  }
+
+  /// search the seed of every bucket and build the locator, both in parallel. The locator leaves out a key of each
+  /// cycle of its first seed, rather than hashing all keys again with the next, and such a key moves from its
+  /// bucket to the fallback table, as an insert that would close a cycle does.
+  void prepareToExport(uint32_t threads = thread::hardware_concurrency()) {
+    const uint32_t nb = buckets_.size();
+    threads = max(1U, min(threads, nb / kMinBucketsPerThread));
+
+    vector<uint64_t> offsets(threads + 1, 0);
+    parallelFor(threads, [&](uint32_t t) {
+      for (uint32_t bktIdx = nb * uint64_t(t) / threads; bktIdx < nb * uint64_t(t + 1) / threads; ++bktIdx) {
+        offsets[t + 1] += __builtin_popcount(buckets_[bktIdx].occupiedMask);
+      }
+    });
+    for (uint32_t t = 0; t < threads; ++t) offsets[t + 1] += offsets[t];
 
-        Counter::countMax("MPC max seed", seed);
-        bucket.seed = seed;
+    vector<Key> keys(offsets[threads]);
+    vector<uint8_t> values(offsets[threads]);
+    parallelFor(threads, [&](uint32_t t) {
+      uint64_t i = offsets[t];
 
-        return seed;
+      for (uint32_t bktIdx = nb * uint64_t(t) / threads; bktIdx < nb * uint64_t(t + 1) / threads; ++bktIdx) {
+        Bucket &bucket = buckets_[bktIdx];
+
+        for (char s = 0; s < kSlotsPerBucket; ++s) {
+          if (bucket.occupiedMask & (1 << s)) {
+            uint32_t buckets[2];
+            Key k = bucket.keys[s];
+            fast_map_to_buckets(h(k), buckets);
+
+            keys[i] = k;
+            values[i++] = uint8_t(buckets[1] == bktIdx);
+          }
+        }
       }
-    }
+    });
+
+    // Counter is not thread safe, so the seeds are searched with findSeed and only the maximum is counted
+    vector<uint8_t> maxSeed(threads, 0);
+    parallelFor(threads, [&](uint32_t t) {
+      for (uint32_t bktIdx = nb * uint64_t(t) / threads; bktIdx < nb * uint64_t(t + 1) / threads; ++bktIdx) {
+        Bucket &bucket = buckets_[bktIdx];
+        bucket.seed = findSeed(bucket);
+        maxSeed[t] = max(maxSeed[t], bucket.seed);
+      }
+    });
+    COUNT_MAX_ID("MPC max seed", *max_element(maxSeed.begin(), maxSeed.end()));
 
-    throw runtime_error("Cannot generate a proper hash seed within 255 tries, which is rare");
-  }
+    // keep the key capacity the locator got in Clear, so that inserting to the exported table does not resize it
+    const uint32_t keyCnt = keys.size();
+    keys.resize(max<size_t>(keyCnt, locator.keys.size()));
+    values.resize(keys.size());
 
-  void prepareToExport() {
-    vector<Key> keys;
-    vector<uint8_t> values;
-    keys.reserve(entryCount);
-    values.reserve(entryCount);
+    locator.keys = std::move(keys);
+    locator.values = std::move(values);
+    locator.keyCnt = keyCnt;
 
-    for (uint32_t bktIdx = 0; bktIdx < buckets_.size(); ++bktIdx) {
-      Bucket &bucket = buckets_[bktIdx];
-      updateSeed(bktIdx);
+    vector<pair<Key, uint8_t>> cyclic;
+    locator.buildBreakingCycles(cyclic, threads);
 
-      for (char s = 0; s < kSlotsPerBucket; ++s) {
-        if (bucket.occupiedMask & (1 << s)) {
-          uint32_t buckets[2];
-          Key k = bucket.keys[s];
-          fast_map_to_buckets(h(k), buckets);
+    for (const auto &kv: cyclic) {
+      uint32_t buckets[2];
+      fast_map_to_buckets(h(kv.first), buckets);
+      Bucket &bucket = buckets_[buckets[kv.second]];
 
-          keys.push_back(k);
-          values.push_back(uint8_t(buckets[1] == bktIdx));
+      for (char s = 0; s < kSlotsPerBucket; ++s) {
+        if ((bucket.occupiedMask & (1 << s)) && bucket.keys[s] == kv.first) {
+          bucket.occupiedMask ^= 1 << s;
+          fallback.insert(kv.first, bucket.values[s] & ValueMask);   // without the digest, like the other fallbacks
         }
       }
     }
-
-    locator.keys = keys;
-    locator.values = values;
-    locator.keyCnt = keys.size();
-    locator.build();
+    COUNT_ID("Locator cycle broken, key moved to fallback", cyclic.size());
   }
 
   Bucket getDpBucket(uint32_t index) const {
@@ -691,12 +1030,11 @@ public:
     Bucket result;
     result.occupiedMask = 0;
     result.seed = getSeed(index);
-    FastHasher64<Key> h(result.seed);
 
     for (char cpSlot = 0; cpSlot < 4; ++cpSlot) {
       if (!(cpBucket.occupiedMask & (1ULL << cpSlot))) continue;
 
-      char dpSlot = h(cpBucket.keys[cpSlot]) >> 62;
+      char dpSlot = arrangedSlot(h(cpBucket.keys[cpSlot]), result.seed);
       result.occupiedMask |= 1 << dpSlot;
       result.values[dpSlot] = cpBucket.values[cpSlot];
     }
@@ -720,17 +1058,18 @@ public:
 
       for (uint32_t b : buckets) {
         cpq_.push_back({b, 1, -1, -1}); // Note depth starts at 1.
-        Counter::count("Cuckoo reach bucket");
+        COUNT_ID("Cuckoo reach bucket", 1);
       }
     }
 
     while (!cpq_.empty()) {
       CuckooPathEntry entry = cpq_.pop_front();
-      Counter::count("Cuckoo visit bucket");
+      COUNT_ID("Cuckoo visit bucket", 1);
       char free_slot = FindFreeSlot(entry.bucket);
       if (free_slot != -1) {
-        Counter::count("Cuckoo total depth", entry.depth);
-        Counter::countMax("Cuckoo max depth", entry.depth);
+        COUNT_ID("Cuckoo total depth", entry.depth);
+        COUNT_MAX_ID("Cuckoo max depth", entry.depth);
+        pathStats.record(entry.depth);
 
         // found a free slot in this path. just insert and follow this path
         buckets_[entry.bucket].occupiedMask |= 1U << free_slot;
@@ -766,7 +1105,7 @@ public:
           if (buckets[j] == entry.bucket) continue;
 
           cpq_.push_back({buckets[j], entry.depth + 1, parent_index, slot});
-          Counter::count("Cuckoo reach bucket");
+          COUNT_ID("Cuckoo reach bucket", 1);
         }
       }
     }
@@ -775,10 +1114,88 @@ public:
   }
 };
 
-template<class Key, class Value, uint8_t VL = sizeof(Value) * 8, uint8_t DL = 0>
+/// Bucket layouts of DataPlaneLudo::memory. Given the packed length of a bucket in bits, a layout decides the bit
+/// offset of every bucket and the total number of bits of the table.
+
+/// Buckets are packed back to back. The smallest table, but a bucket may straddle two words or two cache lines.
+struct PackedBucketLayout {
+  template<uint32_t bits>
+  static constexpr uint64_t offset(uint32_t index) {
+    return (uint64_t) index * bits;
+  }
+  
+  template<uint32_t bits>
+  static constexpr uint64_t totalBits(uint32_t buckets) {
+    return (uint64_t) buckets * bits;
+  }
+};
+
+/// Buckets are padded to the next power of two bits, so a bucket never straddles a cache line, and a bucket of
+/// at most 64 bits never straddles a word.
+struct PowerOfTwoBucketLayout {
+  template<uint32_t bits>
+  static constexpr uint32_t stride() {
+    uint32_t s = 1;
+    while (s < bits) s <<= 1;
+    return s;
+  }
+  
+  template<uint32_t bits>
+  static constexpr uint64_t offset(uint32_t index) {
+    return (uint64_t) index * stride<bits>();
+  }
+  
+  template<uint32_t bits>
+  static constexpr uint64_t totalBits(uint32_t buckets) {
+    return (uint64_t) buckets * stride<bits>();
+  }
+};
+
+/// As many whole buckets as fit are packed into each 64-byte line, and the rest of the line is left unused, so a
+/// bucket never straddles a cache line.
+struct CacheLineBucketLayout {
+  static const uint32_t kLineBits = 512;
+  
+  template<uint32_t bits>
+  static constexpr uint64_t offset(uint32_t index) {
+    return (uint64_t) (index / (kLineBits / bits)) * kLineBits + (index % (kLineBits / bits)) * bits;
+  }
+  
+  template<uint32_t bits>
+  static constexpr uint64_t totalBits(uint32_t buckets) {
+    return ((uint64_t) buckets + kLineBits / bits - 1) / (kLineBits / bits) * kLineBits;
+  }
+};
+
+/// Run f(t, begin, end) over threads ranges of the nb buckets of a data plane, whose index-th bucket starts at bit
+/// offset(index). Every range but the first starts at a word boundary, so the threads encode their buckets into
+/// distinct words without atomic operations.
+template<class Offset, class F>
+void forBucketRanges(uint32_t nb, uint32_t threads, Offset offset, F f) {
+  threads = max(1U, min(threads, nb / kMinBucketsPerThread));
+
+  vector<uint32_t> bounds(threads + 1, nb);
+  bounds[0] = 0;
+  for (uint32_t t = 1; t < threads; ++t) {
+    uint32_t b = max(bounds[t - 1], uint32_t(nb * uint64_t(t) / threads));
+    while (b < nb && offset(b) % 64) ++b;   // at most 64 buckets on, whatever the layout
+    bounds[t] = b;
+  }
+
+  parallelFor(threads, [&](uint32_t t) { f(t, bounds[t], bounds[t + 1]); });
+}
+
+template<class Key, class Value, uint8_t VL = sizeof(Value) * 8, uint8_t DL = 0, class Layout = PackedBucketLayout>
 class DataPlaneLudo {
   static const uint8_t kSlotsPerBucket = 4;   // modification to this value leads to undefined behavior
+  static const uint8_t kBatchSize = 64;       // keys hashed and prefetched per round in lookUpBatch
   static const uint8_t bucketLength = LocatorSeedLength + kSlotsPerBucket * (VL + DL);
+  static_assert(sizeof(Value) * 8 >= VL + DL, "a slot holds the value and the digest");
+  
+  // bit offset of the index-th bucket in memory
+  static inline uint64_t bucketOffset(uint32_t index) {
+    return Layout::template offset<bucketLength>(index);
+  }
 
   static const uint64_t ValueMask = (1ULL << VL) - 1;
   static const uint64_t DigestMask = ((1ULL << DL) - 1) << VL;
@@ -788,10 +1205,10 @@ public:
   FastHasher64<Key> h;
   uint32_t num_buckets_;
 
-  std::vector<uint64_t> memory;
+  TableArray<uint64_t, AlignedAllocator<uint64_t>> memory;   // aligned to cache lines, see Layout
   FastHasher64<Key> digestH;
   DataPlaneOthello<Key, uint8_t, 1> locator;
-  CuckooHashTable<uint32_t, uint8_t> overflow;
+  OverflowSeeds overflow;
 
   struct Bucket {  // only as parameters and return values for easy access. the storage is compact.
     uint8_t seed;
@@ -812,124 +1229,155 @@ public:
     }
   };
 
-  explicit DataPlaneLudo(const ControlPlaneLudo<Key, Value, VL, DL> &cp)
-    : num_buckets_(cp.buckets_.size()), h(cp.h), locator(cp.locator), overflow(cp.entryCount * 0.012),
-      digestH(cp.digestH) {
-
-    resetMemory();
+  DataPlaneLudo() = default;   // only for loadSnapshot
 
-    for (uint32_t bktIdx = 0; bktIdx < num_buckets_; ++bktIdx) {
-      const typename ControlPlaneLudo<Key, Value, VL>::Bucket &cpBucket = cp.buckets_[bktIdx];
-      Bucket dpBucket;
-      dpBucket.seed = cpBucket.seed > MaxArrangementSeed ? MaxArrangementSeed : cpBucket.seed;
-      memset(dpBucket.values, 0, kSlotsPerBucket * sizeof(Value));
-
-      if (cpBucket.seed >= MaxArrangementSeed) {
-        overflow.insert(bktIdx, cpBucket.seed);
-      }
-
-      const FastHasher64<Key> locateHash(cpBucket.seed);
-
-      for (char slot = 0; slot < kSlotsPerBucket; ++slot) {
-        if (cpBucket.occupiedMask & (1U << slot)) {
-          const Key &k = cpBucket.keys[slot];
-          dpBucket.values[locateHash(k) >> 62] = cpBucket.values[slot];
-        }
-      }
-
-      writeBucket(dpBucket, bktIdx);
-    }
+  /// the data plane of cp, its buckets encoded on threads threads
+  explicit DataPlaneLudo(const ControlPlaneLudo<Key, Value, VL, DL> &cp,
+                         uint32_t threads = thread::hardware_concurrency())
+    : num_buckets_(cp.buckets_.size()), h(cp.h), locator(cp.locator), overflow(cp.buckets_.size()),
+      digestH(cp.digestH) {
+    exportBuckets(cp, [](const Value &v, Value &out) { out = v; }, threads);
+    fallback = cp.fallbackEntries();
   }
 
-  template<class V2>
-  DataPlaneLudo(const ControlPlaneLudo<Key, V2, VL, DL> &cp, unordered_map<V2, Value> m)
+  /// the data plane of cp with every value v mapped to m(v), e.g., the hosts of a control plane to the ports of a
+  /// gateway. The values of cp may be longer than VL.
+  template<class V2, uint8_t VL2>
+  DataPlaneLudo(const ControlPlaneLudo<Key, V2, VL2, DL> &cp, const FlatStash<V2, Value> &m,
+                uint32_t threads = thread::hardware_concurrency())
     : num_buckets_(cp.buckets_.size()), h(cp.h), locator(cp.locator),
-      overflow(cp.entryCount * 0.012), digestH(cp.digestH) {
-
-    resetMemory();
+      overflow(cp.buckets_.size()), digestH(cp.digestH) {
+    const V2 mask = V2((1ULL << VL2) - 1);   // without the digest of cp
+    exportBuckets(cp, [&m, mask](const V2 &v, Value &out) { m.lookUp(V2(v & mask), out); }, threads);
+
+    cp.fallbackEntries().forEach([&](const Key &k, const V2 &v) {
+      Value mapped = 0;
+      m.lookUp(v, mapped);
+      fallback.insert(k, mapped);
+    });
+  }
 
-    for (uint32_t bktIdx = 0; bktIdx < num_buckets_; ++bktIdx) {
-      const typename ControlPlaneLudo<Key, V2, VL>::Bucket &cpBucket = cp.buckets_[bktIdx];
-      Bucket dpBucket;
-      dpBucket.seed = cpBucket.seed >= MaxArrangementSeed ? MaxArrangementSeed : cpBucket.seed;
-      memset(dpBucket.values, 0, kSlotsPerBucket * sizeof(Value));
+  inline void resetMemory() {
+    memory.resize(bitPackedWords(Layout::template totalBits<bucketLength>(num_buckets_)));
+    locks = VersionLocks(num_buckets_);
+  }
 
-      if (cpBucket.seed >= MaxArrangementSeed) {
-        overflow.insert(bktIdx, cpBucket.seed);
-      }
+  // move the tables to memory allocated following the policy, e.g., huge pages of another NUMA node
+  inline void setMemoryPolicy(const MemoryPolicy &policy) {
+    memory.setMemoryPolicy(policy);
+    locator.setMemoryPolicy(policy);
+  }
 
-      const FastHasher64<Key> locateHash(cpBucket.seed);
+  struct FallbackEntry {
+    Key k;
+    Value v;
+  };
 
-      for (char slot = 0; slot < kSlotsPerBucket; ++slot) {
-        if (cpBucket.occupiedMask & (1U << slot)) {
-          const Key &k = cpBucket.keys[slot];
-          dpBucket.values[locateHash(k) >> 62] = m[cpBucket.values[slot]];
-        }
-      }
+  // the buckets, the locator and the overflow seeds, as well as the fallback when the keys are of fixed width
+  void writeSnapshot(SnapshotWriter &w) const {
+    w.putSignature(signature());
+    w.put(num_buckets_);
+    w.put(h.s);
+    w.put(digestH.s);
+    w.putArray(memory);
+    locator.writeSnapshot(w);
+    overflow.writeSnapshot(w);
+
+    if constexpr (std::is_trivially_copyable<Key>::value) {
+      vector<FallbackEntry> entries;
+      fallback.forEach([&entries](const Key &k, const Value &v) { entries.push_back({k, v}); });
+      w.putArray(entries);
+    } else if (!fallback.empty()) {
+      throw runtime_error("cannot snapshot a fallback of variable-length keys");
+    }
+  }
 
-      writeBucket(dpBucket, bktIdx);
+  void readSnapshot(SnapshotReader &r) {
+    r.expectSignature(signature());
+    r.get(num_buckets_);
+    r.get(h.s);
+    r.get(digestH.s);
+    r.getArray(memory);
+    locks = VersionLocks(num_buckets_);
+    locator.readSnapshot(r);
+    overflow.readSnapshot(r);
+
+    fallback.clear();
+    if constexpr (std::is_trivially_copyable<Key>::value) {
+      uint64_t n;
+      const FallbackEntry *entries = r.getArray<FallbackEntry>(n);
+      for (uint64_t i = 0; i < n; ++i) fallback.insert(entries[i].k, entries[i].v);
     }
   }
 
-  inline void resetMemory() {
-    memory.resize(((uint64_t) num_buckets_ * bucketLength + 63) / 64);
+  void saveSnapshot(const string &path) const {
+    SnapshotWriter w(path);
+    writeSnapshot(w);
+    w.close();
   }
 
-  template<char length>
-  inline void writeMem(uint64_t start, char offset, uint64_t v) {
-    assert(v < (1ULL << length));
+  // restart a data plane from a snapshot, without its control plane
+  static DataPlaneLudo loadSnapshot(const string &path) {
+    SnapshotReader r(path);
+    DataPlaneLudo dp;
+    dp.readSnapshot(r);
+    return dp;
+  }
 
-    // [offset, offset + length) should be 0 and others are 1
-    uint64_t mask = ~uint64_t(((1ULL << length) - 1) << offset);
-    char overflow = char(offset + length - 64);
+  static SnapshotSignature signature() {
+    return SnapshotSignature("DataPlaneLudo", {sizeof(Key), sizeof(Value), VL, DL,
+                                               uint32_t(Layout::template totalBits<bucketLength>(1))});
+  }
 
-    memory[start] &= mask;
-    memory[start] |= (uint64_t) v << offset;
+  // the seed and the slots of the buckets. concurrent: buckets of other stripes may share the words, so each word
+  // is updated by an atomic operation
+  typedef BitPackedArray<LocatorSeedLength> SeedBits;
+  typedef BitPackedArray<VL + DL> SlotBits;   // the value with the digest above it
 
-    if (overflow > 0) {
-      mask = uint64_t(-1) << overflow;     // lower "overflow" bits should be 0, and others are 1
-      memory[start + 1] &= mask;
-      memory[start + 1] |= v >> (length - overflow);
-    }
+  VersionLocks locks;           // one stripe per 8 buckets, about a cache line
+  VersionLocks overflowLock;    // serializes the writers of overflow, only stripe 0 is used, see OverflowSeeds
 
-    assert(v == readMem<length>(start, offset));
-  }
+  /// Encode the buckets of cp straight into memory, the values mapped by map(v, out), each thread a range of
+  /// words. The seeds past MaxArrangementSeed are collected by each thread and inserted into overflow afterwards.
+  template<class CP, class Map>
+  void exportBuckets(const CP &cp, Map map, uint32_t threads) {
+    resetMemory();
 
-  template<char length>
-  inline uint64_t readMem(uint64_t start, char offset) const {
-    char left = char(offset + length - 64);
-    left = char(left < 0 ? 0 : left);
+    vector<vector<pair<uint32_t, uint8_t>>> overflows(max(1U, threads));
+    forBucketRanges(num_buckets_, threads, bucketOffset, [&](uint32_t t, uint32_t begin, uint32_t end) {
+      for (uint32_t bktIdx = begin; bktIdx < end; ++bktIdx) {
+        const auto &cpBucket = cp.buckets_[bktIdx];
+        Value values[kSlotsPerBucket] = {0};
+
+        for (char slot = 0; slot < kSlotsPerBucket; ++slot) {
+          if (cpBucket.occupiedMask & (1U << slot)) {
+            Value &v = values[arrangedSlot(h(cpBucket.keys[slot]), cpBucket.seed)];
+            map(cpBucket.values[slot], v);
+            if (DL) v = withDigest(cpBucket.keys[slot], v);
+          }
+        }
 
-    uint64_t mask = ~(uint64_t(-1)
-      << (length - left));   // lower length-left bits should be 1, and others are 0
-    uint64_t result = (memory[start] >> offset) & mask;
+        if (cpBucket.seed >= MaxArrangementSeed) overflows[t].emplace_back(bktIdx, cpBucket.seed);
 
-    if (left > 0) {
-      mask = ~(uint64_t(-1) << left);     // lower left bits should be 1, and others are 0
-      result |= (memory[start + 1] & mask) << (length - left);
-    }
+        const uint64_t i1 = bucketOffset(bktIdx);
+        SeedBits::set(memory.data(), i1, min(cpBucket.seed, MaxArrangementSeed));
+        SlotBits::encode(memory.data(), i1 + LocatorSeedLength, values, kSlotsPerBucket);
+      }
+    });
 
-    return result;
+    vector<pair<uint32_t, uint8_t>> seeds;
+    for (const auto &list: overflows) seeds.insert(seeds.end(), list.begin(), list.end());
+    overflow.assign(num_buckets_, seeds);
   }
 
-  vector<uint8_t> lock = vector<uint8_t>(8192, 0);
-
-  // Only call it during update!
+  // Only call it during update! concurrent: other writers may be updating neighbouring buckets
+  template<bool concurrent = false>
   inline void writeBucket(Bucket &bucket, uint32_t index) {
-    uint64_t i1 = (uint64_t) index * bucketLength;
-    uint64_t start = i1 / 64;
-    char offset = char(i1 % 64);
+    uint64_t i1 = bucketOffset(index);
 
     assert(bucket.seed <= MaxArrangementSeed);
-    writeMem<LocatorSeedLength>(start, offset, bucket.seed);
-
-    for (char i = 0; i < kSlotsPerBucket; ++i) {
-      uint64_t offsetFromBeginning = i1 + LocatorSeedLength + i * VL;
-      start = offsetFromBeginning / 64;
-      offset = char(offsetFromBeginning % 64);
-
-      writeMem<VL>(start, offset, bucket.values[i]);
-    }
+    SeedBits::set<concurrent>(memory.data(), i1, bucket.seed);
+    SlotBits::template encode<concurrent>(memory.data(), i1 + LocatorSeedLength, bucket.values, kSlotsPerBucket);
 
 #ifndef NDEBUG
     Bucket retrieved = readBucket(index);
@@ -941,76 +1389,186 @@ public:
   inline Bucket readBucket(uint32_t index) const {
     Bucket bucket;
 
-    uint64_t i1 = (uint64_t) index * bucketLength;
-    uint64_t start = i1 / 64;
-    char offset = char(i1 % 64);
+    uint64_t i1 = bucketOffset(index);
 
-    bucket.seed = readMem<LocatorSeedLength>(start, offset);
+    bucket.seed = SeedBits::get(memory.data(), i1);
     if (bucket.seed == MaxArrangementSeed) {
       overflow.lookUp(index, bucket.seed);
     }
 
-    for (char i = 0; i < kSlotsPerBucket; ++i) {
-      uint64_t offsetFromBeginning = i1 + LocatorSeedLength + i * VL;
-      start = offsetFromBeginning / 64;
-      offset = char(offsetFromBeginning % 64);
+    SlotBits::decode(memory.data(), i1 + LocatorSeedLength, bucket.values, kSlotsPerBucket);
+    return bucket;
+  }
+
+  // the seed of a bucket, including the ones kept in overflow. The overflow table is only probed for the
+  // saturated seed, so nearly all lookups never touch it
+  inline uint8_t readSeed(uint32_t index) const {
+    uint64_t i1 = bucketOffset(index);
+    uint8_t seed = SeedBits::get(memory.data(), i1);
 
-      bucket.values[i] = readMem<VL>(start, offset);
+    if (seed == MaxArrangementSeed) {
+      overflow.lookUp(index, seed);
     }
 
-    return bucket;
+    return seed;
   }
 
-  inline void writeSlot(uint32_t bid, char sid, Value val) {
-    uint64_t offsetFromBeginning = uint64_t(bid) * bucketLength + LocatorSeedLength + sid * VL;
-    uint64_t start = offsetFromBeginning / 64;
-    char offset = char(offsetFromBeginning % 64);
+  /// the bit of memory where slot sid of bucket bid starts, the value in its low VL bits and the digest above
+  static inline uint64_t slotOffset(uint32_t bid, char sid) {
+    return bucketOffset(bid) + LocatorSeedLength + uint64_t(sid) * (VL + DL);
+  }
 
-    writeMem<VL>(start, offset, val);
+  template<bool concurrent = false>
+  inline void writeSlot(uint32_t bid, char sid, Value val) {
+    SlotBits::template set<concurrent>(memory.data(), slotOffset(bid, sid), val);
   }
 
-  inline Value readSlot(uint32_t bid, char sid) {
-    uint64_t offsetFromBeginning = uint64_t(bid) * bucketLength + LocatorSeedLength + sid * VL;
-    uint64_t start = offsetFromBeginning / 64;
-    char offset = char(offsetFromBeginning % 64);
+  inline Value readSlot(uint32_t bid, char sid) const {
+    return SlotBits::get(memory.data(), slotOffset(bid, sid));
+  }
 
-    return readMem<VL>(start, offset);
+  /// v with the digest of k above its VL bits, as a slot stores it, e.g., the value of applyInsert when DL > 0
+  inline Value withDigest(const Key &k, Value v) const {
+    return Value((v & ValueMask) | ((digestH(k) << VL) & DigestMask));
   }
 
-  unordered_map<Key, Value> fallback;
+  FlatStash<Key, Value> fallback;
 
   // Returns true if found.  Sets *out = value.
   inline bool lookUp(const Key &k, Value &out) {
-    if (!fallback.empty()) {
-      auto it = fallback.find(k);
-      if (it != fallback.end())
-        return it->second;
+    uint32_t buckets[2], aInd, bInd;
+
+    if constexpr (CompactKey<Key>::value) {
+      // the bucket, locator and digest hashes all mix the same base
+      const KeyBase base = compactBase(k);
+      const uint64_t hash = h.fromBase(base);
+      fast_map_to_buckets(hash, buckets);
+      locator.getIndices(base, aInd, bInd);
+      return lookUpAt(k, hash, buckets, aInd, bInd, out, &base);
     }
-    uint32_t buckets[2];
-    fast_map_to_buckets(h(k), buckets);
 
-    while (true) {
-      uint8_t va1 = lock[buckets[0] & 8191], vb1 = lock[buckets[1] & 8191];
-      COMPILER_BARRIER();
-      if (va1 % 2 == 1 || vb1 % 2 == 1) continue;
+    const uint64_t hash = h(k);
+    fast_map_to_buckets(hash, buckets);
+    locator.getIndices(k, aInd, bInd);
+
+    return lookUpAt(k, hash, buckets, aInd, bInd, out);
+  }
+
+  // Batched lookUp, e.g., for a burst of received packets. The whole batch is hashed first (with SIMD kernels
+  // for fixed-width keys) and the locator cells as well as both candidate buckets are prefetched. Then the seeds
+  // of the chosen buckets are read, the slots are derived from the hashes and the seeds, and only the selected
+  // slots are extracted. Keys whose buckets are modified meanwhile are retried by lookUpAt.
+  // Sets found[i] if found is not null.
+  inline void lookUpBatch(const Key *keys, Value *out, size_t n, bool *found = nullptr) {
+    uint64_t hashes[kBatchSize];
+    uint8_t seeds[kBatchSize];
+    KeyBase bases[CompactKey<Key>::value ? kBatchSize : 1];
+    uint32_t buckets[kBatchSize][2], aInd[kBatchSize], bInd[kBatchSize], bids[kBatchSize];
+    uint32_t versions[kBatchSize][2];
+
+    for (size_t base = 0; base < n; base += kBatchSize) {
+      size_t cnt = min(n - base, (size_t) kBatchSize);
+      const Key *batch = keys + base;
+
+      if constexpr (CompactKey<Key>::value) {
+        for (size_t i = 0; i < cnt; ++i) {
+          bases[i] = compactBase(batch[i]);
+          hashes[i] = h.fromBase(bases[i]);
+        }
+      } else {
+        simd_hash::fastHash64(h, batch, hashes, cnt);
+      }
 
-      Bucket bucket = readBucket(buckets[locator.lookUp(k)]);
+      for (size_t i = 0; i < cnt; ++i) {
+        fast_map_to_buckets(hashes[i], buckets[i]);
+        if constexpr (CompactKey<Key>::value) {
+          locator.getIndices(bases[i], aInd[i], bInd[i]);
+        } else {
+          locator.getIndices(batch[i], aInd[i], bInd[i]);
+        }
+
+        locator.prefetch(aInd[i]);
+        locator.prefetch(bInd[i]);
+        prefetchBucket(buckets[i][0]);
+        prefetchBucket(buckets[i][1]);
+      }
+
+      for (size_t i = 0; i < cnt; ++i) {
+        versions[i][0] = locks.beginRead(buckets[i][0]);
+        versions[i][1] = locks.beginRead(buckets[i][1]);
+
+        uint8_t loc;
+        locator.lookUpAt(aInd[i], bInd[i], loc);
+        bids[i] = buckets[i][loc];
+        seeds[i] = readSeed(bids[i]);
+      }
+
+      for (size_t i = 0; i < cnt; ++i) {
+        Value result = readSlot(bids[i], char(arrangedSlot(hashes[i], seeds[i])));
+        const KeyBase *keyBase = CompactKey<Key>::value ? &bases[i] : nullptr;
+
+        bool f;
+        if (!fallback.empty() && fallback.lookUp(batch[i], out[base + i])) {
+          f = true;
+        } else if (!locks.validate(buckets[i][0], versions[i][0]) || !locks.validate(buckets[i][1], versions[i][1])) {
+          COUNT_ID("Ludo lookup retries", 1);
+          f = lookUpAt(batch[i], hashes[i], buckets[i], aInd[i], bInd[i], out[base + i], keyBase);
+        } else if (DL == 0 || (result & DigestMask) == ((digest(batch[i], keyBase) << VL) & DigestMask)) {
+          out[base + i] = result & ValueMask;
+          f = true;
+        } else {
+          f = false;
+        }
+
+        if (found) found[base + i] = f;
+      }
+    }
+  }
 
-      COMPILER_BARRIER();
-      uint8_t va2 = lock[buckets[0] & 8191], vb2 = lock[buckets[1] & 8191];
+  // issue prefetches of the first and the last word of a bucket, which may lie in different cache lines
+  inline void prefetchBucket(uint32_t index) const {
+    uint64_t i1 = bucketOffset(index);
+    __builtin_prefetch(&memory[i1 / 64]);
+    __builtin_prefetch(&memory[(i1 + bucketLength - 1) / 64]);
+  }
 
-      if (va1 != va2 || vb1 != vb2) continue;
+  // the digest of k, from its base if k is compact and the base is given
+  inline uint64_t digest(const Key &k, const KeyBase *base) const {
+    if constexpr (CompactKey<Key>::value) {
+      if (base) return digestH.fromBase(*base);
+    }
+    return digestH(k);
+  }
 
-      uint64_t i = FastHasher64<Key>(bucket.seed)(k) >> 62;
-      Value result = bucket.values[i];
+  // Lookup with the hash h(k), the candidate buckets by it and the locator indices already computed.
+  inline bool lookUpAt(const Key &k, uint64_t hash, const uint32_t *buckets, uint32_t aInd, uint32_t bInd,
+                       Value &out, const KeyBase *base = nullptr) {
+    if (!fallback.empty() && fallback.lookUp(k, out)) return true;
 
-      if ((result & DigestMask) == ((digestH(k) << VL) & DigestMask)) {
+    while (true) {
+      uint32_t va = locks.beginRead(buckets[0]), vb = locks.beginRead(buckets[1]);
+
+      // only the seed and the selected slot are decoded, see readSeed and readSlot
+      uint8_t loc;
+      locator.lookUpAt(aInd, bInd, loc);
+      uint32_t bid = buckets[loc];
+      uint8_t seed = readSeed(bid);
+      Value result = readSlot(bid, char(arrangedSlot(hash, seed)));
+
+      if (!locks.validate(buckets[0], va) || !locks.validate(buckets[1], vb)) {
+        COUNT_ID("Ludo lookup retries", 1);
+        continue;
+      }
+
+      if (DL == 0 || (result & DigestMask) == ((digest(k, base) << VL) & DigestMask)) {
         out = result & ValueMask;
         return true;
       } else { return false; }
     }
   }
 
+  // Apply the cuckoo path of an insertion. Writers may apply paths concurrently if their buckets are disjoint. With
+  // DL > 0, value carries the digest of the inserted key, see withDigest.
   inline void applyInsert(const vector<MPC_PathEntry> &path, Value value) {
     for (int i = 0; i < path.size(); ++i) {
       MPC_PathEntry entry = path[i];
@@ -1043,20 +1601,20 @@ public:
         bucket.values[entry.sid] = readSlot(from.bid, sid);
       }
 
-      lock[entry.bid & 8191]++;
-      COMPILER_BARRIER();
+      locks.lock(entry.bid);
 
       if (entry.locatorCC.size()) {
         locator.fixHalfTreeByConnectedComponent(entry.locatorCC, 1);
       }
 
       if (bucket.seed == MaxArrangementSeed) {
-        overflow.insert(entry.bid, entry.newSeed, true);
+        overflowLock.lock(0);
+        overflow.insert(entry.bid, entry.newSeed);
+        overflowLock.unlock(0);
       }
-      writeBucket(bucket, entry.bid);
+      writeBucket<true>(bucket, entry.bid);
 
-      COMPILER_BARRIER();
-      lock[entry.bid & 8191]++;
+      locks.unlock(entry.bid);
     }
   }
 
@@ -1064,19 +1622,46 @@ public:
     uint32_t bid = bs >> 2;
     uint8_t sid = bs & 3;
 
-    lock[bid & 8191]++;
-    COMPILER_BARRIER();
+    locks.lock(bid);
+    writeSlot<true>(bid, sid, (val & ValueMask) | (readSlot(bid, sid) & DigestMask));   // keep the digest
+    locks.unlock(bid);
+  }
 
-    writeSlot(bid, sid, val & ValueMask);
+  /// clear the slot of a key removed by ControlPlaneLudo::remove. The bucket keeps its seed and the locator keeps
+  /// its values, as a removed key is looked up to an arbitrary value anyway.
+  /// \param bs (bucket << 2) + slot, from ControlPlaneLudo::remove
+  inline void applyRemove(uint32_t bs) {
+    uint32_t bid = bs >> 2;
+    uint8_t sid = bs & 3;
 
-    COMPILER_BARRIER();
-    lock[bid & 8191]++;
+    locks.lock(bid);
+    writeSlot<true>(bid, sid, 0);
+    locks.unlock(bid);
   }
 
   inline uint64_t getMemoryCost() const {
     return memory.size() * 8;
   }
 
+  /// as ControlPlaneLudo::stats, from the data plane alone: one pass over the seed fields, MaxArrangementSeed
+  /// counting the buckets whose seeds are in overflow. The lookups that ran into an update and read their buckets
+  /// again are counted per thread as "Ludo lookup retries"; retries growing faster than the lookups mean the updates
+  /// contend with them.
+  json stats() const {
+    uint64_t seeds[MaxArrangementSeed + 1] = {0};
+    for (uint32_t bktIdx = 0; bktIdx < num_buckets_; ++bktIdx) {
+      ++seeds[SeedBits::get(memory.data(), bucketOffset(bktIdx))];
+    }
+
+    return {{"buckets", num_buckets_},
+            {"seeds", histogramJson(seeds, MaxArrangementSeed + 1)},
+            {"overflow", {{"entries", overflow.size()}, {"dense", overflow.dense()},
+                          {"memory", overflow.getMemoryCost()}}},
+            {"fallback", fallback.size()},
+            {"locator memory", locator.getMemoryCost()},
+            {"memory", getMemoryCost()}};
+  }
+
   // Utility function to compute (x * y) >> 64, or "multiply high".
   // On x86-64, this is a single instruction, but not all platforms
   // support the __uint128_t type, so we provide a generic
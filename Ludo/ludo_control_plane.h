@@ -0,0 +1,225 @@
+#pragma once
+
+#include "../control_plane.h"
+#include "../common.h"
+#include "ludo.h"
+#include "../Othello/data_plane_othello.h"
+
+/// The network-wide design with Ludo tables, to compare with TwoLevelCuckooControlPlane. The control plane maps every
+/// key to its host in a ControlPlaneLudo. A gateway is a DataPlaneLudo mapping the keys to its ports, converted from
+/// the control plane with the ports of the hosts. A router is a DataPlaneOthello mapping the keys to its ports in L2,
+/// to the hosts in L3; the routers share one Othello build and differ only in the values filled in.
+template<class K, bool l2>
+class LudoControlPlane : public ControlPlane<K, l2> {
+  typedef typename std::conditional<l2, uint8_t, uint16_t>::type P;
+  static const uint8_t PL = sizeof(P) * 8;
+
+public:
+  typedef DataPlaneLudo<K, uint8_t, 8> Gateway;
+  typedef DataPlaneOthello<K, P, PL> Router;
+
+  // the lookups of the data planes read their version locks, so they are not const
+  mutable vector<Gateway> gateways;
+  mutable vector<Router> routers;
+
+  using ControlPlane<K, l2>::insert;
+  using ControlPlane<K, l2>::remove;
+  using ControlPlane<K, l2>::graph;
+  using ControlPlane<K, l2>::capacity;
+  using ControlPlane<K, l2>::getGatewayIds;
+  using ControlPlane<K, l2>::getRouterIds;
+  using ControlPlane<K, l2>::getHostIds;
+
+  ControlPlaneLudo<K, uint16_t, 16> *ludo;
+  ControlPlaneOthello<K, P, PL> *othello = nullptr;   // the build the routers are filled from
+  vector<uint16_t> othelloHosts;                       // the hosts of its keys, in the order of the build
+
+  /// construct keeps the data plane of every node, as simulateRoutingBatch needs, instead of building a few to
+  /// measure the construction and keeping only the first
+  bool keepAllDataPlanes = false;
+
+  explicit LudoControlPlane(uint32_t capacity)
+    : ControlPlane<K, l2>(capacity), ludo(new ControlPlaneLudo<K, uint16_t, 16>(capacity)) {
+  }
+
+  virtual ~LudoControlPlane() {
+    delete ludo;
+    delete othello;
+  }
+
+  void scenario(int topo) override {
+    ControlPlane<K, l2>::scenario(topo);
+
+    gateways.reserve(getGatewayIds().size());
+    routers.reserve(getRouterIds().size());
+  };
+
+  inline const char *getName() const override {
+    return "Ludo-CP";
+  }
+
+  inline void insert(const K &k, uint16_t host) override {
+    if (ludo->insert(k, host) == nullptr) Counter::count(getName(), "fallback insert");
+  }
+
+  inline void remove(const K &k) override {
+    ludo->remove(k);
+  }
+
+  inline bool lookUp(const K &k, uint16_t &out) const override {
+    return ludo->lookUp(k, out);
+  }
+
+  inline uint8_t lookUpGateway(uint16_t id, const K &key) const override {
+    uint8_t port = uint8_t(-1);
+    return gateways[id].lookUp(key, port), port;
+  }
+
+  inline P lookUpRouter(uint16_t id, const K &key) const override {
+    P port = static_cast<P>(-1);
+    return routers[id].lookUp(key, port), port;
+  }
+
+  void construct() override {
+    if (l2) constructGateways();
+    constructRouters();
+  }
+
+  /// Rebuild the kept data planes of nodes from the next hops of the graph: the gateways from the control plane as
+  /// exported at construct, the routers from its Othello build with their new ports. The routers of L3 map the keys
+  /// to the hosts, whatever the paths.
+  void refreshNodes(const vector<uint16_t> &nodes) override {
+    const vector<uint16_t> hostIds = getHostIds();
+    const uint16_t gatewayCnt = uint16_t(getGatewayIds().size());
+
+    for (uint16_t node: nodes) {
+      if (node < gatewayCnt) {
+        if (node >= gateways.size()) continue;
+
+        FlatStash<uint16_t, uint8_t> hostToPort(uint32_t(hostIds.size()));
+        portsToHosts(node, hostIds, hostToPort);
+        gateways[node] = Gateway(*ludo, hostToPort);
+      } else if (l2 && othello && node - gatewayCnt < routers.size()) {
+        fillRouterPorts(node, hostIds);
+        routers[node - gatewayCnt] = Router(*othello);
+      }
+    }
+  }
+
+  uint64_t getGatewayMemoryCost() const override {
+    uint64_t result = 0;
+
+    for (const Gateway &gateway: gateways) {
+      result += gateway.getMemoryCost();
+    }
+
+    return result;
+  }
+
+  uint64_t getRouterMemoryCost() const override {
+    uint64_t result = 0;
+
+    for (const Router &router: routers) {
+      result += router.getMemoryCost();
+    }
+
+    return result;
+  }
+
+  uint64_t getControlPlaneMemoryCost() const override {
+    return ludo->getMemoryCost() + (othello ? othello->getMemoryCost() : 0);
+  }
+
+private:
+  /// the port of node to every host, i.e., the index of the link to the next hop in its sorted adjacency list
+  template<class Map>
+  void portsToHosts(uint16_t node, const vector<uint16_t> &hostIds, Map &hostToPort) const {
+    const vector<typename Graph<>::AdjacencyMatrixCell> &links = graph->adjacencyList[node];
+
+    for (uint16_t host: hostIds) {
+      uint16_t nextHop = graph->nextHopTo(host, node);
+      P port = P(std::lower_bound(links.begin(), links.end(), typename Graph<>::AdjacencyMatrixCell({nextHop, 0})) -
+                 links.begin());
+      hostToPort.insert(host, port);
+    }
+  }
+
+  // the values of the Othello build: the ports of a router of L2 to the hosts of the keys. The keys keep their ids
+  // through the build, so only the values change, and the data plane fills them in
+  void fillRouterPorts(uint16_t routerId, const vector<uint16_t> &hostIds) {
+    FlatStash<uint16_t, P> hostToPort(uint32_t(hostIds.size()));
+    portsToHosts(routerId, hostIds, hostToPort);
+
+    vector<P> &ports = othello->getValues();
+    for (uint32_t i = 0; i < othello->size(); ++i) {
+      ports[i] = P(-1);
+      hostToPort.lookUp(othelloHosts[i], ports[i]);
+    }
+  }
+
+  void constructGateways() {
+    auto hostIds = getHostIds();
+    auto gatewayIds = getGatewayIds();
+    ostringstream oss;
+    oss << "Gateway construction (" << gatewayIds.size() << " gateways)";
+    Clocker clocker(oss.str());
+
+    ludo->prepareToExport();
+    gateways.clear();
+    for (uint16_t gatewayId: gatewayIds) {
+      FlatStash<uint16_t, uint8_t> hostToPort(uint32_t(hostIds.size()));
+      portsToHosts(gatewayId, hostIds, hostToPort);
+
+      Gateway gateway(*ludo, hostToPort);
+
+      if (gateways.empty() || keepAllDataPlanes) {
+        gateways.push_back(std::move(gateway));  // just store 1 gateway
+      } else {
+        asm volatile (""::"g" (&gateway): "memory");
+      }
+    }
+  }
+
+  void constructRouters() {
+    auto hostIds = getHostIds();
+    auto routerIds = getRouterIds();
+    if (!keepAllDataPlanes) routerIds.resize(min<size_t>(routerIds.size(), l2 ? 10 : 1));
+
+    ostringstream oss;
+    oss << "Router construction (" << routerIds.size() << " routers)";
+    Clocker clocker(oss.str());
+
+    // the keys and hosts of the control plane, in the order of the Othello build
+    vector<K> keys;
+    vector<uint16_t> hosts;
+    for (const auto &bucket: ludo->buckets_) {
+      for (int slot = 0; slot < 4; ++slot) {
+        if (!(bucket.occupiedMask & (1 << slot))) continue;
+        keys.push_back(bucket.keys[slot]);
+        hosts.push_back(bucket.values[slot]);
+      }
+    }
+    ludo->fallbackEntries().forEach([&](const K &k, uint16_t host) {
+      keys.push_back(k);
+      hosts.push_back(host);
+    });
+
+    vector<P> values(hosts.begin(), hosts.end());
+    delete othello;
+    othello = new ControlPlaneOthello<K, P, PL>(uint32_t(keys.size()), true, keys, values);
+    othelloHosts = std::move(hosts);
+
+    routers.clear();
+    for (uint16_t routerId: routerIds) {
+      if (l2) fillRouterPorts(routerId, hostIds);
+
+      Router router(*othello);
+
+      if (routers.empty() || keepAllDataPlanes) {
+        routers.push_back(std::move(router));  // just store 1 router
+      } else {
+        asm volatile (""::"g" (&router): "memory");
+      }
+    }
+  }
+};
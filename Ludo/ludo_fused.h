@@ -0,0 +1,323 @@
+/*!
+ \file ludo_fused.h
+ Network functions co-located in one Ludo table: every slot packs several independently updatable fields, e.g.,
+ the next hop of a FIB, the class of an ACL and a saturating packet counter, so that a packet takes one lookup for
+ all of them instead of one per function. The fields are laid out in the VL bits of the slot value, below the
+ DL-bit digest, the first field in the lowest bits.
+ */
+
+#pragma once
+
+#include "ludo.h"
+
+/// the widths of the fields of a slot, e.g., SlotFields<8, 4, 4> for an 8-bit next hop, a 4-bit ACL class and a
+/// 4-bit counter
+template<uint8_t... Widths>
+struct SlotFields {
+  static const uint8_t kFields = sizeof...(Widths);
+  static const uint8_t VL = (Widths + ... + 0);
+  static_assert(kFields > 0 && VL <= 32, "the fields of a slot take 1 to 32 bits");
+
+  /// the integer of a slot holding the fields and a DL-bit digest above them
+  template<uint8_t DL>
+  using Slot = typename std::conditional<VL + DL <= 8, uint8_t,
+    typename std::conditional<VL + DL <= 16, uint16_t,
+      typename std::conditional<VL + DL <= 32, uint32_t, uint64_t>::type>::type>::type;
+
+  typedef Slot<0> Value;
+  typedef std::array<uint32_t, kFields> Values;
+
+  static constexpr uint8_t width(uint8_t f) {
+    constexpr uint8_t widths[] = {Widths...};
+    return widths[f];
+  }
+
+  static constexpr uint8_t offset(uint8_t f) {
+    uint8_t result = 0;
+    for (uint8_t i = 0; i < f; ++i) result += width(i);
+    return result;
+  }
+
+  static constexpr uint64_t mask(uint8_t f) {
+    return ((1ULL << width(f)) - 1) << offset(f);
+  }
+
+  template<uint8_t F>
+  static inline uint32_t get(uint64_t packed) {
+    static_assert(F < kFields, "no such field");
+    return uint32_t((packed & mask(F)) >> offset(F));
+  }
+
+  /// packed with field F replaced by the low bits of v, the bits above the fields, e.g., a digest, kept
+  template<uint8_t F>
+  static inline uint64_t set(uint64_t packed, uint64_t v) {
+    static_assert(F < kFields, "no such field");
+    return (packed & ~mask(F)) | ((v << offset(F)) & mask(F));
+  }
+
+  /// the value current of field F plus delta, at most the maximum of the field instead of wrapping
+  template<uint8_t F>
+  static inline uint64_t saturate(uint64_t current, uint64_t delta) {
+    const uint64_t max = (1ULL << width(F)) - 1;
+    return delta > max - current ? max : current + delta;
+  }
+
+  /// packed with delta added to field F, see saturate
+  template<uint8_t F>
+  static inline uint64_t saturatingAdd(uint64_t packed, uint64_t delta) {
+    return set<F>(packed, saturate<F>(get<F>(packed), delta));
+  }
+
+  static inline Value pack(const Values &values) {
+    uint64_t packed = 0;
+    for (uint8_t f = 0; f < kFields; ++f) packed |= (uint64_t(values[f]) << offset(f)) & mask(f);
+    return Value(packed);
+  }
+
+  static inline Values unpack(uint64_t packed) {
+    Values values;
+    for (uint8_t f = 0; f < kFields; ++f) values[f] = uint32_t((packed & mask(f)) >> offset(f));
+    return values;
+  }
+};
+
+template<class Key, class Fields, uint8_t DL = 0>
+class FusedControlPlaneLudo : public ControlPlaneLudo<Key, typename Fields::template Slot<DL>, Fields::VL, DL> {
+  typedef ControlPlaneLudo<Key, typename Fields::template Slot<DL>, Fields::VL, DL> Base;
+
+public:
+  typedef typename Fields::template Slot<DL> Value;
+  typedef typename Fields::Values Values;
+
+  using Base::insert;
+  using Base::lookUp;
+
+  explicit FusedControlPlaneLudo(uint32_t capacity = 64) : Base(capacity) {}
+
+  /// \return as ControlPlaneLudo::insert
+  const Key *insert(const Key &k, const Values &values, vector<MPC_PathEntry> *const path = 0) {
+    return Base::insert(k, Fields::pack(values), path);
+  }
+
+  inline bool lookUp(const Key &k, Values &out) const {
+    Value packed;
+    if (!Base::lookUp(k, packed)) return false;
+
+    out = Fields::unpack(packed);
+    return true;
+  }
+
+  /// Set field F of k and keep the others.
+  /// \param dpSlot if not null, set to the data plane slot of k for FusedDataPlaneLudo::applyFieldUpdate, or -1 if
+  ///        k is in the fallback table, see FusedDataPlaneLudo::applyFallbackFieldUpdate
+  /// \return false if k is not in the table
+  template<uint8_t F>
+  bool updateField(const Key &k, uint64_t v, uint32_t *dpSlot = nullptr) {
+    Value packed;
+    if (!Base::lookUp(k, packed)) return false;
+
+    packed = Value(Fields::template set<F>(packed, v));
+    uint32_t bs = this->updateMapping(k, packed);
+    if (bs == uint32_t(-1)) this->updateFallback(k, packed);
+
+    if (dpSlot) *dpSlot = bs;
+    return true;
+  }
+
+  /// Copy field F of every key from dp, e.g., the counters lookUpAndCount keeps in the data plane alone, so that a
+  /// data plane exported afterwards starts from them instead of the values inserted
+  template<uint8_t F, class DP>
+  void collectField(DP &dp) {
+    auto collect = [&](const Key &k) {
+      Values values;
+      if (dp.lookUp(k, values)) updateField<F>(k, values[F]);
+    };
+
+    for (const auto &bucket: this->buckets_) {
+      for (uint32_t s = 0; s < 4; ++s) {
+        if (bucket.occupiedMask & (1U << s)) collect(bucket.keys[s]);
+      }
+    }
+
+    vector<Key> fallbackKeys;
+    this->fallbackEntries().forEach([&](const Key &k, const Value &) { fallbackKeys.push_back(k); });
+    for (const Key &k: fallbackKeys) collect(k);
+  }
+};
+
+/// The data plane of a FusedControlPlaneLudo. A field update rewrites only its own bits, so fields the data plane
+/// maintains itself, e.g., the counters of lookUpAndCount, survive the updates of the others, and the cuckoo moves
+/// of applyInsert carry them along with the slots. FusedControlPlaneLudo::collectField carries them to the next
+/// data plane exported. Keys the control plane puts in the fallback table afterwards go through applyFallbackInsert,
+/// which gives their fields a slot of their own as well.
+template<class Key, class Fields, uint8_t DL = 0, class Layout = PackedBucketLayout>
+class FusedDataPlaneLudo : public DataPlaneLudo<Key, typename Fields::template Slot<DL>, Fields::VL, DL, Layout> {
+  typedef DataPlaneLudo<Key, typename Fields::template Slot<DL>, Fields::VL, DL, Layout> Base;
+
+  // the bits of field F of slot sid of bucket bid
+  template<uint8_t F>
+  using FieldBits = BitPackedArray<Fields::width(F)>;
+
+  template<uint8_t F>
+  static inline uint64_t fieldOffset(uint32_t bid, char sid) {
+    return Base::slotOffset(bid, sid) + Fields::offset(F);
+  }
+
+  // Replace field F of a slot by f(its value) without touching the other bits of the slot. A field in one word is
+  // updated by a compare-and-swap, so concurrent updates of it lose nothing; one straddling two words is updated
+  // under the lock of its bucket, which the caller may hold already.
+  // \return the new value of the field
+  template<uint8_t F, class Update>
+  inline uint64_t updateFieldBits(uint32_t bid, char sid, bool locked, Update f) {
+    const uint64_t bit = fieldOffset<F>(bid, sid);
+    if (FieldBits<F>::inWord(bit)) return FieldBits<F>::atomicUpdate(this->memory.data(), bit, f);
+
+    if (!locked) this->locks.lock(bid);
+    const uint64_t v = f(FieldBits<F>::get(this->memory.data(), bit)) & FieldBits<F>::kMask;
+    FieldBits<F>::template set<true>(this->memory.data(), bit, v);
+    if (!locked) this->locks.unlock(bid);
+    return v;
+  }
+
+public:
+  typedef typename Fields::template Slot<DL> Value;
+  typedef typename Fields::Values Values;
+
+  using Base::lookUp;
+  using Base::applyInsert;
+
+  explicit FusedDataPlaneLudo(const FusedControlPlaneLudo<Key, Fields, DL> &cp) : Base(cp) {
+    this->fallback.forEach([this](const Key &k, const Value &v) { addFallbackSlot(k, v); });
+  }
+
+  /// all the fields of k in one lookup
+  inline bool lookUp(const Key &k, Values &out) {
+    uint32_t i;
+    if (fallbackIds.lookUp(k, i)) {
+      out = Fields::unpack(__atomic_load_n(&fallbackSlot(i), __ATOMIC_RELAXED));
+      return true;
+    }
+
+    Value packed;
+    if (!Base::lookUp(k, packed)) return false;
+
+    out = Fields::unpack(packed);
+    return true;
+  }
+
+  /// apply the cuckoo path of FusedControlPlaneLudo::insert of k, its slot getting the digest of k with the fields
+  inline void applyInsert(const vector<MPC_PathEntry> &path, const Key &k, const Values &values) {
+    Base::applyInsert(path, this->withDigest(k, Fields::pack(values)));
+  }
+
+  /// \param bs the slot from FusedControlPlaneLudo::updateField
+  template<uint8_t F>
+  inline void applyFieldUpdate(uint32_t bs, uint64_t v) {
+    uint32_t bid = bs >> 2;
+    uint8_t sid = bs & 3;
+
+    this->locks.lock(bid);
+    updateFieldBits<F>(bid, char(sid), true, [v](uint64_t) { return v; });
+    this->locks.unlock(bid);
+  }
+
+  /// add a key that FusedControlPlaneLudo::insert put in the fallback table
+  void applyFallbackInsert(const Key &k, const Values &values) {
+    const Value packed = Fields::pack(values);
+    uint32_t i;
+    if (fallbackIds.lookUp(k, i)) {
+      __atomic_store_n(&fallbackSlot(i), packed, __ATOMIC_RELAXED);
+    } else {
+      addFallbackSlot(k, packed);
+    }
+    this->fallback.insert(k, packed);
+  }
+
+  /// the update of a key that FusedControlPlaneLudo::updateField found in the fallback table
+  template<uint8_t F>
+  void applyFallbackFieldUpdate(const Key &k, uint64_t v) {
+    uint32_t i;
+    if (!fallbackIds.lookUp(k, i)) return;
+
+    const Value packed = updateFallbackSlot(fallbackSlot(i), [v](Value old) {
+      return Fields::template set<F>(old, v);
+    });
+    this->fallback.insert(k, packed);
+  }
+
+  /// Look up all the fields of k and add delta to its saturating counter F in place, out getting the counted
+  /// value. The counter is added to by a compare-and-swap of its word, so concurrent lookups neither lose counts
+  /// nor wait for each other, and lookups of other keys of the buckets do not retry. A count racing a cuckoo move of
+  /// the bucket of k may be lost. Like lookUp, it assumes k is in the table: the slot of another key would be
+  /// counted otherwise. A key of the fallback table is counted in its own slot, by a compare-and-swap as well.
+  template<uint8_t F>
+  inline bool lookUpAndCount(const Key &k, Values &out, uint64_t delta = 1) {
+    uint32_t i;
+    if (fallbackIds.lookUp(k, i)) {
+      out = Fields::unpack(updateFallbackSlot(fallbackSlot(i), [delta](Value old) {
+        return Fields::template saturatingAdd<F>(old, delta);
+      }));
+      return true;
+    }
+
+    uint32_t buckets[2], aInd, bInd;
+    const uint64_t hash = this->h(k);
+    this->fast_map_to_buckets(hash, buckets);
+    this->locator.getIndices(k, aInd, bInd);
+
+    // the slot of k, read as lookUp does
+    uint32_t bid;
+    char sid;
+    while (true) {
+      uint32_t va = this->locks.beginRead(buckets[0]), vb = this->locks.beginRead(buckets[1]);
+      uint8_t loc;
+      this->locator.lookUpAt(aInd, bInd, loc);
+      bid = buckets[loc];
+      sid = char(arrangedSlot(hash, this->readSeed(bid)));
+      if (this->locks.validate(buckets[0], va) && this->locks.validate(buckets[1], vb)) break;
+      COUNT_ID("Ludo lookup retries", 1);
+    }
+
+    const uint64_t count = updateFieldBits<F>(bid, sid, false, [delta](uint64_t c) {
+      return Fields::template saturate<F>(c, delta);
+    });
+
+    out = Fields::unpack(this->readSlot(bid, sid));
+    out[F] = uint32_t(count);
+    return true;
+  }
+
+private:
+  // The fields of the fallback keys, updated in place by compare-and-swap as the slots of the buckets are, since
+  // the fallback table has a single writer. Key i of fallbackIds is at fallbackSlot(i) of the chunks, chunk c of
+  // 64 << c slots, so that a chunk never moves once a lookup may read it.
+  static const uint32_t kFallbackChunks = 26;
+  FlatStash<Key, uint32_t> fallbackIds;
+  std::array<vector<Value>, kFallbackChunks> fallbackChunks;
+
+  inline Value &fallbackSlot(uint32_t i) {
+    const uint32_t c = 31 - __builtin_clz(i / 64 + 1);
+    return fallbackChunks[c][i - 64 * ((1U << c) - 1)];
+  }
+
+  // set slot to f(its value) and return the new value
+  template<class Update>
+  static inline Value updateFallbackSlot(Value &slot, Update f) {
+    Value old = __atomic_load_n(&slot, __ATOMIC_RELAXED), v;
+    do {
+      v = Value(f(old));
+    } while (!__atomic_compare_exchange_n(&slot, &old, v, true, __ATOMIC_RELAXED, __ATOMIC_RELAXED));
+    return v;
+  }
+
+  // give k a slot of its own, the chunk allocated before fallbackIds publishes k
+  void addFallbackSlot(const Key &k, Value v) {
+    const uint32_t i = fallbackIds.size();
+    const uint32_t c = 31 - __builtin_clz(i / 64 + 1);
+    if (c >= kFallbackChunks) throw runtime_error("too many keys in the fallback table");
+    if (fallbackChunks[c].empty()) fallbackChunks[c].resize(64ULL << c);
+
+    fallbackSlot(i) = v;
+    fallbackIds.insert(k, i);
+  }
+};
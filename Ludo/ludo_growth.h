@@ -0,0 +1,298 @@
+/*!
+ \file ludo_growth.h
+ A ControlPlaneLudo with its DataPlaneLudo that grow online instead of spilling into the fallback table. When the
+ table gets full, a generation with about twice as many buckets is allocated and the keys are migrated a few groups
+ at a time with every modification, while lookups consult both generations. A key belongs to the group of its first
+ candidate bucket in the old generation, which the data plane computes without the locator, so the groups below
+ the migration cursor are looked up in the new generation and the others in the old one.
+ */
+
+#pragma once
+
+#include "ludo.h"
+#include "../version_lock.h"
+#include "../epoch.h"
+
+template<class Key, class Value, uint8_t VL = sizeof(Value) * 8>
+class GrowingLudo {
+  typedef ControlPlaneLudo<Key, Value, VL> CP;
+  typedef DataPlaneLudo<Key, Value, VL> DP;
+
+  struct Generation {
+    unique_ptr<CP> cp;   // freed when the generation retires, lookups only read the data plane
+    unique_ptr<DP> dp;
+
+    explicit Generation(uint32_t capacity) : cp(new CP(capacity)) {
+      cp->prepareToExport();
+      dp.reset(new DP(*cp));
+    }
+
+    // the group of k, i.e., its first candidate bucket
+    inline uint32_t group(const Key &k) const {
+      return (uint32_t) (((uint64_t) (uint32_t) dp->h(k) * dp->num_buckets_) >> 32);
+    }
+
+    inline uint32_t capacity() const {
+      return uint32_t(cp->buckets_.size() * 4 * kGrowLoad);
+    }
+  };
+
+  unique_ptr<Generation> current, next;
+  EpochRetired<Generation> retired;   // until the lookups that may read them leave
+
+  // what lookups see, changed under state
+  atomic<Generation *> readCurrent, readNext;
+  atomic<uint32_t> cursor;
+  VersionLocks state;     // only stripe 0 is used
+
+  // the keys of the old generation ordered by group at the start of the growth, and the ones inserted to the old
+  // generation since then
+  vector<uint32_t> groupStart;
+  vector<Key> groupKeys;
+  unordered_map<uint32_t, vector<Key>> lateKeys;
+
+  // insert to one generation and apply the cuckoo path to its data plane
+  static const Key *insertTo(Generation &g, const Key &k, Value v) {
+    vector<MPC_PathEntry> path;
+    const Key *result = g.cp->insert(k, v, &path);
+
+    if (result == &k) {
+      g.dp->applyInsert(path, v & ((1ULL << VL) - 1));
+    } else if (result == nullptr) {
+      g.dp->fallback.insert(k, v & ((1ULL << VL) - 1));
+    }
+
+    return result;
+  }
+
+  // a removal from the fallback table may shift another fallback key out of the sight of a lookup, which retries
+  bool removeFrom(Generation &g, const Key &k) {
+    uint32_t bs;
+    if (!g.cp->remove(k, &bs)) return false;
+
+    if (bs == uint32_t(-1)) {
+      state.lock(0);
+      g.dp->fallback.remove(k);
+      state.unlock(0);
+    } else {
+      g.dp->applyRemove(bs);
+    }
+    return true;
+  }
+
+  inline Generation &owner(const Key &k) {
+    return next && current->group(k) < cursor.load(std::memory_order_relaxed) ? *next : *current;
+  }
+
+  void publish() {
+    state.lock(0);
+    readCurrent.store(current.get(), std::memory_order_relaxed);
+    readNext.store(next.get(), std::memory_order_relaxed);
+    state.unlock(0);
+  }
+
+  // the fallback keys of the old generation move last, lookups find them there until the generations switch
+  void finishGrowth() {
+    current->cp->fallbackEntries().forEach([this](const Key &k, const Value &v) { insertTo(*next, k, v); });
+
+    Generation *old = current.release();
+    current = std::move(next);
+    cursor.store(0, std::memory_order_relaxed);
+    publish();
+
+    old->cp.reset();
+    retired.retire(unique_ptr<Generation>(old));
+    retired.reclaim();
+
+    groupStart.clear();
+    groupStart.shrink_to_fit();
+    groupKeys.clear();
+    groupKeys.shrink_to_fit();
+    lateKeys.clear();
+  }
+
+public:
+  // the load of the cuckoo table which starts a growth, and the groups migrated by every modification meanwhile
+  static constexpr double kGrowLoad = 0.9;
+  static const uint32_t kGroupsPerStep = 8;
+
+  // a fallback table of more than one key in kFallbackRatio of the capacity also starts a growth, a few keys there
+  // are normal, e.g., those left out of the locator cycles
+  static const uint32_t kFallbackRatio = 1024;
+
+  explicit GrowingLudo(uint32_t capacity = 64) : current(new Generation(capacity)), cursor(0), state(1) {
+    publish();
+  }
+
+  GrowingLudo(const GrowingLudo &) = delete;
+
+  inline bool growing() const {
+    return next != nullptr;
+  }
+
+  inline uint32_t size() const {
+    return current->cp->entryCount + (next ? next->cp->entryCount : 0);
+  }
+
+  /// the control plane of the newest generation, where the keys end up
+  inline const CP &controlPlane() const {
+    return next ? *next->cp : *current->cp;
+  }
+
+  /// Allocate the next generation, with about twice as many buckets. The retired generations no lookup reads
+  /// anymore are freed now.
+  void startGrowth() {
+    if (next) return;
+
+    retired.reclaim();
+    next.reset(new Generation(current->capacity() * 2));
+
+    const vector<typename CP::Bucket> &buckets = current->cp->buckets_;
+    const uint32_t nb = buckets.size();
+
+    groupStart.assign(nb + 1, 0);
+    for (const auto &bucket: buckets) {
+      for (uint32_t s = 0; s < 4; ++s) {
+        if (bucket.occupiedMask & (1U << s)) groupStart[current->group(bucket.keys[s]) + 1]++;
+      }
+    }
+    for (uint32_t i = 0; i < nb; ++i) groupStart[i + 1] += groupStart[i];
+
+    vector<uint32_t> pos(groupStart.begin(), groupStart.end() - 1);
+    groupKeys.resize(groupStart[nb]);
+    for (const auto &bucket: buckets) {
+      for (uint32_t s = 0; s < 4; ++s) {
+        if (bucket.occupiedMask & (1U << s)) groupKeys[pos[current->group(bucket.keys[s])]++] = bucket.keys[s];
+      }
+    }
+
+    cursor.store(0, std::memory_order_relaxed);
+    publish();
+  }
+
+  /// Migrate up to groups groups to the next generation, e.g., from the thread owning the writes when it is idle.
+  /// The migrated keys are inserted to the next generation before the cursor passes them and are removed from
+  /// the old one afterwards, so every lookup finds them in the generation the cursor picks.
+  /// \return whether the growth is finished, or none is going on
+  bool migrate(uint32_t groups = kGroupsPerStep) {
+    if (!next) return true;
+
+    const uint32_t from = cursor.load(std::memory_order_relaxed);
+    const uint32_t to = min<uint64_t>(uint64_t(from) + groups, current->cp->buckets_.size());
+    vector<Key> moved;
+
+    auto move = [&](const Key &k) {
+      pair<uint32_t, uint32_t> loc = current->cp->locate(k);
+      if (loc.first == uint32_t(-1)) return;   // removed meanwhile, or in the fallback table which moves last
+
+      insertTo(*next, k, current->cp->buckets_[loc.first].values[loc.second]);
+      moved.push_back(k);
+    };
+
+    for (uint32_t g = from; g < to; ++g) {
+      for (uint32_t i = groupStart[g]; i < groupStart[g + 1]; ++i) move(groupKeys[i]);
+
+      auto it = lateKeys.find(g);
+      if (it != lateKeys.end()) {
+        for (const Key &k: it->second) move(k);
+        lateKeys.erase(it);
+      }
+    }
+
+    state.lock(0);
+    cursor.store(to, std::memory_order_relaxed);
+    state.unlock(0);
+
+    // their slots back in the old data plane are no longer looked up, just free them for the late inserts
+    for (const Key &k: moved) current->cp->remove(k);
+
+    if (to == current->cp->buckets_.size()) {
+      finishGrowth();
+      return true;
+    }
+    return false;
+  }
+
+  /// Like ControlPlaneLudo::insert, keys must be unique. A growth starts once the newest generation reaches
+  /// kGrowLoad, or its fallback table grows past one key in kFallbackRatio.
+  /// \return as ControlPlaneLudo::insert
+  const Key *insert(const Key &k, Value v) {
+    Generation &g = owner(k);
+    const Key *result = insertTo(g, k, v);
+
+    if (next && &g == current.get() && result == &k) lateKeys[current->group(k)].push_back(k);
+
+    if (next) {
+      migrate();
+    } else if (current->cp->entryCount >= current->capacity() ||
+               current->cp->fallbackEntries().size() > current->capacity() / kFallbackRatio) {
+      startGrowth();
+    }
+
+    return result;
+  }
+
+  /// \return false if k is not in the table
+  bool remove(const Key &k) {
+    bool result = removeFrom(owner(k), k) || (next && removeFrom(*current, k));   // k may wait in the fallback
+    migrate();
+    return result;
+  }
+
+  /// \return false if k is not in the table
+  bool updateMapping(const Key &k, Value v) {
+    Generation &g = owner(k);
+    uint32_t bs = g.cp->updateMapping(k, v);
+
+    if (bs != uint32_t(-1)) {
+      g.dp->applyUpdate(bs, v);
+    } else if (g.cp->updateFallback(k, v)) {
+      g.dp->fallback.insert(k, v & ((1ULL << VL) - 1));
+    } else if (&g == current.get() || !removeFrom(*current, k)) {
+      return false;
+    } else {
+      insertTo(*next, k, v);   // a fallback key of the old generation moves ahead of time
+    }
+
+    migrate();
+    return true;
+  }
+
+  /// Lookups run concurrently with the thread modifying the table, and retry when the migration cursor or the
+  /// generations change meanwhile, or a fallback key is removed. A retired generation is freed only after every
+  /// lookup in it left its epoch guard.
+  inline bool lookUp(const Key &k, Value &out) const {
+    Epoch::Guard guard;
+
+    while (true) {
+      uint32_t version = state.beginRead(0);
+      Generation *c = readCurrent.load(std::memory_order_relaxed);
+      Generation *n = readNext.load(std::memory_order_relaxed);
+      uint32_t migrated = cursor.load(std::memory_order_relaxed);
+
+      DP &dp = *c->dp;
+      bool found;
+
+      if (n && !dp.fallback.contains(k) && c->group(k) < migrated) {
+        found = n->dp->lookUp(k, out);
+      } else {
+        found = dp.lookUp(k, out);
+      }
+
+      if (state.validate(0, version)) return found;
+    }
+  }
+
+  /// free the retired generations no lookup reads anymore, e.g., from the writer when it is idle
+  /// \return the generations still retired
+  size_t reclaim() {
+    retired.reclaim();
+    return retired.size();
+  }
+
+  inline uint64_t getMemoryCost() const {
+    uint64_t cost = current->dp->getMemoryCost();
+    if (next) cost += next->dp->getMemoryCost();
+    return cost;
+  }
+};
@@ -0,0 +1,328 @@
+/*!
+ \file ludo_sharded.h
+ A Ludo table sharded per core the way a NIC spreads packets with RSS: a key belongs to the shard of the queue its
+ packets are received on, i.e., the indirection table entry of the Toeplitz hash of its header fields. Every core
+ then looks up and counts in its own DataPlaneLudo or DataPlaneLudoSketch, sharing no lock or counter with the
+ others, and the control plane applies the updates of different shards in parallel.
+ */
+
+#pragma once
+
+#include <mutex>
+#include "ludo.h"
+#include "../Sketch/ludo_sketch.h"
+#include "../input/input_types.h"
+
+/// The Toeplitz hash of RSS over the header fields of a key in network order, and the indirection table from the
+/// hash to the receive queues. With the hash key and the indirection table programmed into the NIC, e.g., by
+/// ethtool -X, shardOf(k) is the queue the NIC delivers the packets of k to.
+template<class Key>
+class RssPartitioner {
+public:
+  // the default key of the Microsoft RSS specification, which most drivers program
+  static constexpr uint8_t kDefaultKey[40] = {
+    0x6d, 0x5a, 0x56, 0xda, 0x25, 0x5b, 0x0e, 0xc2, 0x41, 0x67, 0x25, 0x3d, 0x43, 0xa3, 0x8f, 0xb0,
+    0xd0, 0xca, 0x2b, 0xcb, 0xae, 0x7b, 0x30, 0xb4, 0x77, 0xcb, 0x2d, 0xa3, 0x80, 0x30, 0xf2, 0x0c,
+    0x6a, 0x42, 0xb7, 0x3b, 0xbe, 0xac, 0x01, 0xfa};
+
+  static const uint32_t kIndirectionSize = 128;
+
+  /// the hashed fields of k, as the NIC reads them from the packet: the source and destination addresses and ports
+  /// of a 5-tuple (not the protocol), an address and port, an integer key as an address or a prefix, the bytes of
+  /// anything else
+  static inline uint32_t input(const Key &k, uint8_t *out) {
+    if constexpr (std::is_same<Key, Tuple5>::value) {
+      putBigEndian(out, k.src.addr, 4);
+      putBigEndian(out + 4, k.dst.addr, 4);
+      putBigEndian(out + 8, k.src.port, 2);
+      putBigEndian(out + 10, k.dst.port, 2);
+      return 12;
+    } else if constexpr (std::is_same<Key, Addr_Port>::value) {
+      putBigEndian(out, k.addr, 4);
+      putBigEndian(out + 4, k.port, 2);
+      return 6;
+    } else if constexpr (std::is_same<Key, unsigned __int128>::value) {
+      putBigEndian(out, uint64_t(k >> 64), 8);
+      putBigEndian(out + 8, uint64_t(k), 8);
+      return 16;
+    } else if constexpr (std::is_integral<Key>::value) {
+      putBigEndian(out, uint64_t(k), sizeof(Key));
+      return sizeof(Key);
+    } else {
+      static_assert(std::is_trivially_copyable<Key>::value, "RSS hashes the fixed-width header fields");
+      memcpy(out, &k, sizeof(Key));
+      return sizeof(Key);
+    }
+  }
+
+  static const uint32_t kInputLength = sizeof(Key);   // an upper bound of input()
+  static_assert(kInputLength + 4 <= sizeof(kDefaultKey), "the hash key is too short for the fields");
+
+  /// the hash by definition, one bit at a time, against which the table of the constructor is built
+  static inline uint32_t toeplitz(const uint8_t *data, uint32_t length, const uint8_t *hashKey) {
+    uint32_t result = 0;
+    uint32_t window = uint32_t(hashKey[0]) << 24 | uint32_t(hashKey[1]) << 16 | uint32_t(hashKey[2]) << 8 | hashKey[3];
+
+    for (uint32_t i = 0; i < length; ++i) {
+      for (int bit = 7; bit >= 0; --bit) {
+        if (data[i] & (1 << bit)) result ^= window;
+        window = window << 1 | ((hashKey[i + 4] >> bit) & 1);
+      }
+    }
+
+    return result;
+  }
+
+  /// \param queues the receive queues, i.e., the shards, spread over the indirection table round-robin, as ethtool
+  ///        -X equal does
+  explicit RssPartitioner(uint16_t queues = 1, const uint8_t *hashKey = kDefaultKey)
+    : indirection(kIndirectionSize) {
+    for (uint32_t i = 0; i < kIndirectionSize; ++i) indirection[i] = uint16_t(i % max<uint16_t>(1, queues));
+
+    // the hash is linear in the input bits, so it is the xor of the hashes of the bytes at their positions
+    for (uint32_t position = 0; position < kInputLength; ++position) {
+      uint8_t data[kInputLength] = {0};
+      for (uint32_t byte = 0; byte < 256; ++byte) {
+        data[position] = uint8_t(byte);
+        table[position][byte] = toeplitz(data, kInputLength, hashKey);
+      }
+    }
+  }
+
+  /// the indirection table read from the NIC, e.g., by ethtool -x, of a power of 2 entries
+  void setIndirection(const vector<uint16_t> &entries) {
+    if (entries.empty() || (entries.size() & (entries.size() - 1))) {
+      throw runtime_error("the RSS indirection table has a power of 2 entries");
+    }
+    indirection = entries;
+  }
+
+  inline uint32_t hash(const Key &k) const {
+    uint8_t data[kInputLength];
+    const uint32_t length = input(k, data);
+
+    uint32_t result = 0;
+    for (uint32_t i = 0; i < length; ++i) result ^= table[i][data[i]];
+    return result;
+  }
+
+  /// the queue of k, as the NIC takes the low bits of the hash into the indirection table
+  inline uint16_t shardOf(const Key &k) const {
+    return indirection[hash(k) & (indirection.size() - 1)];
+  }
+
+  inline uint16_t shards() const {
+    return uint16_t(*max_element(indirection.begin(), indirection.end()) + 1);
+  }
+
+  /// the fraction of the hashes that go to the queue
+  inline double share(uint16_t queue) const {
+    return double(count(indirection.begin(), indirection.end(), queue)) / indirection.size();
+  }
+
+private:
+  uint32_t table[kInputLength][256];
+  vector<uint16_t> indirection;
+
+  template<class T>
+  static inline void putBigEndian(uint8_t *out, T v, uint32_t bytes) {
+    for (uint32_t i = 0; i < bytes; ++i) out[i] = uint8_t(uint64_t(v) >> (8 * (bytes - 1 - i)));
+  }
+};
+
+/// The shards of one table, each a ControlPlaneLudo with its data plane. The data plane of a shard is read by the
+/// core of its queue, and is a DataPlaneLudoSketch if sketch, counting the lookups of that core only.
+template<class Key, class Value, uint8_t VL = sizeof(Value) * 8, bool sketch = false>
+class ShardedLudo {
+public:
+  typedef ControlPlaneLudo<Key, Value, VL> CP;
+  typedef typename std::conditional<sketch, DataPlaneLudoSketch<Key, Value, VL>, DataPlaneLudo<Key, Value, VL>>::type
+    DP;
+  typedef typename DataPlaneLudoSketch<Key, Value, VL>::SketchCounter SketchCounter;
+
+  struct Shard {
+    CP cp;
+    unique_ptr<DP> dp;
+    mutex writer;     // serializes the control plane updates of the shard, the others proceed meanwhile
+
+    explicit Shard(uint32_t capacity) : cp(capacity) {}
+  };
+
+  RssPartitioner<Key> rss;
+  vector<unique_ptr<Shard>> shards;
+
+  /// \param capacity of all the shards together, split by their shares of the indirection table, with a margin for
+  ///        the deviation of a random partition
+  ShardedLudo(uint32_t capacity, const RssPartitioner<Key> &rss) : rss(rss) {
+    for (uint16_t s = 0; s < rss.shards(); ++s) {
+      double share = capacity * rss.share(s);
+      shards.emplace_back(new Shard(uint32_t(share + 4 * sqrt(share) + 64)));
+    }
+  }
+
+  ShardedLudo(uint32_t capacity, uint16_t shardCnt) : ShardedLudo(capacity, RssPartitioner<Key>(shardCnt)) {}
+
+  inline uint16_t shardOf(const Key &k) const {
+    return rss.shardOf(k);
+  }
+
+  /// the data plane the core of the queue looks up in
+  inline DP &dataPlane(uint16_t shard) {
+    return *shards[shard]->dp;
+  }
+
+  /// Partition the keys, then load and export every shard, the shards in parallel. Replaces the content.
+  void bulkLoad(const Key *keys, const Value *values, uint64_t n, uint32_t threads = thread::hardware_concurrency()) {
+    vector<vector<uint32_t>> members = partition(keys, n, threads);
+
+    forShards(threads, [&](uint16_t s) {
+      Shard &shard = *shards[s];
+      vector<Key> shardKeys(members[s].size());
+      vector<Value> shardValues(members[s].size());
+      for (size_t i = 0; i < members[s].size(); ++i) {
+        shardKeys[i] = keys[members[s][i]];
+        shardValues[i] = values[members[s][i]];
+      }
+
+      shard.cp.bulkLoad(shardKeys.data(), shardValues.data(), uint32_t(shardKeys.size()), 1);
+      shard.cp.prepareToExport(1);
+      shard.dp.reset(new DP(shard.cp));
+    });
+  }
+
+  /// \return as ControlPlaneLudo::insert
+  const Key *insert(const Key &k, Value v) {
+    Shard &shard = *shards[shardOf(k)];
+    lock_guard<mutex> guard(shard.writer);
+    return insertTo(shard, k, v);
+  }
+
+  bool remove(const Key &k) {
+    Shard &shard = *shards[shardOf(k)];
+    lock_guard<mutex> guard(shard.writer);
+    return removeFrom(shard, k);
+  }
+
+  /// \return false if k is not in the table
+  bool updateMapping(const Key &k, Value v) {
+    Shard &shard = *shards[shardOf(k)];
+    lock_guard<mutex> guard(shard.writer);
+
+    uint32_t bs = shard.cp.updateMapping(k, v);
+    if (bs != uint32_t(-1)) {
+      shard.dp->applyUpdate(bs, v & ((1ULL << VL) - 1));
+    } else if (shard.cp.updateFallback(k, v)) {
+      shard.dp->fallback.insert(k, v & ((1ULL << VL) - 1));
+    } else {
+      return false;
+    }
+    return true;
+  }
+
+  /// insert a batch on threads threads, each applying whole shards, so the keys of a shard keep their order
+  void insertBatch(const Key *keys, const Value *values, uint64_t n, uint32_t threads = thread::hardware_concurrency()) {
+    vector<vector<uint32_t>> members = partition(keys, n, threads);
+
+    forShards(threads, [&](uint16_t s) {
+      lock_guard<mutex> guard(shards[s]->writer);
+      for (uint32_t i: members[s]) insertTo(*shards[s], keys[i], values[i]);
+    });
+  }
+
+  void removeBatch(const Key *keys, uint64_t n, uint32_t threads = thread::hardware_concurrency()) {
+    vector<vector<uint32_t>> members = partition(keys, n, threads);
+
+    forShards(threads, [&](uint16_t s) {
+      lock_guard<mutex> guard(shards[s]->writer);
+      for (uint32_t i: members[s]) removeFrom(*shards[s], keys[i]);
+    });
+  }
+
+  /// look up k in its shard, for a core that did not receive k from the NIC, e.g., a slow path
+  inline bool lookUp(const Key &k, Value &out) {
+    return shards[shardOf(k)]->dp->lookUp(k, out);
+  }
+
+  /// The shard of k counted all its lookups, if they came through the NIC, so its estimate is the one of the table.
+  template<bool s = sketch>
+  inline typename std::enable_if<s, SketchCounter>::type estimate(const Key &k) {
+    return shards[shardOf(k)]->dp->estimate(k);
+  }
+
+  /// the estimates of a batch of keys, each shard queried by one thread, as a collector merging the counts of
+  /// every core does
+  template<bool s = sketch>
+  typename std::enable_if<s>::type estimateBatch(const Key *keys, uint64_t n, SketchCounter *out,
+                                                 uint32_t threads = thread::hardware_concurrency()) {
+    vector<vector<uint32_t>> members = partition(keys, n, threads);
+
+    forShards(threads, [&](uint16_t sh) {
+      DP &dp = *shards[sh]->dp;
+      for (uint32_t i: members[sh]) out[i] = dp.estimate(keys[i]);
+    });
+  }
+
+  uint64_t getMemoryCost() const {
+    uint64_t result = 0;
+    for (const auto &shard: shards) result += shard->dp ? shard->dp->getMemoryCost() : 0;
+    return result;
+  }
+
+private:
+  /// the indices of the keys of every shard, in order
+  vector<vector<uint32_t>> partition(const Key *keys, uint64_t n, uint32_t threads) const {
+    if (n >= (1ULL << 32)) throw runtime_error("too many keys for one batch");
+
+    vector<uint16_t> owner(n);
+    threads = uint32_t(max<uint64_t>(1, min<uint64_t>(threads, n / 4096)));
+    parallelFor(threads, [&](uint32_t t) {
+      for (uint64_t i = n * t / threads; i < n * (t + 1) / threads; ++i) owner[i] = shardOf(keys[i]);
+    });
+
+    vector<vector<uint32_t>> members(shards.size());
+    for (uint32_t i = 0; i < n; ++i) members[owner[i]].push_back(i);
+    return members;
+  }
+
+  template<class F>
+  void forShards(uint32_t threads, F f) {
+    threads = max<uint32_t>(1, min<uint32_t>(threads, uint32_t(shards.size())));
+    parallelFor(threads, [&](uint32_t t) {
+      for (uint32_t s = t; s < shards.size(); s += threads) f(uint16_t(s));
+    });
+  }
+
+  static const Key *insertTo(Shard &shard, const Key &k, Value v) {
+    vector<MPC_PathEntry> path;
+    const Key *result = shard.cp.insert(k, v, &path);
+    v &= Value((1ULL << VL) - 1);
+
+    if (result == &k) {
+      if constexpr (sketch) {
+        vector<LS_PathEntry> sketchPath;
+        for (const MPC_PathEntry &e: path) {
+          sketchPath.push_back({e.bid, e.sid, e.newSeed, e.s0, e.s1, e.s2, e.s3, e.locatorCC});
+        }
+        shard.dp->applyInsert(sketchPath, v);
+      } else {
+        shard.dp->applyInsert(path, v);
+      }
+    } else if (result == nullptr) {
+      shard.dp->fallback.insert(k, v);
+    }
+
+    return result;
+  }
+
+  static bool removeFrom(Shard &shard, const Key &k) {
+    uint32_t bs;
+    if (!shard.cp.remove(k, &bs)) return false;
+
+    if (bs == uint32_t(-1)) {
+      shard.dp->fallback.remove(k);
+    } else {
+      shard.dp->applyRemove(bs);
+    }
+    return true;
+  }
+};
@@ -0,0 +1,200 @@
+/*!
+ \file ludo_sync.h
+ Streaming the modifications of a ControlPlaneLudo to remote DataPlaneLudo replicas as delta frames, see
+ delta_stream.h, instead of exporting the whole table again after every change.
+ */
+
+#pragma once
+
+#include "../delta_stream.h"
+#include "ludo.h"
+
+enum LudoDeltaKind : uint8_t {
+  LudoDeltaInsert = 1,     // the cuckoo path of an insertion, with the locator fixes, and the new slot value
+  LudoDeltaUpdate = 2,     // the new value of one slot
+  LudoDeltaFallback = 3,   // a key the cuckoo table could not hold
+  LudoDeltaRemove = 4,     // the slot of a removed key
+  LudoDeltaRemoveFallback = 5,
+  LudoDeltaUpdateFallback = 6,   // the new value of a key of the fallback table
+};
+
+/// The control plane end: modifies the ControlPlaneLudo and records what the replicas have to apply. The records of
+/// the fallback table carry the key itself, so keys must be plain values.
+template<class Key, class Value, uint8_t VL = sizeof(Value) * 8, uint8_t DL = 0>
+class LudoDeltaPublisher {
+  static_assert(std::is_trivially_copyable<Key>::value, "only plain keys can be streamed to the replicas");
+  static const uint64_t ValueMask = (1ULL << VL) - 1;
+
+public:
+  ControlPlaneLudo<Key, Value, VL, DL> &cp;
+  DeltaWriter writer;
+
+  /// \param appliedSeq the sequence number of the state exported to the replicas
+  explicit LudoDeltaPublisher(ControlPlaneLudo<Key, Value, VL, DL> &cp, uint64_t appliedSeq = 0)
+    : cp(cp), writer(appliedSeq) {}
+
+  /// \return as ControlPlaneLudo::insert
+  const Key *insert(const Key &k, Value v) {
+    vector<MPC_PathEntry> path;
+    const Key *result = cp.insert(k, v, &path);
+
+    if (result == &k) {
+      // the slot value in the control plane carries the digest as well
+      pair<uint32_t, uint32_t> loc = cp.locate(k);
+      Value stored = cp.buckets_[loc.first].values[loc.second];
+
+      writer.begin(LudoDeltaInsert);
+      writer.put(stored);
+      writer.put(uint32_t(path.size()));
+
+      for (const MPC_PathEntry &entry: path) {
+        writer.put(uint32_t(entry.bid << 2 | entry.sid));
+        writer.put(entry.newSeed);
+        writer.put(uint8_t(entry.s0 | entry.s1 << 2 | entry.s2 << 4 | entry.s3 << 6));
+        writer.putArray(entry.locatorCC);
+      }
+    } else if (result == nullptr) {
+      writer.begin(LudoDeltaFallback);
+      writer.put(k);
+      writer.put(Value(v & ValueMask));
+    }
+
+    return result;
+  }
+
+  /// \return false if k is not in the table
+  bool updateMapping(const Key &k, Value v) {
+    v = Value(v & ValueMask);
+    uint32_t bs = cp.updateMapping(k, v);
+
+    if (bs != uint32_t(-1)) {
+      writer.begin(LudoDeltaUpdate);
+      writer.put(bs);
+      writer.put(v);
+      return true;
+    }
+
+    if (!cp.updateFallback(k, v)) return false;
+
+    writer.begin(LudoDeltaUpdateFallback);
+    writer.put(k);
+    writer.put(v);
+    return true;
+  }
+
+  /// \return false if k is not in the table
+  bool remove(const Key &k) {
+    uint32_t bs;
+    if (!cp.remove(k, &bs)) return false;
+
+    if (bs != uint32_t(-1)) {
+      writer.begin(LudoDeltaRemove);
+      writer.put(bs);
+    } else {
+      writer.begin(LudoDeltaRemoveFallback);
+      writer.put(k);
+    }
+    return true;
+  }
+
+  /// \return the frame of the modifications since the last flush, empty if none. Write it to a ClientSock or a
+  /// SharedMemoryRing.
+  inline string flush() {
+    return writer.flush();
+  }
+
+  inline uint64_t sequence() const {
+    return writer.sequence();
+  }
+};
+
+/// The data plane end: a DataPlaneLudo and the sequence number of the last modification it reflects
+template<class Key, class Value, uint8_t VL = sizeof(Value) * 8, uint8_t DL = 0, class Layout = PackedBucketLayout>
+class LudoReplica {
+public:
+  DataPlaneLudo<Key, Value, VL, DL, Layout> dp;
+  uint64_t appliedSeq = 0;
+
+  LudoReplica() = default;   // only for loadSnapshot
+
+  LudoReplica(const ControlPlaneLudo<Key, Value, VL, DL> &cp, uint64_t appliedSeq)
+    : dp(cp), appliedSeq(appliedSeq) {}
+
+  /// Apply a frame. The records already reflected are skipped, and a gap throws, after which the replica should
+  /// be reloaded from a newer snapshot. Lookups may run meanwhile, except when the overflow seeds outgrow their
+  /// table, and a lookup of a fallback key may miss it while another fallback key is removed, see FlatStash.
+  void apply(const string &frame) {
+    appliedSeq = forEachDelta(frame, appliedSeq, [this](DeltaReader &r, uint8_t kind, bool apply) {
+      switch (kind) {
+        case LudoDeltaInsert: {
+          Value value = r.get<Value>();
+          vector<MPC_PathEntry> path(r.get<uint32_t>());
+
+          for (MPC_PathEntry &entry: path) {
+            uint32_t bs = r.get<uint32_t>();
+            uint8_t seed = r.get<uint8_t>();
+            uint8_t slots = r.get<uint8_t>();
+
+            entry.bid = bs >> 2;
+            entry.sid = bs & 3;
+            entry.newSeed = seed;
+            entry.s0 = slots & 3;
+            entry.s1 = (slots >> 2) & 3;
+            entry.s2 = (slots >> 4) & 3;
+            entry.s3 = slots >> 6;
+            r.getArray(entry.locatorCC);
+          }
+
+          if (apply) dp.applyInsert(path, value);
+          break;
+        }
+        case LudoDeltaUpdate: {
+          uint32_t bs = r.get<uint32_t>();
+          Value value = r.get<Value>();
+          if (apply) dp.applyUpdate(bs, value);
+          break;
+        }
+        case LudoDeltaRemove: {
+          uint32_t bs = r.get<uint32_t>();
+          if (apply) dp.applyRemove(bs);
+          break;
+        }
+        case LudoDeltaFallback:
+        case LudoDeltaUpdateFallback:
+        case LudoDeltaRemoveFallback: {
+          if constexpr (std::is_trivially_copyable<Key>::value) {
+            Key k = r.get<Key>();
+            if (kind == LudoDeltaRemoveFallback) {
+              if (apply) dp.fallback.remove(k);
+            } else {
+              Value value = r.get<Value>();
+              if (apply) dp.fallback.insert(k, value);   // an update overwrites the value
+            }
+            break;
+          }
+        }
+        default:
+          throw runtime_error("unknown Ludo delta record " + to_string(kind));
+      }
+    });
+  }
+
+  /// the sequence number, then the data plane
+  void saveSnapshot(const string &path) const {
+    SnapshotWriter w(path);
+    w.putSignature(SnapshotSignature("LudoReplica", {}));
+    w.put(appliedSeq);
+    dp.writeSnapshot(w);
+    w.close();
+  }
+
+  static LudoReplica loadSnapshot(const string &path) {
+    SnapshotReader r(path);
+    r.expectSignature(SnapshotSignature("LudoReplica", {}));
+
+    LudoReplica replica;
+    r.get(replica.appliedSeq);
+    replica.dp.readSnapshot(r);
+    return replica;
+  }
+};
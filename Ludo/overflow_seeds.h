@@ -0,0 +1,237 @@
+/*!
+ \file overflow_seeds.h
+ The seeds of the Ludo buckets that do not fit in LocatorSeedLength bits. A bucket whose seed field is saturated
+ keeps its seed here, and only those buckets are looked up, so the structure is off the path of nearly all lookups.
+ */
+
+#pragma once
+
+#include "../common.h"
+#include "../epoch.h"
+
+/// The seeds by bucket index, in two parts. When the saturated buckets are dense, i.e., one in 64 or more, the seeds
+/// are a flat array by the rank of the bucket among them, ranked by a bitmap of all buckets with a count per word,
+/// so a lookup reads one bitmap block and one seed. The rest, e.g., the buckets saturated by updates after the
+/// build, are in a linear probing table of bucket ids, which is rebuilt twice as large, or merged into the flat
+/// array, when half full: it grows without failing, unlike a presized cuckoo table.
+///
+/// One writer at a time, concurrent with any readers. A reader checks the bucket it read against the version lock
+/// of the bucket, which the writer holds. A rebuild publishes a new table and retires the one replaced, which is
+/// freed once every lookup that may read it left its Epoch::Guard.
+class OverflowSeeds {
+  static const uint32_t kDenseRatio = 64;     // buckets per saturated bucket at least to rank them
+  static const uint32_t kMinProbeSize = 16;
+
+  struct Block {
+    uint64_t bits;      // the saturated buckets of 64 buckets
+    uint64_t rank;      // the saturated buckets before them
+  };
+
+  struct Table {
+    TableArray<Block> blocks;     // empty when sparse
+    TableArray<uint8_t> ranked;   // the seeds of the buckets of blocks, by rank
+    TableArray<uint64_t> probe;   // (bid + 1) << 8 | seed, 0 if empty, a power of 2 entries
+    uint32_t probeCnt = 0;
+  };
+
+  uint32_t buckets = 0;
+  unique_ptr<Table> owned;
+  EpochRetired<Table> retired;
+  Table *live = nullptr;        // owned, but replaced atomically for the readers
+
+  static inline uint64_t probeStart(uint32_t bid, uint64_t mask) {
+    return (bid * 0x9E3779B97F4A7C15ULL >> 32) & mask;
+  }
+
+  static uint64_t probeSizeFor(uint64_t entries) {
+    uint64_t size = kMinProbeSize;
+    while (size < entries * 4) size <<= 1;
+    return size;
+  }
+
+  /// the table of the entries, ranked if they are dense, and room for some more in probe
+  Table *build(vector<pair<uint32_t, uint8_t>> entries) const {
+    sort(entries.begin(), entries.end());
+    entries.erase(unique(entries.begin(), entries.end(),
+                         [](const pair<uint32_t, uint8_t> &a, const pair<uint32_t, uint8_t> &b) {
+                           return a.first == b.first;
+                         }), entries.end());
+
+    Table *t = new Table;
+    if (!entries.empty() && entries.size() * kDenseRatio >= buckets) {
+      t->blocks.resize((buckets + 63) / 64, Block{0, 0});
+      t->ranked.resize(entries.size());
+
+      for (uint64_t i = 0; i < entries.size(); ++i) {
+        t->blocks[entries[i].first / 64].bits |= 1ULL << (entries[i].first % 64);
+        t->ranked[i] = entries[i].second;
+      }
+      for (uint64_t b = 1; b < t->blocks.size(); ++b) {
+        t->blocks[b].rank = t->blocks[b - 1].rank + __builtin_popcountll(t->blocks[b - 1].bits);
+      }
+      t->probe.resize(probeSizeFor(entries.size() / 8));
+    } else {
+      t->probe.resize(probeSizeFor(entries.size()));
+      for (const auto &entry: entries) insertProbe(*t, entry.first, entry.second);
+    }
+
+    return t;
+  }
+
+  static void insertProbe(Table &t, uint32_t bid, uint8_t seed) {
+    const uint64_t mask = t.probe.size() - 1, entry = (uint64_t(bid) + 1) << 8 | seed;
+
+    for (uint64_t i = probeStart(bid, mask);; i = (i + 1) & mask) {
+      if (t.probe[i] == 0) ++t.probeCnt;
+      if (t.probe[i] == 0 || (t.probe[i] >> 8) == uint64_t(bid) + 1) {
+        __atomic_store_n(&t.probe[i], entry, __ATOMIC_RELEASE);
+        return;
+      }
+    }
+  }
+
+  void publish(Table *t) {
+    unique_ptr<Table> replaced = std::move(owned);
+    owned.reset(t);
+    __atomic_store_n(&live, t, __ATOMIC_RELEASE);
+    retired.retire(std::move(replaced));
+    retired.reclaim();
+  }
+
+public:
+  explicit OverflowSeeds(uint32_t buckets = 0) : buckets(buckets), owned(build({})), live(owned.get()) {}
+
+  OverflowSeeds(const OverflowSeeds &other) : buckets(other.buckets), owned(new Table(*other.owned)),
+                                              live(owned.get()) {}
+
+  OverflowSeeds(OverflowSeeds &&other) noexcept
+    : buckets(other.buckets), owned(std::move(other.owned)), retired(std::move(other.retired)), live(owned.get()) {}
+
+  OverflowSeeds &operator=(OverflowSeeds &&other) noexcept {
+    buckets = other.buckets;
+    owned = std::move(other.owned);
+    retired = std::move(other.retired);
+    live = owned.get();
+    return *this;
+  }
+
+  OverflowSeeds &operator=(const OverflowSeeds &other) {
+    if (this != &other) {
+      buckets = other.buckets;
+      publish(new Table(*other.owned));
+    }
+    return *this;
+  }
+
+  /// replace the content with the seeds of the buckets of num_buckets buckets
+  void assign(uint32_t num_buckets, const vector<pair<uint32_t, uint8_t>> &entries) {
+    buckets = num_buckets;
+    publish(build(entries));
+  }
+
+  inline bool lookUp(uint32_t bid, uint8_t &seed) const {
+    Epoch::Guard guard;
+    const Table &t = *__atomic_load_n(&live, __ATOMIC_ACQUIRE);
+
+    if (!t.blocks.empty()) {
+      const Block &block = t.blocks[bid / 64];
+      const uint64_t bit = 1ULL << (bid % 64);
+
+      if (block.bits & bit) {
+        seed = __atomic_load_n(&t.ranked[block.rank + __builtin_popcountll(block.bits & (bit - 1))], __ATOMIC_RELAXED);
+        return true;
+      }
+    }
+
+    const uint64_t mask = t.probe.size() - 1;
+    for (uint64_t i = probeStart(bid, mask);; i = (i + 1) & mask) {
+      const uint64_t entry = __atomic_load_n(&t.probe[i], __ATOMIC_ACQUIRE);
+      if (entry == 0) return false;
+      if ((entry >> 8) == uint64_t(bid) + 1) {
+        seed = uint8_t(entry);
+        return true;
+      }
+    }
+  }
+
+  /// insert or update the seed of a bucket, the writer only
+  void insert(uint32_t bid, uint8_t seed) {
+    Table &t = *owned;
+
+    if (!t.blocks.empty() && (t.blocks[bid / 64].bits >> (bid % 64) & 1)) {
+      const Block &block = t.blocks[bid / 64];
+      __atomic_store_n(&t.ranked[block.rank + __builtin_popcountll(block.bits & ((1ULL << (bid % 64)) - 1))], seed,
+                       __ATOMIC_RELAXED);
+      return;
+    }
+
+    uint8_t old;
+    if ((t.probeCnt + 1) * 2 > t.probe.size() && !lookUp(bid, old)) {
+      vector<pair<uint32_t, uint8_t>> entries;
+      forEach([&entries](uint32_t b, uint8_t s) { entries.emplace_back(b, s); });
+      entries.emplace_back(bid, seed);
+      publish(build(std::move(entries)));
+      return;
+    }
+
+    insertProbe(t, bid, seed);
+  }
+
+  /// f(bid, seed) of every bucket, ranked first, the writer only
+  template<class F>
+  void forEach(F f) const {
+    const Table &t = *owned;
+
+    for (uint64_t b = 0; b < t.blocks.size(); ++b) {
+      for (uint64_t bits = t.blocks[b].bits, r = t.blocks[b].rank; bits; bits &= bits - 1, ++r) {
+        f(uint32_t(b * 64 + __builtin_ctzll(bits)), t.ranked[r]);
+      }
+    }
+    for (uint64_t entry: t.probe) {
+      if (entry) f(uint32_t((entry >> 8) - 1), uint8_t(entry));
+    }
+  }
+
+  inline uint64_t size() const {
+    return owned->ranked.size() + owned->probeCnt;
+  }
+
+  /// whether the seeds are mostly ranked, or all in the probing table
+  inline bool dense() const {
+    return !owned->blocks.empty();
+  }
+
+  inline uint64_t getMemoryCost() const {
+    return owned->blocks.size() * sizeof(Block) + owned->ranked.size() + owned->probe.size() * 8;
+  }
+
+  /// the tables as they are, so that a loaded snapshot views them in its mapping
+  void writeSnapshot(SnapshotWriter &w) const {
+    w.put(buckets);
+    w.put(owned->probeCnt);
+    w.putArray(owned->blocks);
+    w.putArray(owned->ranked);
+    w.putArray(owned->probe);
+  }
+
+  void readSnapshot(SnapshotReader &r) {
+    unique_ptr<Table> t(new Table);
+    uint32_t num_buckets;
+    r.get(num_buckets);
+    r.get(t->probeCnt);
+    r.getArray(t->blocks);
+    r.getArray(t->ranked);
+    r.getArray(t->probe);
+
+    const uint64_t probeSize = t->probe.size();
+    if (!probeSize || (probeSize & (probeSize - 1)) || t->probeCnt * 2 > probeSize ||
+        (!t->blocks.empty() && (t->blocks.size() != (num_buckets + 63) / 64 ||
+                                t->blocks.end()[-1].rank + __builtin_popcountll(t->blocks.end()[-1].bits) !=
+                                t->ranked.size()))) {
+      throw runtime_error("corrupt overflow seeds in snapshot");
+    }
+
+    buckets = num_buckets;
+    publish(t.release());
+  }
+};
@@ -1,13 +1,14 @@
 #pragma once
 
 #include "../common.h"
+#include "../bit_packed_array.h"
 
 using namespace std;
 
 template<class K, class V, uint8_t L, uint8_t CL>
 class DataPlaneOthello;
 
-struct OthelloCPCell {
+struct alignas(8) OthelloCPCell {   // aligned so that a cell is exchanged atomically in the parallel build
   uint32_t keyId;
   uint32_t nodeId;
 };
@@ -94,96 +95,35 @@ public:
   /// \return the number of uint64_t elements to hold ma + mb valueType elements
   inline void memResize() {
     if (!maintainingDP) return;
-    mem.resize((((uint64_t) ma + mb) * VCL + 63) / 64);
+    mem.resize(bitPackedWords(((uint64_t) ma + mb) * VCL));
   }
   
-  /// Set the index-th element to be value. if the index > ma, it is the (index - ma)-th element in array B
+  // the cells, and the values within them after the CL check bits
+  typedef BitPackedArray<VCL> CellBits;
+  typedef BitPackedArray<L, VCL, CL> ValueBits;
+  
+  /// Set the index-th element to be value. if the index > ma, it is the (index - ma)-th element in array B. When
+  /// concurrent, threads may write other cells of the same words, so each word is updated by an atomic operation
   /// \param index in array A or array B
   /// \param value
+  template<bool concurrent = false>
   inline void memSet(uint32_t index, uint64_t value) {
-    if (VCL == 0) return;
-    
-    uint64_t v = uint64_t(value) & VCMASK;
-    
-    uint64_t i = (uint64_t) index * VCL;
-    uint32_t start = i / 64;
-    uint8_t offset = uint8_t(i % 64);
-    char left = char(offset + VCL - 64);
-    
-    uint64_t mask = ~(VCMASK << offset); // [offset, offset + VCL) should be 0, and others are 1
-    
-    mem[start] &= mask;
-    mem[start] |= v << offset;
-    
-    if (left > 0) {
-      mask = uint64_t(-1) << left;     // lower left bits should be 0, and others are 1
-      mem[start + 1] &= mask;
-      mem[start + 1] |= v >> (VCL - left);
-    }
+    CellBits::template setAt<concurrent>(mem.data(), index, value);
   }
   
   /// \param index in array A or array B
   /// \return the index-th element. if the index > ma, it is the (index - ma)-th element in array B
   inline uint64_t memGet(uint32_t index) const {
-    uint64_t i = (uint64_t) index * VCL;
-    uint32_t start = i / 64;
-    uint8_t offset = uint8_t(i % 64);
-    
-    char left = char(offset + VCL - 64);
-    left = char(left < 0 ? 0 : left);
-    
-    uint64_t mask = ~(uint64_t(-1)
-            << (VCL - left));     // lower VCL-left bits should be 1, and others are 0
-    uint64_t result = (mem[start] >> offset) & mask;
-    
-    if (left > 0) {
-      mask = ~(uint64_t(-1) << left);     // lower left bits should be 1, and others are 0
-      result |= (mem[start + 1] & mask) << (VCL - left);
-    }
-    
-    return result;
+    return CellBits::getAt(mem.data(), index);
   }
   
+  template<bool concurrent = false>
   inline void memValueSet(uint32_t index, uint64_t value) {
-    if (L == 0) return;
-    
-    uint64_t v = uint64_t(value) & VMASK;
-    
-    uint64_t i = (uint64_t) index * VCL + CL;
-    uint32_t start = i / 64;
-    uint8_t offset = uint8_t(i % 64);
-    char left = char(offset + L - 64);
-    
-    uint64_t mask = ~(VMASK << offset); // [offset, offset + L) should be 0, and others are 1
-    
-    mem[start] &= mask;
-    mem[start] |= v << offset;
-    
-    if (left > 0) {
-      mask = uint64_t(-1) << left;     // lower left bits should be 0, and others are 1
-      mem[start + 1] &= mask;
-      mem[start + 1] |= v >> (L - left);
-    }
+    ValueBits::template setAt<concurrent>(mem.data(), index, value);
   }
   
   inline uint64_t memValueGet(uint32_t index) const {
-    if (L == 0) return 0;
-    
-    uint64_t i = (uint64_t) index * VCL + CL;
-    uint32_t start = i / 64;
-    uint8_t offset = uint8_t(i % 64);
-    char left = char(offset + L - 64);
-    left = char(left < 0 ? 0 : left);
-    
-    uint64_t mask = ~(uint64_t(-1) << (L - left));     // lower L-left bits should be 1, and others are 0
-    uint64_t result = (mem[start] >> offset) & mask;
-    
-    if (left > 0) {
-      mask = ~(uint64_t(-1) << left);     // lower left bits should be 1, and others are 0
-      result |= (mem[start + 1] & mask) << (L - left);
-    }
-    
-    return result;
+    return ValueBits::getAt(mem.data(), index);
   }
 
 public:
@@ -428,15 +368,20 @@ public:
   /// 2. the values are in the value array
   /// 3. the root is always from array A
   /// Side effect: all node in this tree is set and if updateToFilled
-  template<bool fillValue, bool fillIndex>
-  void fillTreeDFS(uint32_t root) {
+  /// \tparam concurrent other threads fill other trees meanwhile. The steps are not counted, and the representative
+  ///         of every node in the disjoint set is set to the root.
+  /// \return the number of steps
+  template<bool fillValue, bool fillIndex, bool concurrent = false>
+  uint64_t fillTreeDFS(uint32_t root) {
 //    assert(root < ma);
     
+    uint64_t steps = 0;
     stack<pair<uint32_t, uint32_t>> stack;  // previous key id, this node
     stack.push(make_pair(uint32_t(-1), root));
     
     do {
-      Counter::count("Othello fillTreeDFS step");
+      if (!concurrent) COUNT_ID("Othello fillTreeDFS step", 1);
+      ++steps;
       uint32_t prev = stack.top().first;
       uint32_t nid = stack.top().second;
       stack.pop();
@@ -455,21 +400,24 @@ public:
         
         uint32_t nextNode = cell.nodeId;
         
-        fillSingle<fillValue, fillIndex>(cell.keyId, nextNode, nid);
+        fillSingle<fillValue, fillIndex, concurrent>(cell.keyId, nextNode, nid);
+        if (concurrent) connectivityForest.__set(nextNode, root);
         
         stack.push(make_pair(uint32_t(cell.keyId), nextNode));
       }
     } while (!stack.empty());
+    
+    return steps;
   }
   
-  template<bool fillValue, bool fillIndex>
+  template<bool fillValue, bool fillIndex, bool concurrent = false>
   inline void fillSingle(uint32_t keyId, uint32_t nodeToFill, uint32_t oppositeNode) {
     if (fillValue && maintainingDP) {
       uint64_t valueToFill;
       if (true) {
         uint64_t v = values[keyId];
         valueToFill = v ^ memValueGet(oppositeNode);
-        memValueSet(nodeToFill, valueToFill);
+        memValueSet<concurrent>(nodeToFill, valueToFill);
       }
     }
     
@@ -520,7 +468,7 @@ public:
     stack.push(make_pair(keyId, startNode));
     
     do {
-      Counter::count("Othello fixHalfTreeDFS step");
+      COUNT_ID("Othello fixHalfTreeDFS step", 1);
       uint32_t prev = stack.top().first;
       uint32_t nid = stack.top().second;
       stack.pop();
@@ -693,35 +641,191 @@ public:
     fillValue();
   }
   
+  /// the build gives every thread at least this many keys, smaller builds use fewer threads
+  static const uint32_t kMinKeysPerBuildThread = 1U << 16;
+  
+  /// Test if the hash pair is acyclic by peeling the graph: a node of degree 1 is removed together with its only
+  /// edge until no such node is left, and the graph is acyclic iff all edges are removed. The degree and the xor of
+  /// the incident key ids of every node are counted atomically, so threads peel different parts of the graph at
+  /// the same time, and an edge is claimed by the first thread that reaches it.
+  ///
+  /// Side effect: none except the output, so a failed try leaves the current build intact
+  /// \param ends the two nodes of every key
+  /// \param peeled whether a node is removed with an edge. The only node left in a tree is its root.
+  /// \param dropped if not null, the graph is made acyclic by leaving out one key of every cycle, whose ids are
+  ///        appended, unless more than maxDropped keys would be left out
+  bool peelHash(uint32_t threads, vector<uint32_t> &ends, vector<uint8_t> &peeled,
+                vector<uint32_t> *dropped = nullptr, uint32_t maxDropped = 0) {
+    const uint64_t nodes = (uint64_t) ma + mb;
+    vector<uint32_t> degree(nodes, 0), xorKey(nodes, 0);
+    vector<uint8_t> edgePeeled(keyCnt, 0);
+    vector<uint64_t> peeledCnt(threads, 0);
+    
+    ends.resize(2ULL * keyCnt);
+    peeled.assign(nodes, 0);
+    
+    parallelFor(threads, [&](uint32_t t) {
+      for (uint32_t i = uint64_t(keyCnt) * t / threads; i < uint64_t(keyCnt) * (t + 1) / threads; ++i) {
+        getIndices(keys[i], ends[2ULL * i], ends[2ULL * i + 1]);
+        
+        for (int e = 0; e < 2; ++e) {
+          __atomic_fetch_xor(&xorKey[ends[2ULL * i + e]], i, __ATOMIC_RELAXED);
+          __atomic_fetch_add(&degree[ends[2ULL * i + e]], 1, __ATOMIC_RELAXED);
+        }
+      }
+    });
+    
+    // peel from the nodes of the stack until none of degree 1 is left, counting the peeled edges
+    auto peel = [&](vector<uint32_t> &stack, uint64_t &cnt) {
+      while (!stack.empty()) {
+        uint32_t nid = stack.back();
+        stack.pop_back();
+        
+        // the xor is updated before the degree, so it holds the only edge once the degree reads 1, unless that
+        // edge is being peeled from the other end and the xor is already cleared
+        if (__atomic_load_n(&degree[nid], __ATOMIC_ACQUIRE) != 1) continue;
+        uint32_t keyId = __atomic_load_n(&xorKey[nid], __ATOMIC_RELAXED);
+        if (keyId >= keyCnt || (ends[2ULL * keyId] != nid && ends[2ULL * keyId + 1] != nid)) continue;
+        
+        uint8_t expected = 0;
+        if (!__atomic_compare_exchange_n(&edgePeeled[keyId], &expected, 1, false, __ATOMIC_ACQ_REL,
+                                         __ATOMIC_RELAXED)) {
+          continue;   // peeled from the other end
+        }
+        
+        peeled[nid] = 1;
+        ++cnt;
+        
+        uint32_t other = ends[2ULL * keyId] == nid ? ends[2ULL * keyId + 1] : ends[2ULL * keyId];
+        for (uint32_t end: {nid, other}) {
+          __atomic_fetch_xor(&xorKey[end], keyId, __ATOMIC_RELAXED);
+          if (__atomic_fetch_sub(&degree[end], 1, __ATOMIC_RELEASE) == 2) stack.push_back(end);
+        }
+      }
+    };
+    
+    parallelFor(threads, [&](uint32_t t) {
+      vector<uint32_t> stack;
+      
+      for (uint64_t n = nodes * t / threads; n < nodes * (t + 1) / threads; ++n) {
+        stack.push_back(n);
+        peel(stack, peeledCnt[t]);
+      }
+    });
+    
+    uint64_t total = 0;
+    for (uint64_t c: peeledCnt) total += c;
+    if (total == keyCnt || !dropped) return total == keyCnt;
+    
+    // The edges left are the cycles and the paths between them. Leaving out one edge of a cycle lets the peeling
+    // go on from its ends, so only the components of the cycles are visited again, and no key is hashed again.
+    const size_t droppedBefore = dropped->size();
+    vector<uint32_t> stack;
+    for (uint32_t i = 0; i < keyCnt && total < keyCnt; ++i) {
+      if (edgePeeled[i]) continue;
+      if (dropped->size() - droppedBefore == maxDropped) {
+        dropped->resize(droppedBefore);
+        return false;
+      }
+      
+      edgePeeled[i] = 1;
+      dropped->push_back(i);
+      ++total;
+      
+      for (int e = 0; e < 2; ++e) {
+        uint32_t end = ends[2ULL * i + e];
+        xorKey[end] ^= i;
+        if (--degree[end] == 1) stack.push_back(end);
+      }
+      peel(stack, total);
+    }
+    
+    return true;
+  }
+  
   /// Begin a new build
   /// Side effect: 1) discard all memory except keys and values. 2) build fail, or
   /// all the values and disjoint set are properly set
-  bool tryBuild() {
-    resetBuildState();
-    
+  /// \note a failed try only costs the hashing and the peeling, the tables are reset only on success. Then the edges
+  /// are linked and the trees are filled in parallel, each tree by one thread.
+  /// \param dropped if not null, the keys left out to break the cycles, with their values, see peelHash. They are
+  ///        removed from keys and values, each replaced by the last key as in remove.
+  bool tryBuild(uint32_t threads = thread::hardware_concurrency(), vector<pair<K, V>> *dropped = nullptr,
+                uint32_t maxDropped = 0) {
     if (keyCnt == 0) {
+      resetBuildState();
       return true;
     }
 
+    builds++;
 #ifndef NDEBUG
     Clocker rebuild("rebuild");
 #else
     cout << "rebuild" << endl;
 #endif
     
-    bool succ = testHash();
-    if (succ) {
-      fillValue();
+    threads = max(1U, min(threads, keyCnt / kMinKeysPerBuildThread));
+    
+    vector<uint32_t> ends, cyclic;
+    vector<uint8_t> peeled;
+    if (!peelHash(threads, ends, peeled, dropped ? &cyclic : nullptr, maxDropped)) {
+      return false;
     }
     
-    return succ;
+    // from the last, so that the key moved into a hole is never one to drop
+    for (auto it = cyclic.rbegin(); it != cyclic.rend(); ++it) {
+      const uint32_t i = *it, last = --keyCnt;
+      dropped->emplace_back(keys[i], values[i]);
+      
+      keys[i] = keys[last];
+      values[i] = values[last];
+      ends[2ULL * i] = ends[2ULL * last];
+      ends[2ULL * i + 1] = ends[2ULL * last + 1];
+    }
+    
+    resetBuildState();
+    
+    parallelFor(threads, [&](uint32_t t) {
+      for (uint32_t i = uint64_t(keyCnt) * t / threads; i < uint64_t(keyCnt) * (t + 1) / threads; ++i) {
+        uint32_t ha = ends[2ULL * i], hb = ends[2ULL * i + 1];
+        
+        OthelloCPCell cell = {i, hb};
+        __atomic_exchange(&head[ha], &cell, &nextAtA[i], __ATOMIC_RELAXED);
+        cell = {i, ha};
+        __atomic_exchange(&head[hb], &cell, &nextAtB[i], __ATOMIC_RELAXED);
+      }
+    });
+    
+    // every tree is filled by the thread owning its only unpeeled node. The roots are from array A, as in addEdge.
+    const uint64_t nodes = (uint64_t) ma + mb;
+    vector<uint64_t> steps(threads, 0);
+    parallelFor(threads, [&](uint32_t t) {
+      for (uint64_t n = nodes * t / threads; n < nodes * (t + 1) / threads; ++n) {
+        if (peeled[n] || head[n].keyId == uint32_t(-1)) continue;
+        
+        uint32_t root = n < ma ? n : head[n].nodeId;
+        connectivityForest.__set(root, root);
+        
+        if ((CL || randomized) && maintainingDP) {
+          memSet<true>(root, randomized ? randVal() | 1 : 1);
+        }
+        
+        steps[t] += fillTreeDFS<true, true, true>(root);
+      }
+    });
+    
+    uint64_t totalSteps = 0;
+    for (uint64_t s: steps) totalSteps += s;
+    COUNT_ID("Othello fillTreeDFS step", totalSteps);
+    
+    return true;
   }
   
   /// try really hard to build, until success or tryCount >= MAX_REHASH
   ///
   /// Side effect: 1) discard all memory except keys and values. 2) build fail, or
   /// all the values and disjoint set are properly set
-  bool build() {
+  bool build(uint32_t threads = thread::hardware_concurrency()) {
     int tryCount = 0;
     
     bool built = false;
@@ -734,7 +838,7 @@ public:
              << " keyT" << sizeof(K) * 8 << "b  valueT" << sizeof(V) * 8 << "b"     //
              << " Lvd=" << (int) VCL << endl;
       }
-      built = tryBuild();
+      built = tryBuild(threads);
     } while ((!built) && (tryCount < MAX_REHASH));
     
     //printf("%08x %08x\n", Ha.s, Hb.s);
@@ -754,6 +858,24 @@ public:
     return built;
   }
   
+  /// build with one seed, leaving out one key of every cycle instead of trying other seeds, each of which hashes
+  /// all keys again. Another seed is tried only if the cycles are unusually many, more than maxDropped keys.
+  /// \param dropped the keys left out, with their values, e.g., to be kept in a fallback table
+  void buildBreakingCycles(vector<pair<K, V>> &dropped, uint32_t threads = thread::hardware_concurrency(),
+                           uint32_t maxDropped = 64) {
+    int tryCount = 0;
+    
+    do {
+      hab.setSeed((uint64_t(rand()) << 32) | rand());
+      if (++tryCount > MAX_REHASH) {
+        cout << "rebuild fail! " << endl;
+        throw exception();
+      }
+    } while (!tryBuild(threads, &dropped, maxDropped));
+    
+    checkIntegrity();
+  }
+  
   inline bool lookUp(const K &k, V &out) const {
     uint32_t ha, hb;
     getIndices(k, ha, hb);
@@ -885,6 +1007,15 @@ public:
     return keyCnt;
   }
   
+  /// whether k can be inserted with DoNotRebuild, i.e., no resize is needed and its two nodes are not connected yet
+  inline bool canInsertWithoutRebuild(const K &k) {
+    if (keyCnt + 1 >= keys.size() || keyCnt >= mb) return false;
+    
+    uint32_t ha, hb;
+    getIndices(k, ha, hb);
+    return !isConnectedDFS(ha, hb);
+  }
+  
   inline bool isMember(const K &x) const {
     uint32_t index = lookUpIndex(x);
     return (index < keyCnt && keys[index] == x);
@@ -949,7 +1080,7 @@ public:
         nextAtB[t] = {keyId, hal};
       }
       // update the mapped index
-      fixHalfTreeDFS<false, true, true>(keyId, hal, hbl);
+      fixHalfTreeDFS<false, true>(keyId, hal, hbl);
     }
     
     if (maintainDisjointSet) {
@@ -964,11 +1095,13 @@ public:
   inline void checkIntegrity() const {
 #ifdef FULL_DEBUG
     for (int i = 0; i < size(); ++i) {
-      V q;
-      assert(lookUp(keys[i], q));
-      q &= VMASK;
-      V e = values[i] & VMASK;
-      assert(q == e);
+      if (maintainingDP) {   // otherwise mem is not allocated
+        V q;
+        assert(lookUp(keys[i], q));
+        q &= VMASK;
+        V e = values[i] & VMASK;
+        assert(q == e);
+      }
       assert(lookUpIndex(keys[i]) == i);
     }
 #endif
@@ -994,6 +1127,20 @@ public:
     return mem.size() * sizeof(mem[0]) + keys.size() * sizeof(keys[0]) + values.size() * sizeof(values[0]) +
            indMem.size() * sizeof(indMem[0]);
   }
+  
+  uint64_t builds = 0;   // of the whole arrays, by tryBuild, e.g., when an insert closes a cycle or resizes
+  
+  /// The keys against the nodes of the two arrays, and the builds so far. The arrays hold mb keys at most, an insert
+  /// past it resizes and builds them again, so keys near mb, or builds growing between samples, are due for a resize.
+  json stats() const {
+    return {{"keys", keyCnt},
+            {"key capacity", keys.size()},
+            {"ma", ma},
+            {"mb", mb},
+            {"load factor", ma + mb ? double(keyCnt) / (ma + mb) : 0.0},
+            {"builds", builds},
+            {"memory", getMemoryCost()}};
+  }
 };
 
 
@@ -1,6 +1,8 @@
 #pragma once
 
 #include "control_plane_othello.h"
+#include "../version_lock.h"
+#include "../bit_packed_array.h"
 
 using namespace std;
 
@@ -23,20 +25,21 @@ public:
   //****************************************
   //*************DATA Plane
   //****************************************
-  vector<uint64_t> mem{};        // memory space for array A and array B. All elements are stored compactly into consecutive uint64_t
+  TableArray<uint64_t> mem{};        // memory space for array A and array B. All elements are stored compactly into consecutive uint64_t
   uint32_t ma = 0;               // number of elements of array A
   uint32_t mb = 0;               // number of elements of array B
   Hasher64<K> hab;          // hash function Ha
   Hasher32<K> hd;
   
-  vector<uint8_t> lock = vector<uint8_t>(8192, 0);
+  const static uint32_t CellsPerLine = VCL ? 512 / VCL : 512;
+  VersionLocks locks;   // one stripe per cache line of cells
+  
+  static const uint8_t kBatchSize = 64;   // keys resolved per prefetch round in lookUpBatch
   
   inline uint32_t multiply_high_u32(uint32_t x, uint32_t y) const {
     return (uint32_t) (((uint64_t) x * (uint64_t) y) >> 32);
   }
   
-  vector<uint8_t> versions;
-  
   inline uint64_t fast_map_to_A(uint32_t x) const {
     // Map x (uniform in 2^64) to the range [0, num_buckets_ -1]
     // using Lemire's alternative to modulo reduction:
@@ -57,104 +60,54 @@ public:
     aInd = fast_map_to_A(hash);
   }
   
+  /// getIndices of a compact key by its base, see CompactKey
+  inline void getIndices(const KeyBase &base, uint32_t &aInd, uint32_t &bInd) const {
+    uint64_t hash = hab.fromBase(base);
+    bInd = fast_map_to_B(hash >> 32) + ma;
+    aInd = fast_map_to_A(hash);
+  }
+  
+  // the cells, and the values within them after the CL check bits
+  typedef BitPackedArray<VCL> CellBits;
+  typedef BitPackedArray<L, VCL, CL> ValueBits;
+  
   /// Set the index-th element to be value. if the index > ma, it is the (index - ma)-th element in array B
   /// \param index in array A or array B
   /// \param value
   inline void memSet(uint32_t index, uint64_t value) {
     if (VCL == 0) return;
     
-    lock[index & 8191]++;
-    
-    uint64_t v = uint64_t(value) & VCMASK;
-    
-    uint64_t i = (uint64_t) index * VCL;
-    uint32_t start = i / 64;
-    uint8_t offset = uint8_t(i % 64);
-    char left = char(offset + VCL - 64);
-    
-    uint64_t mask = ~(VCMASK << offset); // [offset, offset + VCL) should be 0, and others are 1
-    
-    mem[start] &= mask;
-    mem[start] |= v << offset;
-    
-    if (left > 0) {
-      mask = uint64_t(-1) << left;     // lower left bits should be 0, and others are 1
-      mem[start + 1] &= mask;
-      mem[start + 1] |= v >> (VCL - left);
-    }
-    
-    lock[index & 8191]++;
+    locks.lock(index);
+    CellBits::setAt(mem.data(), index, value);
+    locks.unlock(index);
   }
   
   /// \param index in array A or array B
   /// \return the index-th element. if the index > ma, it is the (index - ma)-th element in array B
   inline uint64_t memGet(uint32_t index) const {
-    uint64_t i = (uint64_t) index * VCL;
-    uint32_t start = i / 64;
-    uint8_t offset = uint8_t(i % 64);
-    
-    char left = char(offset + VCL - 64);
-    left = char(left < 0 ? 0 : left);
-    
-    uint64_t mask = ~(uint64_t(-1)
-            << (VCL - left));     // lower VCL-left bits should be 1, and others are 0
-    uint64_t result = (mem[start] >> offset) & mask;
-    
-    if (left > 0) {
-      mask = ~(uint64_t(-1) << left);     // lower left bits should be 1, and others are 0
-      result |= (mem[start + 1] & mask) << (VCL - left);
-    }
-    
-    return result;
+    return CellBits::getAt(mem.data(), index);
   }
   
+  // cells of other stripes may share the words, so the update of each word is a single atomic operation
   inline void memValueSet(uint32_t index, uint64_t value) {
     if (L == 0) return;
     
-    lock[index & 8191]++;
-    COMPILER_BARRIER();
-    
-    uint64_t v = uint64_t(value) & VMASK;
-    
-    uint64_t i = (uint64_t) index * VCL + CL;
-    uint32_t start = i / 64;
-    uint8_t offset = uint8_t(i % 64);
-    char left = char(offset + L - 64);
-    
-    uint64_t mask = ~(VMASK << offset); // [offset, offset + L) should be 0, and others are 1
-    
-    mem[start] &= mask;
-    mem[start] |= v << offset;
-    
-    if (left > 0) {
-      mask = uint64_t(-1) << left;     // lower left bits should be 0, and others are 1
-      mem[start + 1] &= mask;
-      mem[start + 1] |= v >> (L - left);
-    }
+    locks.lock(index);
+    ValueBits::template setAt<true>(mem.data(), index, value);
+    locks.unlock(index);
+  }
+  
+  /// xor the value at index with x. Fixes commute, so writers fixing overlapping trees may run concurrently
+  inline void memValueXor(uint32_t index, uint64_t x) {
+    if (L == 0) return;
     
-    COMPILER_BARRIER();
-    lock[index & 8191]++;
+    locks.lock(index);
+    ValueBits::template exclusiveOrAt<true>(mem.data(), index, x);
+    locks.unlock(index);
   }
   
   inline uint64_t memValueGet(uint32_t index) const {
-    if (L == 0) return 0;
-    
-    uint64_t i = (uint64_t) index * VCL + CL;
-    uint32_t start = i / 64;
-    uint8_t offset = uint8_t(i % 64);
-    char left = char(offset + L - 64);
-    left = char(left < 0 ? 0 : left);
-    
-    uint64_t mask = ~(uint64_t(-1)
-            << (L - left));     // lower L-left bits should be 1, and others are 0
-    uint64_t result = (mem[start] >> offset) & mask;
-    
-    if (left > 0) {
-      mask = ~(uint64_t(-1) << left);     // lower left bits should be 1, and others are 0
-      result |= (mem[start + 1] & mask) << (L - left);
-    }
-    
-    return result;
+    return ValueBits::getAt(mem.data(), index);
   }
   
   inline void fillSingle(uint32_t valueToFill, uint32_t nodeToFill) {
@@ -164,8 +117,7 @@ public:
   /// fix the value and index at single node by xoring x
   /// \param x the xor'ed number
   inline void fixSingle(uint32_t nodeToFix, uint64_t x) {
-    uint64_t valueToFill = x ^memValueGet(nodeToFix);
-    memValueSet(nodeToFix, valueToFill);
+    memValueXor(nodeToFix, x);
   }
   
   /// Fix the values of a connected tree starting at the root node and avoid searching keyId
@@ -186,21 +138,50 @@ public:
   /// \return the lookup is successfully passed the digest match, but it does not mean the key is really a member
   inline bool lookUp(const K &k, V &v) {
     uint32_t ha, hb;
+    return lookUp(k, v, ha, hb);
+  }
+
+  /// \param ha, hb return the indices of k into array A&B, so that callers can reuse them
+  inline bool lookUp(const K &k, V &v, uint32_t &ha, uint32_t &hb) {
     getIndices(k, ha, hb);
-    
+    return lookUpAt(ha, hb, v);
+  }
+
+  /// Batched lookUp. The indices of a whole batch are computed and prefetched before any cell is read,
+  /// so that the cache misses of different keys overlap instead of being serialized.
+  inline void lookUpBatch(const K *keys, V *out, size_t n) {
+    uint32_t ha[kBatchSize], hb[kBatchSize];
+
+    for (size_t base = 0; base < n; base += kBatchSize) {
+      size_t cnt = min(n - base, (size_t) kBatchSize);
+
+      for (size_t i = 0; i < cnt; ++i) {
+        getIndices(keys[base + i], ha[i], hb[i]);
+        prefetch(ha[i]);
+        prefetch(hb[i]);
+      }
+
+      for (size_t i = 0; i < cnt; ++i) {
+        lookUpAt(ha[i], hb[i], out[base + i]);
+      }
+    }
+  }
+
+  /// issue a prefetch of the word holding the index-th element
+  inline void prefetch(uint32_t index) const {
+    __builtin_prefetch(&mem[(uint64_t) index * VCL / 64]);
+  }
+
+  /// \param ha, hb the indices of the key into array A&B, as returned by getIndices
+  /// \param v the lookup value for the key
+  inline bool lookUpAt(uint32_t ha, uint32_t hb, V &v) {
     while (true) {
-      uint8_t va1 = lock[ha & 8191], vb1 = lock[hb & 8191];
-      COMPILER_BARRIER();
-      
-      if (va1 % 2 == 1 || vb1 % 2 == 1) continue;
+      uint32_t va = locks.beginRead(ha), vb = locks.beginRead(hb);
       
       uint64_t aa = memGet(ha);
       uint64_t bb = memGet(hb);
       
-      COMPILER_BARRIER();
-      uint8_t va2 = lock[ha & 8191], vb2 = lock[hb & 8191];
-      
-      if (va1 != va2 || vb1 != vb2) continue;
+      if (!locks.validate(ha, va) || !locks.validate(hb, vb)) continue;
       
       ////printf("%llx   [%x] %x ^ [%x] %x = %x\n", k,ha,aa&LMASK,hb,bb&LMASK,(aa^bb)&LMASK);
       uint64_t vc = aa ^bb;
@@ -242,8 +223,6 @@ public:
       assert(cp.lookUp(k, out) && (out == lookUp(k)));
     }
 #endif
-    
-    versions.resize(ma + mb);
   }
   
   template<bool maintainDisjointSet, bool randomized>
@@ -251,8 +230,9 @@ public:
     this->ma = cp.ma;
     this->mb = cp.mb;
     this->hab = cp.hab;
-    this->mem = cp.mem;
+    this->mem.assign(cp.mem.begin(), cp.mem.end());
     this->hd = cp.hd;
+    this->locks = VersionLocks(ma + mb, CellsPerLine);
   }
   
   template<bool maintainDisjointSet, bool randomized>
@@ -264,7 +244,49 @@ public:
     this->mb = cp.mb;
     this->hab = cp.hab;
     this->hd = cp.hd;
-    this->mem = cp.mem;
+    this->mem.assign(cp.mem.begin(), cp.mem.end());
+    this->locks = VersionLocks(ma + mb, CellsPerLine);
+  }
+  
+  /// move mem to memory allocated following the policy, e.g., huge pages of another NUMA node
+  void setMemoryPolicy(const MemoryPolicy &policy) {
+    mem.setMemoryPolicy(policy);
+  }
+  
+  void writeSnapshot(SnapshotWriter &w) const {
+    w.putSignature(signature());
+    w.put(ma);
+    w.put(mb);
+    w.put(hab.s);
+    w.put(hd.s);
+    w.putArray(mem);
+  }
+  
+  void readSnapshot(SnapshotReader &r) {
+    r.expectSignature(signature());
+    r.get(ma);
+    r.get(mb);
+    r.get(hab.s);
+    r.get(hd.s);
+    r.getArray(mem);
+    locks = VersionLocks(ma + mb, CellsPerLine);
+  }
+  
+  void saveSnapshot(const string &path) const {
+    SnapshotWriter w(path);
+    writeSnapshot(w);
+    w.close();
+  }
+  
+  static DataPlaneOthello loadSnapshot(const string &path) {
+    SnapshotReader r(path);
+    DataPlaneOthello dp;
+    dp.readSnapshot(r);
+    return dp;
+  }
+  
+  static SnapshotSignature signature() {
+    return SnapshotSignature("DataPlaneOthello", {sizeof(K), sizeof(V), L, CL});
   }
   
   virtual uint64_t getMemoryCost() const {
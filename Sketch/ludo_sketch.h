@@ -27,9 +27,8 @@
 // ensure that their keys fall in the range 0 .. (uint64max-1);
 // the table uses 2^64-1 as the "not occupied" flag.
 //
-// Inserted k must be unique, and there are no update
-// or delete functions (until some subsequent use of this table
-// requires them).
+// Inserted k must be unique. Updates and deletions made in the
+// control plane are applied with applyUpdate and applyRemove.
 //
 // Threads must synchronize their access to a PresizedHeadlessCuckoo.
 //
@@ -57,13 +56,18 @@ class DataPlaneLudoSketch {
   static const uint64_t VDMask = (1ULL << (VL + DL)) - 1;
 
 public:
+  typedef uint16_t SketchCounter;
+
   FastHasher64<Key> h;
   uint32_t num_buckets_;
 
   std::vector<uint64_t> memory;
   FastHasher64<Key> digestH;
   DataPlaneOthello<Key, uint8_t, 1> locator;
-  CuckooHashTable<uint32_t, uint8_t> overflow;
+  OverflowSeeds overflow;
+
+  // count-min rows indexed by the lookup itself: [0] locator array A, [1] locator array B, [2] the chosen bucket
+  vector<SketchCounter> counters[3];
 
   struct Bucket {  // only as parameters and return values for easy access. the storage is compact.
     uint8_t seed;
@@ -84,124 +88,79 @@ public:
     }
   };
 
-  explicit DataPlaneLudoSketch(const ControlPlaneLudo<Key, Value, VL, DL> &cp)
-    : num_buckets_(cp.buckets_.size()), h(cp.h), locator(cp.locator), overflow(cp.entryCount * 0.012),
+  /// the sketch of cp, its buckets encoded on threads threads
+  explicit DataPlaneLudoSketch(const ControlPlaneLudo<Key, Value, VL, DL> &cp,
+                               uint32_t threads = thread::hardware_concurrency())
+    : num_buckets_(cp.buckets_.size()), h(cp.h), locator(cp.locator), overflow(cp.buckets_.size()),
       digestH(cp.digestH) {
-
-    resetMemory();
-
-    for (uint32_t bktIdx = 0; bktIdx < num_buckets_; ++bktIdx) {
-      const typename ControlPlaneLudo<Key, Value, VL>::Bucket &cpBucket = cp.buckets_[bktIdx];
-      Bucket dpBucket;
-      dpBucket.seed = cpBucket.seed > MaxArrangementSeed ? MaxArrangementSeed : cpBucket.seed;
-      memset(dpBucket.values, 0, kSlotsPerBucket * sizeof(Value));
-
-      if (cpBucket.seed >= MaxArrangementSeed) {
-        overflow.insert(bktIdx, cpBucket.seed);
-      }
-
-      const FastHasher64<Key> locateHash(cpBucket.seed);
-
-      for (char slot = 0; slot < kSlotsPerBucket; ++slot) {
-        if (cpBucket.occupiedMask & (1U << slot)) {
-          const Key &k = cpBucket.keys[slot];
-          dpBucket.values[locateHash(k) >> 62] = cpBucket.values[slot];
-        }
-      }
-
-      writeBucket(dpBucket, bktIdx);
-    }
+    resetCounters();
+    exportBuckets(cp, [](const Value &v, Value &out) { out = v; }, threads);
+    fallback = cp.fallbackEntries();
   }
 
   template<class V2>
-  DataPlaneLudoSketch(const ControlPlaneLudo<Key, V2, VL, DL> &cp, unordered_map<V2, Value> m)
+  DataPlaneLudoSketch(const ControlPlaneLudo<Key, V2, VL, DL> &cp, const FlatStash<V2, Value> &m,
+                      uint32_t threads = thread::hardware_concurrency())
     : num_buckets_(cp.buckets_.size()), h(cp.h), locator(cp.locator),
-      overflow(cp.entryCount * 0.012), digestH(cp.digestH) {
-
-    resetMemory();
-
-    for (uint32_t bktIdx = 0; bktIdx < num_buckets_; ++bktIdx) {
-      const typename ControlPlaneLudo<Key, V2, VL>::Bucket &cpBucket = cp.buckets_[bktIdx];
-      Bucket dpBucket;
-      dpBucket.seed = cpBucket.seed >= MaxArrangementSeed ? MaxArrangementSeed : cpBucket.seed;
-      memset(dpBucket.values, 0, kSlotsPerBucket * sizeof(Value));
-
-      if (cpBucket.seed >= MaxArrangementSeed) {
-        overflow.insert(bktIdx, cpBucket.seed);
-      }
-
-      const FastHasher64<Key> locateHash(cpBucket.seed);
-
-      for (char slot = 0; slot < kSlotsPerBucket; ++slot) {
-        if (cpBucket.occupiedMask & (1U << slot)) {
-          const Key &k = cpBucket.keys[slot];
-          dpBucket.values[locateHash(k) >> 62] = m[cpBucket.values[slot]];
-        }
-      }
-
-      writeBucket(dpBucket, bktIdx);
-    }
+      overflow(cp.buckets_.size()), digestH(cp.digestH) {
+    resetCounters();
+    exportBuckets(cp, [&m](const V2 &v, Value &out) { m.lookUp(v, out); }, threads);
+
+    cp.fallbackEntries().forEach([&](const Key &k, const V2 &v) {
+      Value mapped = 0;
+      m.lookUp(v, mapped);
+      fallback.insert(k, mapped);
+    });
   }
 
   inline void resetMemory() {
-    memory.resize(((uint64_t) num_buckets_ * bucketLength + 63) / 64);
+    memory.resize(bitPackedWords((uint64_t) num_buckets_ * bucketLength));
+    locks = VersionLocks(num_buckets_);
   }
 
-  template<char length>
-  inline void writeMem(uint64_t start, char offset, uint64_t v) {
-    assert(v < (1ULL << length));
+  typedef BitPackedArray<LocatorSeedLength> SeedBits;
+  typedef BitPackedArray<VL> SlotBits;
 
-    // [offset, offset + length) should be 0 and others are 1
-    uint64_t mask = ~uint64_t(((1ULL << length) - 1) << offset);
-    char overflow = char(offset + length - 64);
+  VersionLocks locks;   // one stripe per 8 buckets, see DataPlaneLudo
 
-    memory[start] &= mask;
-    memory[start] |= (uint64_t) v << offset;
-
-    if (overflow > 0) {
-      mask = uint64_t(-1) << overflow;     // lower "overflow" bits should be 0, and others are 1
-      memory[start + 1] &= mask;
-      memory[start + 1] |= v >> (length - overflow);
-    }
+  /// encode the buckets of cp straight into memory, as DataPlaneLudo::exportBuckets
+  template<class CP, class Map>
+  void exportBuckets(const CP &cp, Map map, uint32_t threads) {
+    resetMemory();
 
-    assert(v == readMem<length>(start, offset));
-  }
+    vector<vector<pair<uint32_t, uint8_t>>> overflows(max(1U, threads));
+    auto offset = [](uint32_t index) { return (uint64_t) index * bucketLength; };
+    forBucketRanges(num_buckets_, threads, offset, [&](uint32_t t, uint32_t begin, uint32_t end) {
+      for (uint32_t bktIdx = begin; bktIdx < end; ++bktIdx) {
+        const auto &cpBucket = cp.buckets_[bktIdx];
+        Value values[kSlotsPerBucket] = {0};
 
-  template<char length>
-  inline uint64_t readMem(uint64_t start, char offset) const {
-    char left = char(offset + length - 64);
-    left = char(left < 0 ? 0 : left);
+        for (char slot = 0; slot < kSlotsPerBucket; ++slot) {
+          if (cpBucket.occupiedMask & (1U << slot)) {
+            map(cpBucket.values[slot], values[arrangedSlot(h(cpBucket.keys[slot]), cpBucket.seed)]);
+          }
+        }
 
-    uint64_t mask = ~(uint64_t(-1)
-      << (length - left));   // lower length-left bits should be 1, and others are 0
-    uint64_t result = (memory[start] >> offset) & mask;
+        if (cpBucket.seed >= MaxArrangementSeed) overflows[t].emplace_back(bktIdx, cpBucket.seed);
 
-    if (left > 0) {
-      mask = ~(uint64_t(-1) << left);     // lower left bits should be 1, and others are 0
-      result |= (memory[start + 1] & mask) << (length - left);
-    }
+        const uint64_t i1 = offset(bktIdx);
+        SeedBits::set(memory.data(), i1, min(cpBucket.seed, MaxArrangementSeed));
+        SlotBits::encode(memory.data(), i1 + LocatorSeedLength, values, kSlotsPerBucket);
+      }
+    });
 
-    return result;
+    vector<pair<uint32_t, uint8_t>> seeds;
+    for (const auto &list: overflows) seeds.insert(seeds.end(), list.begin(), list.end());
+    overflow.assign(num_buckets_, seeds);
   }
 
-  vector<uint8_t> lock = vector<uint8_t>(8192, 0);
-
   // Only call it during update!
   inline void writeBucket(Bucket &bucket, uint32_t index) {
     uint64_t i1 = (uint64_t) index * bucketLength;
-    uint64_t start = i1 / 64;
-    char offset = char(i1 % 64);
 
     assert(bucket.seed <= MaxArrangementSeed);
-    writeMem<LocatorSeedLength>(start, offset, bucket.seed);
-
-    for (char i = 0; i < kSlotsPerBucket; ++i) {
-      uint64_t offsetFromBeginning = i1 + LocatorSeedLength + i * VL;
-      start = offsetFromBeginning / 64;
-      offset = char(offsetFromBeginning % 64);
-
-      writeMem<VL>(start, offset, bucket.values[i]);
-    }
+    SeedBits::set(memory.data(), i1, bucket.seed);
+    SlotBits::encode(memory.data(), i1 + LocatorSeedLength, bucket.values, kSlotsPerBucket);
 
 #ifndef NDEBUG
     Bucket retrieved = readBucket(index);
@@ -214,66 +173,51 @@ public:
     Bucket bucket;
 
     uint64_t i1 = (uint64_t) index * bucketLength;
-    uint64_t start = i1 / 64;
-    char offset = char(i1 % 64);
 
-    bucket.seed = readMem<LocatorSeedLength>(start, offset);
+    bucket.seed = SeedBits::get(memory.data(), i1);
     if (bucket.seed == MaxArrangementSeed) {
       overflow.lookUp(index, bucket.seed);
     }
 
-    for (char i = 0; i < kSlotsPerBucket; ++i) {
-      uint64_t offsetFromBeginning = i1 + LocatorSeedLength + i * VL;
-      start = offsetFromBeginning / 64;
-      offset = char(offsetFromBeginning % 64);
-
-      bucket.values[i] = readMem<VL>(start, offset);
-    }
-
+    SlotBits::decode(memory.data(), i1 + LocatorSeedLength, bucket.values, kSlotsPerBucket);
     return bucket;
   }
 
   inline void writeSlot(uint32_t bid, char sid, Value val) {
-    uint64_t offsetFromBeginning = uint64_t(bid) * bucketLength + LocatorSeedLength + sid * VL;
-    uint64_t start = offsetFromBeginning / 64;
-    char offset = char(offsetFromBeginning % 64);
-
-    writeMem<VL>(start, offset, val);
+    SlotBits::set(memory.data(), uint64_t(bid) * bucketLength + LocatorSeedLength + sid * VL, val);
   }
 
   inline Value readSlot(uint32_t bid, char sid) {
-    uint64_t offsetFromBeginning = uint64_t(bid) * bucketLength + LocatorSeedLength + sid * VL;
-    uint64_t start = offsetFromBeginning / 64;
-    char offset = char(offsetFromBeginning % 64);
-
-    return readMem<VL>(start, offset);
+    return SlotBits::get(memory.data(), uint64_t(bid) * bucketLength + LocatorSeedLength + sid * VL);
   }
 
-  unordered_map<Key, Value> fallback;
+  FlatStash<Key, Value> fallback;
 
   // Returns true if found.  Sets *out = value.
   inline bool lookUp(const Key &k, Value &out) {
-    if (!fallback.empty()) {
-      auto it = fallback.find(k);
-      if (it != fallback.end())
-        return it->second;
-    }
+    uint32_t aInd, bInd, bid;
+    return lookUp(k, out, aInd, bInd, bid);
+  }
+
+  // Returns true if found.  Sets *out = value, and aInd/bInd/bid to the locator cells and the bucket visited.
+  inline bool lookUp(const Key &k, Value &out, uint32_t &aInd, uint32_t &bInd, uint32_t &bid) {
     uint32_t buckets[2];
-    fast_map_to_buckets(h(k), buckets);
+    const uint64_t hash = h(k);
+    fast_map_to_buckets(hash, buckets);
 
     while (true) {
-      uint8_t va1 = lock[buckets[0] & 8191], vb1 = lock[buckets[1] & 8191];
-      COMPILER_BARRIER();
-      if (va1 % 2 == 1 || vb1 % 2 == 1) continue;
+      uint32_t va = locks.beginRead(buckets[0]), vb = locks.beginRead(buckets[1]);
 
-      Bucket bucket = readBucket(buckets[locator.lookUp(k)]);
+      uint8_t loc;
+      locator.lookUp(k, loc, aInd, bInd);
+      bid = buckets[loc];
+      Bucket bucket = readBucket(bid);
 
-      COMPILER_BARRIER();
-      uint8_t va2 = lock[buckets[0] & 8191], vb2 = lock[buckets[1] & 8191];
+      if (!locks.validate(buckets[0], va) || !locks.validate(buckets[1], vb)) continue;
 
-      if (va1 != va2 || vb1 != vb2) continue;
+      if (!fallback.empty() && fallback.lookUp(k, out)) return true;
 
-      uint64_t i = FastHasher64<Key>(bucket.seed)(k) >> 62;
+      uint64_t i = arrangedSlot(hash, bucket.seed);
       Value result = bucket.values[i];
 
       if ((result & DigestMask) == ((digestH(k) << VL) & DigestMask)) {
@@ -283,9 +227,42 @@ public:
     }
   }
 
-  inline void applyInsert(const vector<LS_PathEntry> &path, Value value) {
+  // Lookup and count-min update in one pass. The counters are addressed by the indices the lookup already
+  // computed, so the measurement does not cost any extra hashing.
+  inline bool lookUpAndCount(const Key &k, Value &out) {
+    uint32_t aInd, bInd, bid;
+    bool found = lookUp(k, out, aInd, bInd, bid);
+
+    increase(counters[0][aInd]);
+    increase(counters[1][bInd - locator.ma]);
+    increase(counters[2][bid]);
+
+    return found;
+  }
+
+  // Count-min estimation of the number of lookUpAndCount calls on k. Never underestimates until saturation.
+  inline SketchCounter estimate(const Key &k) {
+    uint32_t buckets[2];
+    fast_map_to_buckets(h(k), buckets);
+
+    uint8_t loc;
+    uint32_t aInd, bInd;
+    locator.lookUp(k, loc, aInd, bInd);
+
+    return min(min(counters[0][aInd], counters[1][bInd - locator.ma]), counters[2][buckets[loc]]);
+  }
+
+  inline void resetCounters() {
+    counters[0].assign(locator.ma, 0);
+    counters[1].assign(locator.mb, 0);
+    counters[2].assign(num_buckets_, 0);
+  }
+
+  /// apply a cuckoo path, of LS_PathEntry or of the MPC_PathEntry of ControlPlaneLudo, e.g., of reseedOverflowed
+  template<class PathEntry>
+  inline void applyInsert(const vector<PathEntry> &path, Value value) {
     for (int i = 0; i < path.size(); ++i) {
-      LS_PathEntry entry = path[i];
+      const PathEntry &entry = path[i];
       Bucket bucket = readBucket(entry.bid);
       bucket.seed = min(entry.newSeed, MaxArrangementSeed);
 
@@ -303,7 +280,7 @@ public:
       if (i + 1 == path.size()) {  // put the new value
         bucket.values[entry.sid] = value;
       } else {  // move key from another bucket and slot to this bucket and slot
-        LS_PathEntry from = path[i + 1];
+        const PathEntry &from = path[i + 1];
         uint8_t tmp[4] = {from.s0, from.s1, from.s2, from.s3};
         uint8_t sid;
         for (uint8_t ii = 0; ii < 4; ++ii) {
@@ -315,20 +292,18 @@ public:
         bucket.values[entry.sid] = readSlot(from.bid, sid);
       }
 
-      lock[entry.bid & 8191]++;
-      COMPILER_BARRIER();
+      locks.lock(entry.bid);
 
       if (entry.locatorCC.size()) {
         locator.fixHalfTreeByConnectedComponent(entry.locatorCC, 1);
       }
 
       if (bucket.seed == MaxArrangementSeed) {
-        overflow.insert(entry.bid, entry.newSeed, true);
+        overflow.insert(entry.bid, entry.newSeed);
       }
       writeBucket(bucket, entry.bid);
 
-      COMPILER_BARRIER();
-      lock[entry.bid & 8191]++;
+      locks.unlock(entry.bid);
     }
   }
 
@@ -336,17 +311,50 @@ public:
     uint32_t bid = bs >> 2;
     uint8_t sid = bs & 3;
 
-    lock[bid & 8191]++;
-    COMPILER_BARRIER();
-
+    locks.lock(bid);
     writeSlot(bid, sid, val & ValueMask);
+    locks.unlock(bid);
+  }
+
+  /// clear the slot of a key removed by ControlPlaneLudo::remove, see DataPlaneLudo::applyRemove
+  inline void applyRemove(uint32_t bs) {
+    uint32_t bid = bs >> 2;
+    uint8_t sid = bs & 3;
+
+    locks.lock(bid);
+    writeSlot(bid, sid, 0);
+    locks.unlock(bid);
+  }
+
+  /// the buckets of seeds in overflow looked up the most, at most count of them, the hottest first, to relieve by
+  /// ControlPlaneLudo::reseedOverflowed. The writer only, like the updates.
+  vector<uint32_t> hotOverflowedBuckets(uint32_t count) const {
+    vector<pair<SketchCounter, uint32_t>> hot;
+    overflow.forEach([&](uint32_t bid, uint8_t) {
+      if (SeedBits::get(memory.data(), (uint64_t) bid * bucketLength) == MaxArrangementSeed) {
+        hot.emplace_back(counters[2][bid], bid);
+      }
+    });
 
-    COMPILER_BARRIER();
-    lock[bid & 8191]++;
+    count = uint32_t(min<size_t>(count, hot.size()));
+    partial_sort(hot.begin(), hot.begin() + count, hot.end(), greater<pair<SketchCounter, uint32_t>>());
+
+    vector<uint32_t> result(count);
+    for (uint32_t i = 0; i < count; ++i) result[i] = hot[i].second;
+    return result;
   }
 
   inline uint64_t getMemoryCost() const {
-    return memory.size() * 8;
+    return memory.size() * 8 + getSketchMemoryCost();
+  }
+
+  inline uint64_t getSketchMemoryCost() const {
+    return (counters[0].size() + counters[1].size() + counters[2].size()) * sizeof(SketchCounter);
+  }
+
+  // saturating increment, so that an estimation never wraps around to a small number
+  static inline void increase(SketchCounter &c) {
+    c += SketchCounter(c != SketchCounter(-1));
   }
 
   // Utility function to compute (x * y) >> 64, or "multiply high".
@@ -0,0 +1,335 @@
+/**
+ * The lookup benchmarks over a parameter matrix: structure x VL x key type x key set size x distribution x threads.
+ * Ludo is also run with each bucket layout, reporting its memory and the cache lines a bucket spans alongside the
+ * time. Every case is run a few times after warmup. The time per lookup and, where perf_event is permitted, the cycles,
+ * instructions and misses per lookup are summarized over the repetitions in a JSON file with a stable schema, which
+ * --compare diffs between two runs, e.g., before and after a commit.
+ *
+ * usage: benchmarkSuite [--filter=substring] [--sizes=1048576,16777216] [--threads=1,4] [--ops=4194304]
+ *                       [--warmup=1] [--repetitions=5] [--out=benchmark.json]
+ *        benchmarkSuite --compare base.json new.json [--threshold=3]
+ */
+#include "common.h"
+#include "perf_counters.h"
+#include "Ludo/ludo.h"
+#include "Sketch/ludo_sketch.h"
+#include "Othello/data_plane_othello.h"
+#include "CuckooPresized/cuckoo_filtable.h"
+
+// bump when a field of the report changes meaning, so that --compare refuses to diff incompatible runs
+const int kSchemaVersion = 1;
+
+struct Options {
+  string filter;
+  vector<uint64_t> sizes{1 << 20};
+  vector<uint32_t> threads{1};
+  uint64_t ops = 1 << 22;
+  uint32_t warmup = 1;
+  uint32_t repetitions = 5;
+  string out = "benchmark.json";
+};
+
+vector<uint64_t> parseList(const string &s) {
+  vector<uint64_t> result;
+  for (const string &token: split(s.c_str(), ',')) result.push_back(strtoull(token.c_str(), nullptr, 10));
+  return result;
+}
+
+json summarize(vector<double> samples) {
+  sort(samples.begin(), samples.end());
+
+  double mean = 0, var = 0;
+  for (double s: samples) mean += s;
+  mean /= samples.size();
+  for (double s: samples) var += (s - mean) * (s - mean);
+
+  json j;
+  j["median"] = samples[samples.size() / 2];
+  j["mean"] = mean;
+  j["stddev"] = samples.size() > 1 ? sqrt(var / (samples.size() - 1)) : 0.0;
+  j["min"] = samples.front();
+  j["max"] = samples.back();
+  return j;
+}
+
+/// Time threads threads looking up ops keys in total, each starting at its own offset of lookupKeys. The time per
+/// op is the one of a lookup on one thread, mops the throughput of all threads.
+template<class LookUp>
+json measure(const Options &options, uint32_t threads, const vector<uint64_t> &lookupKeys, LookUp lookUp) {
+  vector<double> ns;
+  vector<vector<double>> events(PerfCounters::kEvents);
+  PerfCounters perf;
+
+  for (uint32_t rep = 0; rep < options.warmup + options.repetitions; ++rep) {
+    vector<thread> workers;
+    atomic<uint64_t> sink(0);
+
+    perf.start();
+    uint64_t begin = monotonicNs();
+
+    for (uint32_t t = 0; t < threads; ++t) {
+      workers.emplace_back([&, t] {
+        uint64_t stupid = 0, n = options.ops / threads;
+        uint64_t i = lookupKeys.size() / threads * t;
+
+        for (uint64_t done = 0; done < n; ++done) {
+          stupid += lookUp(lookupKeys[i]);
+          if (++i == lookupKeys.size()) i = 0;
+        }
+        sink += stupid;
+      });
+    }
+    for (thread &w: workers) w.join();
+
+    uint64_t elapsed = monotonicNs() - begin;
+    perf.stop();
+
+    if (rep < options.warmup) continue;
+    ns.push_back(double(elapsed) * threads / options.ops);
+    for (int e = 0; e < PerfCounters::kEvents; ++e) {
+      events[e].push_back(double(perf.value(PerfCounters::Event(e))) / options.ops);
+    }
+  }
+
+  json j;
+  j["ns per op"] = summarize(ns);
+  j["mops"] = threads * 1000.0 / j["ns per op"]["median"].get<double>();
+  for (int e = 0; e < PerfCounters::kEvents; ++e) {
+    string name = string(PerfCounters::kNames[e]) + " per op";
+    j[name] = perf.available(PerfCounters::Event(e)) ? summarize(events[e]) : json();
+  }
+  return j;
+}
+
+/// the mean number of cache lines the buckets of bits bits of a table of Layout span, i.e., a lookup reads
+template<class Layout, uint32_t bits>
+double linesPerBucket(uint32_t buckets) {
+  uint64_t lines = 0;
+  for (uint32_t b = 0; b < buckets; ++b) {
+    const uint64_t offset = Layout::template offset<bits>(b);
+    lines += (offset + bits - 1) / 512 - offset / 512 + 1;
+  }
+  return double(lines) / buckets;
+}
+
+template<class Key>
+const char *keyTypeName() {
+  return sizeof(Key) == 4 ? "uint32" : "uint64";
+}
+
+/// the cases of one structure for one VL and key type: every size x distribution x threads
+template<class Key, class Val, int VL>
+void runCases(const Options &options, json &results) {
+  static const char *structures[] = {"Ludo", "LudoPowerOfTwo", "LudoCacheLine", "LudoSketch", "Othello",
+                                     "CuckooFiltable"};
+
+  for (uint64_t nn: options.sizes) {
+    // a case is built only if some of its names pass the filter
+    auto selected = [&](const char *structure) {
+      for (const char *dist: {"uniform", "Zipfian"}) {
+        for (uint32_t threads: options.threads) {
+          ostringstream oss;
+          oss << structure << "/VL=" << VL << "/key=" << keyTypeName<Key>() << "/n=" << nn << "/" << dist
+              << "/threads=" << threads;
+          if (oss.str().find(options.filter) != string::npos) return true;
+        }
+      }
+      return false;
+    };
+
+    bool any = false;
+    for (const char *s: structures) any |= selected(s);
+    if (!any) continue;
+
+    LFSRGen<Key> keyGen(0x1234567801234567ULL, nn, 0);
+    LFSRGen<Val> valueGen(0x1234567887654321ULL, nn, 0);
+    vector<Key> keys(nn);
+    vector<Val> values(nn);
+
+    for (uint64_t i = 0; i < nn; ++i) {
+      keyGen.gen(&keys[i]);
+      valueGen.gen(&values[i]);
+      values[i] &= Val(~(uint64_t(-1) << VL));
+    }
+
+    // the keys to look up, as indices into keys
+    vector<uint64_t> uniform(nn), zipfian(nn);
+    for (uint64_t i = 0; i < nn; ++i) uniform[i] = i;
+    InputBase::distribution = exponential;
+    InputBase::bound = nn;
+    InputBase::setSeed(uint32_t(nn));
+    for (uint64_t i = 0; i < nn; ++i) zipfian[i] = InputBase::rand();
+
+    auto run = [&](const char *structure, auto lookUp, const json &params = json::object(),
+                   const json &costs = json::object()) {
+      for (const char *dist: {"uniform", "Zipfian"}) {
+        for (uint32_t threads: options.threads) {
+          ostringstream oss;
+          oss << structure << "/VL=" << VL << "/key=" << keyTypeName<Key>() << "/n=" << nn << "/" << dist
+              << "/threads=" << threads;
+          if (oss.str().find(options.filter) == string::npos) continue;
+
+          json r;
+          r["name"] = oss.str();
+          r["params"] = {{"structure", structure}, {"VL", VL}, {"key", keyTypeName<Key>()}, {"n", nn},
+                         {"distribution", dist}, {"threads", threads}};
+          r["params"].update(params);
+          r.update(costs);
+          r.update(measure(options, threads, dist[0] == 'u' ? uniform : zipfian, lookUp));
+          cout << r["name"].get<string>() << ": " << r["ns per op"]["median"] << " ns/op" << endl;
+          results.push_back(r);
+        }
+      }
+    };
+
+    // the packed layout keeps the plain name, so that its cases compare to the runs before the layout axis
+    auto runLudo = [&](const char *structure, const char *layout, auto &dp, auto layoutTag) {
+      typedef decltype(layoutTag) Layout;
+      const json costs = {{"bytes per key", double(dp.getMemoryCost()) / nn},
+                          {"lines per bucket", linesPerBucket<Layout, LocatorSeedLength + 4 * VL>(dp.num_buckets_)}};
+      run(structure, [&](uint64_t i) {
+        Val v = 0;
+        dp.lookUp(keys[i], v);
+        return v;
+      }, {{"layout", layout}}, costs);
+    };
+
+    if (selected("Ludo") || selected("LudoPowerOfTwo") || selected("LudoCacheLine") || selected("LudoSketch")) {
+      ControlPlaneLudo<Key, Val, VL> cp(nn);
+      cp.bulkLoad(keys.data(), values.data(), nn);
+      cp.prepareToExport();
+
+      if (selected("Ludo")) {
+        DataPlaneLudo<Key, Val, VL> dp(cp);
+        runLudo("Ludo", "packed", dp, PackedBucketLayout());
+      }
+
+      if (selected("LudoPowerOfTwo")) {
+        DataPlaneLudo<Key, Val, VL, 0, PowerOfTwoBucketLayout> dp(cp);
+        runLudo("LudoPowerOfTwo", "power of two", dp, PowerOfTwoBucketLayout());
+      }
+
+      if (selected("LudoCacheLine")) {
+        DataPlaneLudo<Key, Val, VL, 0, CacheLineBucketLayout> dp(cp);
+        runLudo("LudoCacheLine", "cache line", dp, CacheLineBucketLayout());
+      }
+
+      if (selected("LudoSketch")) {
+        DataPlaneLudoSketch<Key, Val, VL> dp(cp);
+        run("LudoSketch", [&](uint64_t i) {
+          Val v = 0;
+          dp.lookUpAndCount(keys[i], v);
+          return v;
+        });
+      }
+    }
+
+    if (selected("Othello")) {
+      ControlPlaneOthello<Key, Val, VL> cp(nn, true, keys, values);
+      DataPlaneOthello<Key, Val, VL> dp(cp);
+      run("Othello", [&](uint64_t i) {
+        Val v = 0;
+        dp.lookUp(keys[i], v);
+        return v;
+      });
+    }
+
+    if (selected("CuckooFiltable")) {
+      ControlPlaneCuckooFiltable<Key, Val> cp(nn);
+      for (uint64_t i = 0; i < nn; ++i) cp.insert(keys[i], values[i]);
+      DataPlaneCuckooFiltable<Key, Val> dp(*cp.level1, *cp.level2);
+      run("CuckooFiltable", [&](uint64_t i) {
+        Val v = 0;
+        dp.lookUp(keys[i], v);
+        return v;
+      });
+    }
+  }
+}
+
+template<int VL, class Val>
+void runVL(const Options &options, json &results) {
+  runCases<uint32_t, Val, VL>(options, results);
+  runCases<uint64_t, Val, VL>(options, results);
+}
+
+/// \return the exit status: 1 if a case present in both runs got slower than the threshold
+int compare(const string &basePath, const string &newPath, double threshold) {
+  json base, next;
+  ifstream(basePath) >> base;
+  ifstream(newPath) >> next;
+
+  if (base["schema"] != next["schema"]) {
+    cerr << "schema " << base["schema"] << " vs " << next["schema"] << ", not comparable" << endl;
+    return 2;
+  }
+
+  map<string, double> before;
+  for (const json &r: base["results"]) before[r["name"]] = r["ns per op"]["median"];
+
+  int status = 0;
+  for (const json &r: next["results"]) {
+    auto it = before.find(r["name"]);
+    if (it == before.end()) continue;
+
+    double now = r["ns per op"]["median"], change = (now / it->second - 1) * 100;
+    bool regressed = change > threshold;
+    status |= regressed;
+
+    ostringstream line;
+    line << (regressed ? "SLOWER " : change < -threshold ? "FASTER " : "       ") << r["name"].get<string>() << ": "
+         << fixed << setprecision(2) << it->second << " -> " << now << " ns/op (" << showpos << setprecision(1)
+         << change << "%)";
+    cout << line.str() << endl;
+  }
+  return status;
+}
+
+int main(int argc, char **argv) {
+  commonInit();
+
+  Options options;
+  double threshold = 3;
+  vector<string> positional;
+  bool comparing = false;
+
+  for (int i = 1; i < argc; ++i) {
+    string arg = argv[i];
+    auto value = [&](const char *flag) {
+      return arg.compare(0, strlen(flag), flag) == 0 ? arg.substr(strlen(flag)) : string();
+    };
+
+    if (arg == "--compare") comparing = true;
+    else if (!value("--filter=").empty()) options.filter = value("--filter=");
+    else if (!value("--sizes=").empty()) options.sizes = parseList(value("--sizes="));
+    else if (!value("--threads=").empty()) {
+      options.threads.clear();
+      for (uint64_t t: parseList(value("--threads="))) options.threads.push_back(uint32_t(t));
+    } else if (!value("--ops=").empty()) options.ops = strtoull(value("--ops=").c_str(), nullptr, 10);
+    else if (!value("--warmup=").empty()) options.warmup = atoi(value("--warmup=").c_str());
+    else if (!value("--repetitions=").empty()) options.repetitions = max(1, atoi(value("--repetitions=").c_str()));
+    else if (!value("--out=").empty()) options.out = value("--out=");
+    else if (!value("--threshold=").empty()) threshold = atof(value("--threshold=").c_str());
+    else positional.push_back(arg);
+  }
+
+  if (comparing) {
+    if (positional.size() != 2) throw runtime_error("--compare needs the base and the new report");
+    return compare(positional[0], positional[1], threshold);
+  }
+
+  json results = json::array();
+  runVL<4, uint8_t>(options, results);
+  runVL<8, uint8_t>(options, results);
+  runVL<12, uint16_t>(options, results);
+  runVL<16, uint16_t>(options, results);
+  runVL<20, uint32_t>(options, results);
+
+  json report;
+  report["schema"] = kSchemaVersion;
+  report["options"] = {{"ops", options.ops}, {"warmup", options.warmup}, {"repetitions", options.repetitions}};
+  report["results"] = results;
+  ofstream(options.out) << report.dump(2) << endl;
+
+  return 0;
+}
@@ -0,0 +1,177 @@
+/*!
+ \file bit_packed_array.h
+ Fields of Width bits at arbitrary bit positions of an array of 64-bit words, the storage of the Ludo buckets and
+ the Othello cells. Whole-byte widths at byte-aligned positions are plain loads and stores. Other fields are read
+ by one unaligned 64-bit load and a shift, without branching on whether the field straddles two words, which is why
+ the arrays are allocated with bitPackedWords: the padding word lets the last field be loaded as a whole word.
+ The bit order is the little-endian one of the words, i.e., bit b is bit b % 8 of byte b / 8.
+ */
+
+#pragma once
+
+#include <cinttypes>
+#include <cstring>
+
+/// the words of an array holding bits bits, with the padding word of the unaligned loads
+static constexpr uint64_t bitPackedWords(uint64_t bits) {
+  return (bits + 63) / 64 + 1;
+}
+
+/// Width-bit fields, the index-th one at bit index * Stride + Offset for getAt and setAt, or at any bit for get and
+/// set. Concurrent setters may write other fields of the same words, each word being updated by a single atomic
+/// xor, but a field itself must be written by one thread at a time, e.g., under a version lock.
+template<uint8_t Width, uint32_t Stride = Width, uint32_t Offset = 0>
+struct BitPackedArray {
+  static_assert(Width <= 64, "a field must fit a word");
+
+  static constexpr uint64_t kMask = Width == 64 ? ~uint64_t(0) : (uint64_t(1) << Width) - 1;
+
+  // the fields of getAt and setAt are plain, naturally aligned 8/16/32/64-bit integers
+  static constexpr bool kPlain = (Width == 8 || Width == 16 || Width == 32 || Width == 64) &&
+                                 Stride % Width == 0 && Offset % Width == 0;
+
+  // one unaligned load holds the field after the shift by the bit position within its first byte
+  static constexpr bool kSingleLoad = Width <= 57;
+
+  template<class T>
+  static inline T loadPlain(const uint64_t *words, uint64_t bit) {
+    T v;
+    memcpy(&v, (const uint8_t *) words + bit / 8, sizeof(T));
+    return v;
+  }
+
+  static inline uint64_t get(const uint64_t *words, uint64_t bit) {
+    if constexpr (Width == 0) {
+      return 0;
+    } else if constexpr (kSingleLoad) {
+      return (loadPlain<uint64_t>(words, bit & ~uint64_t(7)) >> (bit & 7)) & kMask;
+    } else {
+      uint64_t start = bit / 64;
+      uint32_t offset = bit % 64;
+      uint64_t high = offset ? words[start + 1] << (64 - offset) : 0;
+      return ((words[start] >> offset) | high) & kMask;
+    }
+  }
+
+  /// xor the field at bit with x
+  template<bool concurrent = false>
+  static inline void exclusiveOr(uint64_t *words, uint64_t bit, uint64_t x) {
+    if constexpr (Width == 0) return;
+
+    x &= kMask;
+    uint64_t start = bit / 64;
+    uint32_t offset = bit % 64;
+
+    if (concurrent) {
+      __atomic_fetch_xor(&words[start], x << offset, __ATOMIC_RELAXED);
+      if (offset + Width > 64) __atomic_fetch_xor(&words[start + 1], x >> (64 - offset), __ATOMIC_RELAXED);
+    } else {
+      words[start] ^= x << offset;
+      if (offset + Width > 64) words[start + 1] ^= x >> (64 - offset);
+    }
+  }
+
+  template<bool concurrent = false>
+  static inline void set(uint64_t *words, uint64_t bit, uint64_t v) {
+    if constexpr (Width == 0) {
+      return;
+    } else if constexpr (kSingleLoad) {
+      if (concurrent) {
+        exclusiveOr<true>(words, bit, get(words, bit) ^ v);
+      } else {
+        uint8_t *p = (uint8_t *) words + bit / 8;
+        uint32_t shift = bit & 7;
+        uint64_t w;
+        memcpy(&w, p, 8);
+        w = (w & ~(kMask << shift)) | ((v & kMask) << shift);
+        memcpy(p, &w, 8);
+      }
+    } else {
+      exclusiveOr<concurrent>(words, bit, get(words, bit) ^ v);
+    }
+  }
+
+  /// whether the field at bit lies in one word, as atomicUpdate needs
+  static constexpr bool inWord(uint64_t bit) {
+    return bit % 64 + Width <= 64;
+  }
+
+  /// Replace the field at bit by f(its value) with a compare-and-swap of its word, so that concurrent updaters of
+  /// the same field lose none of their updates, and concurrent setters of other fields of the word are kept.
+  /// \return the new value
+  template<class F>
+  static inline uint64_t atomicUpdate(uint64_t *words, uint64_t bit, F f) {
+    static_assert(Width > 0, "no field to update");
+    uint64_t *word = &words[bit / 64];
+    const uint32_t offset = bit % 64;
+
+    uint64_t old = __atomic_load_n(word, __ATOMIC_RELAXED), v;
+    do {
+      v = f((old >> offset) & kMask) & kMask;
+    } while (!__atomic_compare_exchange_n(word, &old, (old & ~(kMask << offset)) | (v << offset), true,
+                                          __ATOMIC_RELAXED, __ATOMIC_RELAXED));
+    return v;
+  }
+
+  static inline uint64_t getAt(const uint64_t *words, uint64_t index) {
+    const uint64_t bit = index * Stride + Offset;
+
+    if constexpr (kPlain && Width == 8) return loadPlain<uint8_t>(words, bit);
+    else if constexpr (kPlain && Width == 16) return loadPlain<uint16_t>(words, bit);
+    else if constexpr (kPlain && Width == 32) return loadPlain<uint32_t>(words, bit);
+    else if constexpr (kPlain) return loadPlain<uint64_t>(words, bit);
+    else return get(words, bit);
+  }
+
+  template<bool concurrent = false>
+  static inline void setAt(uint64_t *words, uint64_t index, uint64_t v) {
+    const uint64_t bit = index * Stride + Offset;
+
+    if constexpr (kPlain && Width == 8) storePlain<uint8_t, concurrent>(words, bit, v);
+    else if constexpr (kPlain && Width == 16) storePlain<uint16_t, concurrent>(words, bit, v);
+    else if constexpr (kPlain && Width == 32) storePlain<uint32_t, concurrent>(words, bit, v);
+    else if constexpr (kPlain) storePlain<uint64_t, concurrent>(words, bit, v);
+    else set<concurrent>(words, bit, v);
+  }
+
+  template<bool concurrent = false>
+  static inline void exclusiveOrAt(uint64_t *words, uint64_t index, uint64_t x) {
+    exclusiveOr<concurrent>(words, index * Stride + Offset, x);
+  }
+
+  /// decode n consecutive fields starting at bit, e.g., the slots of a bucket or a range of cells to export
+  template<class T>
+  static inline void decode(const uint64_t *words, uint64_t bit, T *out, uint32_t n) {
+    if constexpr (Width == sizeof(T) * 8 && Width % 8 == 0) {
+      if (bit % 8 == 0) {
+        memcpy(out, (const uint8_t *) words + bit / 8, uint64_t(n) * sizeof(T));
+        return;
+      }
+    }
+
+    for (uint32_t i = 0; i < n; ++i) out[i] = T(get(words, bit + uint64_t(i) * Width));
+  }
+
+  template<bool concurrent = false, class T>
+  static inline void encode(uint64_t *words, uint64_t bit, const T *in, uint32_t n) {
+    if constexpr (Width == sizeof(T) * 8 && Width % 8 == 0) {
+      if (!concurrent && bit % 8 == 0) {
+        memcpy((uint8_t *) words + bit / 8, in, uint64_t(n) * sizeof(T));
+        return;
+      }
+    }
+
+    for (uint32_t i = 0; i < n; ++i) set<concurrent>(words, bit + uint64_t(i) * Width, uint64_t(in[i]));
+  }
+
+private:
+  template<class T, bool concurrent>
+  static inline void storePlain(uint64_t *words, uint64_t bit, uint64_t v) {
+    T *p = (T *) ((uint8_t *) words + bit / 8);
+    if (concurrent) {
+      __atomic_store_n(p, T(v), __ATOMIC_RELAXED);
+    } else {
+      *p = T(v);
+    }
+  }
+};
@@ -10,7 +10,23 @@
 #include "input/input_types.h"
 
 int Clocker::currentLevel = 0;
+const thread::id Clocker::mainThread = this_thread::get_id();
 list<Counter> Counter::counters;
+
+// constructed before the global Clocker, which collects the counts by id when it stops at exit
+static mutex counterIdMutex;
+static vector<pair<string, Counter::Kind>> counterIds;
+static vector<unique_ptr<Counter::ThreadSlots>> counterSlots;
+
+namespace {
+  struct ThreadSlotsRelease {
+    ~ThreadSlotsRelease() {
+      lock_guard<mutex> lock(counterIdMutex);
+      if (Counter::localSlots) Counter::localSlots->inUse = false;
+    }
+  };
+}
+
 TeeOstream tos;
 Clocker global("root", &tos);
 
@@ -75,6 +91,7 @@ void commonInit() {
   system("mkdir -p ../dist/logs/");
   srand(1);
   InputBase::setSeed(1);
+  MemoryPolicy::configureFromEnv();
   registerSigHandler();
 //  ProfilerStart("./validity.pprof");
   pthread_mutex_init(&printf_mutex, NULL);
@@ -105,6 +122,62 @@ std::vector<std::string> split(const char *str, char deli) {
   return ret;
 }
 
+CounterId Counter::id(const string &name, Kind kind) {
+  lock_guard<mutex> lock(counterIdMutex);
+  
+  for (CounterId i = 0; i < counterIds.size(); ++i) {
+    if (counterIds[i].first == name) return i;
+  }
+  
+  if (counterIds.size() == kMaxIds) throw runtime_error("too many counters by id, at " + name);
+  counterIds.emplace_back(name, kind);
+  return counterIds.size() - 1;
+}
+
+Counter::ThreadSlots &Counter::acquireSlots() {
+  thread_local ThreadSlotsRelease release;
+  lock_guard<mutex> lock(counterIdMutex);
+  
+  for (auto &s: counterSlots) {
+    if (!s->inUse) {
+      s->inUse = true;
+      return *(localSlots = s.get());
+    }
+  }
+  
+  counterSlots.emplace_back(new ThreadSlots);
+  return *(localSlots = counterSlots.back().get());
+}
+
+void Counter::collect() {
+  lock_guard<mutex> lock(counterIdMutex);
+  if (counters.empty()) return;
+  
+  Counter &c = counters.back();
+  for (CounterId i = 0; i < counterIds.size(); ++i) {
+    bool counted = false;
+    uint64_t total = 0;
+    
+    for (auto &s: counterSlots) {
+      uint64_t v = __atomic_load_n(&s->values[i], __ATOMIC_RELAXED);
+      
+      if (counterIds[i].second == Sum) {
+        counted |= v != s->collected[i];
+        total += v - s->collected[i];
+        s->collected[i] = v;
+      } else if (v) {
+        counted = true;
+        total = max(total, v);
+        __atomic_store_n(&s->values[i], uint64_t(0), __ATOMIC_RELAXED);
+      }
+    }
+    
+    if (!counted) continue;
+    double &m = c.mem[counterIds[i].first];
+    m = counterIds[i].second == Sum ? m + total : max(m, double(total));
+  }
+}
+
 string Counter::pad() const {
   if (!Clocker::currentLevel) return "";
   
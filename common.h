@@ -16,6 +16,7 @@
 #include <cassert>
 #include <cinttypes>
 #include <sys/time.h>
+#include <sys/resource.h>
 
 #include <iostream>
 #include <sstream>
@@ -23,6 +24,7 @@
 #include <iomanip>
 
 #include <functional>
+#include <exception>
 #include <algorithm>
 #include <iterator>
 #include <utility>
@@ -46,6 +48,8 @@
 #include "disjointset.h"
 #include "hash.h"
 #include "lfsr64.h"
+#include "table_allocator.h"
+#include "snapshot.h"
 #include "utils/debugbreak.h"
 #include "utils/json.hpp"
 #include "utils/hashutil.h"
@@ -90,8 +94,48 @@ inline uint64_t diff_ms(timeval t1, timeval t2) {
   return diff_us(t1, t2) / 1000ULL;
 }
 
+/// nanoseconds of CLOCK_MONOTONIC, which unlike gettimeofday never jumps with the wall clock
+inline uint64_t monotonicNs() {
+  timespec t;
+  clock_gettime(CLOCK_MONOTONIC, &t);
+  return t.tv_sec * 1000000000ULL + t.tv_nsec;
+}
+
+/// the peak resident set of the process so far, in KiB
+inline uint64_t peakRssKiB() {
+  rusage usage;
+  getrusage(RUSAGE_SELF, &usage);
+  return uint64_t(usage.ru_maxrss);
+}
+
+/// the histogram of values, without the trailing zeros, as the stats of the tables report them
+inline json histogramJson(const uint64_t *counts, uint64_t n) {
+  while (n > 0 && counts[n - 1] == 0) --n;
+  return json(std::vector<uint64_t>(counts, counts + n));
+}
+
+/// The lengths of the cuckoo paths of the insertions into a table, in buckets, i.e., 1 for a key put into one of its
+/// own buckets, and the insertions that found no path. Recorded by the sequential inserts only.
+struct CuckooPathStats {
+  static constexpr uint32_t kMaxLength = 8;   // the longer paths are counted as this long
+
+  uint64_t lengths[kMaxLength + 1] = {0};   // by the length, [0] unused
+  uint64_t failures = 0;
+
+  inline void record(uint32_t length) {
+    ++lengths[std::min(length, kMaxLength)];
+  }
+
+  json toJson() const {
+    return {{"path lengths", histogramJson(lengths, kMaxLength + 1)}, {"failures", failures}};
+  }
+};
+
 std::string human(uint64_t word);
 
+//! split a c-style string with delimineter chara.
+std::vector<std::string> split(const char *str, char deli);
+
 #ifndef _GNU_SOURCE
 #define _GNU_SOURCE 1
 #endif
@@ -108,6 +152,36 @@ void sync_printf(const char *format, ...);
 
 void commonInit();
 
+/// run f(0), ..., f(threads - 1) in parallel, f(0) on the calling thread. The first exception thrown by any f is
+/// rethrown after all of them finish.
+template<class F>
+void parallelFor(uint32_t threads, F f) {
+  if (threads <= 1) {
+    f(0U);
+    return;
+  }
+
+  std::vector<std::thread> workers;
+  std::exception_ptr error;
+  std::mutex errorMutex;
+
+  auto run = [&](uint32_t t) {
+    try {
+      f(t);
+    } catch (...) {
+      std::lock_guard<std::mutex> lock(errorMutex);
+      if (!error) error = std::current_exception();
+    }
+  };
+
+  workers.reserve(threads - 1);
+  for (uint32_t t = 1; t < threads; ++t) workers.emplace_back(run, t);
+  run(0);
+  for (auto &w: workers) w.join();
+
+  if (error) std::rethrow_exception(error);
+}
+
 enum Distribution {
   exponential,
   uniform
@@ -262,6 +336,9 @@ private:
   std::ofstream my_fstream;
 };
 
+/// the index of a counter registered by Counter::id
+typedef uint32_t CounterId;
+
 /// for runtime statistics collection
 class Counter {
 public:
@@ -271,6 +348,50 @@ public:
   
   explicit Counter(TeeOstream &os) : os(os) {}
   
+  //*******counters registered by id, for the hot paths
+  enum Kind : uint8_t {
+    Sum, Max
+  };
+  
+  static const uint32_t kMaxIds = 128;
+  
+  // the counts of one thread, which only that thread writes. The block of an exited thread is kept, so its
+  // counts are still collected, and is reused by the next thread
+  struct alignas(64) ThreadSlots {
+    uint64_t values[kMaxIds] = {};
+    uint64_t collected[kMaxIds] = {};   // the sums already added to a Counter, only touched by collect
+    bool inUse = true;
+  };
+  
+  inline static thread_local ThreadSlots *localSlots = nullptr;
+  
+  /// \return the id of name, registering it at the first call. Call it once per call site, e.g., through COUNT_ID
+  static CounterId id(const string &name, Kind kind = Sum);
+  
+  static ThreadSlots &acquireSlots();
+  
+  static inline ThreadSlots &slots() {
+    return localSlots ? *localSlots : acquireSlots();
+  }
+  
+  static inline void count(CounterId id, uint64_t acc = 1) {
+    #ifdef PROFILE
+    uint64_t &v = slots().values[id];
+    __atomic_store_n(&v, v + acc, __ATOMIC_RELAXED);
+    #endif
+  }
+  
+  static inline void countMax(CounterId id, uint64_t number) {
+    #ifdef PROFILE
+    uint64_t &v = slots().values[id];
+    if (number > v) __atomic_store_n(&v, number, __ATOMIC_RELAXED);
+    #endif
+  }
+  
+  /// Add the counts by id of all threads since the last collection to the innermost Counter. A maximum reset
+  /// meanwhile may lose the update of a thread counting at the same moment.
+  static void collect();
+  
   static inline void count(const string &solution, const string &type, double acc = 1) {
     #ifdef PROFILE
     count(solution + " " + type, acc);
@@ -317,6 +438,7 @@ public:
   
   static inline double getCount(const string &solution) {
     #ifdef PROFILE
+    collect();
     assertExistence(solution);
     return counters.back().mem[solution];
     #else
@@ -362,35 +484,59 @@ public:
   }
 };
 
+/// Count at a hot path. The name is registered at the first execution only, and without PROFILE the arguments
+/// are not evaluated at all.
+#ifdef PROFILE
+#define COUNT_ID(name, acc) do { \
+    static const CounterId counterId_ = Counter::id(name); \
+    Counter::count(counterId_, acc); \
+  } while (0)
+#define COUNT_MAX_ID(name, number) do { \
+    static const CounterId counterId_ = Counter::id(name, Counter::Max); \
+    Counter::countMax(counterId_, number); \
+  } while (0)
+#else
+#define COUNT_ID(name, acc) do {} while (0)
+#define COUNT_MAX_ID(name, number) do {} while (0)
+#endif
+
 class Clocker {
+  // on another thread than the main one, e.g., a shard built in a parallelFor worker, a Clocker only times, since
+  // the Counter stack and the levels belong to the main thread
+  bool quiet;
   int level;
-  struct timeval start;
+  uint64_t start;   // monotonicNs
   string name;
   bool stopped = false;
   
   int laps = 0;
-  uint64_t us = 0;
+  uint64_t ns = 0;
   
   TeeOstream &os;
 
 public:
   explicit Clocker(const string &name, TeeOstream *os = nullptr)
-    : name(name), level(currentLevel++), os(os ? *os : Counter::counters.back().os) {
+    : quiet(this_thread::get_id() != mainThread), level(quiet ? 0 : currentLevel++), name(name),
+      os(os ? *os : quiet ? nowhere() : Counter::counters.back().os) {
+    if (quiet) {
+      start = monotonicNs();
+      return;
+    }
+    
+    Counter::collect();   // the counts by id so far belong to the enclosing Counter, not to this one
     if (Counter::counters.size()) Counter::counters.back().os.flush();
     
     for (int i = 0; i < level; ++i) this->os << "| ";
     this->os << "++";
     
-    gettimeofday(&start, nullptr);
+    start = monotonicNs();
     this->os << " [" << name << "]" << endl;
     
     Counter::counters.emplace_back(this->os);
   }
   
   void lap() {
-    timeval end;
-    gettimeofday(&end, nullptr);
-    us += diff_us(end, start);
+    ns += monotonicNs() - start;
     
     output();
     
@@ -398,10 +544,23 @@ public:
   }
   
   void resume() {
-    gettimeofday(&start, nullptr);
+    start = monotonicNs();
+  }
+  
+  /// the time of the laps so far, e.g., to compute a throughput after stop
+  inline uint64_t elapsedNs() const {
+    return ns;
   }
   
   void stop() {
+    if (quiet) {
+      ns += monotonicNs() - start;
+      laps++;
+      stopped = true;
+      return;
+    }
+    
+    Counter::collect();
     Counter::counters.back().lap();
     Counter::counters.pop_back();
     
@@ -417,14 +576,23 @@ public:
   }
   
   void output() const {
+    if (quiet) return;
+    
     for (int i = 0; i < level; ++i) os << "| ";
     os << "--";
     os << " [" << name << "]" << (laps ? "@" + to_string(laps) : "") << ": "
-       << us / 1000 << "ms or " << us << "us"
+       << ns / 1000000 << "ms or " << ns / 1000 << "us"
        << endl;
   }
   
   static int currentLevel;
+  static const thread::id mainThread;   // the thread of the static initialization
+
+private:
+  static TeeOstream &nowhere() {
+    static TeeOstream none;
+    return none;
+  }
 };
 
 // C++ program to find Current Day, Date
@@ -70,6 +70,119 @@ public:
     simulateRoutingTmpl<true>(k);
   }
   
+  /// the keys a thread of simulateRoutingBatch walks through the network together
+  static const uint32_t kRoutingBatch = 32;
+  
+  /// Route keys[0, n) through the data planes of the network on threads threads, each key starting from a gateway
+  /// (a router in L3) by its index. A thread walks a batch of its shard of keys hop by hop in lockstep, so the
+  /// lookups of a hop are independent and overlap their cache misses, and calls the lookups of Derived directly
+  /// instead of through the virtual functions. A key is delivered when its port is a link leading back to the node
+  /// it is at, the one of the attached host, and stops when a lookup misses, or after ttl hops. For alien keys, the
+  /// hops are the false positives.
+  /// \return the throughput and the outcome of the keys, the lookups and the throughput of every node, and the
+  /// memory of the data planes
+  template<class Derived>
+  json simulateRoutingBatch(const K *keys, uint64_t n, uint32_t threads = std::thread::hardware_concurrency(),
+                            int ttl = 10) const {
+    const Derived &self = static_cast<const Derived &>(*this);
+    const uint32_t nodeCnt = uint32_t(graph->nodes.size());
+    const uint16_t gatewayCnt = l2 ? 3 : 0;
+    const uint16_t starts = l2 ? gatewayCnt : uint16_t(nodeCnt);
+    threads = uint32_t(max<uint64_t>(1, min<uint64_t>(threads, n / kRoutingBatch)));
+    
+    struct Stats {
+      vector<uint64_t> lookups;
+      uint64_t hops = 0, delivered = 0, misses = 0, timeouts = 0;
+      double cost = 0;
+    };
+    vector<Stats> stats(threads);
+    
+    uint64_t begin = monotonicNs();
+    parallelFor(threads, [&](uint32_t t) {
+      Stats &s = stats[t];
+      s.lookups.assign(nodeCnt, 0);
+      
+      uint16_t current[kRoutingBatch];
+      P port[kRoutingBatch];
+      uint32_t active[kRoutingBatch];
+      
+      const uint64_t from = n * t / threads, to = n * (t + 1) / threads;
+      for (uint64_t b = from; b < to; b += kRoutingBatch) {
+        uint32_t live = uint32_t(min<uint64_t>(kRoutingBatch, to - b));
+        for (uint32_t i = 0; i < live; ++i) {
+          current[i] = uint16_t((b + i) % starts);
+          active[i] = i;
+        }
+        
+        for (int hop = 0; live && hop < ttl; ++hop) {
+          for (uint32_t a = 0; a < live; ++a) {
+            const uint32_t i = active[a];
+            const uint16_t c = current[i];
+            port[i] = c < gatewayCnt ? P(self.Derived::lookUpGateway(c, keys[b + i]))
+                                     : self.Derived::lookUpRouter(uint16_t(c - gatewayCnt), keys[b + i]);
+            s.lookups[c]++;
+          }
+          
+          uint32_t still = 0;
+          for (uint32_t a = 0; a < live; ++a) {
+            const uint32_t i = active[a];
+            const uint16_t c = current[i];
+            const vector<typename Graph<>::AdjacencyMatrixCell> &links = graph->adjacencyList[c];
+            
+            if (port[i] == P(-1) || port[i] >= links.size()) {
+              s.misses++;
+            } else if (links[port[i]].to == c) {
+              s.delivered++;
+            } else {
+              s.hops++;
+              s.cost += links[port[i]].cost;
+              current[i] = links[port[i]].to;
+              active[still++] = i;
+            }
+          }
+          live = still;
+        }
+        s.timeouts += live;
+      }
+    });
+    const double ns = double(max<uint64_t>(1, monotonicNs() - begin));
+    
+    Stats all;
+    all.lookups.assign(nodeCnt, 0);
+    for (const Stats &s: stats) {
+      for (uint32_t i = 0; i < nodeCnt; ++i) all.lookups[i] += s.lookups[i];
+      all.hops += s.hops;
+      all.delivered += s.delivered;
+      all.misses += s.misses;
+      all.timeouts += s.timeouts;
+      all.cost += s.cost;
+    }
+    
+    json nodes = json::array();
+    uint64_t lookups = 0;
+    for (uint32_t i = 0; i < nodeCnt; ++i) {
+      lookups += all.lookups[i];
+      if (all.lookups[i]) nodes.push_back({{"id", i}, {"lookups", all.lookups[i]}, {"mops", all.lookups[i] * 1000 / ns}});
+    }
+    
+    json j;
+    j["structure"] = getName();
+    j["keys"] = n;
+    j["threads"] = threads;
+    j["mops"] = n * 1000 / ns;
+    j["lookups"] = lookups;
+    j["lookup mops"] = lookups * 1000 / ns;
+    j["hops"] = all.hops;
+    j["delivered"] = all.delivered;
+    j["misses"] = all.misses;
+    j["timeouts"] = all.timeouts;
+    j["cost per key"] = n ? all.cost / n : 0.0;
+    j["gateway memory"] = getGatewayMemoryCost();
+    j["router memory"] = getRouterMemoryCost();
+    j["nodes"] = nodes;
+    return j;
+  }
+  
   inline vector<uint16_t> getGatewayIds() const {
     if (!l2) return {};
     
@@ -122,6 +235,41 @@ public:
   virtual inline typename std::conditional<l2, uint8_t, uint16_t>::type
   lookUpRouter(uint16_t id, const K &key) const = 0;
   
+  /// Change the cost of the link between from and to, add it, or take it down with Graph::kUnreachable, see
+  /// Graph::setEdgeCost, then rebuild the data planes of the nodes whose FIB changed: those with another next hop to
+  /// a host, and both ends of an added link, whose ports shift.
+  /// \return the nodes refreshed
+  vector<uint16_t> setLinkCost(uint16_t from, uint16_t to, double cost) {
+    const vector<uint16_t> hostIds = getHostIds();
+    const uint16_t nodeCnt = uint16_t(graph->nodes.size());
+    const size_t fromPorts = graph->adjacencyList[from].size(), toPorts = graph->adjacencyList[to].size();
+    
+    vector<uint16_t> before(size_t(nodeCnt) * hostIds.size());
+    for (uint16_t node = 0; node < nodeCnt; ++node) {
+      for (size_t h = 0; h < hostIds.size(); ++h) before[node * hostIds.size() + h] = graph->nextHopTo(hostIds[h], node);
+    }
+    
+    graph->setEdgeCost(from, to, cost);
+    
+    vector<uint16_t> changed;
+    for (uint16_t node = 0; node < nodeCnt; ++node) {
+      bool shifted = (node == from && graph->adjacencyList[from].size() != fromPorts) ||
+                     (node == to && graph->adjacencyList[to].size() != toPorts);
+      for (size_t h = 0; h < hostIds.size() && !shifted; ++h) {
+        shifted = before[node * hostIds.size() + h] != graph->nextHopTo(hostIds[h], node);
+      }
+      if (shifted) changed.push_back(node);
+    }
+    
+    if (!changed.empty()) refreshNodes(changed);
+    return changed;
+  }
+  
+  /// rebuild the data planes of nodes after their ports to the hosts changed, by default all of them by construct
+  virtual void refreshNodes(const vector<uint16_t> &nodes) {
+    construct();
+  }
+  
   virtual void scenario(int topo) {
     static vector<string> domainTopoFiles{"1221.txt", "1239.txt", "1755.txt", "2914.txt", "3257.txt", "3697.txt",
                                           "4755.txt", "7018.txt"};
@@ -0,0 +1,295 @@
+/*!
+ \file delta_stream.h
+ Incremental updates from a control plane to remote data planes. The control plane appends records to a
+ DeltaWriter, every record taking the next sequence number, and flushes the pending records as one frame: a
+ header with the sequence number of the first record, then the records, each a kind byte and its payload. Frames
+ are plain bytes, written to a ClientSock or a SharedMemoryRing; a DeltaFrameAssembler cuts a received byte stream
+ back into frames. A data plane remembers the last sequence number it applied, so after loading a snapshot taken
+ at sequence s it skips the records up to s, and a frame beyond the next expected one reports a gap.
+ */
+
+#pragma once
+
+#include <algorithm>
+#include <atomic>
+#include <cstring>
+#include <cinttypes>
+#include <stdexcept>
+#include <string>
+#include <type_traits>
+#include <vector>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+struct DeltaFrameHeader {
+  char magic[4] = {'L', 'u', 'D', 'F'};
+  uint32_t bytes = 0;      // of the records following the header
+  uint64_t firstSeq = 0;   // sequence number of the first record
+  uint32_t records = 0;
+  uint32_t reserved = 0;
+
+  inline bool valid() const {
+    return memcmp(magic, DeltaFrameHeader().magic, sizeof(magic)) == 0;
+  }
+};
+
+class DeltaWriter {
+  std::string pending;
+  uint32_t count = 0;
+  uint64_t nextSeq;
+
+public:
+  /// \param appliedSeq the sequence number of the state the data planes start from, e.g., of their snapshot
+  explicit DeltaWriter(uint64_t appliedSeq = 0) : nextSeq(appliedSeq + 1) {}
+
+  /// start a record, whose payload follows with put and putArray
+  inline void begin(uint8_t kind) {
+    ++count;
+    put(kind);
+  }
+
+  template<class T>
+  inline void put(const T &v) {
+    static_assert(std::is_trivially_copyable<T>::value, "only plain values can be put");
+    pending.append((const char *) &v, sizeof(T));
+  }
+
+  template<class T>
+  inline void putArray(const T *data, uint32_t n) {
+    static_assert(std::is_trivially_copyable<T>::value, "only arrays of plain values can be put");
+    put(n);
+    pending.append((const char *) data, n * sizeof(T));
+  }
+
+  template<class T>
+  inline void putArray(const std::vector<T> &v) {
+    putArray(v.data(), v.size());
+  }
+
+  /// the sequence number of the last record
+  inline uint64_t sequence() const {
+    return nextSeq - 1 + count;
+  }
+
+  inline bool empty() const {
+    return count == 0;
+  }
+
+  inline uint32_t size() const {
+    return count;
+  }
+
+  /// \return the frame of the pending records, which are then cleared, or an empty string if none is pending
+  std::string flush() {
+    if (!count) return std::string();
+
+    DeltaFrameHeader header;
+    header.bytes = pending.size();
+    header.firstSeq = nextSeq;
+    header.records = count;
+
+    std::string frame((const char *) &header, sizeof(header));
+    frame += pending;
+
+    nextSeq += count;
+    count = 0;
+    pending.clear();
+
+    return frame;
+  }
+};
+
+class DeltaReader {
+  const uint8_t *p;
+  const uint8_t *end;
+  DeltaFrameHeader header;
+
+  inline const uint8_t *take(uint64_t len) {
+    if (p + len > end) throw std::runtime_error("truncated delta frame");
+    const uint8_t *q = p;
+    p += len;
+    return q;
+  }
+
+public:
+  explicit DeltaReader(const std::string &frame)
+    : p((const uint8_t *) frame.data()), end((const uint8_t *) frame.data() + frame.size()) {
+    header = get<DeltaFrameHeader>();
+    if (!header.valid() || header.bytes != uint64_t(end - p)) throw std::runtime_error("malformed delta frame");
+  }
+
+  inline uint64_t firstSequence() const {
+    return header.firstSeq;
+  }
+
+  inline uint32_t size() const {
+    return header.records;
+  }
+
+  template<class T>
+  inline T get() {
+    static_assert(std::is_trivially_copyable<T>::value, "only plain values can be got");
+    T v;
+    memcpy(&v, take(sizeof(T)), sizeof(T));
+    return v;
+  }
+
+  template<class T>
+  inline void getArray(std::vector<T> &v) {
+    uint32_t n = get<uint32_t>();
+    v.resize(n);
+    if (n) memcpy(&v[0], take(uint64_t(n) * sizeof(T)), uint64_t(n) * sizeof(T));
+  }
+
+  inline bool atEnd() const {
+    return p == end;
+  }
+};
+
+/// Decode a frame for a data plane that has applied the records up to appliedSeq. f(reader, kind, apply) is called
+/// for every record and must consume its payload, applying it only if apply is true.
+/// \return the sequence number of the last record applied
+template<class F>
+uint64_t forEachDelta(const std::string &frame, uint64_t appliedSeq, F f) {
+  DeltaReader r(frame);
+
+  if (r.firstSequence() > appliedSeq + 1) {
+    throw std::runtime_error("gap in the delta stream at " + std::to_string(appliedSeq + 1) +
+                             ", reload a newer snapshot");
+  }
+
+  uint64_t seq = r.firstSequence();
+  for (uint32_t i = 0; i < r.size(); ++i, ++seq) {
+    bool apply = seq > appliedSeq;
+    f(r, r.get<uint8_t>(), apply);
+    if (apply) appliedSeq = seq;
+  }
+
+  if (!r.atEnd()) throw std::runtime_error("trailing bytes in a delta frame");
+  return appliedSeq;
+}
+
+/// Cut a byte stream, e.g., what ClientSock::read returns, into whole frames
+class DeltaFrameAssembler {
+  std::string buffer;
+
+public:
+  inline void feed(const std::string &bytes) {
+    buffer += bytes;
+  }
+
+  /// \return whether a whole frame is buffered, which is then moved to frame
+  bool next(std::string &frame) {
+    if (buffer.size() < sizeof(DeltaFrameHeader)) return false;
+
+    DeltaFrameHeader header;
+    memcpy(&header, buffer.data(), sizeof(header));
+    if (!header.valid()) throw std::runtime_error("lost the framing of the delta stream");
+
+    uint64_t len = sizeof(header) + uint64_t(header.bytes);
+    if (buffer.size() < len) return false;
+
+    frame.assign(buffer, 0, len);
+    buffer.erase(0, len);
+    return true;
+  }
+};
+
+/// Single-producer single-consumer ring of frames in a shared file mapping, e.g., under /dev/shm, between a control
+/// plane and a data plane process on the same host.
+class SharedMemoryRing {
+  struct Control {
+    std::atomic<uint64_t> head;   // bytes consumed
+    alignas(64) std::atomic<uint64_t> tail;   // bytes produced
+    alignas(64) uint64_t capacity;
+  };
+
+  static const uint64_t kDataOffset = 4096;
+
+  Control *control = nullptr;
+  uint8_t *data = nullptr;
+  uint64_t capacity = 0;
+  uint64_t mapped = 0;
+
+  inline void copyIn(uint64_t pos, const void *src, uint64_t n) {
+    uint64_t off = pos % capacity, first = std::min(n, capacity - off);
+    memcpy(data + off, src, first);
+    memcpy(data, (const uint8_t *) src + first, n - first);
+  }
+
+  inline void copyOut(uint64_t pos, void *dst, uint64_t n) const {
+    uint64_t off = pos % capacity, first = std::min(n, capacity - off);
+    memcpy(dst, data + off, first);
+    memcpy((uint8_t *) dst + first, data, n - first);
+  }
+
+public:
+  /// \param create whether this end creates and resets the ring, otherwise it opens an existing one
+  SharedMemoryRing(const std::string &path, uint64_t capacity, bool create) {
+    int fd = open(path.c_str(), create ? (O_RDWR | O_CREAT | O_TRUNC) : O_RDWR, 0600);
+    if (fd < 0) throw std::runtime_error("cannot open the shared ring " + path);
+
+    if (create && ftruncate(fd, kDataOffset + capacity) != 0) {
+      ::close(fd);
+      throw std::runtime_error("cannot size the shared ring " + path);
+    }
+
+    struct stat st;
+    fstat(fd, &st);
+    mapped = st.st_size;
+
+    void *p = mapped > kDataOffset ? mmap(nullptr, mapped, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0) : MAP_FAILED;
+    ::close(fd);
+    if (p == MAP_FAILED) throw std::runtime_error("cannot map the shared ring " + path);
+
+    control = (Control *) p;
+    data = (uint8_t *) p + kDataOffset;
+
+    if (create) {
+      control->head.store(0, std::memory_order_relaxed);
+      control->tail.store(0, std::memory_order_relaxed);
+      control->capacity = capacity;
+    }
+    this->capacity = control->capacity;
+  }
+
+  SharedMemoryRing(const SharedMemoryRing &) = delete;
+
+  ~SharedMemoryRing() {
+    if (control) munmap(control, mapped);
+  }
+
+  /// \return false if the ring has no room for the frame now
+  bool write(const std::string &frame) {
+    if (frame.size() > capacity) throw std::runtime_error("delta frame larger than the shared ring");
+
+    uint64_t tail = control->tail.load(std::memory_order_relaxed);
+    uint64_t head = control->head.load(std::memory_order_acquire);
+    if (tail + frame.size() - head > capacity) return false;
+
+    copyIn(tail, frame.data(), frame.size());
+    control->tail.store(tail + frame.size(), std::memory_order_release);
+    return true;
+  }
+
+  /// \return false if no whole frame is available now
+  bool read(std::string &frame) {
+    uint64_t head = control->head.load(std::memory_order_relaxed);
+    uint64_t tail = control->tail.load(std::memory_order_acquire);
+    if (tail - head < sizeof(DeltaFrameHeader)) return false;
+
+    DeltaFrameHeader header;
+    copyOut(head, &header, sizeof(header));
+    if (!header.valid()) throw std::runtime_error("lost the framing of the shared ring");
+
+    uint64_t len = sizeof(header) + uint64_t(header.bytes);
+    if (tail - head < len) return false;
+
+    frame.resize(len);
+    copyOut(head, &frame[0], len);
+    control->head.store(head + len, std::memory_order_release);
+    return true;
+  }
+};
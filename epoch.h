@@ -0,0 +1,130 @@
+/*!
+ \file epoch.h
+ Epoch-based reclamation of the tables a writer replaces while lookups may still read them, e.g., a retired
+ generation of GrowingLudo. A reader thread registers once, at its first Epoch::Guard, and announces the epoch it
+ reads in; a retired table is freed only once every reader that could have seen it has left its guard.
+ */
+
+#pragma once
+
+#include <algorithm>
+#include <atomic>
+#include <cinttypes>
+#include <memory>
+#include <stdexcept>
+#include <utility>
+#include <vector>
+
+class Epoch {
+  static const uint32_t kMaxReaders = 1024;
+  static const uint64_t kIdle = ~0ULL;
+
+  struct alignas(64) Slot {
+    std::atomic<uint64_t> epoch{kIdle};   // the epoch the reader entered in, kIdle out of a guard
+    std::atomic<bool> used{false};
+  };
+
+  static Slot *slots() {
+    static Slot s[kMaxReaders];
+    return s;
+  }
+
+  static std::atomic<uint64_t> &global() {
+    static std::atomic<uint64_t> e{1};
+    return e;
+  }
+
+  // the slot of the calling thread, taken at its first guard and given back when it exits
+  struct Registration {
+    Slot *slot = nullptr;
+    uint32_t depth = 0;
+
+    Slot &get() {
+      if (slot) return *slot;
+
+      for (uint32_t i = 0; i < kMaxReaders; ++i) {
+        bool expected = false;
+        if (slots()[i].used.compare_exchange_strong(expected, true)) return *(slot = &slots()[i]);
+      }
+      throw std::runtime_error("too many reader threads for Epoch");
+    }
+
+    ~Registration() {
+      if (slot) {
+        slot->epoch.store(kIdle, std::memory_order_relaxed);
+        slot->used.store(false, std::memory_order_release);
+      }
+    }
+  };
+
+  static Registration &self() {
+    static thread_local Registration r;
+    return r;
+  }
+
+public:
+  /// Brackets the reads of the tables that may be retired meanwhile. Nested guards only count.
+  class Guard {
+  public:
+    Guard() {
+      Registration &r = self();
+      if (r.depth++) return;
+
+      Slot &s = r.get();
+      s.epoch.store(global().load(std::memory_order_relaxed), std::memory_order_relaxed);
+      std::atomic_thread_fence(std::memory_order_seq_cst);   // announced before any table pointer is read
+    }
+
+    ~Guard() {
+      Registration &r = self();
+      if (--r.depth == 0) r.slot->epoch.store(kIdle, std::memory_order_release);
+    }
+
+    Guard(const Guard &) = delete;
+  };
+
+  /// end the current epoch, after the writer unpublished what it retires
+  /// \return the epoch ended: the readers that may still see the retired table entered in it or before
+  static uint64_t advance() {
+    uint64_t ended = global().fetch_add(1, std::memory_order_seq_cst);
+    std::atomic_thread_fence(std::memory_order_seq_cst);
+    return ended;
+  }
+
+  /// the oldest epoch a reader is in, ~0 if none is in a guard. What was retired in an earlier epoch is unreachable.
+  static uint64_t oldestReader() {
+    std::atomic_thread_fence(std::memory_order_seq_cst);
+    uint64_t oldest = kIdle;
+    for (uint32_t i = 0; i < kMaxReaders; ++i) {
+      oldest = std::min(oldest, slots()[i].epoch.load(std::memory_order_acquire));
+    }
+    return oldest;
+  }
+};
+
+/// The tables one writer retired and that readers may still be reading, freed by reclaim once they cannot
+template<class T>
+class EpochRetired {
+  std::vector<std::pair<uint64_t, std::unique_ptr<T>>> items;   // each with the epoch it was retired in
+
+public:
+  /// keep t, already unpublished, until the readers that could have seen it leave their guards
+  void retire(std::unique_ptr<T> t) {
+    if (t) items.emplace_back(Epoch::advance(), std::move(t));
+  }
+
+  /// free the tables no reader can reach anymore
+  void reclaim() {
+    if (items.empty()) return;
+
+    const uint64_t oldest = Epoch::oldestReader();
+    items.erase(std::remove_if(items.begin(), items.end(),
+                               [oldest](const std::pair<uint64_t, std::unique_ptr<T>> &item) {
+                                 return item.first < oldest;
+                               }), items.end());
+  }
+
+  inline size_t size() const {
+    return items.size();
+  }
+};
@@ -10,9 +10,80 @@
 #include <cinttypes>
 #include <string>
 #include <iostream>
+#include <cstring>
 #include "farmhash/farmhash.h"
 #include "utils/hashutil.h"
 
+#ifdef __AES__
+#include <wmmintrin.h>
+#endif
+
+/// Keys of a fixed size of at most 16 bytes, e.g., MAC addresses and 5-tuples, opt in by specializing this to
+/// std::true_type. Such a key is loaded once into the two words of a KeyBase, and every hasher of it only mixes the
+/// base with its seed, so a lookup needing several hashes of a key, e.g., the bucket, the locator and the slot of
+/// Ludo, loads the key once and runs no general-purpose hash.
+template<class K>
+struct CompactKey : std::false_type {
+};
+
+struct KeyBase {
+  uint64_t lo, hi;
+};
+
+/// the n <= 8 bytes at p as a word, composed of loads of whole integers in registers, as a word load of the bytes
+/// copied to the stack would stall on the narrower stores
+template<size_t n>
+inline uint64_t loadWord(const char *p) {
+  if constexpr (n >= 8) {
+    uint64_t w;
+    return memcpy(&w, p, 8), w;
+  } else if constexpr (n >= 4) {
+    uint32_t w;
+    memcpy(&w, p, 4);
+    return w | (loadWord<n - 4>(p + 4) << 32);
+  } else if constexpr (n >= 2) {
+    uint16_t w;
+    memcpy(&w, p, 2);
+    return w | (loadWord<n - 2>(p + 2) << 16);
+  } else if constexpr (n == 1) {
+    return uint8_t(*p);
+  } else {
+    return 0;
+  }
+}
+
+/// the key in two words, zero-padded
+template<class K>
+inline KeyBase compactBase(const K &k) {
+  static_assert(sizeof(K) <= 16 && std::is_trivially_copyable<K>::value, "compact keys are plain and up to 16B");
+
+  const char *p = reinterpret_cast<const char *>(&k);
+  if constexpr (sizeof(K) > 8) {
+    return {loadWord<8>(p), loadWord<sizeof(K) - 8>(p + 8)};
+  } else {
+    return {loadWord<sizeof(K)>(p), 0};
+  }
+}
+
+/// The 64-bit hash of a compact key by its base and a seed: with -maes, two AES rounds keyed by the seed, which
+/// spread every input byte over the 128 bits, folded; otherwise two 64-bit mixes. CRC32C is not used, as it is
+/// linear: the hashes of two seeds would differ by a constant, which cuckoo tables and Othello cannot afford.
+inline uint64_t compactHash(const KeyBase &b, uint64_t seed) {
+#ifdef __AES__
+  const __m128i s = _mm_set_epi64x(seed * 0x9e3779b97f4a7c15ULL, seed);
+  __m128i x = _mm_xor_si128(_mm_set_epi64x(b.hi, b.lo), s);
+  x = _mm_aesenc_si128(x, s);
+  x = _mm_aesenc_si128(x, _mm_set_epi64x(0xbe5466cf34e90c6cULL, 0xc0ac29b7c97c50ddULL));
+  return uint64_t(_mm_cvtsi128_si64(x)) ^ uint64_t(_mm_cvtsi128_si64(_mm_unpackhi_epi64(x, x)));
+#else
+  uint64_t x = b.lo ^ seed;
+  x = (x ^ (x >> 30)) * 0xbf58476d1ce4e5b9ULL;
+  x ^= b.hi + (seed * 0x9e3779b97f4a7c15ULL);
+  x = (x ^ (x >> 27)) * 0x94d049bb133111ebULL;
+  return x ^ (x >> 31);
+#endif
+}
+
 template<class K>
 class Hasher32 {
 public:
@@ -59,12 +130,18 @@ public:
   
   inline uint32_t operator()(const K &k0) const {
     static_assert(sizeof(K) <= 32, "K length should be 32/64/96/128/160/192/224/256 bits");
+    if constexpr (CompactKey<K>::value) return fromBase(compactBase(k0));
     
     uint64_t *base = getBase<K>(k0);
     const uint16_t keyByteLength = getKeyByteLength<K>(k0);
     return farmhash::Hash32WithSeed((char *) base, (size_t) keyByteLength, s);
 //    return XXH32((void*) base, keyByteLength, s);
   }
+  
+  /// the hash of a compact key by its base
+  inline uint32_t fromBase(const KeyBase &b) const {
+    return uint32_t(compactHash(b, s));
+  }
 };
 
 //! \brief A hash function that hashes keyType to uint32_t. When SSE4.2 support is found, use sse4.2 instructions, otherwise use default hash function  std::hash.
@@ -117,11 +194,18 @@ public:
   }
   
   inline uint64_t operator()(const K &k0) const {
+    if constexpr (CompactKey<K>::value) return fromBase(compactBase(k0));
+    
     uint64_t *base = getBase<K>(k0);
     const uint16_t keyByteLength = getKeyByteLength<K>(k0);
     return farmhash::Hash64WithSeed((char *) base, (size_t) keyByteLength, s);
 //    return XXH64((void *) base, keyByteLength, s);
   }
+  
+  /// the hash of a compact key by its base
+  inline uint64_t fromBase(const KeyBase &b) const {
+    return compactHash(b, s);
+  }
 };
 
 
@@ -139,6 +223,8 @@ public:
   }
   
   inline uint64_t operator()(const K &k0) const {
+    if constexpr (CompactKey<K>::value) return this->fromBase(compactBase(k0));
+    
     void *base = this -> template getBase<K>(k0);
     const uint16_t keyByteLength = this -> template getKeyByteLength<K>(k0);
     uint32_t h[2];
@@ -0,0 +1,154 @@
+/*!
+ \file hash_simd.h
+ SIMD versions of FastHasher64 for fixed-width keys. Several keys are hashed in one instruction stream, each
+ lane computing exactly the same value as FastHasher64<K>(seed)(key), so tables built with the scalar hasher can
+ be looked up with these kernels. Keys that are not trivially copyable, and the tail of a batch, are hashed
+ one by one.
+ */
+
+#pragma once
+
+#include <cstring>
+#include <type_traits>
+#include "hash.h"
+
+#if defined(__AVX512F__) || defined(__AVX2__)
+#include <immintrin.h>
+#endif
+
+namespace simd_hash {
+
+#if defined(__AVX512F__)
+/// 16 lanes of 32-bit integers
+struct Lanes {
+  typedef __m512i V;
+  static const int N = 16;
+
+  static inline V set1(uint32_t x) { return _mm512_set1_epi32(x); }
+  static inline V load(const uint32_t *p) { return _mm512_loadu_si512(p); }
+  static inline void store(uint32_t *p, V v) { _mm512_storeu_si512(p, v); }
+  static inline V add(V a, V b) { return _mm512_add_epi32(a, b); }
+  static inline V sub(V a, V b) { return _mm512_sub_epi32(a, b); }
+  static inline V xor_(V a, V b) { return _mm512_xor_si512(a, b); }
+  template<int k>
+  static inline V rot(V x) { return _mm512_rol_epi32(x, k); }
+};
+#elif defined(__AVX2__)
+/// 8 lanes of 32-bit integers
+struct Lanes {
+  typedef __m256i V;
+  static const int N = 8;
+
+  static inline V set1(uint32_t x) { return _mm256_set1_epi32(x); }
+  static inline V load(const uint32_t *p) { return _mm256_loadu_si256((const __m256i *) p); }
+  static inline void store(uint32_t *p, V v) { _mm256_storeu_si256((__m256i *) p, v); }
+  static inline V add(V a, V b) { return _mm256_add_epi32(a, b); }
+  static inline V sub(V a, V b) { return _mm256_sub_epi32(a, b); }
+  static inline V xor_(V a, V b) { return _mm256_xor_si256(a, b); }
+  template<int k>
+  static inline V rot(V x) { return _mm256_or_si256(_mm256_slli_epi32(x, k), _mm256_srli_epi32(x, 32 - k)); }
+};
+#endif
+
+#if defined(__AVX512F__) || defined(__AVX2__)
+#define SIMD_HASH_ENABLED 1
+
+/// the mix() of lookup3, see utils/hashutil.cc
+template<class L>
+inline void mix(typename L::V &a, typename L::V &b, typename L::V &c) {
+  a = L::xor_(L::sub(a, c), L::template rot<4>(c));
+  c = L::add(c, b);
+  b = L::xor_(L::sub(b, a), L::template rot<6>(a));
+  a = L::add(a, c);
+  c = L::xor_(L::sub(c, b), L::template rot<8>(b));
+  b = L::add(b, a);
+  a = L::xor_(L::sub(a, c), L::template rot<16>(c));
+  c = L::add(c, b);
+  b = L::xor_(L::sub(b, a), L::template rot<19>(a));
+  a = L::add(a, c);
+  c = L::xor_(L::sub(c, b), L::template rot<4>(b));
+  b = L::add(b, a);
+}
+
+/// the final() of lookup3, see utils/hashutil.cc
+template<class L>
+inline void final(typename L::V &a, typename L::V &b, typename L::V &c) {
+  c = L::sub(L::xor_(c, b), L::template rot<14>(b));
+  a = L::sub(L::xor_(a, c), L::template rot<11>(c));
+  b = L::sub(L::xor_(b, a), L::template rot<25>(a));
+  c = L::sub(L::xor_(c, b), L::template rot<16>(b));
+  a = L::sub(L::xor_(a, c), L::template rot<4>(c));
+  b = L::sub(L::xor_(b, a), L::template rot<14>(a));
+  c = L::sub(L::xor_(c, b), L::template rot<24>(b));
+}
+
+/// BobHash of L::N keys. The keys are transposed into words[w][lane], the 32-bit words of every key zero-padded
+/// at the tail, which is what lookup3 computes with its masked reads.
+template<class K, class L = Lanes>
+inline void bobHash(const K *keys, const uint32_t *seedLo, const uint32_t *seedHi, uint64_t *out) {
+  static const uint32_t kWords = (sizeof(K) + 3) / 4;
+  uint32_t words[kWords][L::N];
+
+  if (sizeof(K) == 4) {
+    memcpy(words, keys, sizeof(words));
+  } else {
+    memset(words, 0, sizeof(words));
+    for (int lane = 0; lane < L::N; ++lane) {
+      const uint8_t *base = (const uint8_t *) &keys[lane];
+      for (uint32_t w = 0; w < kWords; ++w) {
+        memcpy(&words[w][lane], base + w * 4, w + 1 < kWords ? 4 : sizeof(K) - w * 4);
+      }
+    }
+  }
+
+  typename L::V a, b, c;
+  a = b = c = L::add(L::set1(0xdeadbeef + sizeof(K)), L::load(seedLo));
+  c = L::add(c, L::load(seedHi));
+
+  uint32_t w = 0;
+  for (uint32_t length = sizeof(K); length > 12; length -= 12, w += 3) {
+    a = L::add(a, L::load(words[w]));
+    b = L::add(b, L::load(words[w + 1]));
+    c = L::add(c, L::load(words[w + 2]));
+    mix<L>(a, b, c);
+  }
+
+  if (w < kWords) a = L::add(a, L::load(words[w]));
+  if (w + 1 < kWords) b = L::add(b, L::load(words[w + 1]));
+  if (w + 2 < kWords) c = L::add(c, L::load(words[w + 2]));
+  final<L>(a, b, c);
+
+  uint32_t lo[L::N], hi[L::N];
+  L::store(lo, c);
+  L::store(hi, b);
+  for (int lane = 0; lane < L::N; ++lane) {
+    out[lane] = lo[lane] | (uint64_t(hi[lane]) << 32);
+  }
+}
+
+#endif
+
+/// out[i] = h(keys[i]) for i in [0, n)
+template<class K>
+inline void fastHash64(const FastHasher64<K> &h, const K *keys, uint64_t *out, size_t n) {
+  size_t i = 0;
+
+#ifdef SIMD_HASH_ENABLED
+  if constexpr (std::is_trivially_copyable<K>::value && !CompactKey<K>::value) {   // compact keys are not BobHash
+    uint32_t seedLo[Lanes::N], seedHi[Lanes::N];
+    for (int lane = 0; lane < Lanes::N; ++lane) {
+      seedLo[lane] = uint32_t(h.s);
+      seedHi[lane] = uint32_t(h.s >> 32);
+    }
+    for (; i + Lanes::N <= n; i += Lanes::N) {
+      bobHash<K>(keys + i, seedLo, seedHi, out + i);
+    }
+  }
+#endif
+
+  for (; i < n; ++i) {
+    out[i] = h(keys[i]);
+  }
+}
+
+}
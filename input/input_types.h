@@ -188,3 +188,16 @@ inline ostream &operator<<(ostream &os, const Tuple5 &tuple5) {
 }
 
 #pragma pack(pop)
+
+// the packet header keys are hashed by hash.h from two words instead of by farmhash
+template<>
+struct CompactKey<MAC> : std::true_type {
+};
+
+template<>
+struct CompactKey<Addr_Port> : std::true_type {
+};
+
+template<>
+struct CompactKey<Tuple5> : std::true_type {
+};
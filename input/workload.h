@@ -0,0 +1,293 @@
+/*!
+ \file workload.h
+ Key sets, values and query streams of the benchmarks, generated in parallel and cached as snapshot files that are
+ mapped back instead of being generated again. Every element is a function of its index and the seed, e.g., the
+ i-th key is a bijection of i, so the keys are distinct without a membership check, and the result does not depend
+ on the number of threads. A packet trace of 5-tuples can replace the generated keys and the Zipfian stream.
+ */
+
+#pragma once
+
+#include <arpa/inet.h>
+#include <sys/stat.h>
+#include "input_types.h"
+
+/// bijections of the 32-bit and the 64-bit integers, the finalizers of MurmurHash3 and SplitMix64
+inline uint32_t mixIndex32(uint32_t x) {
+  x ^= x >> 16;
+  x *= 0x85ebca6b;
+  x ^= x >> 13;
+  x *= 0xc2b2ae35;
+  x ^= x >> 16;
+  return x;
+}
+
+inline uint64_t mixIndex64(uint64_t x) {
+  x ^= x >> 30;
+  x *= 0xbf58476d1ce4e5b9ULL;
+  x ^= x >> 27;
+  x *= 0x94d049bb133111ebULL;
+  x ^= x >> 31;
+  return x;
+}
+
+/// the index-th key, distinct for distinct indices below 2^32. The packet header types (MAC, Addr_Port, Tuple5)
+/// are enumerated from a 32-bit seed as their samplers do, IPv4 is uint32_t and IPv6 unsigned __int128.
+template<class K>
+inline K workloadKey(uint64_t index, uint64_t seed) {
+  if constexpr (std::is_same<K, unsigned __int128>::value) {
+    return IPv6::enumerate(mixIndex32(uint32_t(index ^ seed)));
+  } else if constexpr (std::is_integral<K>::value && sizeof(K) == 8) {
+    return K(mixIndex64(index ^ seed));
+  } else if constexpr (std::is_integral<K>::value) {
+    static_assert(sizeof(K) == 4, "only 32-bit and 64-bit integer keys are enumerated without collisions");
+    return K(mixIndex32(uint32_t(index ^ seed)));
+  } else {
+    return K::enumerate(mixIndex32(uint32_t(index ^ seed)));
+  }
+}
+
+/// the queries generated by each task of parallelFor, so that a stream is the same for any number of threads
+static const uint64_t kWorkloadChunk = 1 << 16;
+
+/// run f(begin, end) over the chunks of [0, n) on threads threads
+template<class F>
+void forEachWorkloadChunk(uint64_t n, uint32_t threads, F f) {
+  const uint64_t chunks = (n + kWorkloadChunk - 1) / kWorkloadChunk;
+  threads = uint32_t(max<uint64_t>(1, min<uint64_t>(threads, chunks)));
+
+  parallelFor(threads, [&](uint32_t t) {
+    for (uint64_t c = t; c < chunks; c += threads) f(c * kWorkloadChunk, min(n, (c + 1) * kWorkloadChunk));
+  });
+}
+
+/// count keys drawn uniformly from keys[0, n)
+template<class K>
+vector<K> uniformQueries(const K *keys, uint64_t n, uint64_t count, uint64_t seed,
+                         uint32_t threads = thread::hardware_concurrency()) {
+  vector<K> queries(count);
+  forEachWorkloadChunk(count, threads, [&](uint64_t begin, uint64_t end) {
+    for (uint64_t i = begin; i < end; ++i) {
+      queries[i] = keys[(uint64_t) (((unsigned __int128) mixIndex64(i ^ seed) * n) >> 64)];
+    }
+  });
+  return queries;
+}
+
+/// count keys of keys[0, n) drawn with Zipfian popularity of exponent skew, keys[0] the most popular. The keys are
+/// in a random order themselves, so the popular ones are spread over the table.
+template<class K>
+vector<K> zipfianQueries(const K *keys, uint64_t n, uint64_t count, double skew, uint64_t seed,
+                         uint32_t threads = thread::hardware_concurrency()) {
+  vector<K> queries(count);
+  forEachWorkloadChunk(count, threads, [&](uint64_t begin, uint64_t end) {
+    std::default_random_engine rng(uint32_t(mixIndex64(begin ^ seed)));
+    zipf_distribution<uint64_t, double> zipf(n, skew);
+
+    for (uint64_t i = begin; i < end; ++i) queries[i] = keys[zipf(rng) - 1];
+  });
+  return queries;
+}
+
+/// an IPv4 address of a trace, dotted or an integer in host order
+inline uint32_t parseTraceAddress(const string &field) {
+  in_addr addr;
+  if (inet_pton(AF_INET, field.c_str(), &addr) == 1) return ntohl(addr.s_addr);
+
+  char *end;
+  unsigned long long v = strtoull(field.c_str(), &end, 10);
+  if (field.empty() || *end || v > 0xFFFFFFFFULL) throw runtime_error("not an IPv4 address: " + field);
+  return uint32_t(v);
+}
+
+/// Read a packet trace of 5-tuples, one packet per line as "src ip,dst ip,src port,dst port,protocol", e.g., the
+/// fields exported from a pcap by tshark -T fields -E separator=, -e ip.src -e ip.dst -e tcp.srcport -e tcp.dstport
+/// -e ip.proto. Empty lines, the ones starting with '#' and a header line are skipped.
+/// \return the tuples in the order of the trace, repeated as often as their flows send packets
+inline vector<Tuple5> readTuple5Trace(const string &path) {
+  ifstream in(path);
+  if (!in) throw runtime_error("cannot open the trace " + path);
+
+  vector<Tuple5> packets;
+  string line;
+  for (uint64_t lineNo = 1; getline(in, line); ++lineNo) {
+    if (!line.empty() && line.back() == '\r') line.pop_back();
+    if (line.empty() || line[0] == '#' || (lineNo == 1 && !isdigit(line[0]))) continue;
+
+    const vector<string> fields = split(line.c_str(), ',');
+    if (fields.size() != 5) throw runtime_error(path + ":" + to_string(lineNo) + ": not 5 fields");
+
+    try {
+      const uint32_t src = parseTraceAddress(fields[0]), dst = parseTraceAddress(fields[1]);
+      const unsigned long srcPort = stoul(fields[2]), dstPort = stoul(fields[3]), protocol = stoul(fields[4]);
+      if (srcPort > 0xFFFF || dstPort > 0xFFFF || protocol > 0xFF) throw runtime_error("out of range");
+
+      packets.emplace_back(Addr_Port(dst, uint16_t(dstPort)), Addr_Port(src, uint16_t(srcPort)), uint8_t(protocol));
+    } catch (exception &e) {
+      throw runtime_error(path + ":" + to_string(lineNo) + ": " + e.what());
+    }
+  }
+  return packets;
+}
+
+struct WorkloadParams {
+  uint64_t keys = 1 << 20;
+  uint64_t queries = 1 << 25;     // of each distribution
+  uint8_t valueBits = 8;
+  double skew = 1.0;              // the exponent of the Zipfian stream
+  uint64_t seed = 0x1234567801234567ULL;
+};
+
+/// keys, values masked to valueBits, and a uniform and a Zipfian query stream
+template<class K, class V>
+class Workload {
+  static_assert(std::is_trivially_copyable<K>::value && std::is_trivially_copyable<V>::value,
+                "the workload is cached as plain arrays");
+
+  unique_ptr<SnapshotReader> file;   // the arrays point into its mapping when the workload is loaded
+  vector<K> keyStore, uniformStore, zipfianStore;
+  vector<V> valueStore;
+
+  SnapshotSignature signature() const {
+    return SnapshotSignature("Workload", {uint32_t(sizeof(K)), uint32_t(sizeof(V)), params.valueBits,
+                                          uint32_t(params.skew * 1000), uint32_t(params.seed),
+                                          uint32_t(params.seed >> 32)});
+  }
+
+public:
+  WorkloadParams params;
+  const K *keys = nullptr;
+  const V *values = nullptr;
+  const K *uniform = nullptr;
+  const K *zipfian = nullptr;
+
+  explicit Workload(const WorkloadParams &params) : params(params) {}
+
+  Workload(Workload &&) = default;
+
+  Workload &operator=(Workload &&) = default;
+
+  static Workload generate(const WorkloadParams &params, uint32_t threads = thread::hardware_concurrency()) {
+    Workload w(params);
+    const uint64_t n = params.keys;
+    const V mask = V(params.valueBits >= sizeof(V) * 8 ? ~uint64_t(0) : ~(~uint64_t(0) << params.valueBits));
+
+    w.keyStore.resize(n);
+    w.valueStore.resize(n);
+    forEachWorkloadChunk(n, threads, [&](uint64_t begin, uint64_t end) {
+      for (uint64_t i = begin; i < end; ++i) {
+        w.keyStore[i] = workloadKey<K>(i, params.seed);
+        w.valueStore[i] = V(mixIndex64(i ^ ~params.seed)) & mask;
+      }
+    });
+
+    w.uniformStore = uniformQueries(w.keyStore.data(), n, params.queries, params.seed + 1, threads);
+    w.zipfianStore = zipfianQueries(w.keyStore.data(), n, params.queries, params.skew, params.seed + 2, threads);
+
+    w.keys = w.keyStore.data();
+    w.values = w.valueStore.data();
+    w.uniform = w.uniformStore.data();
+    w.zipfian = w.zipfianStore.data();
+    return w;
+  }
+
+  /// The workload of a packet trace: the keys are the distinct packets in the order they first appear, and the
+  /// Zipfian stream is the trace itself, replayed to params.queries packets, with the popularity of its flows. The
+  /// values and the uniform stream are generated as for generate, and params.keys is the number of distinct keys.
+  static Workload fromTrace(const vector<K> &packets, WorkloadParams params,
+                            uint32_t threads = thread::hardware_concurrency()) {
+    if (packets.empty()) throw runtime_error("empty trace");
+
+    // the first packet of every key, by sorting (key, index)
+    vector<pair<K, uint64_t>> byKey(packets.size());
+    for (uint64_t i = 0; i < packets.size(); ++i) byKey[i] = {packets[i], i};
+    sort(byKey.begin(), byKey.end());
+
+    vector<uint64_t> first;
+    for (uint64_t i = 0; i < byKey.size(); ++i) {
+      if (i == 0 || !(byKey[i].first == byKey[i - 1].first)) first.push_back(byKey[i].second);
+    }
+    sort(first.begin(), first.end());
+
+    params.keys = first.size();
+    Workload w(params);
+    const uint64_t n = params.keys;
+    const V mask = V(params.valueBits >= sizeof(V) * 8 ? ~uint64_t(0) : ~(~uint64_t(0) << params.valueBits));
+
+    w.keyStore.resize(n);
+    w.valueStore.resize(n);
+    for (uint64_t i = 0; i < n; ++i) {
+      w.keyStore[i] = packets[first[i]];
+      w.valueStore[i] = V(mixIndex64(i ^ ~params.seed)) & mask;
+    }
+
+    w.uniformStore = uniformQueries(w.keyStore.data(), n, params.queries, params.seed + 1, threads);
+    w.zipfianStore.resize(params.queries);
+    for (uint64_t i = 0; i < params.queries; ++i) w.zipfianStore[i] = packets[i % packets.size()];
+
+    w.keys = w.keyStore.data();
+    w.values = w.valueStore.data();
+    w.uniform = w.uniformStore.data();
+    w.zipfian = w.zipfianStore.data();
+    return w;
+  }
+
+  void save(const string &path) const {
+    SnapshotWriter out(path);
+    out.putSignature(signature());
+    out.putArray(keys, params.keys);
+    out.putArray(values, params.keys);
+    out.putArray(uniform, params.queries);
+    out.putArray(zipfian, params.queries);
+    out.close();
+  }
+
+  /// map a saved workload, which must have been generated with params
+  static Workload load(const string &path, const WorkloadParams &params) {
+    Workload w(params);
+    w.file.reset(new SnapshotReader(path));
+    w.file->expectSignature(w.signature());
+
+    uint64_t n, nv, nu, nz;
+    w.keys = w.file->getArray<K>(n);
+    w.values = w.file->getArray<V>(nv);
+    w.uniform = w.file->getArray<K>(nu);
+    w.zipfian = w.file->getArray<K>(nz);
+
+    if (n != params.keys || nv != n || nu != params.queries || nz != params.queries) {
+      throw runtime_error(path + " holds a workload of other sizes");
+    }
+    return w;
+  }
+
+  /// the file of the workload of params in dir
+  static string cachePath(const WorkloadParams &params, const string &dir) {
+    ostringstream oss;
+    oss << dir << "/" << typeid(K).name() << "-" << sizeof(V) << "B-n" << params.keys << "-q" << params.queries
+        << "-vl" << int(params.valueBits) << "-zipf" << params.skew << "-" << hex << params.seed << ".workload";
+    return oss.str();
+  }
+
+  /// Load the workload of params from dir, or generate and save it there. A file that cannot be loaded, e.g., of an
+  /// older snapshot version, is generated again.
+  static Workload cached(const WorkloadParams &params, const string &dir = "../dist/workloads",
+                         uint32_t threads = thread::hardware_concurrency()) {
+    const string path = cachePath(params, dir);
+
+    try {
+      return load(path, params);
+    } catch (exception &) {
+      Workload w = generate(params, threads);
+
+      mkdir(dir.c_str(), 0755);
+      const string tmp = path + ".tmp" + to_string(getpid());
+      try {
+        w.save(tmp);
+        rename(tmp.c_str(), path.c_str());   // readers never see a partial file
+      } catch (exception &) {
+        unlink(tmp.c_str());                 // e.g., a read-only directory: use it without caching
+      }
+      return w;
+    }
+  }
+};
@@ -0,0 +1,170 @@
+/*!
+ \file latency.h
+ Cycle-accurate timing of single operations and HDR-style latency histograms, to report the tail latency of lookups
+ and updates rather than only the throughput of a whole phase. A histogram belongs to one thread, which records into
+ it without synchronization; the histograms of the threads are merged after they join.
+ */
+
+#pragma once
+
+#include <x86intrin.h>
+#include "common.h"
+
+/// The time stamp counter, converted to nanoseconds by the rate measured once against CLOCK_MONOTONIC
+class CycleClock {
+public:
+  /// start of a timed operation, ordered after the preceding instructions
+  static inline uint64_t begin() {
+    _mm_lfence();
+    return __rdtsc();
+  }
+
+  /// end of a timed operation, ordered after it
+  static inline uint64_t end() {
+    uint32_t aux;
+    uint64_t t = __rdtscp(&aux);
+    _mm_lfence();
+    return t;
+  }
+
+  static double nsPerCycle() {
+    static const double rate = calibrate();
+    return rate;
+  }
+
+  static inline uint64_t toNs(uint64_t cycles) {
+    return uint64_t(cycles * nsPerCycle());
+  }
+
+private:
+  static double calibrate() {
+    uint64_t ns0 = monotonicNs(), c0 = begin();
+    while (monotonicNs() - ns0 < 10000000) {}
+    uint64_t ns1 = monotonicNs(), c1 = end();
+    return double(ns1 - ns0) / double(c1 - c0);
+  }
+};
+
+/// Counts of values in log-linear buckets: 2^kSubBits buckets per power of 2, so every value is reported within
+/// 1 / 2^kSubBits of its magnitude, as HdrHistogram does with 2 significant digits
+class LatencyHistogram {
+public:
+  static const uint32_t kSubBits = 5;
+  static const uint32_t kSub = 1U << kSubBits;
+  static const uint32_t kBuckets = (64 - kSubBits + 1) * kSub;
+
+  vector<uint64_t> counts;
+  uint64_t total = 0;
+  uint64_t sum = 0;
+  uint64_t minValue = uint64_t(-1);
+  uint64_t maxValue = 0;
+
+  LatencyHistogram() : counts(kBuckets) {}
+
+  static inline uint32_t bucketOf(uint64_t v) {
+    if (v < kSub) return uint32_t(v);
+
+    uint32_t shift = 63 - __builtin_clzll(v) - kSubBits;
+    return (shift + 1) * kSub + uint32_t(v >> shift) - kSub;
+  }
+
+  /// the largest value of a bucket
+  static inline uint64_t highestOf(uint32_t bucket) {
+    if (bucket < kSub) return bucket;
+
+    uint32_t shift = bucket / kSub - 1;
+    uint64_t low = uint64_t(bucket % kSub + kSub) << shift;
+    return low + (uint64_t(1) << shift) - 1;
+  }
+
+  inline void record(uint64_t v) {
+    counts[bucketOf(v)]++;
+    total++;
+    sum += v;
+    minValue = min(minValue, v);
+    maxValue = max(maxValue, v);
+  }
+
+  void merge(const LatencyHistogram &other) {
+    for (uint32_t i = 0; i < kBuckets; ++i) counts[i] += other.counts[i];
+    total += other.total;
+    sum += other.sum;
+    minValue = min(minValue, other.minValue);
+    maxValue = max(maxValue, other.maxValue);
+  }
+
+  void clear() {
+    *this = LatencyHistogram();
+  }
+
+  /// \param q in [0, 1]
+  /// \return the smallest bucket bound covering a fraction q of the values, 0 if empty
+  uint64_t percentile(double q) const {
+    if (!total) return 0;
+
+    uint64_t rank = max<uint64_t>(1, uint64_t(ceil(q * total))), seen = 0;
+    for (uint32_t i = 0; i < kBuckets; ++i) {
+      seen += counts[i];
+      if (seen >= rank) return min(highestOf(i), maxValue);
+    }
+    return maxValue;
+  }
+
+  /// the summary, in the unit of the recorded values
+  json toJson() const {
+    json j;
+    j["count"] = total;
+    j["min"] = total ? minValue : 0;
+    j["max"] = maxValue;
+    j["mean"] = total ? double(sum) / total : 0.0;
+    j["p50"] = percentile(0.5);
+    j["p90"] = percentile(0.9);
+    j["p99"] = percentile(0.99);
+    j["p99.9"] = percentile(0.999);
+    j["p99.99"] = percentile(0.9999);
+    return j;
+  }
+};
+
+/// The histograms of the threads of one phase, in nanoseconds. Each thread records one operation in every
+/// sampleEvery, so the reads of the time stamp counter hardly slow down the throughput measured meanwhile.
+class LatencyRecorder {
+public:
+  vector<LatencyHistogram> threads;
+  uint32_t sampleEvery;
+
+  explicit LatencyRecorder(uint32_t threadCnt = 1, uint32_t sampleEvery = 1)
+    : threads(threadCnt), sampleEvery(sampleEvery) {}
+
+  /// run op, timing it when i is a sampled operation of thread t
+  template<class Op>
+  inline void time(uint32_t t, uint64_t i, Op op) {
+    if (i % sampleEvery) {
+      op();
+      return;
+    }
+
+    uint64_t c0 = CycleClock::begin();
+    op();
+    uint64_t c1 = CycleClock::end();
+    threads[t].record(CycleClock::toNs(c1 - c0));
+  }
+
+  /// "all": the merged histogram, "threads": the one of every thread
+  json toJson() const {
+    LatencyHistogram all;
+    json perThread = json::array();
+
+    for (const LatencyHistogram &h: threads) {
+      all.merge(h);
+      perThread.push_back(h.toJson());
+    }
+
+    json j;
+    j["unit"] = "ns";
+    j["sampleEvery"] = sampleEvery;
+    j["all"] = all.toJson();
+    j["threads"] = perThread;
+    return j;
+  }
+};
@@ -0,0 +1,1095 @@
+/*!
+ \file lookupEquivalence.cpp
+ Each test changes a table through one of its update or restart paths, e.g., a snapshot, a delta stream or a
+ growth, and checks that every key is looked up to the same value as in a table built from scratch, or as in the
+ map of the keys. Returns the number of failed tests, so that ctest reports them.
+ */
+
+#include "common.h"
+#include "Ludo/ludo.h"
+#include "Ludo/ludo_sync.h"
+#include "Ludo/ludo_growth.h"
+#include "Sketch/ludo_sketch.h"
+#include "Ludo/ludo_control_plane.h"
+#include "Ludo/ludo_sharded.h"
+#include "Ludo/ludo_fused.h"
+#include "CuckooPresized/cuckoo_map.h"
+#include "input/workload.h"
+
+typedef uint32_t Key;
+typedef uint16_t Val;
+static const uint8_t VL = 12;
+
+uint64_t failures = 0;
+
+// count a failed check of the running test and print why, continuing with the test
+#define EXPECT(cond, what) \
+  do { if (!(cond)) { ++failures; cerr << "  " << __func__ << ": " << what << endl; } } while (0)
+
+/// the keys and values of a test, values masked to VL bits
+Workload<Key, Val> workload(uint64_t n, uint64_t seed = 0x1234567801234567ULL) {
+  WorkloadParams params;
+  params.keys = n;
+  params.queries = 1;
+  params.valueBits = VL;
+  params.seed = seed;
+  return Workload<Key, Val>::generate(params);
+}
+
+/// the number of keys of keys[0, n) that dp looks up to another value than values
+template<class DP, class K>
+uint64_t mismatches(DP &dp, const K *keys, const Val *values, uint64_t n) {
+  uint64_t wrong = 0;
+  for (uint64_t i = 0; i < n; ++i) {
+    Val v;
+    if (!dp.lookUp(keys[i], v) || (v & ((1 << VL) - 1)) != values[i]) ++wrong;
+  }
+  return wrong;
+}
+
+// a loaded snapshot views the mapping, looks up as the saved table, and updates only its private copy
+void testSnapshot() {
+  const uint64_t n = 100000;
+  Workload<Key, Val> w = workload(n);
+  ControlPlaneLudo<Key, Val, VL> cp(n);
+  cp.bulkLoad(w.keys, w.values, n);
+  cp.prepareToExport();
+  DataPlaneLudo<Key, Val, VL> dp(cp);
+
+  const string path = "lookupEquivalence.snap";
+  dp.saveSnapshot(path);
+
+  {
+    auto loaded = DataPlaneLudo<Key, Val, VL>::loadSnapshot(path);
+    EXPECT(loaded.memory.borrowed() && loaded.locator.mem.borrowed(), "the loaded tables are copies");
+    EXPECT(mismatches(loaded, w.keys, w.values, n) == 0, "the loaded table looks up other values");
+
+    Val other = Val(~w.values[0]) & ((1 << VL) - 1);
+    loaded.applyUpdate(cp.updateMapping(w.keys[0], other), other);
+    Val v;
+    EXPECT(loaded.lookUp(w.keys[0], v) && v == other, "an update of a loaded table is lost");
+    cp.updateMapping(w.keys[0], w.values[0]);
+  }
+
+  auto reloaded = DataPlaneLudo<Key, Val, VL>::loadSnapshot(path);
+  EXPECT(mismatches(reloaded, w.keys, w.values, n) == 0, "an update of a loaded table reached the file");
+
+  truncate(path.c_str(), 10);
+  bool thrown = false;
+  try {
+    DataPlaneLudo<Key, Val, VL>::loadSnapshot(path);
+  } catch (runtime_error &) {
+    thrown = true;
+  }
+  EXPECT(thrown, "a truncated snapshot is loaded");
+  remove(path.c_str());
+
+  ControlPlaneOthello<Key, Val, VL> ocp(n, true, vector<Key>(w.keys, w.keys + n), vector<Val>(w.values, w.values + n));
+  DataPlaneOthello<Key, Val, VL> odp(ocp);
+  odp.saveSnapshot(path);
+  {
+    auto loaded = DataPlaneOthello<Key, Val, VL>::loadSnapshot(path);
+    EXPECT(loaded.mem.borrowed(), "the loaded Othello is a copy");
+    EXPECT(mismatches(loaded, w.keys, w.values, n) == 0, "the loaded Othello looks up other values");
+  }
+  remove(path.c_str());
+
+  // digests of other keys may shadow a key of the cuckoo map, so it is compared to the table it was saved from
+  typedef DataPlaneCuckooMap<Key, Val, uint16_t> CuckooMap;
+  ControlPlaneCuckooMap<Key, Val, uint16_t, false, 16> ccp(n);
+  for (uint64_t i = 0; i < n; ++i) ccp.insert(w.keys[i], w.values[i]);
+  CuckooMap cdp(ccp);
+  cdp.saveSnapshot(path);
+  {
+    CuckooMap loaded = CuckooMap::loadSnapshot(path);
+    EXPECT(loaded.buckets_.borrowed(), "the loaded cuckoo map is a copy");
+    uint64_t differ = 0;
+    for (uint64_t i = 0; i < n; ++i) {
+      Val a = 0, b = 0;
+      differ += cdp.lookUp(w.keys[i], a) != loaded.lookUp(w.keys[i], b) || a != b;
+    }
+    EXPECT(differ == 0, "the loaded cuckoo map looks up " << differ << " keys to other values");
+  }
+  remove(path.c_str());
+}
+
+// keys left out of the cycles of the locator are looked up in the fallback table, by lookUp and lookUpBatch
+void testLocatorCycles() {
+  const uint64_t n = 20000;
+  uint32_t broken = 0;
+
+  for (uint64_t seed = 1; seed <= 20; ++seed) {
+    Workload<Key, Val> w = workload(n, seed);
+    ControlPlaneLudo<Key, Val, VL> cp(n);
+    cp.bulkLoad(w.keys, w.values, n);
+    cp.prepareToExport();
+    DataPlaneLudo<Key, Val, VL> dp(cp);
+    broken += !dp.fallback.empty();
+
+    EXPECT(cp.locator.builds == 1, "the locator is built " << cp.locator.builds << " times");
+    EXPECT(mismatches(dp, w.keys, w.values, n) == 0, "keys are lost with seed " << seed);
+
+    vector<Val> out(n);
+    dp.lookUpBatch(w.keys, out.data(), n);
+    for (uint64_t i = 0; i < n; ++i) EXPECT(out[i] == w.values[i], "batched lookup of key " << i);
+  }
+
+  EXPECT(broken > 0, "no locator had a cycle to break");
+}
+
+// a replica applying the delta stream of inserts, updates and removals, some to the fallback table, looks up as
+// the control plane, and as a table exported from it afresh
+void testDeltaStream() {
+  const uint64_t n = 50000, loaded = n * 9 / 10;
+  Workload<Key, Val> w = workload(n * 11 / 10);
+  ControlPlaneLudo<Key, Val, VL> cp(n);
+  cp.bulkLoad(w.keys, w.values, loaded);
+  cp.prepareToExport();
+
+  LudoReplica<Key, Val, VL> replica(cp, 0);
+  LudoDeltaPublisher<Key, Val, VL> publisher(cp);
+  unordered_map<Key, Val> expected;
+  for (uint64_t i = 0; i < loaded; ++i) expected[w.keys[i]] = w.values[i];
+
+  // past the capacity, so that some inserts go to the fallback table
+  for (uint64_t i = loaded; i < n * 11 / 10; ++i) {
+    publisher.insert(w.keys[i], w.values[i]);
+    expected[w.keys[i]] = w.values[i];
+  }
+  EXPECT(!cp.fallbackEntries().empty(), "no insert went to the fallback table");
+
+  for (uint64_t i = 0; i < n / 10; ++i) {
+    EXPECT(publisher.remove(w.keys[i * 11]), "key " << i * 11 << " is not removed");
+    expected.erase(w.keys[i * 11]);
+  }
+
+  // the bits above VL are dropped, in the control plane and in the stream
+  uint32_t fallbackUpdates = 0;
+  for (auto &kv: expected) {
+    Val v = Val(kv.second * 7 + 1) | Val(1 << VL);
+    fallbackUpdates += cp.fallbackEntries().contains(kv.first);
+    EXPECT(publisher.updateMapping(kv.first, v), "key " << kv.first << " is not updated");
+    kv.second = v & ((1 << VL) - 1);
+  }
+  EXPECT(fallbackUpdates > 0, "no fallback key is updated");
+
+  replica.apply(publisher.flush());
+  EXPECT(replica.appliedSeq == publisher.sequence(), "the replica is at " << replica.appliedSeq);
+
+  cp.prepareToExport();
+  DataPlaneLudo<Key, Val, VL> fresh(cp);
+  for (const auto &kv: expected) {
+    Val v, c, f;
+    EXPECT(replica.dp.lookUp(kv.first, v) && v == kv.second, "the replica looks up " << v << " for " << kv.first);
+    EXPECT(cp.lookUp(kv.first, c) && c == kv.second, "the control plane looks up " << c << " for " << kv.first);
+    EXPECT(fresh.lookUp(kv.first, f) && f == v, "a fresh export looks up " << f << " for " << kv.first);
+  }
+}
+
+// a table growing through several generations, with removals and updates during the migrations, looks up as the
+// map of the keys, and so do the lookups running meanwhile on other threads, in the generations they entered
+void testGrowth() {
+  const uint64_t n = 200000;
+  Workload<Key, Val> w = workload(n);
+  typedef GrowingLudo<Key, Val, VL> Table;
+  Table table(1024);
+  unordered_map<Key, Val> expected;
+
+  uint32_t growths = 0;
+  auto insert = [&](uint64_t i) {
+    const bool growing = table.growing();
+    table.insert(w.keys[i], w.values[i]);
+    growths += !growing && table.growing();
+  };
+
+  // the first quarter is not modified afterwards, the reader looks it up as inserted
+  for (uint64_t i = 0; i < n / 4; ++i) insert(i);
+  atomic<bool> done(false);
+  atomic<uint64_t> wrong(0), lookups(0);
+  thread reader([&]() {
+    for (uint64_t i = 0; !done.load(std::memory_order_relaxed); i = (i + 1) % (n / 4)) {
+      Val v;
+      if (!table.lookUp(w.keys[i], v) || v != w.values[i]) wrong++;
+      lookups++;
+    }
+  });
+
+  for (uint64_t i = n / 4; i < n; ++i) {
+    insert(i);
+    expected[w.keys[i]] = w.values[i];
+
+    if (table.growing() && i % 7 == 0) {
+      EXPECT(table.remove(w.keys[i - 1]), "key " << i - 1 << " is not removed");
+      expected.erase(w.keys[i - 1]);
+    } else if (table.growing() && i % 5 == 0) {
+      Val v = Val(w.values[i - 2] + 1) & ((1 << VL) - 1);
+      if (expected.count(w.keys[i - 2])) {
+        EXPECT(table.updateMapping(w.keys[i - 2], v), "key " << i - 2 << " is not updated");
+        expected[w.keys[i - 2]] = v;
+      }
+    }
+  }
+  while (!table.migrate()) {}
+
+  done = true;
+  reader.join();
+  EXPECT(growths >= 3, "the table grew " << growths << " times");
+  EXPECT(lookups > 0 && wrong == 0, wrong << " of " << lookups << " concurrent lookups are wrong");
+  EXPECT(table.reclaim() == 0, "retired generations are kept after the readers left");
+  EXPECT(table.controlPlane().fallbackEntries().size() * Table::kFallbackRatio <= n * 2,
+         "the fallback table holds " << table.controlPlane().fallbackEntries().size() << " keys");
+
+  for (uint64_t i = 0; i < n / 4; ++i) expected[w.keys[i]] = w.values[i];
+  EXPECT(table.size() == expected.size(), "the table holds " << table.size() << " keys");
+  for (auto &kv: expected) {
+    Val v;
+    EXPECT(table.lookUp(kv.first, v) && v == kv.second, "the table looks up " << v << " for " << kv.first);
+
+    // the fallback keys of a generation that is not growing are updated too
+    kv.second = Val(kv.second * 3 + 1) & ((1 << VL) - 1);
+    EXPECT(table.updateMapping(kv.first, kv.second), "key " << kv.first << " is not updated");
+    EXPECT(table.lookUp(kv.first, v) && v == kv.second, "the table looks up " << v << " for " << kv.first);
+  }
+}
+
+// relieving the hottest overflowed buckets, by ControlPlaneLudo::reseedOverflowed and applyInsert(path, 0), keeps
+// the lookups of the keys moved to their other bucket and of the keys left in place, in both data planes
+void testReseed() {
+  const uint64_t n = 1 << 18;
+  Workload<Key, Val> w = workload(n);
+  ControlPlaneLudo<Key, Val, VL> cp(n);
+  cp.bulkLoad(w.keys, w.values, n);
+  cp.prepareToExport();
+  DataPlaneLudo<Key, Val, VL> dp(cp);
+  DataPlaneLudoSketch<Key, Val, VL> sketch(cp);
+
+  for (uint64_t i = 0; i < n; i += 2) {
+    Val v;
+    sketch.lookUpAndCount(w.keys[i], v);
+  }
+  const vector<uint32_t> hot = sketch.hotOverflowedBuckets(uint32_t(n));
+  EXPECT(!hot.empty() && hot == sketch.hotOverflowedBuckets(uint32_t(hot.size())), "no hot overflowed bucket");
+
+  unordered_map<Key, uint32_t> before;    // the bucket of each key of the relieved buckets
+  uint32_t relieved = 0;
+  for (uint32_t bid: hot) {
+    EXPECT(cp.getSeed(bid) >= MaxArrangementSeed, "bucket " << bid << " is not overflowed");
+
+    const auto &bucket = cp.buckets_[bid];
+    vector<Key> keys;
+    for (uint8_t s = 0; s < 4; ++s) {
+      if (bucket.occupiedMask & (1 << s)) keys.push_back(bucket.keys[s]);
+    }
+
+    vector<MPC_PathEntry> path;
+    if (!cp.reseedOverflowed(bid, path)) continue;
+    for (const Key &k: keys) before[k] = bid;
+    dp.applyInsert(path, 0);
+    sketch.applyInsert(path, 0);
+    ++relieved;
+    EXPECT(cp.getSeed(bid) < MaxArrangementSeed && dp.readSeed(bid) < MaxArrangementSeed,
+           "bucket " << bid << " is still overflowed");
+  }
+  EXPECT(relieved > 0, "no hot bucket is relieved");
+
+  uint32_t moved = 0, kept = 0;
+  for (const auto &kb: before) (cp.locate(kb.first).first == kb.second ? kept : moved)++;
+  EXPECT(moved == relieved && kept > 0, moved << " keys moved and " << kept << " kept");
+
+  EXPECT(mismatches(dp, w.keys, w.values, n) == 0, "the data plane lost keys");
+  EXPECT(mismatches(sketch, w.keys, w.values, n) == 0, "the sketch lost keys");
+
+  cp.prepareToExport();
+  DataPlaneLudo<Key, Val, VL> fresh(cp);
+  for (uint64_t i = 0; i < n; ++i) {
+    Val v, f;
+    EXPECT(dp.lookUp(w.keys[i], v) && fresh.lookUp(w.keys[i], f) && v == f,
+           "key " << i << " differs from a fresh export");
+  }
+}
+
+// after a skewed stream of lookUpAndCount, the count-min estimate of every key is at least the number of its lookups,
+// or the saturation of the counters for the hottest keys, which the stream reaches
+void testSketchEstimate() {
+  typedef DataPlaneLudoSketch<Key, Val, VL> Sketch;
+  const uint64_t n = 20000;
+  WorkloadParams params;
+  params.keys = n;
+  params.queries = 1 << 19;
+  params.valueBits = VL;
+  params.skew = 1.2;
+  Workload<Key, Val> w = Workload<Key, Val>::generate(params);
+  ControlPlaneLudo<Key, Val, VL> cp(n);
+  cp.bulkLoad(w.keys, w.values, n);
+  cp.prepareToExport();
+  Sketch sketch(cp);
+
+  unordered_map<Key, uint64_t> counts;
+  for (uint64_t i = 0; i < params.queries; ++i) {
+    Val v;
+    sketch.lookUpAndCount(w.zipfian[i], v);
+    counts[w.zipfian[i]]++;
+  }
+
+  const uint64_t saturation = typename Sketch::SketchCounter(-1);
+  uint64_t under = 0, saturated = 0;
+  for (uint64_t i = 0; i < n; ++i) {
+    const auto it = counts.find(w.keys[i]);
+    const uint64_t expected = min(it == counts.end() ? 0 : it->second, saturation);
+    const uint64_t estimate = sketch.estimate(w.keys[i]);
+    under += estimate < expected;
+    saturated += estimate == saturation;
+  }
+  EXPECT(under == 0, under << " of " << n << " keys are underestimated");
+  EXPECT(saturated > 0, "no counter saturates");
+}
+
+// an export by several threads, each encoding its own range of words, writes the same memory as by one thread,
+// whether VL puts the bucket boundaries inside the words or not
+template<uint8_t V>
+void testThreadedExport() {
+  const uint64_t n = 200000;
+  Workload<Key, Val> w = workload(n);
+  ControlPlaneLudo<Key, Val, V> cp(n);
+  cp.bulkLoad(w.keys, w.values, n);
+  cp.prepareToExport();
+
+  DataPlaneLudo<Key, Val, V> one(cp, 1);
+  for (uint32_t threads: {2, 3, 8}) {
+    DataPlaneLudo<Key, Val, V> many(cp, threads);
+    EXPECT(many.memory.size() == one.memory.size() &&
+           equal(many.memory.begin(), many.memory.end(), one.memory.begin()),
+           "VL " << int(V) << ", " << threads << " threads export other memory");
+  }
+
+  uint64_t wrong = 0;
+  for (uint64_t i = 0; i < n; ++i) {
+    Val v;
+    wrong += !one.lookUp(w.keys[i], v) || v != (w.values[i] & ((1 << V) - 1));
+  }
+  EXPECT(wrong == 0, "VL " << int(V) << ": " << wrong << " keys are lost");
+}
+
+void testThreadedExports() {
+  testThreadedExport<1>();
+  testThreadedExport<3>();
+  testThreadedExport<12>();
+}
+
+/// a connected graph of n nodes with integer link costs, so that the costs of the paths compare exactly: a random
+/// tree and about n more links. Nodes 0-2 are the gateways, and every third node of the others has a host.
+Graph<> *randomTopology(uint16_t n, uint32_t seed) {
+  Graph<> *g = new Graph<>(n);
+  for (uint16_t id = 0; id < n; ++id) g->addVertex({id, id >= 3 && id % 3 == 0, nullptr});
+
+  mt19937 rng(seed);
+  for (uint16_t id = 1; id < n; ++id) g->addEdge({uint16_t(rng() % id), id, double(1 + rng() % 9)});
+  for (uint16_t i = 0; i < n; ++i) {
+    uint16_t a = uint16_t(rng() % n), b = uint16_t(rng() % n);
+    const auto &links = g->adjacencyList[a];
+    if (a != b && !binary_search(links.begin(), links.end(), Graph<>::AdjacencyMatrixCell{b, 0})) {
+      g->addEdge({a, b, double(1 + rng() % 9)});
+    }
+  }
+  return g;
+}
+
+/// a change of a random link of g: a new link or another cost, cheaper, dearer, or down if allowed
+tuple<uint16_t, uint16_t, double> randomLinkChange(const Graph<> &g, mt19937 &rng, bool down) {
+  const uint16_t n = uint16_t(g.nodes.size());
+  const uint16_t a = uint16_t(rng() % n), b = uint16_t(rng() % n);
+  const uint32_t kind = rng() % (down ? 4 : 3);
+  if (kind == 0 && a != b) return make_tuple(a, b, double(1 + rng() % 9));
+
+  for (const auto &cell: g.adjacencyList[a]) {   // the first link of a that is up
+    if (cell.to == a || cell.cost >= Graph<>::kUnreachable) continue;
+    if (kind == 1) return make_tuple(a, cell.to, 1.0);
+    if (kind == 2) return make_tuple(a, cell.to, cell.cost + 10);
+    return make_tuple(a, cell.to, double(Graph<>::kUnreachable));
+  }
+  return make_tuple(a, uint16_t((a + 1) % n), 1.0);
+}
+
+// Graph::setEdgeCost updates the shortest paths incrementally to the costs of a full recompute, along next hops
+// of shortest paths, and ControlPlane::setLinkCost refreshes the FIBs of the nodes it changed to the ports a full
+// construction gives
+void testLinkCost() {
+  const uint16_t nodes = 60;
+  mt19937 rng(7);
+  unique_ptr<Graph<>> g(randomTopology(nodes, 1));
+  g->calculateShortestPaths();
+
+  for (uint32_t step = 0; step < 60; ++step) {
+    uint16_t a, b;
+    double cost;
+    tie(a, b, cost) = randomLinkChange(*g, rng, true);
+    g->setEdgeCost(a, b, cost);
+
+    Graph<> fresh(*g);
+    fresh.calculateShortestPaths();
+
+    uint64_t wrongCosts = 0, wrongHops = 0;
+    for (uint16_t dst = 0; dst < nodes; ++dst) {
+      for (uint16_t src = 0; src < nodes; ++src) {
+        wrongCosts += g->costTo(dst, src) != fresh.costTo(dst, src);
+        if (src == dst || g->costTo(dst, src) >= Graph<>::kUnreachable) continue;
+
+        const uint16_t hop = g->nextHopTo(dst, src);
+        const auto &links = g->adjacencyList[src];
+        auto it = lower_bound(links.begin(), links.end(), Graph<>::AdjacencyMatrixCell{hop, 0});
+        wrongHops += it == links.end() || it->to != hop || float(it->cost + g->costTo(dst, hop)) != g->costTo(dst, src);
+      }
+    }
+    EXPECT(wrongCosts == 0 && wrongHops == 0, "step " << step << ": " << wrongCosts << " costs and " << wrongHops
+                                                      << " next hops differ from a full recompute");
+  }
+
+  const uint64_t n = 2000;
+  Workload<Key, Val> w = workload(n);
+  LudoControlPlane<Key, true> cp(n);
+  cp.keepAllDataPlanes = true;
+  cp.graph = randomTopology(40, 2);
+  cp.graph->calculateShortestPaths();
+
+  const vector<uint16_t> hosts = cp.getHostIds();
+  for (uint64_t i = 0; i < n; ++i) cp.insert(w.keys[i], hosts[i % hosts.size()]);
+  cp.construct();
+
+  // the port of every key at every node
+  auto ports = [&]() {
+    vector<uint8_t> result;
+    for (uint16_t node = 0; node < cp.graph->nodes.size(); ++node) {
+      for (uint64_t i = 0; i < n; ++i) result.push_back(node < 3 ? cp.lookUpGateway(node, w.keys[i])
+                                                                 : cp.lookUpRouter(uint16_t(node - 3), w.keys[i]));
+    }
+    return result;
+  };
+
+  uint64_t refreshedNodes = 0;
+  for (uint32_t step = 0; step < 20; ++step) {
+    uint16_t a, b;
+    double cost;
+    tie(a, b, cost) = randomLinkChange(*cp.graph, rng, false);
+    refreshedNodes += cp.setLinkCost(a, b, cost).size();
+
+    // routed from a gateway to its host along a shortest path
+    uint64_t wrong = 0;
+    for (uint64_t i = 0; i < n; ++i) {
+      uint16_t gateway = uint16_t(i % 3), node = gateway;
+      double pathCost = 0;
+      for (int hop = 0; hop <= nodes; ++hop) {
+        const uint8_t port = node < 3 ? cp.lookUpGateway(node, w.keys[i])
+                                      : cp.lookUpRouter(uint16_t(node - 3), w.keys[i]);
+        const auto &link = cp.graph->adjacencyList[node][port];
+        if (link.to == node) break;
+        pathCost += link.cost;
+        node = link.to;
+      }
+      wrong += node != hosts[i % hosts.size()] || float(pathCost) != cp.graph->costTo(node, gateway);
+    }
+    EXPECT(wrong == 0, "step " << step << ": " << wrong << " keys are not routed along a shortest path");
+
+    const vector<uint8_t> refreshed = ports();
+    cp.construct();
+    EXPECT(refreshed == ports(), "step " << step << ": the refreshed FIBs differ from a full construction");
+  }
+  EXPECT(refreshedNodes > 0, "no FIB is refreshed");
+}
+
+// a workload read from a CSV trace of 5-tuples has the distinct flows as keys, in the order of their first
+// packets, and replays the trace as its Zipfian stream, which a table of the keys looks up to their values
+void testTrace() {
+  const uint32_t flows = 3000;
+  const string path = "lookupEquivalence.trace.csv";
+  vector<Tuple5> written;
+  {
+    ofstream out(path);
+    out << "ip.src,ip.dst,tcp.srcport,tcp.dstport,ip.proto\r\n# a comment\n";
+    for (uint32_t round = 0; round < 20; ++round) {
+      for (uint32_t f = 0; f < flows; f += 1 + round * round) {
+        const Tuple5 t = Tuple5::enumerate(mixIndex32(f));
+        char src[INET_ADDRSTRLEN];
+        in_addr addr{htonl(t.src.addr)};
+        inet_ntop(AF_INET, &addr, src, sizeof(src));
+
+        out << src << "," << t.dst.addr << "," << t.src.port << "," << t.dst.port << "," << t.protocol << "\n";
+        written.push_back(t);
+      }
+    }
+  }
+
+  const vector<Tuple5> packets = readTuple5Trace(path);
+  remove(path.c_str());
+  EXPECT(packets == written, "the trace is read as " << packets.size() << " other packets");
+
+  WorkloadParams params;
+  params.queries = packets.size() * 2;
+  params.valueBits = VL;
+  Workload<Tuple5, Val> w = Workload<Tuple5, Val>::fromTrace(packets, params);
+  EXPECT(w.params.keys == flows, w.params.keys << " keys");
+  for (uint32_t f = 0; f < min<uint64_t>(flows, w.params.keys); ++f) {
+    EXPECT(w.keys[f] == written[f], "key " << f << " is not the flow of the first packet " << f);
+  }
+
+  ControlPlaneLudo<Tuple5, Val, VL> cp(w.params.keys);
+  cp.bulkLoad(w.keys, w.values, w.params.keys);
+  cp.prepareToExport();
+  DataPlaneLudo<Tuple5, Val, VL> dp(cp);
+
+  map<Tuple5, Val> expected;
+  for (uint64_t i = 0; i < w.params.keys; ++i) expected[w.keys[i]] = w.values[i];
+  uint64_t wrong = 0;
+  for (uint64_t i = 0; i < params.queries; ++i) {
+    Val v;
+    wrong += !(w.zipfian[i] == packets[i % packets.size()]) || !dp.lookUp(w.zipfian[i], v) ||
+             v != expected[w.zipfian[i]];
+  }
+  EXPECT(wrong == 0, wrong << " of the " << params.queries << " replayed packets are looked up wrong");
+
+  bool thrown = false;
+  {
+    ofstream(path) << "10.0.0.1,10.0.0.2,80,70000,6\n";
+  }
+  try {
+    readTuple5Trace(path);
+  } catch (runtime_error &) {
+    thrown = true;
+  }
+  remove(path.c_str());
+  EXPECT(thrown, "a port out of range is read");
+}
+
+// the Toeplitz hash matches the verification suite of the Microsoft RSS specification under its default key, both
+// over the addresses and ports of a TCP/IPv4 packet and over the addresses only, and a sharded table looks every key
+// up in the data plane of its RSS queue as the single table does
+void testRss() {
+  struct Vector {
+    const char *dst, *src;
+    uint16_t dstPort, srcPort;
+    uint32_t tcp4, ipv4;
+  };
+  const Vector vectors[] = {
+    {"161.142.100.80", "66.9.149.187", 1766, 2794, 0x51ccc178, 0x323e8fc2},
+    {"65.69.140.83", "199.92.111.2", 4739, 14230, 0xc626b0ea, 0xd718262a},
+    {"12.22.207.184", "24.19.198.95", 38024, 12898, 0x5c2b394a, 0xd2d0a5de},
+    {"209.142.163.6", "38.27.205.30", 2217, 48228, 0xafc7327f, 0x82989176},
+    {"202.188.127.2", "153.39.163.191", 1303, 44251, 0x10e828a2, 0x5d1809c5},
+  };
+
+  RssPartitioner<Tuple5> tcp4(4);
+  RssPartitioner<uint64_t> ipv4(4);
+  for (const Vector &v: vectors) {
+    const uint32_t dst = parseTraceAddress(v.dst), src = parseTraceAddress(v.src);
+    const Tuple5 t(Addr_Port(dst, v.dstPort), Addr_Port(src, v.srcPort), 6);
+
+    uint8_t in[RssPartitioner<Tuple5>::kInputLength];
+    const uint32_t length = RssPartitioner<Tuple5>::input(t, in);
+    EXPECT(tcp4.hash(t) == v.tcp4, "the TCP/IPv4 hash of " << v.src << " to " << v.dst << " is " << hex
+                                   << tcp4.hash(t) << dec);
+    EXPECT(RssPartitioner<Tuple5>::toeplitz(in, length, RssPartitioner<Tuple5>::kDefaultKey) == v.tcp4,
+           "the bitwise TCP/IPv4 hash of " << v.src << " to " << v.dst << " differs");
+    EXPECT(ipv4.hash(uint64_t(src) << 32 | dst) == v.ipv4, "the IPv4 hash of " << v.src << " to " << v.dst << " is "
+                                                           << hex << ipv4.hash(uint64_t(src) << 32 | dst) << dec);
+  }
+
+  const uint64_t n = 100000;
+  const uint16_t shardCnt = 3;
+  WorkloadParams params;
+  params.keys = n;
+  params.queries = 1;
+  params.valueBits = VL;
+  Workload<Tuple5, Val> w = Workload<Tuple5, Val>::generate(params);
+
+  ControlPlaneLudo<Tuple5, Val, VL> cp(n);
+  cp.bulkLoad(w.keys, w.values, n);
+  cp.prepareToExport();
+  DataPlaneLudo<Tuple5, Val, VL> dp(cp);
+
+  ShardedLudo<Tuple5, Val, VL> sharded(n, shardCnt);
+  sharded.bulkLoad(w.keys, w.values, n, 2);
+
+  RssPartitioner<Tuple5> rss(shardCnt);
+  uint64_t wrong = 0, misplaced = 0;
+  for (uint64_t i = 0; i < n; ++i) {
+    const uint16_t shard = sharded.shardOf(w.keys[i]);
+    misplaced += shard != rss.shardOf(w.keys[i]);
+
+    Val single, v;
+    wrong += !dp.lookUp(w.keys[i], single) || !sharded.dataPlane(shard).lookUp(w.keys[i], v) || v != single;
+  }
+  EXPECT(misplaced == 0, misplaced << " keys are not in the shard of their RSS queue");
+  EXPECT(wrong == 0, wrong << " keys are looked up in their shard otherwise than in the single table");
+
+  // updates of different shards from several writers
+  vector<Val> updated(w.values, w.values + n);
+  for (uint64_t i = 0; i < n / 2; ++i) updated[i] = Val((updated[i] + 1) & ((1 << VL) - 1));
+  sharded.removeBatch(w.keys, n / 4, 2);
+  sharded.insertBatch(w.keys, updated.data(), n / 4, 2);
+  for (uint64_t i = n / 4; i < n / 2; ++i) sharded.updateMapping(w.keys[i], updated[i]);
+  EXPECT(mismatches(sharded, w.keys, updated.data(), n) == 0, "updated keys are looked up to other values");
+}
+
+// removing keys from the data planes by applyRemove and streaming other keys into the freed slots looks up as the
+// map of the keys, in DataPlaneLudo and DataPlaneLudoSketch, and as a data plane exported from scratch afterwards
+void testRemove() {
+  const uint64_t n = 100000, added = n / 3;
+  Workload<Key, Val> w = workload(n + added);
+  ControlPlaneLudo<Key, Val, VL> cp(n);
+  cp.bulkLoad(w.keys, w.values, n);
+  cp.prepareToExport();
+  DataPlaneLudo<Key, Val, VL> dp(cp);
+  DataPlaneLudoSketch<Key, Val, VL> sketch(cp);
+  const size_t buckets = cp.buckets_.size(), fallback = cp.fallbackEntries().size();
+
+  unordered_map<Key, Val> expected;
+  vector<uint32_t> freed;
+  for (uint64_t i = 0; i < n; ++i) {
+    if (i % 3) {
+      expected[w.keys[i]] = w.values[i];
+      continue;
+    }
+
+    uint32_t bs = uint32_t(-1);
+    if (!cp.remove(w.keys[i], &bs)) {
+      EXPECT(false, "key " << i << " is not removed");
+      continue;
+    }
+    if (bs == uint32_t(-1)) {
+      dp.fallback.remove(w.keys[i]);
+      sketch.fallback.remove(w.keys[i]);
+    } else {
+      dp.applyRemove(bs);
+      sketch.applyRemove(bs);
+      freed.push_back(bs);
+    }
+  }
+
+  uint64_t stale = 0;
+  for (uint32_t bs: freed) {
+    stale += dp.readSlot(bs >> 2, char(bs & 3)) != 0 || sketch.readSlot(bs >> 2, char(bs & 3)) != 0;
+  }
+  EXPECT(stale == 0, stale << " of the " << freed.size() << " freed slots are not cleared");
+
+  for (uint64_t i = n; i < n + added; ++i) {
+    vector<MPC_PathEntry> path;
+    const Key *result = cp.insert(w.keys[i], w.values[i], &path);
+    if (result == &w.keys[i]) {
+      dp.applyInsert(path, w.values[i]);
+      sketch.applyInsert(path, w.values[i]);
+    } else if (result == nullptr) {
+      dp.fallback.insert(w.keys[i], w.values[i]);
+      sketch.fallback.insert(w.keys[i], w.values[i]);
+    }
+    expected[w.keys[i]] = w.values[i];
+  }
+  EXPECT(cp.buckets_.size() == buckets,
+         "the table grew from " << buckets << " to " << cp.buckets_.size() << " buckets");
+  EXPECT(cp.fallbackEntries().size() <= fallback + added / 1000,
+         "the fallback table grew from " << fallback << " to " << cp.fallbackEntries().size() << " keys");
+  EXPECT(cp.entryCount == expected.size(), "the control plane counts " << cp.entryCount << " keys");
+
+  DataPlaneLudo<Key, Val, VL> fresh(cp);
+  uint64_t wrong = 0;
+  for (const auto &kv: expected) {
+    Val a, b, c;
+    wrong += !dp.lookUp(kv.first, a) || !sketch.lookUp(kv.first, b) || !fresh.lookUp(kv.first, c) ||
+             a != kv.second || b != kv.second || c != kv.second;
+  }
+  EXPECT(wrong == 0, wrong << " of " << expected.size() << " keys are looked up wrong after the removals");
+}
+
+// the flat stash holds what an unordered_map holds through inserts, replacements, removals and growths, including
+// long probe clusters, and the values of a data plane exported through a stash of mapped values are the mapped ones
+void testStash() {
+  FlatStash<Key, Val> stash;
+  unordered_map<Key, Val> expected;
+  const uint32_t universe = 5000;
+  uint64_t x = 0x9e3779b97f4a7c15ULL, wrong = 0;
+
+  for (uint32_t op = 0; op < 200000; ++op) {
+    x = mixIndex64(x);
+    const Key k = Key(x % universe) * 64;   // multiples of 64, to cluster in the low bits
+    const Val v = Val((x >> 32) & ((1 << VL) - 1));
+
+    if ((x >> 20) % 3) {
+      stash.insert(k, v);
+      expected[k] = v;
+    } else {
+      wrong += stash.remove(k) != (expected.erase(k) == 1);
+    }
+
+    if (op % 20000 == 0 || op + 1 == 200000) {
+      wrong += stash.size() != expected.size();
+      for (uint32_t u = 0; u < universe; ++u) {
+        const Key key = Key(u) * 64;
+        auto it = expected.find(key);
+        Val got;
+        const bool found = stash.lookUp(key, got);
+        wrong += found != (it != expected.end()) || stash.contains(key) != found || (found && got != it->second);
+      }
+    }
+  }
+  EXPECT(wrong == 0, wrong << " stash operations differ from the map");
+
+  uint64_t listed = 0;
+  stash.forEach([&](const Key &k, const Val &v) {
+    auto it = expected.find(k);
+    listed += it != expected.end() && it->second == v;
+  });
+  EXPECT(listed == expected.size(), "forEach lists " << listed << " of the " << expected.size() << " entries");
+
+  FlatStash<Key, Val> copy(stash), assigned;
+  assigned = stash;
+  uint64_t copied = 0;
+  for (const auto &kv: expected) {
+    Val a, b;
+    copied += copy.lookUp(kv.first, a) && assigned.lookUp(kv.first, b) && a == kv.second && b == kv.second;
+  }
+  EXPECT(copied == expected.size() && copy.size() == stash.size() && assigned.size() == stash.size(),
+         "a copy holds " << copied << " of the " << expected.size() << " entries");
+
+  // a gateway-like data plane, its values the ports its hosts are mapped to
+  const uint64_t n = 50000;
+  Workload<Key, Val> w = workload(n);
+  ControlPlaneLudo<Key, Val, VL> cp(n);
+  cp.bulkLoad(w.keys, w.values, n);
+  cp.prepareToExport();
+
+  FlatStash<Val, uint8_t> ports;
+  for (uint32_t v = 0; v < (1U << VL); ++v) ports.insert(Val(v), uint8_t(mixIndex32(v) % 8));
+  DataPlaneLudo<Key, uint8_t, 3> mapped(cp, ports);
+
+  wrong = 0;
+  for (uint64_t i = 0; i < n; ++i) {
+    uint8_t port, want = 0;
+    ports.lookUp(w.values[i], want);
+    wrong += !mapped.lookUp(w.keys[i], port) || port != want;
+  }
+  EXPECT(wrong == 0, wrong << " keys are looked up to other ports than their mapped values");
+}
+
+// the hashers of a compact key hash it as its two-word base does, a flip of any bit of the key changes its hash,
+// and the bucket, locator and digest hashes all derived from the base pick the slots the control plane placed the
+// keys in, one key at a time and in batches
+template<class K>
+void testCompactKey(const char *name) {
+  static_assert(CompactKey<K>::value, "a compact key type");
+  const uint64_t n = 50000;
+  FastHasher64<K> h64(0x123456789ULL);
+  Hasher64<K> hasher64(0xabcdefULL);
+  Hasher32<K> h32(0x5555);
+
+  uint64_t differ = 0, unchanged = 0;
+  for (uint64_t i = 0; i < 1000; ++i) {
+    const K k = workloadKey<K>(i, 5);
+    const KeyBase base = compactBase(k);
+    differ += h64(k) != h64.fromBase(base) || hasher64(k) != hasher64.fromBase(base) || h32(k) != h32.fromBase(base);
+
+    for (uint32_t bit = 0; bit < sizeof(K) * 8; ++bit) {
+      K flipped = k;
+      reinterpret_cast<uint8_t *>(&flipped)[bit / 8] ^= uint8_t(1 << (bit % 8));
+      unchanged += h64(flipped) == h64(k) || h32(flipped) == h32(k);
+    }
+  }
+  EXPECT(differ == 0, name << ": " << differ << " keys hash otherwise than their bases");
+  EXPECT(unchanged == 0, name << ": " << unchanged << " bit flips keep the hash");
+
+  vector<K> keys(n);
+  vector<Val> values(n);
+  for (uint64_t i = 0; i < n; ++i) {
+    keys[i] = workloadKey<K>(i, 7);
+    values[i] = Val(mixIndex32(uint32_t(i)) & ((1 << VL) - 1));
+  }
+  ControlPlaneLudo<K, Val, VL, 4> cp(n);
+  cp.bulkLoad(keys.data(), values.data(), n);
+  cp.prepareToExport();
+  DataPlaneLudo<K, Val, VL, 4> dp(cp);
+
+  vector<Val> batched(n);
+  unique_ptr<bool[]> found(new bool[n]);
+  dp.lookUpBatch(keys.data(), batched.data(), n, found.get());
+  uint64_t wrong = 0;
+  for (uint64_t i = 0; i < n; ++i) {
+    Val v;
+    uint32_t a, b, baseA, baseB;
+    dp.locator.getIndices(keys[i], a, b);
+    dp.locator.getIndices(compactBase(keys[i]), baseA, baseB);
+    wrong += !dp.lookUp(keys[i], v) || v != values[i] || !found[i] || batched[i] != values[i] || a != baseA ||
+             b != baseB;
+  }
+  EXPECT(wrong == 0, name << ": " << wrong << " keys are looked up wrong from their bases");
+}
+
+void testCompactKeys() {
+  testCompactKey<MAC>("MAC");
+  testCompactKey<Addr_Port>("Addr_Port");
+  testCompactKey<Tuple5>("Tuple5");
+}
+
+// arrangedSlot spreads the hashes evenly over the 4 slots under every seed, the seed the control plane found for
+// a bucket, whether in the seed field or in the overflow seeds, puts its keys in distinct slots, and the data plane
+// holds the value of every key in the slot the seed picks
+void testArrangement() {
+  uint64_t x = 1, skewed = 0;
+  for (uint32_t seed = 0; seed < 255; ++seed) {
+    uint32_t slots[4] = {0};
+    for (uint32_t i = 0; i < 4000; ++i) slots[arrangedSlot(x = mixIndex64(x), uint8_t(seed))]++;
+    for (uint32_t s: slots) skewed += s < 800 || s > 1200;
+  }
+  EXPECT(skewed == 0, skewed << " slots of a seed take far from a quarter of the hashes");
+
+  const uint64_t n = 200000;
+  Workload<Key, Val> w = workload(n);
+  ControlPlaneLudo<Key, Val, VL> cp(n);
+  cp.bulkLoad(w.keys, w.values, n);
+  cp.prepareToExport();
+  DataPlaneLudo<Key, Val, VL> dp(cp);
+
+  uint64_t clashes = 0, wrong = 0, overflowed = 0;
+  for (uint32_t b = 0; b < cp.buckets_.size(); ++b) {
+    const auto &bucket = cp.buckets_[b];
+    overflowed += bucket.seed >= MaxArrangementSeed;
+    wrong += dp.readSeed(b) != bucket.seed;
+
+    uint8_t taken = 0;
+    for (uint32_t s = 0; s < 4; ++s) {
+      if (!(bucket.occupiedMask & (1U << s))) continue;
+
+      const uint8_t slot = arrangedSlot(dp.h(bucket.keys[s]), bucket.seed);
+      clashes += (taken >> slot) & 1;
+      taken |= uint8_t(1 << slot);
+      wrong += (dp.readSlot(b, char(slot)) & ((1 << VL) - 1)) != (bucket.values[s] & ((1 << VL) - 1));
+    }
+  }
+  EXPECT(clashes == 0, clashes << " keys share a slot under the seed of their bucket");
+  EXPECT(wrong == 0, wrong << " seeds or slots of the data plane differ from the control plane");
+  EXPECT(overflowed > 0, "no seed is in overflow, the test does not cover it");
+  EXPECT(mismatches(dp, w.keys, w.values, n) == 0, "keys are looked up to other values");
+}
+
+// A data plane of a padded bucket layout, with digests, follows the removals, updates and inserts of the control plane
+// as the packed one does, lookUp and lookUpBatch agreeing, and so does a data plane of it exported afterwards. No
+// bucket straddles a cache line.
+template<class Layout>
+void testLayout(const string &name) {
+  static const uint8_t DL = 4;
+  typedef DataPlaneLudo<Key, Val, VL, DL, Layout> DP;
+  const uint64_t n = 100000, added = n / 3;
+  Workload<Key, Val> w = workload(n + added, 0x5eed5eed5eed5eedULL);
+  ControlPlaneLudo<Key, Val, VL, DL> cp(n);
+  cp.bulkLoad(w.keys, w.values, n);
+  cp.prepareToExport();
+  DP dp(cp);
+
+  const uint32_t bits = LocatorSeedLength + 4 * (VL + DL);
+  uint64_t straddling = 0;
+  for (uint32_t b = 0; b < dp.num_buckets_; ++b) {
+    const uint64_t offset = Layout::template offset<bits>(b);
+    straddling += offset / 512 != (offset + bits - 1) / 512;
+  }
+  EXPECT(straddling == 0, name << ": " << straddling << " buckets straddle a cache line");
+
+  unordered_map<Key, Val> expected;
+  for (uint64_t i = 0; i < n; ++i) {
+    const Key &k = w.keys[i];
+    if (i % 3 == 0) {
+      uint32_t bs = uint32_t(-1);
+      if (!cp.remove(k, &bs)) {
+        EXPECT(false, name << ": key " << i << " is not removed");
+        continue;
+      }
+      if (bs == uint32_t(-1)) {
+        dp.fallback.remove(k);
+      } else {
+        dp.applyRemove(bs);
+      }
+    } else if (i % 3 == 1) {
+      const Val v = Val(~w.values[i]) & ((1 << VL) - 1);
+      uint32_t bs = cp.updateMapping(k, v);
+      if (bs != uint32_t(-1)) {
+        dp.applyUpdate(bs, v);
+      } else if (cp.updateFallback(k, v)) {
+        dp.fallback.insert(k, v);
+      }
+      expected[k] = v;
+    } else {
+      expected[k] = w.values[i];
+    }
+  }
+
+  for (uint64_t i = n; i < n + added; ++i) {
+    vector<MPC_PathEntry> path;
+    const Key *result = cp.insert(w.keys[i], w.values[i], &path);
+    if (result == &w.keys[i]) {
+      dp.applyInsert(path, dp.withDigest(w.keys[i], w.values[i]));
+    } else if (result == nullptr) {
+      dp.fallback.insert(w.keys[i], w.values[i]);
+    }
+    expected[w.keys[i]] = w.values[i];
+  }
+
+  vector<Key> keys;
+  vector<Val> values;
+  for (const auto &kv: expected) {
+    keys.push_back(kv.first);
+    values.push_back(kv.second);
+  }
+
+  DP fresh(cp);
+  vector<Val> out(keys.size());
+  dp.lookUpBatch(keys.data(), out.data(), keys.size());
+  uint64_t batched = 0;
+  for (uint64_t i = 0; i < keys.size(); ++i) batched += out[i] != values[i];
+
+  EXPECT(mismatches(dp, keys.data(), values.data(), keys.size()) == 0, name << ": keys are lost by the updates");
+  EXPECT(batched == 0, name << ": " << batched << " keys are looked up wrong in batches");
+  EXPECT(mismatches(fresh, keys.data(), values.data(), keys.size()) == 0,
+         name << ": keys are lost by the new export");
+}
+
+void testLayouts() {
+  testLayout<PowerOfTwoBucketLayout>("power of two");
+  testLayout<CacheLineBucketLayout>("cache line");
+}
+
+// A fused table with and without digests looks up the fields of every key as inserted, and rejects most absent keys
+// with them. Lookups counting concurrently, while the writer updates another field of the same slots, lose no count,
+// the counter saturates, and the counts collected into the control plane survive a new export. Keys streamed in
+// afterwards carry their digests.
+template<uint8_t DL>
+void testFused() {
+  typedef SlotFields<8, 4, 12> Fields;   // a next hop, an ACL class and a counter
+  typedef FusedControlPlaneLudo<Key, Fields, DL> CP;
+  typedef FusedDataPlaneLudo<Key, Fields, DL> DP;
+  typedef typename Fields::Values Values;
+  const uint64_t n = 100000, counted = 20000, absent = 50000;
+  const uint32_t threads = 4, rounds = 3;
+
+  Workload<Key, Val> w = workload(n + absent, 0xfeedfacecafebeefULL);
+  auto fieldsOf = [](uint64_t i) { return Values{uint32_t(i & 0xff), uint32_t(i % 16), 0}; };
+
+  CP cp(n);
+  for (uint64_t i = 0; i < n; ++i) cp.insert(w.keys[i], fieldsOf(i));
+  cp.prepareToExport();
+  DP dp(cp);
+
+  uint64_t wrong = 0, accepted = 0;
+  for (uint64_t i = 0; i < n; ++i) {
+    Values v;
+    wrong += !dp.lookUp(w.keys[i], v) || v != fieldsOf(i);
+  }
+  for (uint64_t i = n; i < n + absent; ++i) {
+    Values v;
+    accepted += dp.lookUp(w.keys[i], v);
+  }
+  EXPECT(wrong == 0, "DL " << int(DL) << ": " << wrong << " keys are looked up to other fields");
+  if (DL > 0) {
+    EXPECT(accepted < absent * 2 / (1 << DL),
+           "DL " << int(DL) << ": " << accepted << " of " << absent << " absent keys are accepted");
+  }
+
+  vector<thread> counters;
+  for (uint32_t t = 0; t < threads; ++t) {
+    counters.emplace_back([&]() {
+      for (uint32_t r = 0; r < rounds; ++r) {
+        for (uint64_t i = 0; i < counted; ++i) {
+          Values v;
+          dp.template lookUpAndCount<2>(w.keys[i], v);
+        }
+      }
+    });
+  }
+  for (uint64_t i = 0; i < n; ++i) {
+    uint32_t bs = uint32_t(-1);
+    if (!cp.template updateField<1>(w.keys[i], (i + 1) % 16, &bs)) {
+      EXPECT(false, "DL " << int(DL) << ": key " << i << " is not updated");
+      continue;
+    }
+    if (bs == uint32_t(-1)) {
+      dp.template applyFallbackFieldUpdate<1>(w.keys[i], (i + 1) % 16);
+    } else {
+      dp.template applyFieldUpdate<1>(bs, (i + 1) % 16);
+    }
+  }
+  for (thread &t: counters) t.join();
+
+  Values saturated;
+  for (uint32_t i = 0; i < 5000; ++i) dp.template lookUpAndCount<2>(w.keys[counted], saturated, 1);
+  EXPECT(saturated[2] == 4095, "DL " << int(DL) << ": the counter stops at " << saturated[2]);
+
+  auto expected = [&](uint64_t i) {
+    return Values{uint32_t(i & 0xff), uint32_t((i + 1) % 16),
+                  i < counted ? threads * rounds : i == counted ? 4095U : 0U};
+  };
+  wrong = 0;
+  for (uint64_t i = 0; i < n; ++i) {
+    Values v;
+    wrong += !dp.lookUp(w.keys[i], v) || v != expected(i);
+  }
+  EXPECT(wrong == 0, "DL " << int(DL) << ": " << wrong << " keys lost a count or a field update");
+
+  cp.template collectField<2>(dp);
+  DP exported(cp);
+  wrong = 0;
+  for (uint64_t i = 0; i < n; ++i) {
+    Values v;
+    wrong += !exported.lookUp(w.keys[i], v) || v != expected(i);
+  }
+  EXPECT(wrong == 0, "DL " << int(DL) << ": " << wrong << " keys lost their counts in the new export");
+
+  wrong = 0;
+  for (uint64_t i = n; i < n + absent / 10; ++i) {
+    vector<MPC_PathEntry> path;
+    const Key *result = cp.insert(w.keys[i], fieldsOf(i), &path);
+    if (result == &w.keys[i]) {
+      exported.applyInsert(path, w.keys[i], fieldsOf(i));
+    } else if (result == nullptr) {
+      exported.applyFallbackInsert(w.keys[i], fieldsOf(i));
+    }
+  }
+  for (uint64_t i = 0; i < n + absent / 10; ++i) {
+    Values v;
+    wrong += !exported.lookUp(w.keys[i], v) || v != (i < n ? expected(i) : fieldsOf(i));
+  }
+  EXPECT(wrong == 0, "DL " << int(DL) << ": " << wrong << " keys are looked up wrong after the inserts");
+}
+
+void testFusedTables() {
+  testFused<0>();
+  testFused<4>();
+}
+
+int main(int argc, char **argv) {
+  commonInit();
+
+  const vector<pair<string, function<void()>>> tests = {
+    {"snapshot", testSnapshot},
+    {"locator cycles", testLocatorCycles},
+    {"delta stream", testDeltaStream},
+    {"growth", testGrowth},
+    {"reseed", testReseed},
+    {"sketch estimate", testSketchEstimate},
+    {"threaded export", testThreadedExports},
+    {"link cost", testLinkCost},
+    {"trace", testTrace},
+    {"rss", testRss},
+    {"remove", testRemove},
+    {"stash", testStash},
+    {"compact keys", testCompactKeys},
+    {"arrangement", testArrangement},
+    {"layouts", testLayouts},
+    {"fused", testFusedTables},
+  };
+
+  int failed = 0;
+  for (const auto &test: tests) {
+    if (argc > 1 && test.first != argv[1]) continue;
+
+    const uint64_t before = failures;
+    test.second();
+    cout << (failures == before ? "ok      " : "FAILED  ") << test.first << endl;
+    failed += failures != before;
+  }
+
+  return failed;
+}
@@ -1,22 +1,35 @@
 #include <Sketch/ludo_sketch.h>
 #include "common.h"
 #include "Ludo/ludo.h"
+#include "Ludo/ludo_sharded.h"
+#include "latency.h"
+#include "input/workload.h"
 
 int version = 12;
 int cores = min(20U, std::thread::hardware_concurrency());
 
 typedef uint32_t Key;
 const uint32_t lookupCnt = 1 << 25;
+const uint32_t lookupSampleEvery = 16;   // one lookup in 16 is timed, the others only count for the throughput
+
+// the latency histograms and throughputs of the phases of a test, saved next to its log
+json latencyReport;
+
+// the histograms of a parallel lookup phase, with its throughput over all threads
+void reportLookups(const string &phase, const LatencyRecorder &latency, const Clocker &clocker, uint64_t lookups) {
+  json j = latency.toJson();
+  j["mops"] = lookups * 1000.0 / max<uint64_t>(1, clocker.elapsedNs());
+  latencyReport[phase] = j;
+}
 
 template<int VL, class Val>
-void testLudoAndSketch(vector<Key> &keys, vector<Val> &values, uint64_t nn, vector<Key> &zipfianKeys, int upToThreads) {
+void testLudoAndSketch(const Key *keys, const Val *values, uint64_t nn, const Key *uniformKeys, const Key *zipfianKeys,
+                       int upToThreads) {
   Clocker construction("Ludo construction");
   
   Clocker cpBuild("CP build");
   ControlPlaneLudo<Key, Val, VL> cp(nn);
-  for (int i = 0; i < nn; ++i) {
-    cp.insert(keys[i], values[i]);
-  }
+  cp.bulkLoad(keys, values, nn);
   cpBuild.stop();
   
   Clocker cpPrepare("CP prepare for DP");
@@ -27,6 +40,45 @@ void testLudoAndSketch(vector<Key> &keys, vector<Val> &values, uint64_t nn, vect
   Clocker exp("Ludo export");
   DataPlaneLudo<Key, Val, VL> dp(cp);
   exp.stop();
+  cout << "Ludo export peak RSS: " << peakRssKiB() / 1024 << " MiB" << endl;
+  cout << "Ludo stats: " << json{{"control plane", cp.stats()}, {"data plane", dp.stats()}}.dump() << endl;
+  
+  // remove a slice of the keys and insert them back, timing both halves of every insertion
+  {
+    const uint32_t updateCnt = min<uint64_t>(nn / 100, 1 << 16);
+    LatencyRecorder cpInsert, dpInsert;
+    Clocker update("Ludo remove and insert back " + to_string(updateCnt) + " keys");
+    
+    for (uint32_t i = 0; i < updateCnt; ++i) {
+      uint32_t bs;
+      if (!cp.remove(keys[i], &bs)) continue;
+      
+      if (bs == uint32_t(-1)) {
+        dp.fallback.remove(keys[i]);
+      } else {
+        dp.applyRemove(bs);
+      }
+    }
+    
+    for (uint32_t i = 0; i < updateCnt; ++i) {
+      vector<MPC_PathEntry> path;
+      const Key *result;
+      cpInsert.time(0, i, [&] { result = cp.insert(keys[i], values[i], &path); });
+      
+      if (result == &keys[i]) {
+        dpInsert.time(0, i, [&] { dp.applyInsert(path, values[i]); });
+      } else if (result == nullptr) {
+        dp.fallback.insert(keys[i], values[i]);
+      }
+    }
+    
+    latencyReport["Ludo CP insert"] = cpInsert.toJson();
+    latencyReport["Ludo DP applyInsert"] = dpInsert.toJson();
+  }
+  
+  // on a NUMA machine, a copy of the data plane per node, which the lookup threads of that node read
+  vector<DataPlaneLudo<Key, Val, VL>> replicas;
+  if (MemoryPolicy::nodeCount() > 1) replicas = replicatePerNode(dp);
   
   Hasher32<Key> h[3];
   for (int i = 0; i < 3; ++i) h[i].setSeed(rand());
@@ -41,25 +93,29 @@ void testLudoAndSketch(vector<Key> &keys, vector<Val> &values, uint64_t nn, vect
     uint32_t start[threadCnt];
     
     for (int i = 0; i < threadCnt; ++i) {
-      start[i] = i / threadCnt * zipfianKeys.size();
+      start[i] = i / threadCnt * lookupCnt;
     }
     
     for (Distribution distribution: {uniform, exponential}) {
       ostringstream oss;
       oss << "Ludo parallel lookup " << threadCnt << " threads " << lookupCnt << " keys "
           << (distribution == exponential ? "Zipfian" : "uniform");
+      LatencyRecorder latency(threadCnt, lookupSampleEvery);
       Clocker plookup(oss.str());
       
       for (int i = 0; i < threadCnt; ++i) {
-        threads[i] = std::thread([](DataPlaneLudo<Key, Val, VL> *dp, uint32_t start,
-                                    const vector<Key> *zipfianKeys, uint32_t lookupCnt, vector<uint16_t> *a, Hasher32<Key> *h) {
+        threads[i] = std::thread([](DataPlaneLudo<Key, Val, VL> *dp, vector<DataPlaneLudo<Key, Val, VL>> *replicas,
+                                    uint32_t start, const Key *lookupKeys, uint32_t lookupCnt, vector<uint16_t> *a,
+                                    Hasher32<Key> *h, LatencyRecorder *latency, int t) {
           int stupid = 0;
+          uint64_t n = 0;
+          if (!replicas->empty()) dp = &(*replicas)[MemoryPolicy::currentNode() % replicas->size()];
           
           int ii = start;
           do {
-            const Key &k = zipfianKeys->at(ii);
+            const Key &k = lookupKeys[ii];
             Val val;
-            dp->lookUp(k, val);
+            latency->time(t, n++, [&] { dp->lookUp(k, val); });
             stupid += val;
             
             for (int i = 0; i < 3; ++i) {
@@ -72,25 +128,28 @@ void testLudoAndSketch(vector<Key> &keys, vector<Val> &values, uint64_t nn, vect
             ++ii;
           } while (ii != start);
           printf("%d\b", stupid & 7);
-        }, &dp, start[i], distribution == exponential ? &zipfianKeys : &keys, lookupCnt, a, h);
+        }, &dp, &replicas, start[i], distribution == exponential ? zipfianKeys : uniformKeys, lookupCnt, a, h,
+                                 &latency, i);
       }
       
       for (int i = 0; i < threadCnt; ++i) {
         threads[i].join();
       }
+      
+      plookup.stop();
+      reportLookups(oss.str(), latency, plookup, uint64_t(threadCnt) * lookupCnt);
     }
   }
 }
 
 template<int VL, class Val>
-void testLudoSketch(vector<Key> &keys, vector<Val> &values, uint64_t nn, vector<Key> &zipfianKeys, uint upToThreads) {
+void testLudoSketch(const Key *keys, const Val *values, uint64_t nn, const Key *uniformKeys, const Key *zipfianKeys,
+                    uint upToThreads) {
   Clocker construction("LudoSketch construction");
   
   Clocker cpBuild("CP build");
   ControlPlaneLudo<Key, Val, VL> cp(nn);
-  for (int i = 0; i < nn; ++i) {
-    cp.insert(keys[i], values[i]);
-  }
+  cp.bulkLoad(keys, values, nn);
   cpBuild.stop();
   
   Clocker cpPrepare("CP prepare for DP");
@@ -101,44 +160,132 @@ void testLudoSketch(vector<Key> &keys, vector<Val> &values, uint64_t nn, vector<
   Clocker exp("LudoSketch export");
   DataPlaneLudoSketch<Key, Val, VL> dp(cp);
   exp.stop();
+  cout << "LudoSketch export peak RSS: " << peakRssKiB() / 1024 << " MiB" << endl;
   
+  // every thread looks up and counts in its own shard the keys RSS delivers to its queue, as many lookups as the
+  // single table serves per thread
   for (int threadCnt = 1; threadCnt <= upToThreads; ++threadCnt) {
-    thread threads[threadCnt];
-    uint32_t start[threadCnt];
+    Clocker shardBuild("LudoSketch build " + to_string(threadCnt) + " shards");
+    ShardedLudo<Key, Val, VL, true> sharded(nn, uint16_t(threadCnt));
+    sharded.bulkLoad(keys, values, nn, threadCnt);
+    shardBuild.stop();
     
-    for (int i = 0; i < threadCnt; ++i) {
-      start[i] = i / threadCnt * zipfianKeys.size();
-    }
+    thread threads[threadCnt];
     
     for (Distribution distribution: {uniform, exponential}) {
+      const Key *lookupKeys = distribution == exponential ? zipfianKeys : uniformKeys;
+      vector<vector<Key>> shardKeys(threadCnt);
+      for (uint32_t i = 0; i < lookupCnt; ++i) shardKeys[sharded.shardOf(lookupKeys[i])].push_back(lookupKeys[i]);
+      
       ostringstream oss;
       oss << "LudoSketch parallel lookup " << threadCnt << " threads " << lookupCnt << " keys "
           << (distribution == exponential ? "Zipfian" : "uniform");
+      LatencyRecorder latency(threadCnt, lookupSampleEvery);
       Clocker plookup(oss.str());
       
       for (int i = 0; i < threadCnt; ++i) {
-        threads[i] = std::thread([](DataPlaneLudoSketch<Key, Val, VL> *dp, uint32_t start,
-                                    const vector<Key> *zipfianKeys, uint32_t lookupCnt) {
+        threads[i] = std::thread([](DataPlaneLudoSketch<Key, Val, VL> *dp, const vector<Key> *lookupKeys,
+                                    uint32_t lookupCnt, LatencyRecorder *latency, int t) {
+          if (lookupKeys->empty()) return;
           int stupid = 0;
           
-          int ii = start;
-          do {
-            const Key &k = zipfianKeys->at(ii);
+          for (uint32_t n = 0, ii = 0; n < lookupCnt; ++n) {
+            const Key &k = (*lookupKeys)[ii];
             Val val;
-            dp->lookUp(k, val);
+            latency->time(t, n, [&] { dp->lookUpAndCount(k, val); });
             stupid += val;
             
-            if (ii == lookupCnt - 1) ii = -1;
-            ++ii;
-          } while (ii != start);
+            if (++ii == lookupKeys->size()) ii = 0;
+          }
           printf("%d\b", stupid & 7);
-        }, &dp, start[i], distribution == exponential ? &zipfianKeys : &keys, lookupCnt);
+        }, &sharded.dataPlane(i), &shardKeys[i], lookupCnt, &latency, i);
       }
       
       for (int i = 0; i < threadCnt; ++i) {
         threads[i].join();
       }
+      
+      plookup.stop();
+      reportLookups(oss.str(), latency, plookup, uint64_t(threadCnt) * lookupCnt);
+    }
+  }
+  
+  // the single table counts a pass of the Zipfian keys for the reseed below
+  {
+    Clocker count("LudoSketch count " + to_string(lookupCnt) + " keys Zipfian");
+    int stupid = 0;
+    for (uint32_t i = 0; i < lookupCnt; ++i) {
+      Val val;
+      dp.lookUpAndCount(zipfianKeys[i], val);
+      stupid += val;
+    }
+    printf("%d\b", stupid & 7);
+  }
+  
+  // relieve the overflowed buckets the lookups above counted the most, so that their lookups skip the overflow seeds
+  {
+    const uint32_t hotCnt = 1024;
+    LatencyRecorder cpReseed, dpReseed;
+    Clocker reseed("LudoSketch reseed " + to_string(hotCnt) + " hot overflowed buckets");
+    uint32_t relieved = 0;
+    
+    for (uint32_t bid: dp.hotOverflowedBuckets(hotCnt)) {
+      vector<MPC_PathEntry> path;
+      bool moved;
+      cpReseed.time(0, relieved, [&] { moved = cp.reseedOverflowed(bid, path); });
+      if (!moved) continue;
+      
+      dpReseed.time(0, relieved, [&] { dp.applyInsert(path, 0); });
+      ++relieved;
+    }
+    reseed.stop();
+    
+    cout << "LudoSketch relieved " << relieved << " hot overflowed buckets, " << cp.overflowedBuckets().size()
+         << " overflowed left" << endl;
+    latencyReport["LudoSketch CP reseedOverflowed"] = cpReseed.toJson();
+    latencyReport["LudoSketch DP applyInsert reseed"] = dpReseed.toJson();
+  }
+}
+
+template<int VL, class Val>
+void testLudoBatch(const Key *keys, const Val *values, uint64_t nn, const Key *uniformKeys, const Key *zipfianKeys) {
+  ControlPlaneLudo<Key, Val, VL> cp(nn);
+  for (int i = 0; i < nn; ++i) {
+    cp.insert(keys[i], values[i]);
+  }
+  cp.prepareToExport();
+  DataPlaneLudo<Key, Val, VL> dp(cp);
+  
+  for (Distribution distribution: {uniform, exponential}) {
+    const Key *lookupKeys = distribution == exponential ? zipfianKeys : uniformKeys;
+    const char *dist = distribution == exponential ? "Zipfian" : "uniform";
+    int stupid = 0;
+    
+    {
+      ostringstream oss;
+      oss << "Ludo per-key lookup " << lookupCnt << " keys " << dist;
+      Clocker lookup(oss.str());
+      
+      for (uint32_t i = 0; i < lookupCnt; ++i) {
+        Val val;
+        dp.lookUp(lookupKeys[i], val);
+        stupid += val;
+      }
     }
+    
+    {
+      ostringstream oss;
+      oss << "Ludo batched lookup " << lookupCnt << " keys " << dist;
+      Clocker lookup(oss.str());
+      
+      const uint32_t batch = 32;
+      Val val[batch];
+      for (uint32_t i = 0; i < lookupCnt; i += batch) {
+        dp.lookUpBatch(&lookupKeys[i], val, min(batch, lookupCnt - i));
+        stupid += val[0];
+      }
+    }
+    printf("%d\b", stupid & 7);
   }
 }
 
@@ -166,52 +313,36 @@ void test() {
         
         TeeOstream tos(logName);
         Clocker clocker(oss.str(), &tos);
+        latencyReport = json::object();
         
-        LFSRGen<Key> keyGen(0x1234567801234567ULL, max((uint64_t) lookupCnt, nn), 0);
-        LFSRGen<Val> valueGen(0x1234567887654321ULL, nn, 0);
-        
-        vector<Key> keys(max((uint64_t) lookupCnt, nn));
-        vector<Val> values(nn);
-        
-        for (uint64_t i = 0; i < nn; i++) {
-          keyGen.gen(&keys[i]);
-          Val v;
-          valueGen.gen(&v);
-          values[i] = v & (uint(-1) >> (32 - VL));
-        }
-        
-        for (uint64_t i = nn; i < max((uint64_t) lookupCnt, nn); i++) {
-          keys[i] = keys[i % nn];
-        }
+        WorkloadParams params;
+        params.keys = nn;
+        params.queries = lookupCnt;
+        params.valueBits = VL;
+        Workload<Key, Val> w = Workload<Key, Val>::cached(params);
         
-        vector<Key> zipfianKeys;
-        zipfianKeys.reserve(lookupCnt);
-        
-        for (int i = 0; i < lookupCnt; ++i) {
-          InputBase::distribution = exponential;
-          InputBase::bound = nn;
-          
-          uint seed = Hasher32<string>()(logName);
-          InputBase::setSeed(seed);
-          
-          uint32_t idx = InputBase::rand();
-          zipfianKeys.push_back(keys[idx]);
+        try {
+          testLudoSketch<VL, Val>(w.keys, w.values, nn, w.uniform, w.zipfian, repeat <= 1 ? cores : 1);
+        } catch (exception &e) {
+          cout << e.what() << endl;
+          break;
         }
         
-        
         try {
-          testLudoSketch<VL, Val>(keys, values, nn, zipfianKeys, repeat <= 1 ? cores : 1);
+          testLudoAndSketch<VL, Val>(w.keys, w.values, nn, w.uniform, w.zipfian, repeat <= 1 ? cores : 1);
         } catch (exception &e) {
           cout << e.what() << endl;
           break;
         }
         
         try {
-          testLudoAndSketch<VL, Val>(keys, values, nn, zipfianKeys, repeat <= 1 ? cores : 1);
+          testLudoBatch<VL, Val>(w.keys, w.values, nn, w.uniform, w.zipfian);
         } catch (exception &e) {
           cout << e.what() << endl;
           break;
         }
+        
+        ofstream("../dist/logs/" + oss.str() + ".latency.json") << latencyReport.dump(2) << endl;
         return;
       } catch (exception &e) {
         cerr << e.what() << endl;
@@ -23,11 +23,6 @@ public:
     }
   };
 
-  struct ShortestPathCell {
-    double cost;
-    uint16_t nextHop;
-  };
-
   struct AdjacencyMatrixCell {
     uint16_t to;
     double cost;
@@ -41,47 +36,53 @@ public:
     }
   };
 
+  /// the cost of a path to an unreachable node, and of a link that is down
+  static constexpr float kUnreachable = 3.40282347e+38F;
+
   vector<Node> nodes;
   vector<vector<AdjacencyMatrixCell>> adjacencyList;
-  vector<vector<ShortestPathCell>> shortestPathTo;       // [i][j] is the nextHop and cost of j to i
 
   /// After the construction, the graph is a complete graph
   explicit Graph(size_t capacity) {
     nodes.reserve(capacity);
-    shortestPathTo.reserve(capacity);
 
     for (uint16_t i = 0; i < capacity; ++i) {
       adjacencyList.push_back({{i, 0}});
-
-      vector<ShortestPathCell> v2(capacity);
-      for (uint16_t j = 0; j < capacity; ++j) {
-        v2[j] = {i == j ? 0.0 : 	3.40282347e+38F, i};
-      }
-      shortestPathTo.push_back(v2);
     }
   }
 
+  virtual ~Graph() = default;
+
   /// must be called in the order of 0, 1, 2, ...
   /// \param n
   void addVertex(Node n) {
     nodes.push_back(n);
   }
 
-  /// multiple edges between same two nodes are not checked
+  /// multiple edges between same two nodes are not checked. The adjacency lists stay sorted, so that a port is the
+  /// index of its link in the list as soon as the link is added
   /// \param e
   virtual void addEdge(Edge e) {
-    adjacencyList[e.from].push_back({e.to, e.cost});
-    shortestPathTo[e.to][e.from].cost = e.cost;
-
-    adjacencyList[e.to].push_back({e.from, e.cost});
-    shortestPathTo[e.from][e.to].cost = e.cost;
+    insertSorted(adjacencyList[e.from], {e.to, e.cost});
+    insertSorted(adjacencyList[e.to], {e.from, e.cost});
 
 #ifdef FULL_DEBUG
     assert(checkIntegrity());
 #endif
   }
 
-  /// calculate shortest paths for all hosts
+  /// the next hop from src on a shortest path to dst, dst itself if there is no path
+  inline uint16_t nextHopTo(uint16_t dst, uint16_t src) const {
+    return nextHops[size_t(dst) * order + src];
+  }
+
+  /// the cost of a shortest path from src to dst, kUnreachable if there is none
+  inline float costTo(uint16_t dst, uint16_t src) const {
+    return costs[size_t(dst) * order + src];
+  }
+
+  /// calculate shortest paths for all hosts: a Dijkstra from every destination, the destinations spread over the
+  /// threads. The adjacency lists are sorted first, in case they were filled other than by addEdge.
   virtual void calculateShortestPaths() {
     Clocker sort("sort adjacency list");
 
@@ -91,18 +92,141 @@ public:
     sort.stop();
 
     Clocker path("shortest path");
-    for (uint16_t k = 0; k < nodes.size(); ++k) {
-      for (uint16_t i = 0; i < nodes.size(); ++i) {
-        for (uint16_t j = 0; j < nodes.size(); ++j) {
-          if (k == i || k == j) continue;
-          if (shortestPathTo[j][i].cost > shortestPathTo[k][i].cost + shortestPathTo[j][k].cost) {
-            shortestPathTo[j][i] = {shortestPathTo[k][i].cost + shortestPathTo[j][k].cost,
-                                    shortestPathTo[k][i].nextHop};
+    resizePaths();
+
+    vector<uint16_t> all(order);
+    for (uint32_t dst = 0; dst < order; ++dst) all[dst] = uint16_t(dst);
+    forDestinations(all, [&](uint16_t dst, vector<double> &distance, vector<pair<double, uint16_t>> &heap) {
+      dijkstra(dst, distance, heap);
+    });
+    path.stop();
+  }
+
+  /// Change the cost of the link between from and to, add it if it does not exist, or take it down with a cost of
+  /// kUnreachable, then update the shortest paths of the destinations this may change. A link that is down stays in
+  /// the adjacency lists, so the ports of the others stay the same; an added link shifts the ports after it.
+  void setEdgeCost(uint16_t from, uint16_t to, double cost) {
+    double old = kUnreachable;
+    for (uint16_t a: {from, to}) {
+      uint16_t b = a == from ? to : from;
+      vector<AdjacencyMatrixCell> &list = adjacencyList[a];
+      assert(std::is_sorted(list.begin(), list.end()));
+
+      auto it = std::lower_bound(list.begin(), list.end(), AdjacencyMatrixCell{b, 0});
+      if (it != list.end() && it->to == b) {
+        old = it->cost;
+        it->cost = cost;
+      } else {
+        list.insert(it, {b, cost});
+      }
+    }
+
+    // a cheaper link shortens the paths to a destination only from the nodes it now reaches cheaper, so the new
+    // paths spread from the link. A dearer link only changes the destinations whose shortest path tree uses it; the
+    // paths to the others keep their costs and are still the shortest
+    vector<uint16_t> affected;
+    for (uint32_t dst = 0; dst < order; ++dst) {
+      bool changed;
+      if (cost < old) {
+        float cf = costTo(uint16_t(dst), from), ct = costTo(uint16_t(dst), to);
+        changed = cf + cost < ct || ct + cost < cf;
+      } else {
+        changed = nextHopTo(uint16_t(dst), from) == to || nextHopTo(uint16_t(dst), to) == from;
+      }
+      if (changed) affected.push_back(uint16_t(dst));
+    }
+
+    if (cost < old) {
+      forDestinations(affected, [&](uint16_t dst, vector<double> &distance, vector<pair<double, uint16_t>> &heap) {
+        const float *row = &costs[size_t(dst) * order];
+        for (uint32_t j = 0; j < order; ++j) distance[j] = row[j];
+
+        heap.clear();
+        for (uint16_t a: {from, to}) {
+          uint16_t b = a == from ? to : from;
+          if (distance[a] + cost < distance[b]) {
+            distance[b] = distance[a] + cost;
+            nextHops[size_t(dst) * order + b] = a;
+            heap.emplace_back(distance[b], b);
           }
         }
+        relax(dst, distance, heap);
+      });
+    } else {
+      forDestinations(affected, [&](uint16_t dst, vector<double> &distance, vector<pair<double, uint16_t>> &heap) {
+        dijkstra(dst, distance, heap);
+      });
+    }
+  }
+
+protected:
+  static void insertSorted(vector<AdjacencyMatrixCell> &list, AdjacencyMatrixCell cell) {
+    list.insert(std::upper_bound(list.begin(), list.end(), cell), cell);
+  }
+
+  uint32_t order = 0;          // the rows and the columns of the path matrices
+  vector<uint16_t> nextHops;   // [i * order + j] is the nextHop of j to i
+  vector<float> costs;         // [i * order + j] is the cost of j to i
+
+  void resizePaths() {
+    order = uint32_t(adjacencyList.size());
+    nextHops.assign(size_t(order) * order, 0);
+    costs.assign(size_t(order) * order, kUnreachable);
+  }
+
+  /// run f(dst, distance, heap) for every dst in parallel, distance and heap the scratch space of a thread
+  template<class F>
+  void forDestinations(const vector<uint16_t> &dsts, F f) {
+    const uint32_t threads = uint32_t(min<size_t>(dsts.size() / 16 + 1, std::thread::hardware_concurrency()));
+
+    parallelFor(threads, [&](uint32_t t) {
+      vector<double> distance(order);
+      vector<pair<double, uint16_t>> heap;
+
+      for (size_t i = t; i < dsts.size(); i += threads) f(dsts[i], distance, heap);
+    });
+  }
+
+  /// the shortest path tree to dst, whose parent links are the next hops as the links are undirected
+  void dijkstra(uint16_t dst, vector<double> &distance, vector<pair<double, uint16_t>> &heap) {
+    uint16_t *hops = &nextHops[size_t(dst) * order];
+    std::fill(distance.begin(), distance.end(), double(kUnreachable));
+    for (uint32_t j = 0; j < order; ++j) hops[j] = dst;
+
+    heap.clear();
+    distance[dst] = 0;
+    heap.emplace_back(0, dst);
+    relax(dst, distance, heap);
+  }
+
+  /// Dijkstra on the row of dst from the nodes in heap, then store the costs of the row
+  void relax(uint16_t dst, vector<double> &distance, vector<pair<double, uint16_t>> &heap) {
+    uint16_t *hops = &nextHops[size_t(dst) * order];
+    auto later = [](const pair<double, uint16_t> &a, const pair<double, uint16_t> &b) { return a.first > b.first; };
+    std::make_heap(heap.begin(), heap.end(), later);
+
+    while (!heap.empty()) {
+      std::pop_heap(heap.begin(), heap.end(), later);
+      double d = heap.back().first;
+      uint16_t u = heap.back().second;
+      heap.pop_back();
+      if (d > distance[u]) continue;   // a stale entry of a node reached cheaper since
+
+      for (const AdjacencyMatrixCell &cell: adjacencyList[u]) {
+        if (cell.to == u || cell.cost >= kUnreachable) continue;
+
+        double through = d + cell.cost;
+        if (through < distance[cell.to]) {
+          distance[cell.to] = through;
+          hops[cell.to] = u;
+          heap.emplace_back(through, cell.to);
+          std::push_heap(heap.begin(), heap.end(), later);
+        }
       }
     }
-    path.stop();
+
+    float *cost = &costs[size_t(dst) * order];
+    for (uint32_t j = 0; j < order; ++j) cost[j] = float(distance[j]);
   }
 
 private:
@@ -129,9 +253,11 @@ class CompleteGraph : public Graph<T> {
 public:
   using Graph<T>::adjacencyList;
   using Graph<T>::nodes;
-  using Graph<T>::shortestPathTo;
   using Graph<T>::addVertex;
   using Graph<T>::addEdge;
+  using Graph<T>::order;
+  using Graph<T>::nextHops;
+  using Graph<T>::costs;
 
   explicit CompleteGraph(size_t capacity) : Graph<T>(capacity) {
     for (uint16_t i = 0; i < capacity; ++i) {
@@ -158,12 +284,11 @@ public:
     sort.stop();
 
     Clocker path("shortest path");
-    for (uint16_t i = 0; i < nodes.size(); ++i) {
-      for (uint16_t j = 0; j < nodes.size(); ++j) {
-        if (i != j)
-          shortestPathTo[j][i] = {1, j};
-        else
-          shortestPathTo[j][i] = {0, j};
+    Graph<T>::resizePaths();
+    for (uint32_t i = 0; i < order; ++i) {
+      for (uint32_t j = 0; j < order; ++j) {
+        nextHops[size_t(i) * order + j] = uint16_t(i);
+        costs[size_t(i) * order + j] = i != j;
       }
     }
     path.stop();
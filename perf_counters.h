@@ -0,0 +1,79 @@
+/*!
+ \file perf_counters.h
+ Hardware event counts of a measured region through perf_event_open, for the process and the threads it starts
+ meanwhile. Where the kernel refuses an event, e.g., in a container or with a high perf_event_paranoid, that event
+ is reported as unavailable instead of failing the benchmark.
+ */
+
+#pragma once
+
+#include <cinttypes>
+#include <cstring>
+#include <unistd.h>
+#include <sys/ioctl.h>
+#include <sys/syscall.h>
+#include <linux/perf_event.h>
+
+class PerfCounters {
+public:
+  enum Event {
+    Cycles, Instructions, CacheMisses, BranchMisses, kEvents
+  };
+
+  static constexpr const char *kNames[kEvents] = {"cycles", "instructions", "cache misses", "branch misses"};
+
+  PerfCounters() {
+    static const uint64_t configs[kEvents] = {PERF_COUNT_HW_CPU_CYCLES, PERF_COUNT_HW_INSTRUCTIONS,
+                                              PERF_COUNT_HW_CACHE_MISSES, PERF_COUNT_HW_BRANCH_MISSES};
+
+    for (int e = 0; e < kEvents; ++e) {
+      perf_event_attr attr;
+      memset(&attr, 0, sizeof(attr));
+      attr.size = sizeof(attr);
+      attr.type = PERF_TYPE_HARDWARE;
+      attr.config = configs[e];
+      attr.disabled = 1;
+      attr.inherit = 1;          // count the threads created while enabled
+      attr.exclude_kernel = 1;
+      attr.exclude_hv = 1;
+
+      fds[e] = int(syscall(__NR_perf_event_open, &attr, 0, -1, -1, 0));
+    }
+  }
+
+  PerfCounters(const PerfCounters &) = delete;
+
+  ~PerfCounters() {
+    for (int fd: fds) {
+      if (fd >= 0) close(fd);
+    }
+  }
+
+  inline bool available(Event e) const {
+    return fds[e] >= 0;
+  }
+
+  void start() {
+    for (int fd: fds) {
+      if (fd < 0) continue;
+      ioctl(fd, PERF_EVENT_IOC_RESET, 0);
+      ioctl(fd, PERF_EVENT_IOC_ENABLE, 0);
+    }
+  }
+
+  void stop() {
+    for (int fd: fds) {
+      if (fd >= 0) ioctl(fd, PERF_EVENT_IOC_DISABLE, 0);
+    }
+  }
+
+  /// \return the count since start, 0 if unavailable
+  uint64_t value(Event e) const {
+    uint64_t v = 0;
+    if (fds[e] < 0 || read(fds[e], &v, sizeof(v)) != sizeof(v)) return 0;
+    return v;
+  }
+
+private:
+  int fds[kEvents];
+};
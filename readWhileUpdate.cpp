@@ -0,0 +1,227 @@
+/**
+ * Lookups while the table is updated: reader threads look up random keys of a data plane while one writer thread
+ * streams insertions, value updates and removals through the control plane at a given rate. Reports the reader
+ * throughput, the retries of the readers on the version locks, and the latency of every kind of update.
+ *
+ * usage: readWhileUpdate [keys = 1M] [readers = cores - 1] [updates per second, 0 for unpaced = 100K] [seconds = 5]
+ */
+#include "common.h"
+#include "latency.h"
+#include "Ludo/ludo.h"
+#include "Othello/data_plane_othello.h"
+#include "CuckooPresized/cuckoo_filtable.h"
+
+typedef uint32_t Key;
+typedef uint16_t Val;
+const uint8_t VL = 16;
+
+struct Config {
+  uint64_t nn = 1 << 20;
+  uint32_t readers = max(1U, min(20U, std::thread::hardware_concurrency()) - 1);
+  uint64_t rate = 100000;
+  double seconds = 5;
+};
+
+// removed keys are inserted back this many updates later, so the key set stays about the same
+const uint32_t kReinsertDelay = 1024;
+
+/// Run the readers until the writer has run for the configured time. writerStep(j) performs the j-th update, and
+/// is paced to the configured rate.
+/// \return the reader side of the report
+template<class LookUp, class WriterStep>
+json readWhileUpdate(const Config &config, const vector<Key> &keys, LookUp lookUp, WriterStep writerStep) {
+  atomic<bool> stop(false);
+  vector<uint64_t> lookups(config.readers * 8), retries(config.readers * 8);   // one cache line per reader
+  vector<thread> readers;
+
+  for (uint32_t t = 0; t < config.readers; ++t) {
+    readers.emplace_back([&, t] {
+      uint64_t n = 0, stupid = 0;
+      uint32_t x = 0x9e3779b9 * (t + 1);
+      VersionLocks::retries = 0;
+
+      while (!stop.load(std::memory_order_relaxed)) {
+        for (int i = 0; i < 256; ++i) {
+          x ^= x << 13, x ^= x >> 17, x ^= x << 5;
+          Val v = 0;
+          lookUp(keys[x % keys.size()], v);
+          stupid += v;
+        }
+        n += 256;
+      }
+
+      lookups[t * 8] = n;
+      retries[t * 8] = VersionLocks::retries;
+      printf("%d\b", int(stupid & 7));
+    });
+  }
+
+  uint64_t begin = monotonicNs(), updates = 0;
+  const uint64_t deadline = begin + uint64_t(config.seconds * 1e9);
+
+  for (uint64_t now = begin; now < deadline; now = monotonicNs()) {
+    if (config.rate && updates * 1000000000 / config.rate > now - begin) {
+      _mm_pause();
+      continue;
+    }
+
+    writerStep(updates++);
+  }
+
+  stop.store(true);
+  for (thread &t: readers) t.join();
+  uint64_t ns = monotonicNs() - begin;
+
+  uint64_t totalLookups = 0, totalRetries = 0;
+  for (uint32_t t = 0; t < config.readers; ++t) {
+    totalLookups += lookups[t * 8];
+    totalRetries += retries[t * 8];
+  }
+
+  json j;
+  j["readers"] = config.readers;
+  j["lookups"] = totalLookups;
+  j["reader mops"] = totalLookups * 1000.0 / ns;
+  j["retries"] = totalRetries;
+  j["retries per million lookups"] = totalLookups ? totalRetries * 1e6 / totalLookups : 0.0;
+  j["updates"] = updates;
+  j["updates per second"] = updates * 1e9 / ns;
+  return j;
+}
+
+json testLudo(const Config &config, const vector<Key> &keys, const vector<Val> &values) {
+  Clocker clocker("Ludo read while update");
+
+  ControlPlaneLudo<Key, Val, VL> cp(config.nn);
+  cp.bulkLoad(keys.data(), values.data(), config.nn);
+  cp.prepareToExport();
+  DataPlaneLudo<Key, Val, VL> dp(cp);
+
+  LatencyRecorder insert, applyInsert, update, remove;
+
+  // every update removes a key, inserts back the one removed kReinsertDelay updates ago, and changes the value of
+  // another one
+  json j = readWhileUpdate(config, keys, [&dp](const Key &k, Val &v) { dp.lookUp(k, v); }, [&](uint64_t step) {
+    const uint64_t nn = config.nn;
+    const Key &gone = keys[step % nn];
+
+    remove.time(0, 0, [&] {
+      uint32_t bs;
+      if (!cp.remove(gone, &bs)) return;
+
+      if (bs == uint32_t(-1)) {
+        dp.fallback.remove(gone);
+      } else {
+        dp.applyRemove(bs);
+      }
+    });
+
+    if (step >= kReinsertDelay) {
+      uint64_t i = (step - kReinsertDelay) % nn;
+      vector<MPC_PathEntry> path;
+      const Key *result;
+
+      insert.time(0, 0, [&] { result = cp.insert(keys[i], values[i], &path); });
+      if (result == &keys[i]) {
+        applyInsert.time(0, 0, [&] { dp.applyInsert(path, values[i]); });
+      } else if (result == nullptr) {
+        dp.fallback.insert(keys[i], values[i]);
+      }
+    }
+
+    uint64_t u = (step + nn / 2) % nn;
+    Val v = Val(values[u] ^ step);
+    update.time(0, 0, [&] {
+      uint32_t bs = cp.updateMapping(keys[u], v);
+      if (bs != uint32_t(-1)) dp.applyUpdate(bs, v);
+    });
+  });
+
+  j["CP insert"] = insert.toJson();
+  j["applyInsert"] = applyInsert.toJson();
+  j["updateMapping and applyUpdate"] = update.toJson();
+  j["remove and applyRemove"] = remove.toJson();
+  return j;
+}
+
+json testOthello(const Config &config, const vector<Key> &keys, const vector<Val> &values) {
+  Clocker clocker("Othello read while update");
+
+  ControlPlaneOthello<Key, Val, VL, 0, true> cp(config.nn, true, keys, values);
+  DataPlaneOthello<Key, Val, VL> dp(cp);
+
+  LatencyRecorder update;
+
+  // an insertion may close a cycle of the Othello, which needs a full rebuild, so only the values change: the
+  // control plane returns the xor to apply to the half tree of the key
+  json j = readWhileUpdate(config, keys, [&dp](const Key &k, Val &v) { dp.lookUp(k, v); }, [&](uint64_t step) {
+    const Key &k = keys[step % config.nn];
+
+    update.time(0, 0, [&] {
+      uint64_t x = cp.updateMapping(k, Val(values[step % config.nn] ^ step));
+      dp.fixHalfTreeByConnectedComponent(cp.getHalfTree(k, true, false), x);
+    });
+  });
+
+  j["updateMapping and fixHalfTree"] = update.toJson();
+  return j;
+}
+
+json testCuckooFiltable(const Config &config, const vector<Key> &keys, const vector<Val> &values) {
+  Clocker clocker("Cuckoo filtable read while update");
+
+  ControlPlaneCuckooFiltable<Key, Val> cp(config.nn);
+  for (uint64_t i = 0; i < config.nn; ++i) cp.insert(keys[i], values[i]);
+  DataPlaneCuckooFiltable<Key, Val> dp(*cp.level1, *cp.level2);
+
+  LatencyRecorder update;
+
+  // ControlPlaneCuckooFiltable does not report where a key moves, so the writer only changes the values of
+  // occupied slots of the first level in place. The data plane has no version locks, so there are no retries
+  json j = readWhileUpdate(config, keys, [&dp](const Key &k, Val &v) { dp.lookUp(k, v); }, [&](uint64_t step) {
+    uint32_t bid = uint32_t(step * 0x9e3779b97f4a7c15ULL >> 40) % dp.level1.num_buckets_;
+    uint8_t sid = step & 3;
+
+    update.time(0, 0, [&] {
+      if (dp.level1.buckets_[bid].occupiedMask & (1U << sid)) dp.modify(true, bid, sid, Val(step));
+    });
+  });
+
+  j["modify"] = update.toJson();
+  return j;
+}
+
+int main(int argc, char **argv) {
+  commonInit();
+
+  Config config;
+  if (argc > 1) config.nn = strtoull(argv[1], nullptr, 10);
+  if (argc > 2) config.readers = atoi(argv[2]);
+  if (argc > 3) config.rate = strtoull(argv[3], nullptr, 10);
+  if (argc > 4) config.seconds = atof(argv[4]);
+
+  LFSRGen<Key> keyGen(0x1234567801234567ULL, config.nn, 0);
+  LFSRGen<Val> valueGen(0x1234567887654321ULL, config.nn, 0);
+  vector<Key> keys(config.nn);
+  vector<Val> values(config.nn);
+
+  for (uint64_t i = 0; i < config.nn; i++) {
+    keyGen.gen(&keys[i]);
+    valueGen.gen(&values[i]);
+  }
+
+  json report;
+  report["keys"] = config.nn;
+  report["updates per second requested"] = config.rate;
+  report["Ludo"] = testLudo(config, keys, values);
+  report["Othello"] = testOthello(config, keys, values);
+  report["Cuckoo filtable"] = testCuckooFiltable(config, keys, values);
+
+  ostringstream name;
+  name << "../dist/logs/readWhileUpdate " << config.nn << " keys " << config.readers << " readers " << config.rate
+       << " updates.json";
+  ofstream(name.str()) << report.dump(2) << endl;
+  cout << report.dump(2) << endl;
+
+  return 0;
+}
@@ -0,0 +1,99 @@
+/**
+ * The network-wide routing simulation. Every structure builds the FIBs of all nodes of a topology for a key set whose
+ * keys are attached to the hosts in turn, and ControlPlane::simulateRoutingBatch routes the keys from the gateways
+ * on every thread count. The throughput, the outcome of the keys, the lookups of every node and the memory of the
+ * data planes go to a JSON report.
+ *
+ * usage: routingBenchmark [--topos=-1,0] [--keys=1048576] [--threads=1,4] [--nodes] [--out=routing.json]
+ *        a topology below 8 is a file of ../input/topo, -1 the test one, and a larger one a complete graph of that
+ *        many nodes. --nodes keeps the per-node lookups in the report.
+ */
+#include "common.h"
+#include "input/workload.h"
+#include "CuckooPresized/cuckoo_filter_control_plane.h"
+#include "Ludo/ludo_control_plane.h"
+
+typedef uint32_t Key;
+
+struct Options {
+  vector<int> topos{-1};
+  uint64_t keys = 1 << 20;
+  vector<uint32_t> threads{1};
+  bool nodes = false;
+  string out = "routing.json";
+};
+
+vector<int64_t> parseList(const string &s) {
+  vector<int64_t> result;
+  for (const string &token: split(s.c_str(), ',')) result.push_back(strtoll(token.c_str(), nullptr, 10));
+  return result;
+}
+
+/// build the FIBs of CP on one topology and route the keys on every thread count
+template<class CP>
+void run(const Options &options, int topo, const Workload<Key, uint16_t> &w, json &results) {
+  CP cp(uint32_t(options.keys));
+  cp.keepAllDataPlanes = true;   // the keys pass many nodes, not only the ones sampled by the other experiments
+  cp.scenario(topo);
+
+  const vector<uint16_t> hosts = cp.getHostIds();
+  if (hosts.empty()) throw runtime_error("no host in topology " + to_string(topo));
+
+  {
+    Clocker build(string(cp.getName()) + " FIBs of topology " + to_string(topo));
+    for (uint64_t i = 0; i < options.keys; ++i) cp.insert(w.keys[i], hosts[i % hosts.size()]);
+    cp.construct();
+  }
+
+  for (uint32_t threads: options.threads) {
+    json j = cp.template simulateRoutingBatch<CP>(w.keys, options.keys, threads);
+    j["topology"] = topo;
+    if (!options.nodes) j.erase("nodes");
+
+    cout << j["structure"].get<string>() << " topology " << topo << " " << j["threads"] << " threads: "
+         << j["mops"].get<double>() << " Mkeys/s, " << j["delivered"] << " delivered, " << j["misses"]
+         << " misses, " << j["timeouts"] << " timeouts" << endl;
+    results.push_back(j);
+  }
+}
+
+int main(int argc, char **argv) {
+  commonInit();
+
+  Options options;
+  for (int i = 1; i < argc; ++i) {
+    string arg = argv[i];
+    auto value = [&](const char *flag) {
+      return arg.compare(0, strlen(flag), flag) == 0 ? arg.substr(strlen(flag)) : string();
+    };
+
+    if (arg == "--nodes") options.nodes = true;
+    else if (!value("--topos=").empty()) {
+      options.topos.clear();
+      for (int64_t t: parseList(value("--topos="))) options.topos.push_back(int(t));
+    } else if (!value("--keys=").empty()) options.keys = strtoull(value("--keys=").c_str(), nullptr, 10);
+    else if (!value("--threads=").empty()) {
+      options.threads.clear();
+      for (int64_t t: parseList(value("--threads="))) options.threads.push_back(uint32_t(max<int64_t>(1, t)));
+    } else if (!value("--out=").empty()) options.out = value("--out=");
+    else throw runtime_error("unknown option " + arg);
+  }
+
+  WorkloadParams params;
+  params.keys = options.keys;
+  params.queries = 1;
+  Workload<Key, uint16_t> w = Workload<Key, uint16_t>::cached(params);
+
+  json results = json::array();
+  for (int topo: options.topos) {
+    run<LudoControlPlane<Key, true>>(options, topo, w, results);
+    run<TwoLevelCuckooControlPlane<Key, true>>(options, topo, w, results);
+  }
+
+  json report;
+  report["options"] = {{"keys", options.keys}};
+  report["results"] = results;
+  ofstream(options.out) << report.dump(2) << endl;
+
+  return 0;
+}
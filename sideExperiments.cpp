@@ -10,6 +10,7 @@
 #include "Othello/data_plane_othello.h"
 #include "Ludo/ludo.h"
 #include "DPH/dph.h"
+#include "input/workload.h"
 
 int version = 12;
 
@@ -244,19 +245,7 @@ void lookupThroughputBinary() {
           keys[i] = keys[i % nn];
         }
         
-        vector<K> zipfianKeys;
-        zipfianKeys.reserve(lookupCnt);
-        
-        for (int i = 0; i < lookupCnt; ++i) {
-          InputBase::distribution = exponential;
-          InputBase::bound = nn;
-          
-          uint seed = Hasher32<string>()(logName);
-          InputBase::setSeed(seed);
-          
-          uint32_t idx = InputBase::rand();
-          zipfianKeys.push_back(keys[idx]);
-        }
+        vector<K> zipfianKeys = zipfianQueries(keys.data(), nn, lookupCnt, 1.0, Hasher32<string>()(logName));
         
         typedef uint8_t V;
         const uint VL = 1;
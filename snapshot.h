@@ -0,0 +1,204 @@
+/*!
+ \file snapshot.h
+ Versioned binary snapshots of the exported data planes, so that a data plane can be restarted without
+ rebuilding its control plane. A snapshot is a header followed by the sections written by the data plane: plain
+ values, and arrays whose payload starts at a 64-byte aligned file offset. The reader maps the file privately with
+ mmap, so every array is cache-line aligned in memory, and the tables of a loaded data plane view their arrays in
+ the mapping: loading copies nothing, and an update copies only the pages it writes.
+ */
+
+#pragma once
+
+#include <cstring>
+#include <cinttypes>
+#include <fstream>
+#include <initializer_list>
+#include <memory>
+#include <stdexcept>
+#include <string>
+#include <type_traits>
+#include <vector>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+#include "table_allocator.h"
+
+static const char SnapshotMagic[8] = {'L', 'u', 'C', 'S', 'S', 'N', 'A', 'P'};
+// 2: the bit-packed arrays end with a padding word; 3: the compact keys are hashed by compactHash;
+// 4: the Ludo slots are arranged by arrangedSlot; 5: the overflow seeds are OverflowSeeds; 6: OverflowSeeds are
+// saved as their tables, to be viewed in place
+static const uint32_t SnapshotVersion = 6;
+static const uint32_t SnapshotAlignment = 64;
+
+/// identifies the data structure and its template parameters, so that a snapshot is only loaded by the same type
+struct SnapshotSignature {
+  char kind[24] = {0};
+  uint32_t params[6] = {0};
+
+  SnapshotSignature() = default;
+
+  SnapshotSignature(const char *name, std::initializer_list<uint32_t> ps) {
+    strncpy(kind, name, sizeof(kind) - 1);
+    int i = 0;
+    for (uint32_t p: ps) {
+      if (i == 6) throw std::runtime_error("too many snapshot signature parameters");
+      params[i++] = p;
+    }
+  }
+
+  bool operator==(const SnapshotSignature &other) const {
+    return memcmp(this, &other, sizeof(SnapshotSignature)) == 0;
+  }
+};
+
+class SnapshotWriter {
+  std::ofstream out;
+  uint64_t pos = 0;
+
+  inline void write(const void *p, uint64_t len) {
+    out.write((const char *) p, len);
+    pos += len;
+  }
+
+public:
+  explicit SnapshotWriter(const std::string &path) : out(path, std::ios::binary | std::ios::trunc) {
+    if (!out) throw std::runtime_error("cannot open snapshot " + path + " for writing");
+
+    write(SnapshotMagic, sizeof(SnapshotMagic));
+    put(SnapshotVersion);
+  }
+
+  ~SnapshotWriter() {
+    out.flush();
+  }
+
+  template<class T>
+  inline void put(const T &v) {
+    static_assert(std::is_trivially_copyable<T>::value, "only plain values can be put");
+    write(&v, sizeof(T));
+  }
+
+  inline void putSignature(const SnapshotSignature &signature) {
+    put(signature);
+  }
+
+  /// the length, then the payload at the next aligned offset
+  template<class T>
+  inline void putArray(const T *data, uint64_t n) {
+    static_assert(std::is_trivially_copyable<T>::value, "only arrays of plain values can be put");
+    put(n);
+
+    static const char zeros[SnapshotAlignment] = {0};
+    write(zeros, (SnapshotAlignment - pos % SnapshotAlignment) % SnapshotAlignment);
+    write(data, n * sizeof(T));
+  }
+
+  template<class T, class A>
+  inline void putArray(const std::vector<T, A> &v) {
+    putArray(v.data(), v.size());
+  }
+
+  template<class T, class A>
+  inline void putArray(const TableArray<T, A> &v) {
+    putArray(v.data(), v.size());
+  }
+
+  inline void close() {
+    out.flush();
+    if (!out) throw std::runtime_error("failed to write the snapshot");
+    out.close();
+  }
+};
+
+class SnapshotReader {
+  const uint8_t *base = nullptr;
+  uint64_t size = 0;
+  uint64_t pos = 0;
+  std::shared_ptr<void> mapping;   // unmaps the file once the reader and every table borrowing from it are gone
+
+  inline const uint8_t *take(uint64_t len) {
+    if (pos + len > size) throw std::runtime_error("truncated snapshot");
+    const uint8_t *p = base + pos;
+    pos += len;
+    return p;
+  }
+
+public:
+  explicit SnapshotReader(const std::string &path) {
+    int fd = open(path.c_str(), O_RDONLY);
+    if (fd < 0) throw std::runtime_error("cannot open snapshot " + path);
+
+    struct stat st;
+    if (fstat(fd, &st) != 0) {
+      ::close(fd);
+      throw std::runtime_error("cannot stat snapshot " + path);
+    }
+    size = st.st_size;
+    if (size < sizeof(SnapshotMagic) + sizeof(SnapshotVersion)) {
+      ::close(fd);
+      throw std::runtime_error(path + " is too short for a snapshot");
+    }
+
+    // writable but private: the tables borrowing the arrays may be updated without touching the file
+    void *p = mmap(nullptr, size, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_POPULATE, fd, 0);
+    ::close(fd);
+    if (p == MAP_FAILED) throw std::runtime_error("cannot map snapshot " + path);
+    base = (const uint8_t *) p;
+
+    const uint64_t length = size;
+    mapping = std::shared_ptr<void>(p, [length](void *q) { munmap(q, length); });
+
+    if (memcmp(take(sizeof(SnapshotMagic)), SnapshotMagic, sizeof(SnapshotMagic)) != 0) {
+      throw std::runtime_error(path + " is not a snapshot");
+    }
+    if (get<uint32_t>() != SnapshotVersion) {
+      throw std::runtime_error("unsupported snapshot version in " + path);
+    }
+  }
+
+  SnapshotReader(const SnapshotReader &) = delete;
+
+  template<class T>
+  inline T get() {
+    static_assert(std::is_trivially_copyable<T>::value, "only plain values can be got");
+    T v;
+    memcpy(&v, take(sizeof(T)), sizeof(T));
+    return v;
+  }
+
+  template<class T>
+  inline void get(T &v) {
+    v = get<T>();
+  }
+
+  inline void expectSignature(const SnapshotSignature &signature) {
+    if (!(get<SnapshotSignature>() == signature)) {
+      throw std::runtime_error(std::string("snapshot does not hold a ") + signature.kind + " of these parameters");
+    }
+  }
+
+  /// the length and the aligned payload of an array in the mapped file
+  template<class T>
+  inline const T *getArray(uint64_t &n) {
+    n = get<uint64_t>();
+    take((SnapshotAlignment - pos % SnapshotAlignment) % SnapshotAlignment);
+    return (const T *) take(n * sizeof(T));
+  }
+
+  template<class T, class A>
+  inline void getArray(std::vector<T, A> &v) {
+    uint64_t n;
+    const T *data = getArray<T>(n);
+    v.assign(data, data + n);
+  }
+
+  /// view the array in the mapping, which outlives the reader as long as v does
+  template<class T, class A>
+  inline void getArray(TableArray<T, A> &v) {
+    uint64_t n;
+    T *data = const_cast<T *>(getArray<T>(n));
+    v.borrow(data, n, mapping);
+  }
+};
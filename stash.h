@@ -0,0 +1,179 @@
+/*!
+ \file stash.h
+ A small flat hash table for the few keys the compact tables cannot hold, e.g., the fallback of the Ludo tables.
+ The entries are stored inline in one array with linear probing and backward-shift deletion, so a probe touches one
+ or two cache lines instead of chasing the nodes of a std::unordered_map, and an empty stash costs one branch.
+ */
+
+#pragma once
+
+#include <atomic>
+#include <cinttypes>
+#include <memory>
+#include <utility>
+#include <vector>
+#include "hash.h"
+
+/// One thread modifies the stash. Lookups may run meanwhile without crashing, since the array replaced by a growth
+/// is kept until clear, but they may miss an entry being moved. Readers that need exact answers retry under a
+/// version lock of their own.
+template<class K, class V>
+class FlatStash {
+  struct Slot {
+    K k;
+    V v;
+    bool used = false;
+  };
+
+  struct Table {
+    uint32_t mask;
+    std::vector<Slot> slots;
+
+    explicit Table(uint32_t capacity) : mask(capacity - 1), slots(capacity) {}
+  };
+
+  std::vector<std::unique_ptr<Table>> tables;   // the last one is in use, the others were replaced by rehash
+  std::atomic<Table *> table{nullptr};
+  std::atomic<uint32_t> count{0};
+  Hasher32<K> h;
+
+  static inline bool used(const Slot &s) {
+    return __atomic_load_n(&s.used, __ATOMIC_ACQUIRE);
+  }
+
+  inline uint32_t find(const Table &t, const K &k) const {
+    for (uint32_t i = h(k) & t.mask;; i = (i + 1) & t.mask) {
+      if (!used(t.slots[i])) return uint32_t(-1);
+      if (t.slots[i].k == k) return i;
+    }
+  }
+
+  // the key and the value are written before the slot is marked used, so a lookup never sees half an insertion
+  static void place(Table &t, uint32_t home, const K &k, const V &v) {
+    uint32_t i = home;
+    while (t.slots[i].used) i = (i + 1) & t.mask;
+
+    t.slots[i].k = k;
+    t.slots[i].v = v;
+    __atomic_store_n(&t.slots[i].used, true, __ATOMIC_RELEASE);
+  }
+
+  void rehash(uint32_t capacity) {
+    Table *next = new Table(capacity);
+
+    if (!tables.empty()) {
+      for (const Slot &s: tables.back()->slots) {
+        if (s.used) place(*next, h(s.k) & next->mask, s.k, s.v);
+      }
+    }
+
+    tables.emplace_back(next);
+    table.store(next, std::memory_order_release);
+  }
+
+public:
+  // the stash grows to stay at most 3/4 full
+  static const uint32_t kMinCapacity = 8;
+
+  /// \param expected the number of entries expected, e.g., the overflow of a table at its load
+  explicit FlatStash(uint32_t expected = 0) {
+    uint32_t capacity = kMinCapacity;
+    while (capacity * 3 / 4 < expected) capacity <<= 1;
+    rehash(capacity);
+  }
+
+  FlatStash(const FlatStash &other) : FlatStash(other.size()) {
+    other.forEach([this](const K &k, const V &v) { insert(k, v); });
+  }
+
+  FlatStash &operator=(const FlatStash &other) {
+    if (this != &other) {
+      clear();
+      other.forEach([this](const K &k, const V &v) { insert(k, v); });
+    }
+    return *this;
+  }
+
+  inline uint32_t size() const {
+    return count.load(std::memory_order_relaxed);
+  }
+
+  inline bool empty() const {
+    return size() == 0;
+  }
+
+  inline bool lookUp(const K &k, V &out) const {
+    if (empty()) return false;
+
+    const Table &t = *table.load(std::memory_order_acquire);
+    uint32_t i = find(t, k);
+    if (i == uint32_t(-1)) return false;
+
+    out = t.slots[i].v;
+    return true;
+  }
+
+  inline bool contains(const K &k) const {
+    return !empty() && find(*table.load(std::memory_order_acquire), k) != uint32_t(-1);
+  }
+
+  /// insert k, or replace its value
+  void insert(const K &k, const V &v) {
+    Table *t = tables.back().get();
+    uint32_t i = find(*t, k);
+    if (i != uint32_t(-1)) {
+      t->slots[i].v = v;
+      return;
+    }
+
+    if ((size() + 1) * 4 > t->slots.size() * 3) {
+      rehash(t->slots.size() * 2);
+      t = tables.back().get();
+    }
+
+    place(*t, h(k) & t->mask, k, v);
+    count.store(size() + 1, std::memory_order_release);
+  }
+
+  /// \return false if k is not in the stash
+  bool remove(const K &k) {
+    Table &t = *tables.back();
+    uint32_t i = find(t, k);
+    if (i == uint32_t(-1)) return false;
+
+    // shift the following entries of the cluster back unless that moves them before their home slot
+    for (uint32_t j = (i + 1) & t.mask; t.slots[j].used; j = (j + 1) & t.mask) {
+      uint32_t home = h(t.slots[j].k) & t.mask;
+      if (((j - home) & t.mask) >= ((j - i) & t.mask)) {
+        t.slots[i].k = t.slots[j].k;
+        t.slots[i].v = t.slots[j].v;
+        i = j;
+      }
+    }
+
+    __atomic_store_n(&t.slots[i].used, false, __ATOMIC_RELEASE);
+    count.store(size() - 1, std::memory_order_release);
+    return true;
+  }
+
+  /// also frees the arrays replaced by earlier growths, so no lookup may run meanwhile
+  void clear() {
+    count.store(0, std::memory_order_relaxed);
+    tables.erase(tables.begin(), tables.end() - 1);
+    for (Slot &s: tables.back()->slots) s.used = false;
+  }
+
+  /// f(k, v) for every entry
+  template<class F>
+  void forEach(F f) const {
+    if (empty()) return;
+
+    for (const Slot &s: tables.back()->slots) {
+      if (s.used) f(s.k, s.v);
+    }
+  }
+
+  inline uint64_t getMemoryCost() const {
+    return tables.back()->slots.size() * sizeof(Slot);
+  }
+};
@@ -0,0 +1,296 @@
+/*!
+ \file table_allocator.h
+ Allocation of the data plane tables: cache-line aligned heap storage by default, or mmap'ed huge pages bound to a
+ NUMA node when a MemoryPolicy asks for them. A table may also borrow memory owned elsewhere, e.g., a snapshot.
+ */
+
+#pragma once
+
+#include <cstdlib>
+#include <cstdio>
+#include <memory>
+#include <new>
+#include <stdexcept>
+#include <string>
+#include <vector>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+
+#ifndef MAP_HUGE_SHIFT
+#define MAP_HUGE_SHIFT 26
+#endif
+
+/// Where and how the tables are allocated.
+struct MemoryPolicy {
+  static const size_t kSmallPage = 4096;
+  static const size_t kHugePage2M = 2UL << 20;
+  static const size_t kHugePage1G = 1UL << 30;
+
+  size_t pageSize = 0;   // 0: the heap; otherwise mmap'ed pages of this size, e.g., kHugePage2M
+  int numaNode = -1;     // bind the pages to this node, -1: leave the placement to the kernel
+
+  /// whether a table of these many bytes goes to huge pages: only one of a page or more, since a smaller one would
+  /// pin a mostly empty huge page, e.g., 1 GiB for the few KiB of a locator of a small table
+  inline bool usesHugePages(size_t bytes) const {
+    return pageSize > kSmallPage && bytes >= pageSize;
+  }
+
+  inline bool usesMmap(size_t bytes) const {
+    return usesHugePages(bytes) || numaNode >= 0;
+  }
+
+  bool operator==(const MemoryPolicy &other) const {
+    return pageSize == other.pageSize && numaNode == other.numaNode;
+  }
+
+  /// the policy of the tables whose allocators are default constructed. Only later allocations are affected.
+  static MemoryPolicy &global() {
+    static MemoryPolicy policy;
+    return policy;
+  }
+
+  /// set the global policy from the environment, e.g., HUGE_PAGE=2M NUMA_NODE=0 ./microbenchmarks
+  static void configureFromEnv() {
+    const char *page = getenv("HUGE_PAGE");
+    const char *node = getenv("NUMA_NODE");
+
+    if (page) {
+      std::string p(page);
+      if (p == "1G") global().pageSize = kHugePage1G;
+      else if (p == "2M") global().pageSize = kHugePage2M;
+      else throw std::runtime_error("HUGE_PAGE should be 2M or 1G");
+    }
+
+    if (node) global().numaNode = atoi(node);
+  }
+
+  /// the NUMA node of the CPU the calling thread runs on
+  static int currentNode() {
+    unsigned cpu = 0, node = 0;
+    if (syscall(SYS_getcpu, &cpu, &node, nullptr) != 0) return 0;
+    return int(node);
+  }
+
+  /// number of NUMA nodes of this machine
+  static int nodeCount() {
+    int n = 0;
+    while (true) {
+      char path[64];
+      snprintf(path, sizeof(path), "/sys/devices/system/node/node%d", n);
+      if (access(path, F_OK) != 0) break;
+      ++n;
+    }
+    return n ? n : 1;
+  }
+};
+
+/// STL allocator following a MemoryPolicy. Heap storage is aligned to cache lines. mmap'ed storage uses hugetlbfs
+/// pages of the requested size, or transparent huge pages if none is reserved, and is bound to the requested node.
+/// Under the default policy, or for tables smaller than a huge page, it is the aligned heap allocator.
+template<class T>
+class TableAllocator {
+public:
+  typedef T value_type;
+  typedef std::true_type propagate_on_container_copy_assignment;
+  typedef std::true_type propagate_on_container_move_assignment;
+  typedef std::true_type propagate_on_container_swap;
+
+  static const size_t kAlignment = 64;
+
+  MemoryPolicy policy;
+
+  TableAllocator() : policy(MemoryPolicy::global()) {}
+
+  explicit TableAllocator(const MemoryPolicy &policy) : policy(policy) {}
+
+  template<class U>
+  TableAllocator(const TableAllocator<U> &other) : policy(other.policy) {}
+
+  inline T *allocate(size_t n) {
+    if (!policy.usesMmap(n * sizeof(T))) {
+      return static_cast<T *>(::operator new(n * sizeof(T), std::align_val_t(kAlignment)));
+    }
+
+    const bool huge = policy.usesHugePages(n * sizeof(T));
+    size_t length = mappedLength(n);
+    void *p = MAP_FAILED;
+
+    if (huge) {
+      int shift = __builtin_ctzl(policy.pageSize);
+      p = mmap(nullptr, length, PROT_READ | PROT_WRITE,
+               MAP_PRIVATE | MAP_ANONYMOUS | MAP_HUGETLB | (shift << MAP_HUGE_SHIFT), -1, 0);
+    }
+
+    if (p == MAP_FAILED) {   // no reserved hugetlbfs pages: ask for transparent huge pages instead
+      p = mmap(nullptr, length, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+      if (p == MAP_FAILED) throw std::bad_alloc();
+
+      if (huge) madvise(p, length, MADV_HUGEPAGE);
+    }
+
+    if (policy.numaNode >= 0) bindToNode(p, length, policy.numaNode);
+
+    return static_cast<T *>(p);
+  }
+
+  inline void deallocate(T *p, size_t n) {
+    if (!policy.usesMmap(n * sizeof(T))) {
+      ::operator delete(p, std::align_val_t(kAlignment));
+      return;
+    }
+
+    munmap(p, mappedLength(n));
+  }
+
+  template<class U>
+  bool operator==(const TableAllocator<U> &other) const { return policy == other.policy; }
+
+  template<class U>
+  bool operator!=(const TableAllocator<U> &other) const { return !(policy == other.policy); }
+
+private:
+  inline size_t mappedLength(size_t n) const {
+    size_t bytes = n * sizeof(T);
+    size_t page = policy.usesHugePages(bytes) ? policy.pageSize : MemoryPolicy::kSmallPage;
+    return bytes ? (bytes + page - 1) / page * page : page;
+  }
+
+  // mbind(2) without a dependency on libnuma
+  static void bindToNode(void *p, size_t length, int node) {
+    static const int kMaxNodes = 1024;
+    static const int MPOL_BIND_ = 2, MPOL_MF_MOVE_ = 1 << 1;
+
+    if (node >= kMaxNodes) throw std::runtime_error("NUMA node out of range");
+
+    unsigned long mask[kMaxNodes / (8 * sizeof(unsigned long))] = {0};
+    mask[node / (8 * sizeof(unsigned long))] = 1UL << (node % (8 * sizeof(unsigned long)));
+
+    if (syscall(SYS_mbind, p, length, MPOL_BIND_, mask, kMaxNodes, MPOL_MF_MOVE_) != 0) {
+      throw std::runtime_error("mbind to NUMA node " + std::to_string(node) + " failed");
+    }
+  }
+};
+
+/// the cache-line aligned allocator of the bucket layouts, see DataPlaneLudo
+template<class T>
+using AlignedAllocator = TableAllocator<T>;
+
+/// A table of a data plane: the storage of an allocator A, or a view of memory owned by another object, e.g., the
+/// mapping of a snapshot, which the table keeps alive. A borrowed table is updated in place, so the memory must be
+/// writable, e.g., a private mapping. resize and setMemoryPolicy copy a borrowed table into storage of its own.
+template<class T, class A = TableAllocator<T>>
+class TableArray {
+  std::vector<T, A> owned;
+  T *data_ = nullptr;
+  size_t size_ = 0;
+  std::shared_ptr<void> source;   // what a borrowed table views, null when the table owns its storage
+
+  inline void own() {
+    data_ = owned.data();
+    size_ = owned.size();
+    source.reset();
+  }
+
+public:
+  typedef T value_type;
+
+  TableArray() = default;
+
+  TableArray(const TableArray &other) : owned(other.begin(), other.end(), other.owned.get_allocator()) {
+    own();
+  }
+
+  TableArray(TableArray &&other) noexcept {
+    *this = std::move(other);
+  }
+
+  TableArray &operator=(const TableArray &other) {
+    if (this != &other) *this = TableArray(other);
+    return *this;
+  }
+
+  TableArray &operator=(TableArray &&other) noexcept {
+    owned = std::move(other.owned);
+    data_ = other.data_;
+    size_ = other.size_;
+    source = std::move(other.source);
+    if (!source) own();
+
+    other.owned.clear();
+    other.own();
+    return *this;
+  }
+
+  inline T *data() { return data_; }
+
+  inline const T *data() const { return data_; }
+
+  inline size_t size() const { return size_; }
+
+  inline bool empty() const { return size_ == 0; }
+
+  inline T &operator[](size_t i) { return data_[i]; }
+
+  inline const T &operator[](size_t i) const { return data_[i]; }
+
+  inline T *begin() { return data_; }
+
+  inline T *end() { return data_ + size_; }
+
+  inline const T *begin() const { return data_; }
+
+  inline const T *end() const { return data_ + size_; }
+
+  /// whether the table views memory it does not own
+  inline bool borrowed() const { return source != nullptr; }
+
+  void resize(size_t n, const T &v = T()) {
+    if (source) owned.assign(begin(), end());
+    owned.resize(n, v);
+    own();
+  }
+
+  /// empty the table, dropping what a borrowed table views
+  void clear() {
+    owned.clear();
+    own();
+  }
+
+  template<class It>
+  void assign(It first, It last) {
+    owned.assign(first, last);
+    own();
+  }
+
+  /// view the n elements at p, keeping from alive as long as the table views them
+  void borrow(T *p, size_t n, std::shared_ptr<void> from) {
+    std::vector<T, A>().swap(owned);
+    data_ = p;
+    size_ = n;
+    source = std::move(from);
+  }
+
+  /// move the table to storage allocated following the policy, e.g., huge pages of another NUMA node
+  void setMemoryPolicy(const MemoryPolicy &policy) {
+    owned = std::vector<T, A>(begin(), end(), A(policy));
+    own();
+  }
+};
+
+/// One copy of a read-only data plane per NUMA node, each in the memory of its own node, so that threads on
+/// node i look up replicas[i] without crossing the interconnect. DP must provide setMemoryPolicy.
+template<class DP>
+std::vector<DP> replicatePerNode(const DP &dp, int nodes = MemoryPolicy::nodeCount(),
+                                 MemoryPolicy policy = MemoryPolicy::global()) {
+  std::vector<DP> replicas;
+  replicas.reserve(nodes);
+
+  for (int node = 0; node < nodes; ++node) {
+    replicas.push_back(dp);
+    policy.numaNode = node;
+    replicas.back().setMemoryPolicy(policy);
+  }
+
+  return replicas;
+}
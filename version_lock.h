@@ -0,0 +1,115 @@
+/*!
+ \file version_lock.h
+ Striped version locks (seqlocks) for the data planes: lookups run without writing shared memory and retry if a
+ writer touched their entries meanwhile, and writers on different stripes proceed in parallel.
+ */
+
+#pragma once
+
+#include <atomic>
+#include <memory>
+#include <utility>
+#include <cinttypes>
+#include <immintrin.h>
+
+class VersionLocks {
+  std::unique_ptr<std::atomic<uint32_t>[]> versions;
+  uint64_t stripes = 0;
+  uint8_t shift = 0;     // log2 of the entries per stripe
+
+  inline std::atomic<uint32_t> &at(uint64_t index) const {
+    return versions[(index >> shift) & (stripes - 1)];
+  }
+
+public:
+  static const uint64_t kMinStripes = 64;
+
+  /// the failed validations of the calling thread, i.e., the retries of its lookups, for the benchmarks
+  inline static thread_local uint64_t retries = 0;
+
+  /// \param entries the number of entries (buckets, cells) of the table, which decides the number of stripes
+  /// \param entriesPerStripe a power of two, entries sharing a stripe falsely conflict
+  explicit VersionLocks(uint64_t entries = 0, uint32_t entriesPerStripe = 8) {
+    while ((1U << shift) < entriesPerStripe) ++shift;
+
+    stripes = kMinStripes;
+    while (stripes < (entries >> shift)) stripes <<= 1;
+
+    versions.reset(new std::atomic<uint32_t>[stripes]);
+    for (uint64_t i = 0; i < stripes; ++i) versions[i].store(0, std::memory_order_relaxed);
+  }
+
+  /// a copy has the same geometry, with all stripes unlocked
+  VersionLocks(const VersionLocks &other) : VersionLocks(other.stripes << other.shift, 1U << other.shift) {}
+
+  VersionLocks &operator=(const VersionLocks &other) {
+    if (this != &other) *this = VersionLocks(other);
+    return *this;
+  }
+
+  VersionLocks(VersionLocks &&) = default;
+
+  VersionLocks &operator=(VersionLocks &&) = default;
+
+  /// wait until no writer holds the stripe of index, and return its version
+  inline uint32_t beginRead(uint64_t index) const {
+    while (true) {
+      uint32_t v = at(index).load(std::memory_order_acquire);
+      if (!(v & 1)) return v;
+      _mm_pause();
+    }
+  }
+
+  /// \return whether the stripe of index is still at the version returned by beginRead, i.e., what was read
+  /// between the two calls is consistent
+  inline bool validate(uint64_t index, uint32_t version) const {
+    std::atomic_thread_fence(std::memory_order_acquire);
+    if (__builtin_expect(at(index).load(std::memory_order_relaxed) == version, 1)) return true;
+
+    retries++;
+    return false;
+  }
+
+  /// make the version odd, waiting for other writers of the same stripe
+  inline void lock(uint64_t index) {
+    std::atomic<uint32_t> &v = at(index);
+    uint32_t expected = v.load(std::memory_order_relaxed);
+
+    while (true) {
+      if (expected & 1) {
+        _mm_pause();
+        expected = v.load(std::memory_order_relaxed);
+      } else if (v.compare_exchange_weak(expected, expected + 1, std::memory_order_acquire)) {
+        break;
+      }
+    }
+
+    std::atomic_thread_fence(std::memory_order_release);   // the version is visible before any protected write
+  }
+
+  inline void unlock(uint64_t index) {
+    at(index).fetch_add(1, std::memory_order_release);
+  }
+
+  /// whether two indices share a stripe, so that a writer holding both must lock it only once
+  inline bool sameStripe(uint64_t a, uint64_t b) const {
+    return &at(a) == &at(b);
+  }
+
+  /// lock the stripes of two indices in address order, so that writers holding pairs do not deadlock each other
+  inline void lockPair(uint64_t a, uint64_t b) {
+    if (sameStripe(a, b)) return lock(a);
+    if (&at(b) < &at(a)) std::swap(a, b);
+    lock(a);
+    lock(b);
+  }
+
+  inline void unlockPair(uint64_t a, uint64_t b) {
+    unlock(a);
+    if (!sameStripe(a, b)) unlock(b);
+  }
+
+  inline uint64_t getMemoryCost() const {
+    return stripes * sizeof(uint32_t);
+  }
+};